@@ -0,0 +1,152 @@
+/*
+  Micro-benchmarks for the NOS 2014 assignment IRC-like chat service.
+
+  (C) Samuel Deane 2014.
+
+  Times the server's inner routines on synthetic but realistic traffic,
+  so a change to one of them can be measured without the noise of sockets
+  and threads.
+
+  usage: bench [megabytes of traffic]
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "linescan.h"
+
+char *nick_names[] = {"agentsmith", "neo", "trinity", "sportacus",
+    "yogibear", "silvester", "daffy", "wecoyote"};
+char *greetings[] = {"Hallo alle", "Guten abend", "Wie geht's alle?", "moin",
+    "Gibt es jemand hier?", "Ich bin eine Kartoffel",
+    "Pausenzeit", "Kann mir jemand helfen mit meinem Auftragt?"};
+
+/**
+ * @return the current time in microseconds
+ */
+long long now_us() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+/**
+ * Fill a buffer with the kind of pipelined traffic a busy client sends,
+ * mostly PRIVMSGs of varying length with the odd PONG, in both line ending
+ * orders test.c uses
+ * @param buf, the buffer to fill
+ * @param size, the size of the buffer
+ * @return the number of bytes of traffic written
+ */
+int make_traffic(char *buf, int size) {
+    int length = 0;
+    while (1) {
+        char line[1024];
+        int n;
+        int r = random();
+        if ((r & 15) == 0) {
+            n = snprintf(line, sizeof (line), "PONG\r\n");
+        } else {
+            // repeat the greeting a few times so message lengths vary from
+            // a handful of bytes to a couple of hundred
+            char text[512] = "";
+            int repeats = 1 + ((r >> 4) & 3);
+            while (repeats--) strcat(text, greetings[(r >> 8) & 7]);
+            n = snprintf(line, sizeof (line), "PRIVMSG %s :%s\n\r",
+                    nick_names[(r >> 12) & 7], text);
+        }
+        if (length + n > size) return length;
+        memcpy(buf + length, line, n);
+        length += n;
+    }
+}
+
+/**
+ * Time splitting the traffic into lines and each line into its parts,
+ * the way the server does it, one read buffer's worth at a time
+ * @param name, the name of the scanners, for the report
+ * @param traffic, the traffic to scan
+ * @param length, the length of the traffic
+ * @param baseline, the time the scalar scanners took, 0 if this is them
+ * @return the time taken in microseconds
+ */
+long long bench_scan(const char *name, const char *traffic, int length, long long baseline) {
+    long long lines = 0;
+    long long checksum = 0; // keeps the compiler from dropping the parse
+    long long start = now_us();
+    int offset = 0;
+    while (offset < length) {
+        int chunk = length - offset < 8192 ? length - offset : 8192;
+        struct line_view views[64];
+        int consumed;
+        int count = split_lines(traffic + offset, chunk, views, 64, &consumed);
+        int i;
+        for (i = 0; i < count; i++) {
+            struct command cmd;
+            parse_command(views[i], &cmd);
+            checksum += cmd.param.length + cmd.trailing.length;
+        }
+        lines += count;
+        // a chunk that ends mid-line is picked up again at the partial line
+        offset += consumed ? consumed : chunk;
+    }
+    long long taken = now_us() - start;
+    if (taken < 1) taken = 1;
+    printf("%-8s %8.1f MB/s %10.0f lines/s %8.2fx  (%lld lines, checksum %lld)\n",
+            name, length / (double) taken, lines * 1e6 / taken,
+            baseline ? (double) baseline / taken : 1.0, lines, checksum);
+    return taken;
+}
+
+int main(int argc, char **argv) {
+    int megabytes = argc > 1 ? atoi(argv[1]) : 64;
+    if (megabytes < 1) {
+        fprintf(stderr, "usage: bench [megabytes of traffic]\n");
+        exit(-1);
+    }
+    int size = megabytes * 1024 * 1024;
+    char *traffic = malloc(size);
+    if (traffic == NULL) {
+        perror("malloc");
+        exit(-1);
+    }
+    srandom(2014); // the same traffic every run so runs compare
+    int length = make_traffic(traffic, size);
+
+    printf("line scanning and command parsing over %d bytes of traffic\n", length);
+    linescan_init(1);
+    long long scalar = bench_scan("scalar", traffic, length, 0);
+#ifdef LINESCAN_X86
+    split_lines = split_lines_sse2;
+    find_byte = find_byte_sse2;
+    bench_scan("sse2", traffic, length, scalar);
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        split_lines = split_lines_avx2;
+        find_byte = find_byte_avx2;
+        bench_scan("avx2", traffic, length, scalar);
+    } else {
+        printf("avx2     not supported by this CPU\n");
+    }
+#endif
+
+    free(traffic);
+    return 0;
+}
@@ -0,0 +1,192 @@
+/*
+  Traffic capture file format for the NOS 2014 assignment IRC-like chat
+  service.
+
+  (C) Samuel Deane 2014.
+
+  Started with -T, the server records every line its clients send, with
+  when it arrived and which connection it came on, so traffic that shows a
+  bug or a slowdown can be played back against a server as it was (see
+  replay.c) rather than approximated with test.c's or loadgen's.
+
+  The file is a run of records.  Each server writing to it starts with a
+  START record giving when, on the wall clock, it started; a server started
+  by an upgrade appends to its predecessor's file with a START of its own.
+  Every other record carries the connection it is about, numbered from 1,
+  and the microseconds since the START of the server that wrote it, as
+  variable length integers (7 bits a byte, low bits first, the top bit set
+  on all but the last byte), so a typical line costs a few bytes more than
+  its text.  An upgraded server carries on its predecessor's numbering, a
+  connection handed over keeping its number.
+
+    START  type, CAPTURE_MAGIC (4 bytes, low first), the wall clock start
+           in microseconds since the epoch (8 bytes, low first)
+    OPEN   type, connection, time
+    LINE   type, connection, time, length, the line without its newline
+    CLOSE  type, connection, time
+
+  Records from different connections are not in time order, each thread
+  of the server writing its own in batches, but those of one connection are.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+ */
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <string.h>
+
+#define CAPTURE_MAGIC 0x54504143 // "CAPT"
+
+#define CAPTURE_START 1
+#define CAPTURE_OPEN 2
+#define CAPTURE_LINE 3
+#define CAPTURE_CLOSE 4
+
+#define CAPTURE_START_SIZE 13
+// the longest line recorded, longer ones are cut short
+#define CAPTURE_LINE_MAX 8192
+// the largest record, a LINE of the longest line
+#define CAPTURE_RECORD_MAX (1 + 5 + 10 + 5 + CAPTURE_LINE_MAX)
+
+/**
+ * a record read back from a capture
+ */
+struct capture_record {
+    int type;
+    unsigned int connection;
+    unsigned long long us; // since the START, or the START's wall clock time
+    const char *data; // a LINE's text
+    int length;
+};
+
+/**
+ * Write a variable length integer
+ * @return the bytes written, at most 10
+ */
+static inline int capture_put_varint(unsigned char *p, unsigned long long v) {
+    int n = 0;
+    while (v >= 0x80) {
+        p[n++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    p[n++] = v;
+    return n;
+}
+
+/**
+ * Read a variable length integer
+ * @param p, where it starts
+ * @param length, the bytes there are to read
+ * @param v, where to put it
+ * @return the bytes read, or -1 if it runs past length
+ */
+static inline int capture_get_varint(const unsigned char *p, int length, unsigned long long *v) {
+    unsigned long long value = 0;
+    int n;
+    for (n = 0; n < length && n < 10; n++) {
+        value |= (unsigned long long) (p[n] & 0x7f) << (7 * n);
+        if (!(p[n] & 0x80)) {
+            *v = value;
+            return n + 1;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Write a START record
+ * @param wall_us, the wall clock time in microseconds since the epoch
+ * @return the length of the record, CAPTURE_START_SIZE
+ */
+static inline int capture_put_start(unsigned char *p, unsigned long long wall_us) {
+    int i;
+    p[0] = CAPTURE_START;
+    for (i = 0; i < 4; i++) p[1 + i] = (unsigned int) CAPTURE_MAGIC >> (8 * i);
+    for (i = 0; i < 8; i++) p[5 + i] = wall_us >> (8 * i);
+    return CAPTURE_START_SIZE;
+}
+
+/**
+ * Write an OPEN, LINE or CLOSE record
+ * @param p, where to write it, CAPTURE_RECORD_MAX bytes
+ * @param data, a LINE's text, or NULL
+ * @param length, its length
+ * @return the length of the record
+ */
+static inline int capture_put_record(unsigned char *p, int type, unsigned int connection,
+        unsigned long long us, const char *data, int length) {
+    int n = 0;
+    p[n++] = type;
+    n += capture_put_varint(p + n, connection);
+    n += capture_put_varint(p + n, us);
+    if (type == CAPTURE_LINE) {
+        if (length > CAPTURE_LINE_MAX) length = CAPTURE_LINE_MAX;
+        n += capture_put_varint(p + n, length);
+        memcpy(p + n, data, length);
+        n += length;
+    }
+    return n;
+}
+
+/**
+ * Read a record
+ * @param p, where it starts
+ * @param length, the bytes there are to read
+ * @param r, where to put it, a LINE's data points into p
+ * @return the length of the record, 0 if it runs past length or -1 if it
+ *  is not a record
+ */
+static inline int capture_get_record(const unsigned char *p, int length, struct capture_record *r) {
+    if (length < 1) return 0;
+    r->type = p[0];
+    r->data = NULL;
+    r->length = 0;
+    if (r->type == CAPTURE_START) {
+        if (length < CAPTURE_START_SIZE) return 0;
+        unsigned int magic = 0;
+        int i;
+        for (i = 0; i < 4; i++) magic |= (unsigned int) p[1 + i] << (8 * i);
+        if (magic != CAPTURE_MAGIC) return -1;
+        r->connection = 0;
+        r->us = 0;
+        for (i = 0; i < 8; i++) r->us |= (unsigned long long) p[5 + i] << (8 * i);
+        return CAPTURE_START_SIZE;
+    }
+    if (r->type < CAPTURE_OPEN || r->type > CAPTURE_CLOSE) return -1;
+    unsigned long long v;
+    int n = 1;
+    int got = capture_get_varint(p + n, length - n, &v);
+    if (got == -1) return 0;
+    r->connection = v;
+    n += got;
+    got = capture_get_varint(p + n, length - n, &r->us);
+    if (got == -1) return 0;
+    n += got;
+    if (r->type == CAPTURE_LINE) {
+        got = capture_get_varint(p + n, length - n, &v);
+        if (got == -1) return 0;
+        n += got;
+        if (v > CAPTURE_LINE_MAX) return -1;
+        if (length - n < (int) v) return 0;
+        r->data = (const char *) p + n;
+        r->length = v;
+        n += v;
+    }
+    return n;
+}
+
+#endif
@@ -0,0 +1,278 @@
+/*
+  Line and command scanning for the NOS 2014 assignment IRC-like chat service.
+
+  (C) Samuel Deane 2014.
+
+  Splits a buffer of pipelined input into line views in one pass, and finds
+  the separators within a command (spaces and the trailing ':').  Each scan
+  has a scalar version and, on x86, SSE2 and AVX2 versions that test 16 or
+  32 bytes per instruction.  linescan_init picks the widest one the CPU
+  running the program supports, so a binary built on an old machine still
+  runs on it and one run on a new machine still uses AVX2.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+ */
+
+#ifndef LINESCAN_H
+#define LINESCAN_H
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define LINESCAN_X86 1
+#include <immintrin.h>
+#endif
+
+/**
+ * a view of one line (or word) inside a larger buffer, it is not nul
+ * terminated as that would mean writing into or copying the buffer
+ */
+struct line_view {
+    const char *start;
+    int length;
+};
+
+/**
+ * Split a buffer into lines, one byte at a time
+ * @param buf, the buffer of input
+ * @param length, the number of bytes in the buffer
+ * @param lines, where to store the views of the complete lines found
+ * @param max_lines, the size of lines
+ * @param consumed, set to the number of bytes used up by the lines returned,
+ *  anything after it is a partial line (or lines beyond max_lines)
+ * @return the number of lines found, empty lines are skipped as clients send
+ *  both "\r\n" and "\n\r" and either order leaves an empty line between them
+ */
+static int split_lines_scalar(const char *buf, int length, struct line_view *lines,
+        int max_lines, int *consumed) {
+    int count = 0;
+    int start = 0;
+    int i;
+    for (i = 0; i < length && count < max_lines; i++) {
+        if (buf[i] == '\n' || buf[i] == '\r') {
+            if (i > start) {
+                lines[count].start = buf + start;
+                lines[count].length = i - start;
+                count++;
+            }
+            start = i + 1;
+        }
+    }
+    *consumed = start;
+    return count;
+}
+
+/**
+ * Find the first occurrence of a byte, one byte at a time
+ * @param buf, the bytes to search
+ * @param length, the number of bytes to search
+ * @param c, the byte to find
+ * @return the offset of the byte or length if it is not there
+ */
+static int find_byte_scalar(const char *buf, int length, char c) {
+    const char *p = memchr(buf, c, length);
+    return p ? p - buf : length;
+}
+
+#ifdef LINESCAN_X86
+
+/**
+ * Record the lines ending at the terminators set in mask, shared by the vector
+ * versions which differ only in how wide a block they build the mask from
+ * @return the number of lines now in lines
+ */
+static inline int emit_lines(const char *buf, int base, unsigned int mask,
+        int *start, struct line_view *lines, int count, int max_lines) {
+    while (mask && count < max_lines) {
+        int i = base + __builtin_ctz(mask);
+        if (i > *start) {
+            lines[count].start = buf + *start;
+            lines[count].length = i - *start;
+            count++;
+        }
+        *start = i + 1;
+        mask &= mask - 1; // clear the terminator just handled
+    }
+    return count;
+}
+
+/**
+ * Split a buffer into lines testing 16 bytes at a time, see split_lines_scalar
+ */
+__attribute__((target("sse2")))
+static int split_lines_sse2(const char *buf, int length, struct line_view *lines,
+        int max_lines, int *consumed) {
+    const __m128i lf = _mm_set1_epi8('\n');
+    const __m128i cr = _mm_set1_epi8('\r');
+    int count = 0;
+    int start = 0;
+    int i;
+    for (i = 0; i + 16 <= length && count < max_lines; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (buf + i));
+        unsigned int mask = _mm_movemask_epi8(_mm_or_si128(
+                _mm_cmpeq_epi8(v, lf), _mm_cmpeq_epi8(v, cr)));
+        count = emit_lines(buf, i, mask, &start, lines, count, max_lines);
+    }
+    if (count < max_lines && i < length) { // the tail too short for a vector
+        int tail_consumed;
+        count += split_lines_scalar(buf + start, length - start, lines + count,
+                max_lines - count, &tail_consumed);
+        start += tail_consumed;
+    }
+    *consumed = start;
+    return count;
+}
+
+/**
+ * Split a buffer into lines testing 32 bytes at a time, see split_lines_scalar
+ */
+__attribute__((target("avx2")))
+static int split_lines_avx2(const char *buf, int length, struct line_view *lines,
+        int max_lines, int *consumed) {
+    const __m256i lf = _mm256_set1_epi8('\n');
+    const __m256i cr = _mm256_set1_epi8('\r');
+    int count = 0;
+    int start = 0;
+    int i;
+    for (i = 0; i + 32 <= length && count < max_lines; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (buf + i));
+        unsigned int mask = _mm256_movemask_epi8(_mm256_or_si256(
+                _mm256_cmpeq_epi8(v, lf), _mm256_cmpeq_epi8(v, cr)));
+        count = emit_lines(buf, i, mask, &start, lines, count, max_lines);
+    }
+    if (count < max_lines && i < length) {
+        int tail_consumed;
+        count += split_lines_scalar(buf + start, length - start, lines + count,
+                max_lines - count, &tail_consumed);
+        start += tail_consumed;
+    }
+    *consumed = start;
+    return count;
+}
+
+/**
+ * Find the first occurrence of a byte testing 16 bytes at a time
+ */
+__attribute__((target("sse2")))
+static int find_byte_sse2(const char *buf, int length, char c) {
+    const __m128i needle = _mm_set1_epi8(c);
+    int i;
+    for (i = 0; i + 16 <= length; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (buf + i));
+        unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, needle));
+        if (mask) return i + __builtin_ctz(mask);
+    }
+    return i + find_byte_scalar(buf + i, length - i, c);
+}
+
+/**
+ * Find the first occurrence of a byte testing 32 bytes at a time
+ */
+__attribute__((target("avx2")))
+static int find_byte_avx2(const char *buf, int length, char c) {
+    const __m256i needle = _mm256_set1_epi8(c);
+    int i;
+    for (i = 0; i + 32 <= length; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (buf + i));
+        unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, needle));
+        if (mask) return i + __builtin_ctz(mask);
+    }
+    return i + find_byte_scalar(buf + i, length - i, c);
+}
+
+#endif
+
+// the scanners in use, chosen by linescan_init
+static int (*split_lines)(const char *, int, struct line_view *, int, int *) = split_lines_scalar;
+static int (*find_byte)(const char *, int, char) = find_byte_scalar;
+
+/**
+ * Choose the widest scanners the running CPU supports
+ * @param force_scalar, non-zero to keep the scalar scanners (for comparison)
+ * @return the name of the scanners chosen
+ */
+static const char *linescan_init(int force_scalar) {
+    if (force_scalar) return "scalar";
+#ifdef LINESCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        split_lines = split_lines_avx2;
+        find_byte = find_byte_avx2;
+        return "avx2";
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        split_lines = split_lines_sse2;
+        find_byte = find_byte_sse2;
+        return "sse2";
+    }
+#endif
+    return "scalar";
+}
+
+/**
+ * the parts of a command line, "VERB param :trailing text"
+ */
+struct command {
+    struct line_view verb;
+    struct line_view param; // the first parameter, e.g. the PRIVMSG target
+    struct line_view trailing; // the text after " :", e.g. the PRIVMSG message
+};
+
+/**
+ * Split a command line into its verb, first parameter and trailing text
+ * @param line, the line to split
+ * @param cmd, the parts found, any that are missing have length 0
+ */
+static void parse_command(struct line_view line, struct command *cmd) {
+    const char *p = line.start;
+    int length = line.length;
+    int n = find_byte(p, length, ' ');
+    cmd->verb.start = p;
+    cmd->verb.length = n;
+    cmd->param.start = cmd->trailing.start = p + length;
+    cmd->param.length = cmd->trailing.length = 0;
+    if (n == length) return;
+    p += n + 1;
+    length -= n + 1;
+    if (length > 0 && p[0] == ':') { // no parameter, only trailing text
+        cmd->trailing.start = p + 1;
+        cmd->trailing.length = length - 1;
+        return;
+    }
+    n = find_byte(p, length, ' ');
+    cmd->param.start = p;
+    cmd->param.length = n;
+    if (n == length) return;
+    p += n + 1;
+    length -= n + 1;
+    // the trailing text starts at a word beginning with ':', skipping any
+    // other parameters, but clients that leave off the ':' get the rest
+    int from = 0;
+    while (from < length) {
+        int colon = from + find_byte(p + from, length - from, ':');
+        if (colon == length) break;
+        if (colon == 0 || p[colon - 1] == ' ') {
+            cmd->trailing.start = p + colon + 1;
+            cmd->trailing.length = length - colon - 1;
+            return;
+        }
+        from = colon + 1;
+    }
+    cmd->trailing.start = p;
+    cmd->trailing.length = length;
+}
+
+#endif
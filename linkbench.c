@@ -0,0 +1,288 @@
+/*
+  Server link benchmark for the NOS 2014 assignment IRC-like chat service.
+
+  (C) Samuel Deane 2014.
+
+  Encodes a stream of routed messages the way one server passes them to
+  another and decodes it again the way the other server does, comparing
+  the raw text lines links used to relay ("PRIVMSG nick :text") with the
+  binary frames of linkproto.h, uncompressed and compressed.  It reports
+  the link bandwidth and the CPU time each takes per million messages.
+  Messages are sent in batches, as many as the server's link writer finds
+  queued at each write.
+
+  usage: linkbench [-n messages] [-u nicknames] [-s message size]
+                   [-b messages per batch]
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "linescan.h"
+#include "linkproto.h"
+
+char *greetings[] = {"Hallo alle", "Guten abend", "Wie geht's alle?", "moin",
+    "Gibt es jemand hier?", "Ich bin eine Kartoffel",
+    "Pausenzeit", "Kann mir jemand helfen mit meinem Auftragt?"};
+
+/**
+ * a message to route, the nickname it is for and its text
+ */
+struct message {
+    int nick;
+    int text; // offset into the texts
+    int length;
+};
+
+char (*nicknames)[32];
+int *nicknamelengths;
+char *texts;
+
+/**
+ * @return the CPU time used so far in microseconds
+ */
+long long cpu_us() {
+    return (long long) clock() * 1000000 / CLOCKS_PER_SEC;
+}
+
+/**
+ * Relay messages as text lines
+ * @param m, the messages
+ * @param count, the number of messages
+ * @param out, where to write them
+ * @return the bytes written
+ */
+long encode_text(struct message *m, int count, unsigned char *out) {
+    long length = 0;
+    int i;
+    for (i = 0; i < count; i++) {
+        char *p = (char *) out + length;
+        memcpy(p, "PRIVMSG ", 8);
+        memcpy(p + 8, nicknames[m[i].nick], nicknamelengths[m[i].nick]);
+        p += 8 + nicknamelengths[m[i].nick];
+        memcpy(p, " :", 2);
+        memcpy(p + 2, texts + m[i].text, m[i].length);
+        p[2 + m[i].length] = '\n';
+        length = p + 3 + m[i].length - (char *) out;
+    }
+    return length;
+}
+
+/**
+ * Read relayed text lines back, a read buffer's worth at a time
+ * @return a checksum of what was read, so the compiler keeps the parse
+ */
+long long decode_text(const unsigned char *in, long length, int *messages) {
+    long long checksum = 0;
+    long offset = 0;
+    while (offset < length) {
+        int chunk = length - offset < 8192 ? length - offset : 8192;
+        struct line_view views[64];
+        int consumed;
+        int count = split_lines((const char *) in + offset, chunk, views, 64, &consumed);
+        int i;
+        for (i = 0; i < count; i++) {
+            struct command cmd;
+            parse_command(views[i], &cmd);
+            checksum += cmd.param.start[0] + cmd.trailing.length;
+        }
+        *messages += count;
+        offset += consumed;
+    }
+    return checksum;
+}
+
+/**
+ * Pass messages as binary frames, a batch of records at a time
+ * @param m, the messages
+ * @param count, the number of messages
+ * @param batch, the messages per batch
+ * @param compress, 1 to compress the frames
+ * @param out, where to write them
+ * @return the bytes written
+ */
+long encode_binary(struct message *m, int count, int batch, int compress, unsigned char *out) {
+    struct link_interns *interns = malloc(sizeof (struct link_interns));
+    unsigned char *records = malloc(batch * (1 + 4 + LINK_NAME_SIZE + LINK_RECORD_MAX));
+    link_interns_reset(interns);
+    long length = 0;
+    int i = 0;
+    while (i < count) {
+        int n = 0;
+        int end = i + batch < count ? i + batch : count;
+        for (; i < end; i++) {
+            const char *name = nicknames[m[i].nick];
+            int namelength = nicknamelengths[m[i].nick];
+            int is_new;
+            int id = link_intern(interns, name, namelength, &is_new);
+            if (id == -1) {
+                records[n++] = LINK_RECORD_RESET;
+                link_interns_reset(interns);
+                id = link_intern(interns, name, namelength, &is_new);
+            }
+            if (is_new) n += link_put_define(records + n, id, name, namelength);
+            n += link_put_privmsg(records + n, id, texts + m[i].text, m[i].length);
+        }
+        int at = 0;
+        while (at < n) {
+            int records_in_frame;
+            int fit = link_frame_fit(records + at, n - at, &records_in_frame);
+            length += link_put_frame(out + length, records + at, fit, records_in_frame, compress);
+            at += fit;
+        }
+    }
+    free(records);
+    free(interns);
+    return length;
+}
+
+/**
+ * Read binary frames back
+ * @return a checksum of what was read, or -1 if a frame was malformed
+ */
+long long decode_binary(const unsigned char *in, long length, int *messages) {
+    struct link_names *names = calloc(1, sizeof (struct link_names));
+    unsigned char *raw = malloc(LINK_FRAME_MAX);
+    long long checksum = 0;
+    long offset = 0;
+    while (offset < length && checksum != -1) {
+        int flags;
+        int payload = link_get_header(in + offset, &flags);
+        const unsigned char *records;
+        int n = payload == -1 ? -1
+                : link_get_records(in + offset + LINK_FRAME_HEADER, payload, flags, raw, &records);
+        int count = link_get16(in + offset + 4);
+        int at = 0;
+        struct link_record r;
+        while (n != -1 && count-- > 0) {
+            int size = link_get_record(records + at, n - at, &r);
+            if (size == -1) {
+                n = -1;
+            } else if (r.type == LINK_RECORD_PRIVMSG) {
+                checksum += names->names[r.id][0] + r.length;
+                (*messages)++;
+            } else if (r.type == LINK_RECORD_DEFINE) {
+                memcpy(names->names[r.id], r.data, r.length);
+                names->lengths[r.id] = r.length;
+            } else if (r.type == LINK_RECORD_RESET) {
+                memset(names->lengths, 0, sizeof (names->lengths));
+            }
+            at += size;
+        }
+        if (n == -1) checksum = -1;
+        offset += LINK_FRAME_HEADER + payload;
+    }
+    free(raw);
+    free(names);
+    return checksum;
+}
+
+int main(int argc, char **argv) {
+    int count = 1000000;
+    int nick_count = 1000;
+    int size = 64;
+    int batch = 35; // what the server's link writer averages under load
+    int opt;
+    while ((opt = getopt(argc, argv, "n:u:s:b:")) != -1) {
+        switch (opt) {
+            case 'n': count = atoi(optarg);
+                break;
+            case 'u': nick_count = atoi(optarg);
+                break;
+            case 's': size = atoi(optarg);
+                break;
+            case 'b': batch = atoi(optarg);
+                break;
+            default: count = 0;
+        }
+    }
+    if (count < 1 || nick_count < 1 || size < 1 || size > LINK_TEXT_MAX || batch < 1) {
+        fprintf(stderr, "usage: linkbench [-n messages] [-u nicknames] [-s message size]\n"
+                "                 [-b messages per batch]\n");
+        exit(-1);
+    }
+
+    // texts made of the greetings, varying around the message size
+    srandom(2014); // the same messages every run so runs compare
+    nicknames = malloc(nick_count * sizeof (*nicknames));
+    nicknamelengths = malloc(nick_count * sizeof (int));
+    int i;
+    for (i = 0; i < nick_count; i++) {
+        nicknamelengths[i] = snprintf(nicknames[i], sizeof (nicknames[i]), "user%d", i);
+    }
+    int text_size = 64 * 1024;
+    texts = malloc(text_size + 2 * LINK_TEXT_MAX);
+    int length = 0;
+    while (length < text_size + LINK_TEXT_MAX) {
+        char *g = greetings[random() & 7];
+        int n = strlen(g);
+        memcpy(texts + length, g, n);
+        texts[length + n] = ' ';
+        length += n + 1;
+    }
+    int longest = size * 3 / 2 < LINK_TEXT_MAX ? size * 3 / 2 : LINK_TEXT_MAX;
+    struct message *m = malloc(count * sizeof (struct message));
+    for (i = 0; i < count; i++) {
+        m[i].nick = random() % nick_count;
+        m[i].length = size / 2 + random() % (longest - size / 2 + 1);
+        m[i].text = random() % text_size;
+    }
+
+    // enough for a text line, or a DEFINE, PRIVMSG and frame, per message
+    unsigned char *out = malloc((long) count * (64 + longest));
+    if (nicknames == NULL || nicknamelengths == NULL || texts == NULL || m == NULL || out == NULL) {
+        perror("malloc");
+        exit(-1);
+    }
+    linescan_init(0);
+
+    printf("%d messages of %d bytes on average to %d nicknames, %d per batch\n",
+            count, size, nick_count, batch);
+    printf("%-11s %10s %12s %12s %12s %8s\n", "format", "bytes/msg", "MB/million",
+            "encode ms/M", "decode ms/M", "bytes");
+    const char *formats[] = {"text", "binary", "compressed"};
+    long text_bytes = 0;
+    int f;
+    for (f = 0; f < 3; f++) {
+        long long start = cpu_us();
+        long bytes = f == 0 ? encode_text(m, count, out) : encode_binary(m, count, batch, f == 2, out);
+        long long encoded = cpu_us();
+        int decoded = 0;
+        long long checksum = f == 0 ? decode_text(out, bytes, &decoded) : decode_binary(out, bytes, &decoded);
+        long long finished = cpu_us();
+        if (f == 0) text_bytes = bytes;
+        if (checksum == -1 || decoded != count) {
+            printf("%-11s decoded %d of %d messages\n", formats[f], decoded, count);
+            continue;
+        }
+        double per_million = 1e6 / count;
+        printf("%-11s %10.1f %12.1f %12.1f %12.1f %7.2fx\n", formats[f], (double) bytes / count,
+                bytes * per_million / 1e6, (encoded - start) * per_million / 1000,
+                (finished - encoded) * per_million / 1000, (double) bytes / text_bytes);
+    }
+
+    free(out);
+    free(m);
+    free(texts);
+    free(nicknamelengths);
+    free(nicknames);
+    return 0;
+}
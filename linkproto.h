@@ -0,0 +1,467 @@
+/*
+  Server link protocol for the NOS 2014 assignment IRC-like chat service.
+
+  (C) Samuel Deane 2014.
+
+  Linked servers (sample -l, -P) send each other frames, each a header then
+  a batch of records.  A link's writer thread puts everything queued since
+  its last write into as few frames as it can, so under load one frame
+  carries hundreds of routed messages.
+
+  A frame header is 8 bytes: the payload length (32 bits), the number of
+  records (16 bits), flags and the protocol version.  A compressed payload
+  (LINK_COMPRESSED) is the raw length (32 bits) then the records compressed
+  by link_compress.  All integers are big endian.
+
+  A record is a type byte then:
+    SERVER  length byte, name       the first record each way
+    KEY     length byte, key        the second, the secret both servers
+                                    were given (sample -K)
+    NICK    length byte, nickname   registered on the sender
+    QUIT    length byte, nickname   no longer registered on the sender
+    DEFINE  id (16 bits), length byte, nickname
+    PRIVMSG id (16 bits), text length (16 bits), text
+    RESET   nothing, every id is forgotten
+  A PRIVMSG names its target by an id the sender interned the nickname as
+  with an earlier DEFINE, so after the first message to a nickname each one
+  costs 5 bytes more than its text.  When the sender's table of ids is full
+  it sends RESET and starts again.  Ids last only as long as the link.
+
+  The first frame each way is SERVER and KEY alone.  The dialling server
+  sends its own first, the accepting one sends its only once it has checked
+  the key, so the key is never sent to a server that has not shown it.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+ */
+
+#ifndef LINKPROTO_H
+#define LINKPROTO_H
+
+#include <string.h>
+#include <strings.h>
+
+#define LINK_VERSION 1
+#define LINK_FRAME_HEADER 8
+// the most record bytes in one frame, before compression
+#define LINK_FRAME_MAX 65536
+// a payload smaller than this is sent as it is, it would not shrink enough
+// to pay for compressing it
+#define LINK_COMPRESS_MIN 1024
+#define LINK_COMPRESSED 1 // a frame flag
+
+#define LINK_RECORD_SERVER 1
+#define LINK_RECORD_NICK 2
+#define LINK_RECORD_QUIT 3
+#define LINK_RECORD_DEFINE 4
+#define LINK_RECORD_PRIVMSG 5
+#define LINK_RECORD_RESET 6
+#define LINK_RECORD_KEY 7
+
+#define LINK_NAME_SIZE 64 // a name is at most 63 bytes
+#define LINK_TEXT_MAX 1024 // as much text as a reply holds
+// the largest record, a PRIVMSG with the most text
+#define LINK_RECORD_MAX (5 + LINK_TEXT_MAX)
+#define LINK_MAX_INTERNS 4096
+#define LINK_INTERN_SLOTS (2 * LINK_MAX_INTERNS) // a power of two
+
+static inline void link_put16(unsigned char *p, unsigned int v) {
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static inline void link_put32(unsigned char *p, unsigned int v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static inline unsigned int link_get16(const unsigned char *p) {
+    return p[0] << 8 | p[1];
+}
+
+static inline unsigned int link_get32(const unsigned char *p) {
+    return (unsigned int) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+/**
+ * Write a frame header
+ * @param p, where to write it, LINK_FRAME_HEADER bytes
+ * @param length, the length of the payload that follows
+ * @param count, the number of records in it
+ * @param flags, LINK_COMPRESSED or 0
+ */
+static inline void link_put_header(unsigned char *p, int length, int count, int flags) {
+    link_put32(p, length);
+    link_put16(p + 4, count);
+    p[6] = flags;
+    p[7] = LINK_VERSION;
+}
+
+/**
+ * Write a SERVER, KEY, NICK or QUIT record
+ * @return the length of the record
+ */
+static inline int link_put_name(unsigned char *p, int type, const char *name, int length) {
+    if (length >= LINK_NAME_SIZE) length = LINK_NAME_SIZE - 1;
+    p[0] = type;
+    p[1] = length;
+    memcpy(p + 2, name, length);
+    return 2 + length;
+}
+
+/**
+ * Write a DEFINE record
+ * @return the length of the record
+ */
+static inline int link_put_define(unsigned char *p, int id, const char *name, int length) {
+    if (length >= LINK_NAME_SIZE) length = LINK_NAME_SIZE - 1;
+    p[0] = LINK_RECORD_DEFINE;
+    link_put16(p + 1, id);
+    p[3] = length;
+    memcpy(p + 4, name, length);
+    return 4 + length;
+}
+
+/**
+ * Write a PRIVMSG record
+ * @return the length of the record
+ */
+static inline int link_put_privmsg(unsigned char *p, int id, const char *text, int length) {
+    if (length > LINK_TEXT_MAX) length = LINK_TEXT_MAX;
+    p[0] = LINK_RECORD_PRIVMSG;
+    link_put16(p + 1, id);
+    link_put16(p + 3, length);
+    memcpy(p + 5, text, length);
+    return 5 + length;
+}
+
+/**
+ * a record as read, pointing into the payload
+ */
+struct link_record {
+    int type;
+    int id; // of a DEFINE or PRIVMSG
+    const char *data; // the name or text
+    int length;
+};
+
+/**
+ * Read a record, checking it lies within the payload
+ * @param p, the record
+ * @param available, the bytes left in the payload
+ * @param r, the record read
+ * @return the length of the record or -1 if it is malformed
+ */
+static inline int link_get_record(const unsigned char *p, int available, struct link_record *r) {
+    if (available < 1) return -1;
+    r->type = p[0];
+    r->id = 0;
+    int header;
+    switch (r->type) {
+        case LINK_RECORD_SERVER:
+        case LINK_RECORD_KEY:
+        case LINK_RECORD_NICK:
+        case LINK_RECORD_QUIT:
+            if (available < 2) return -1;
+            header = 2;
+            r->length = p[1];
+            break;
+        case LINK_RECORD_DEFINE:
+            if (available < 4) return -1;
+            header = 4;
+            r->id = link_get16(p + 1);
+            r->length = p[3];
+            break;
+        case LINK_RECORD_PRIVMSG:
+            if (available < 5) return -1;
+            header = 5;
+            r->id = link_get16(p + 1);
+            r->length = link_get16(p + 3);
+            break;
+        case LINK_RECORD_RESET:
+            header = 1;
+            r->length = 0;
+            break;
+        default:
+            return -1;
+    }
+    if (r->length > available - header || r->id >= LINK_MAX_INTERNS
+            || r->length > (r->type == LINK_RECORD_PRIVMSG ? LINK_TEXT_MAX : LINK_NAME_SIZE - 1)) return -1;
+    r->data = (const char *) p + header;
+    return header + r->length;
+}
+
+/**
+ * Hash a name ignoring case (FNV-1a), as the server's name_hash does
+ */
+static inline unsigned int link_name_hash(const char *name, int length) {
+    unsigned int h = 2166136261u;
+    int i;
+    for (i = 0; i < length; i++) {
+        unsigned char c = name[i];
+        if (c >= 'A' && c <= 'Z') c += 'a' - 'A';
+        h = (h ^ c) * 16777619u;
+    }
+    return h;
+}
+
+/**
+ * the ids a sender has given nicknames, an open addressed table from names
+ * to ids as the server's name_index is
+ */
+struct link_interns {
+    int count; // the ids given out, each id is its index in names
+    unsigned int hashes[LINK_INTERN_SLOTS];
+    short ids[LINK_INTERN_SLOTS]; // -1 for an empty slot
+    unsigned char lengths[LINK_MAX_INTERNS];
+    char names[LINK_MAX_INTERNS][LINK_NAME_SIZE];
+};
+
+/**
+ * Forget every id, as the other side does on a RESET record
+ */
+static inline void link_interns_reset(struct link_interns *in) {
+    in->count = 0;
+    memset(in->ids, -1, sizeof (in->ids));
+}
+
+/**
+ * Find the id of a nickname, giving it one if it has none
+ * @param in, the sender's ids
+ * @param name, the nickname
+ * @param length, its length
+ * @param is_new, set to 1 if it was given an id now, which must be sent in
+ *  a DEFINE before it is used
+ * @return the id, or -1 if there are no more ids until a RESET
+ */
+static inline int link_intern(struct link_interns *in, const char *name, int length, int *is_new) {
+    if (length >= LINK_NAME_SIZE) length = LINK_NAME_SIZE - 1;
+    unsigned int hash = link_name_hash(name, length);
+    unsigned int i = hash & (LINK_INTERN_SLOTS - 1);
+    *is_new = 0;
+    while (in->ids[i] != -1) {
+        int id = in->ids[i];
+        if (in->hashes[i] == hash && in->lengths[id] == length
+                && strncasecmp(in->names[id], name, length) == 0) return id;
+        i = (i + 1) & (LINK_INTERN_SLOTS - 1);
+    }
+    if (in->count == LINK_MAX_INTERNS) return -1;
+    int id = in->count++;
+    memcpy(in->names[id], name, length);
+    in->lengths[id] = length;
+    in->hashes[i] = hash;
+    in->ids[i] = id;
+    *is_new = 1;
+    return id;
+}
+
+/**
+ * the nicknames a receiver has been sent DEFINEs for, by id
+ */
+struct link_names {
+    unsigned char lengths[LINK_MAX_INTERNS]; // 0 for an id not defined
+    char names[LINK_MAX_INTERNS][LINK_NAME_SIZE];
+};
+
+/*
+  Compression is LZF's format: a control byte below 32 starts a run of that
+  many plus one literal bytes, anything else is a back reference, its top
+  three bits the length less two (7 meaning a further byte to add) and its
+  low five bits with the byte after them the distance back less one.  It is
+  fast rather than small, and routed chat repeats nicknames, ids and words
+  enough for it to pay.
+ */
+#define LINK_HASH_BITS 13
+
+/**
+ * Compress bytes
+ * @param in, the bytes
+ * @param length, how many
+ * @param out, where to put them compressed
+ * @param out_size, the room there, compression gives up rather than pass it
+ * @return the compressed length, or 0 if they do not fit in out_size
+ */
+static inline int link_compress(const unsigned char *in, int length, unsigned char *out, int out_size) {
+    int table[1 << LINK_HASH_BITS];
+    memset(table, -1, sizeof (table));
+    int ip = 0;
+    int op = 1; // out[0] is kept for the first literal run's control byte
+    int run_start = 0;
+    int run = 0;
+    while (ip < length) {
+        int ref = -1;
+        if (ip + 2 < length) {
+            unsigned int h = ((in[ip] << 16 | in[ip + 1] << 8 | in[ip + 2]) * 2654435761u) >> (32 - LINK_HASH_BITS);
+            ref = table[h];
+            table[h] = ip;
+            if (ref != -1 && (ip - ref - 1 >= 8192 || in[ref] != in[ip]
+                    || in[ref + 1] != in[ip + 1] || in[ref + 2] != in[ip + 2])) ref = -1;
+        }
+        if (ref == -1) {
+            if (op + 1 >= out_size) return 0;
+            out[op++] = in[ip++];
+            if (++run == 32) { // a run holds at most 32
+                out[run_start] = run - 1;
+                run_start = op++;
+                run = 0;
+            }
+            continue;
+        }
+        int max = length - ip < 264 ? length - ip : 264;
+        int n = 3;
+        while (n < max && in[ref + n] == in[ip + n]) n++;
+        if (op + 3 >= out_size) return 0;
+        // end the literal run, dropping its control byte if it is empty
+        if (run) out[run_start] = run - 1;
+        else op--;
+        int distance = ip - ref - 1;
+        int l = n - 2;
+        if (l < 7) {
+            out[op++] = (l << 5) | (distance >> 8);
+        } else {
+            out[op++] = (7 << 5) | (distance >> 8);
+            out[op++] = l - 7;
+        }
+        out[op++] = distance;
+        run_start = op++;
+        run = 0;
+        ip += n;
+    }
+    if (run) out[run_start] = run - 1;
+    else op--;
+    return op;
+}
+
+/**
+ * Decompress what link_compress made, checking every reference so a corrupt
+ * or hostile payload cannot read or write outside the buffers
+ * @param in, the compressed bytes
+ * @param length, how many
+ * @param out, where to put them
+ * @param out_size, the room there
+ * @return the decompressed length, or -1 if they are malformed
+ */
+static inline int link_decompress(const unsigned char *in, int length, unsigned char *out, int out_size) {
+    int ip = 0;
+    int op = 0;
+    while (ip < length) {
+        int c = in[ip++];
+        if (c < 32) {
+            c++;
+            if (ip + c > length || op + c > out_size) return -1;
+            memcpy(out + op, in + ip, c);
+            ip += c;
+            op += c;
+            continue;
+        }
+        int n = c >> 5;
+        if (n == 7) {
+            if (ip >= length) return -1;
+            n += in[ip++];
+        }
+        n += 2;
+        if (ip >= length) return -1;
+        int ref = op - ((c & 31) << 8 | in[ip++]) - 1;
+        if (ref < 0 || op + n > out_size) return -1;
+        // byte by byte, as a reference may overlap what it produces
+        while (n--) out[op++] = out[ref++];
+    }
+    return op;
+}
+
+/**
+ * Find how many of a run of records go in the next frame
+ * @param p, the records
+ * @param length, their length
+ * @param count, set to the number that fit
+ * @return the length of those that fit
+ */
+static inline int link_frame_fit(const unsigned char *p, int length, int *count) {
+    int used = 0;
+    *count = 0;
+    struct link_record r;
+    while (used < length && *count < 65535) {
+        int n = link_get_record(p + used, length - used, &r);
+        if (n == -1 || used + n > LINK_FRAME_MAX) break;
+        used += n;
+        (*count)++;
+    }
+    return used;
+}
+
+/**
+ * Write a frame of records, compressed if asked and it makes it smaller
+ * @param out, where to write it, needs LINK_FRAME_HEADER + length bytes
+ * @param p, the records, at most LINK_FRAME_MAX bytes
+ * @param length, their length
+ * @param count, the number of records
+ * @param compress, 1 to try compressing it
+ * @return the length of the frame
+ */
+static inline int link_put_frame(unsigned char *out, const unsigned char *p, int length, int count, int compress) {
+    if (compress && length >= LINK_COMPRESS_MIN) {
+        // room for only as much as would make it worth it
+        int n = link_compress(p, length, out + LINK_FRAME_HEADER + 4, length - 4);
+        if (n > 0) {
+            link_put_header(out, 4 + n, count, LINK_COMPRESSED);
+            link_put32(out + LINK_FRAME_HEADER, length);
+            return LINK_FRAME_HEADER + 4 + n;
+        }
+    }
+    link_put_header(out, length, count, 0);
+    memcpy(out + LINK_FRAME_HEADER, p, length);
+    return LINK_FRAME_HEADER + length;
+}
+
+/**
+ * Check a frame header
+ * @param header, the header
+ * @param flags, set to its flags
+ * @return the length of the payload that follows, or -1 if the header is
+ *  not one this version reads
+ */
+static inline int link_get_header(const unsigned char *header, int *flags) {
+    unsigned int length = link_get32(header);
+    *flags = header[6];
+    if (header[7] != LINK_VERSION || length > LINK_FRAME_MAX + 4) return -1;
+    return length;
+}
+
+/**
+ * Get at the records of a payload, decompressing them if need be
+ * @param payload, the payload
+ * @param length, its length
+ * @param flags, the frame's flags
+ * @param raw, room for LINK_FRAME_MAX bytes to decompress into
+ * @param records, set to the records
+ * @return the length of the records, or -1 if the payload is malformed
+ */
+static inline int link_get_records(const unsigned char *payload, int length, int flags,
+        unsigned char *raw, const unsigned char **records) {
+    if (!(flags & LINK_COMPRESSED)) {
+        *records = payload;
+        return length;
+    }
+    if (length < 4) return -1;
+    unsigned int raw_length = link_get32(payload);
+    if (raw_length > LINK_FRAME_MAX
+            || link_decompress(payload + 4, length - 4, raw, raw_length) != (int) raw_length) return -1;
+    *records = raw;
+    return raw_length;
+}
+
+#endif
@@ -0,0 +1,705 @@
+/*
+  Load generator for the NOS 2014 assignment IRC-like chat service.
+
+  (C) Samuel Deane 2014.
+
+  Registers pairs of clients and measures, through the whole server, the
+  latency of one message at a time from one client to another and the
+  throughput of many pairs sending to each other at once.  Given a TCP port
+  and a unix socket path it runs over TCP, the unix socket and shared memory
+  rings attached through the unix socket (see ring.h) in turn and compares
+  them.  Given -P, the port of a second server linked with the first, it
+  also runs with the receiving clients on that server, so every message
+  crosses the server link, and compares that with TCP to one server.
+  Given -H, that many more clients flood the server with pipelined
+  PRIVMSGs while the latency is measured, to show what busy clients cost the quiet ones, at
+  the rate given by -r (twice what the server can take overloads it) or as
+  fast as the server takes them.
+
+  usage: loadgen [-p tcp port] [-u unix socket path] [-h host]
+                 [-c client pairs] [-n messages per pair] [-s message size]
+                 [-l latency samples] [-R (rings only)]
+                 [-P tcp port of a linked server] [-H flooding clients]
+                 [-r messages per second between the flooding clients]
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+
+#include "ring.h"
+
+// the most messages a sender has on their way at once, kept well under the
+// server's per client queue (64) so that none are dropped as too far behind
+#define WINDOW 32
+#define READ_SIZE 65536
+// how long without progress before a run is given up on
+#define STALL_US 5000000
+
+/**
+ * where the server is and how to reach it
+ */
+struct transport {
+    const char *name;
+    int family; // AF_INET or AF_UNIX
+    const char *host;
+    int port;
+    const char *path;
+    int ring; // move each client onto shared memory rings after connecting
+    int receiver_port; // 0, or the port of a linked server for the receivers
+};
+
+/**
+ * one client connection
+ */
+struct client {
+    int fd;
+    struct ring_region *ring; // NULL unless on rings, when fd only wakes
+    char nickname[32];
+    char buffer[READ_SIZE];
+    int length; // bytes in buffer not yet made into lines
+};
+
+/**
+ * one measurement's results
+ */
+struct result {
+    double p50_us;
+    double p99_us;
+    double max_us;
+    double messages_per_second;
+    double megabytes_per_second;
+    long delivered;
+    long expected;
+};
+
+/**
+ * @return the current time in microseconds
+ */
+long long now_us() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+/**
+ * Connect to the server
+ * @return the socket or -1 if it could not connect
+ */
+int connect_to(struct transport *tr) {
+    int fd;
+    if (tr->family == AF_UNIX) {
+        struct sockaddr_un address;
+        bzero(&address, sizeof (address));
+        address.sun_family = AF_UNIX;
+        strncpy(address.sun_path, tr->path, sizeof (address.sun_path) - 1);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd == -1) return -1;
+        if (connect(fd, (struct sockaddr *) &address, sizeof (address)) == -1) {
+            close(fd);
+            return -1;
+        }
+    } else {
+        struct hostent *he = gethostbyname(tr->host);
+        if (he == NULL) return -1;
+        struct sockaddr_in address;
+        bzero(&address, sizeof (address));
+        address.sin_family = AF_INET;
+        memcpy(&address.sin_addr, he->h_addr_list[0], he->h_length);
+        address.sin_port = htons(tr->port);
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd == -1) return -1;
+        if (connect(fd, (struct sockaddr *) &address, sizeof (address)) == -1) {
+            close(fd);
+            return -1;
+        }
+        // as an interactive client would, so latency is not Nagle's delay
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof (on));
+    }
+    return fd;
+}
+
+/**
+ * Write all of a buffer
+ * @return 0 if it was written or -1 if the connection failed
+ */
+int write_all(int fd, const char *data, int length) {
+    while (length > 0) {
+        int n = write(fd, data, length);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += n;
+        length -= n;
+    }
+    return 0;
+}
+
+/**
+ * Send all of a buffer to the server, through the client's ring if it has one
+ * @return 0 if it was sent or -1 if the connection failed
+ */
+int client_write(struct client *c, const char *data, int length) {
+    if (c->ring == NULL) return write_all(c->fd, data, length);
+    while (length > 0) {
+        int n = ring_write(c->ring, &c->ring->to_server, data, length);
+        data += n;
+        length -= n;
+        ring_wake(&c->ring->to_server, c->fd);
+        if (length > 0) usleep(10); // full, give the server time to catch up
+    }
+    return 0;
+}
+
+/**
+ * Get ready to wait for input, a client on a ring must say it is going to sleep
+ * @return 1 if the client already has input, so should not wait, otherwise 0
+ */
+int client_prepare_wait(struct client *c) {
+    return c->ring != NULL && ring_prepare_wait(&c->ring->to_client);
+}
+
+/**
+ * Stop waiting for input
+ */
+void client_end_wait(struct client *c) {
+    if (c->ring != NULL) ring_end_wait(&c->ring->to_client);
+}
+
+/**
+ * Move a connected client onto shared memory rings
+ * @return 0 if it was moved or -1 if not
+ */
+int attach_ring(struct client *c) {
+    // the server's greeting first, so its RING reply arrives on its own
+    char greeting[256];
+    int length = 0;
+    while (length < 2 || memchr(greeting, '\n', length) == NULL) {
+        int n = read(c->fd, greeting + length, sizeof (greeting) - length);
+        if (n <= 0) return -1;
+        length += n;
+    }
+    if (write_all(c->fd, "RING\r\n", 6) == -1) return -1;
+
+    char reply[256];
+    struct iovec iov = {reply, sizeof (reply) - 1};
+    char control[CMSG_SPACE(sizeof (int))];
+    struct msghdr msg;
+    bzero(&msg, sizeof (msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof (control);
+    int n = recvmsg(c->fd, &msg, 0);
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    if (n <= 0 || cm == NULL || cm->cmsg_type != SCM_RIGHTS) {
+        reply[n > 0 ? n : 0] = 0;
+        fprintf(stderr, "no ring from the server: %s\n", reply);
+        return -1;
+    }
+    int fd;
+    memcpy(&fd, CMSG_DATA(cm), sizeof (int));
+    c->ring = mmap(NULL, ring_region_size(), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd); // the mapping keeps it
+    if (c->ring == MAP_FAILED || c->ring->magic != RING_MAGIC || c->ring->size != RING_SIZE) {
+        c->ring = NULL;
+        return -1;
+    }
+    // the socket now only carries wakeups, drained without blocking
+    fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL, NULL) | O_NONBLOCK);
+    return 0;
+}
+
+/**
+ * Read what has arrived for a client and count the lines containing a word
+ * @param c, the client, which must have input waiting
+ * @param word, the word to look for
+ * @param on_line, called with each matching line (and its length) if not NULL
+ * @param arg, passed to on_line
+ * @return the number of matching lines or -1 if the connection closed
+ */
+int read_lines(struct client *c, const char *word,
+        void (*on_line)(const char *, int, void *), void *arg) {
+    int n;
+    if (c->ring != NULL) {
+        if (ring_drain(c->fd) == -1) return -1;
+        n = ring_read(c->ring, &c->ring->to_client, c->buffer + c->length, READ_SIZE - c->length);
+    } else {
+        n = read(c->fd, c->buffer + c->length, READ_SIZE - c->length);
+        if (n <= 0) return -1;
+    }
+    c->length += n;
+    int matches = 0;
+    int start = 0;
+    int i;
+    for (i = 0; i < c->length; i++) {
+        if (c->buffer[i] != '\n' && c->buffer[i] != '\r') continue;
+        if (i > start) {
+            c->buffer[i] = 0;
+            if (strstr(c->buffer + start, word) != NULL) {
+                matches++;
+                if (on_line != NULL) on_line(c->buffer + start, i - start, arg);
+            }
+        }
+        start = i + 1;
+    }
+    memmove(c->buffer, c->buffer + start, c->length - start);
+    c->length -= start;
+    return matches;
+}
+
+/**
+ * Wait until every receiver's server has told the senders' server about it,
+ * by messaging each until a message gets through
+ * @param clients, the clients, senders and receivers in turn
+ * @param count, the number of clients
+ * @return 0 if every receiver is reachable or -1 if not
+ */
+int wait_linked(struct client *clients, int count) {
+    int i;
+    for (i = 0; i + 1 < count; i += 2) {
+        long long deadline = now_us() + STALL_US;
+        int arrived = 0;
+        while (!arrived) {
+            char line[128];
+            int n = snprintf(line, sizeof (line), "PRIVMSG %s :linked\r\n", clients[i + 1].nickname);
+            if (now_us() > deadline || client_write(&clients[i], line, n) == -1) return -1;
+            struct pollfd p[2] = {{clients[i].fd, POLLIN, 0}, {clients[i + 1].fd, POLLIN, 0}};
+            if (poll(p, 2, 10) < 0) return -1;
+            // the sender's "unknown username" replies are just dropped
+            if (p[0].revents && read_lines(&clients[i], "\n", NULL, NULL) == -1) return -1;
+            if (p[1].revents) arrived = read_lines(&clients[i + 1], " :linked", NULL, NULL);
+            if (arrived == -1) return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Note whether a reply to registering is the welcome (its last line, the
+ * 255) or a shedding server's refusal (263)
+ */
+void note_registration(const char *line, int length, void *arg) {
+    int *state = arg;
+    if (strstr(line, " 255 ") != NULL) *state = 1;
+    if (strstr(line, " 263 ") != NULL) *state = -1;
+}
+
+/**
+ * Connect and register clients, waiting until each has been welcomed
+ * @param tr, the server
+ * @param clients, the clients, senders and receivers in turn
+ * @param count, the number of clients
+ * @return 0 if they were all registered or -1 if not
+ */
+int register_clients(struct transport *tr, struct client *clients, int count) {
+    struct transport receivers = *tr;
+    if (tr->receiver_port) receivers.port = tr->receiver_port;
+    int i;
+    for (i = 0; i < count; i++) {
+        struct client *c = &clients[i];
+        c->length = 0;
+        c->ring = NULL;
+        c->fd = connect_to(i % 2 ? &receivers : tr);
+        if (c->fd == -1) {
+            perror("connect");
+            return -1;
+        }
+        if (tr->ring && attach_ring(c) == -1) return -1;
+        snprintf(c->nickname, sizeof (c->nickname), "lg%d_%d", (int) getpid() % 100000, i);
+        char line[128];
+        int n = snprintf(line, sizeof (line), "NICK %s\r\nUSER %s\r\n", c->nickname, c->nickname);
+        if (client_write(c, line, n) == -1) return -1;
+    }
+    // a server shedding load refuses registrations, and is asked again
+    // for a while in case it catches up
+    for (i = 0; i < count; i++) {
+        long long deadline = now_us() + STALL_US;
+        long long give_up = now_us() + 6 * STALL_US;
+        int welcomed = 0;
+        while (welcomed != 1) {
+            struct pollfd p = {clients[i].fd, POLLIN, 0};
+            int ready = client_prepare_wait(&clients[i]);
+            if (now_us() > deadline || poll(&p, 1, ready ? 0 : 1000) < 0) return -1;
+            client_end_wait(&clients[i]);
+            if (ready || p.revents) {
+                if (read_lines(&clients[i], " 2", note_registration, &welcomed) == -1) return -1;
+            }
+            if (welcomed == -1) {
+                usleep(100000);
+                char line[128];
+                int n = snprintf(line, sizeof (line), "USER %s\r\n", clients[i].nickname);
+                if (client_write(&clients[i], line, n) == -1) return -1;
+                deadline = now_us() + STALL_US < give_up ? now_us() + STALL_US : give_up;
+                welcomed = 0;
+            }
+        }
+    }
+    return tr->receiver_port ? wait_linked(clients, count) : 0;
+}
+
+/**
+ * Close clients
+ */
+void close_clients(struct client *clients, int count) {
+    int i;
+    for (i = 0; i < count; i++) {
+        client_write(&clients[i], "QUIT\r\n", 6);
+        close(clients[i].fd);
+        if (clients[i].ring != NULL) munmap(clients[i].ring, ring_region_size());
+    }
+}
+
+/**
+ * Make a PRIVMSG of about the given size carrying the time it was sent
+ * @return the length of the line
+ */
+int make_message(char *line, int size, const char *to, int message_size) {
+    int n = snprintf(line, size, "PRIVMSG %s :%lld ", to, now_us());
+    while (n < message_size - 2 && n < size - 3) line[n++] = 'x';
+    line[n++] = '\r';
+    line[n++] = '\n';
+    return n;
+}
+
+/**
+ * Note the latency of a received message from the send time in its text
+ */
+void note_latency(const char *line, int length, void *arg) {
+    long long *latency = arg;
+    const char *text = strstr(line + 1, " :");
+    if (text != NULL) *latency = now_us() - atoll(text + 2);
+}
+
+int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Measure the latency of one message at a time between a pair of clients
+ * @param tr, the server
+ * @param samples, the number of messages to time
+ * @param message_size, the size of each message
+ * @param go, a pipe to write to once registered to start any flooding
+ *  clients, or -1 if there are none
+ * @param r, where to put the percentiles
+ * @return 0 if measured or -1 if not
+ */
+int measure_latency(struct transport *tr, int samples, int message_size, int go, struct result *r) {
+    struct client *pair = calloc(2, sizeof (struct client));
+    double *times = malloc(samples * sizeof (double));
+    if (pair == NULL || times == NULL || register_clients(tr, pair, 2) == -1) {
+        free(pair);
+        free(times);
+        return -1;
+    }
+    if (go != -1) {
+        write(go, "g", 1);
+        usleep(500000); // for them to get going
+    }
+    int i;
+    for (i = 0; i < samples; i++) {
+        char line[4096];
+        int n = make_message(line, sizeof (line), pair[1].nickname, message_size);
+        if (client_write(&pair[0], line, n) == -1) break;
+        long long latency = -1;
+        while (latency == -1) {
+            struct pollfd p = {pair[1].fd, POLLIN, 0};
+            // a client on a ring spins a little before sleeping, as a bot
+            // after the lowest latency would
+            int ready = 0;
+            int spins;
+            for (spins = 0; spins < 1000 && !ready; spins++) ready = client_prepare_wait(&pair[1]);
+            int r = ready ? 1 : poll(&p, 1, STALL_US / 1000);
+            client_end_wait(&pair[1]);
+            if (r <= 0) break;
+            if (read_lines(&pair[1], "PRIVMSG", note_latency, &latency) == -1) break;
+        }
+        if (latency == -1) break;
+        times[i] = latency;
+    }
+    close_clients(pair, 2);
+    free(pair);
+    if (i == 0) {
+        free(times);
+        return -1;
+    }
+    qsort(times, i, sizeof (double), compare_doubles);
+    r->p50_us = times[i / 2];
+    r->p99_us = times[i * 99 / 100];
+    r->max_us = times[i - 1];
+    free(times);
+    return 0;
+}
+
+/**
+ * Measure the throughput of many pairs of clients each sending messages to
+ * the other of the pair as fast as the server delivers them
+ * @param tr, the server
+ * @param pairs, the number of pairs
+ * @param messages, the messages each pair sends
+ * @param message_size, the size of each message
+ * @param r, where to put the rates
+ * @return 0 if measured or -1 if not
+ */
+int measure_throughput(struct transport *tr, int pairs, int messages, int message_size, struct result *r) {
+    struct client *clients = calloc(2 * pairs, sizeof (struct client));
+    long *sent = calloc(pairs, sizeof (long));
+    long *received = calloc(pairs, sizeof (long));
+    struct pollfd *polls = calloc(pairs, sizeof (struct pollfd));
+    if (clients == NULL || sent == NULL || received == NULL || polls == NULL
+            || register_clients(tr, clients, 2 * pairs) == -1) {
+        free(clients);
+        free(sent);
+        free(received);
+        free(polls);
+        return -1;
+    }
+
+    // client 2i sends to client 2i+1
+    r->expected = (long) pairs * messages;
+    r->delivered = 0;
+    long long start = now_us();
+    long long last_progress = start;
+    while (r->delivered < r->expected && now_us() - last_progress < STALL_US) {
+        int i;
+        for (i = 0; i < pairs; i++) {
+            // top the sender's window up in one write
+            char batch[WINDOW * 1024];
+            int length = 0;
+            while (sent[i] < messages && sent[i] - received[i] < WINDOW
+                    && length + message_size + 64 < sizeof (batch)) {
+                length += make_message(batch + length, sizeof (batch) - length,
+                        clients[2 * i + 1].nickname, message_size);
+                sent[i]++;
+            }
+            if (length && client_write(&clients[2 * i], batch, length) == -1) goto done;
+            polls[i].fd = clients[2 * i + 1].fd;
+            polls[i].events = POLLIN;
+            polls[i].revents = client_prepare_wait(&clients[2 * i + 1]) ? POLLIN : 0;
+        }
+        int ready = 0;
+        for (i = 0; i < pairs; i++) ready |= polls[i].revents;
+        if (!ready && poll(polls, pairs, 100) < 0) break;
+        for (i = 0; i < pairs; i++) {
+            client_end_wait(&clients[2 * i + 1]);
+            if (!polls[i].revents) continue;
+            int n = read_lines(&clients[2 * i + 1], "PRIVMSG", NULL, NULL);
+            if (n == -1) goto done;
+            received[i] += n;
+            r->delivered += n;
+            if (n) last_progress = now_us();
+        }
+    }
+done:;
+    double seconds = (now_us() - start) / 1e6;
+    r->messages_per_second = r->delivered / seconds;
+    r->megabytes_per_second = r->delivered * (double) message_size / seconds / 1e6;
+    close_clients(clients, 2 * pairs);
+    free(clients);
+    free(sent);
+    free(received);
+    free(polls);
+    return 0;
+}
+
+/**
+ * Flood the server from clients each pipelining PRIVMSGs to itself, reading
+ * and discarding what comes back, until killed
+ * @param tr, the server
+ * @param count, the number of flooding clients
+ * @param message_size, the size of each message
+ * @param rate, the messages a second between them all, 0 for as many as
+ *  the server will take
+ * @param go, a pipe to wait on once registered, for the measuring clients to
+ *  register in turn before the server is overloaded and refuses them
+ */
+void flood(struct transport *tr, int count, int message_size, long rate, int go) {
+    struct client *clients = calloc(count, sizeof (struct client));
+    char (*out)[WINDOW * 1024] = calloc(count, sizeof (*out));
+    int *out_length = calloc(count, sizeof (int));
+    if (clients == NULL || out == NULL || out_length == NULL
+            || register_clients(tr, clients, count) == -1) exit(1);
+    char started;
+    if (read(go, &started, 1) != 1) exit(1);
+    int i;
+    for (i = 0; i < count; i++) {
+        fcntl(clients[i].fd, F_SETFL, fcntl(clients[i].fd, F_GETFL, NULL) | O_NONBLOCK);
+    }
+    long long start = now_us();
+    long sent = 0;
+    while (1) {
+        for (i = 0; i < count; i++) {
+            // what the server had no room for last time goes first, so no
+            // line is cut short
+            long due = rate ? (now_us() - start) * rate / 1000000 - sent : -1;
+            while (out_length[i] + message_size + 64 < sizeof (out[i]) && due != 0) {
+                out_length[i] += make_message(out[i] + out_length[i], sizeof (out[i]) - out_length[i],
+                        clients[i].nickname, message_size);
+                sent++;
+                if (due > 0) due--;
+            }
+            int n = write(clients[i].fd, out[i], out_length[i]);
+            if (n > 0) {
+                memmove(out[i], out[i] + n, out_length[i] - n);
+                out_length[i] -= n;
+            }
+            while (read(clients[i].fd, clients[i].buffer, READ_SIZE) > 0);
+        }
+        if (rate) usleep(1000);
+    }
+}
+
+/**
+ * Run both measurements over one transport and report them
+ * @return 0 if both ran or -1 if not
+ */
+int run(struct transport *tr, int pairs, int messages, int message_size, int samples,
+        int flooders, long flood_rate, struct result *r) {
+    // the flooders run in a process of their own so they never wait on us,
+    // and only while the latency is measured
+    int go[2] = {-1, -1};
+    pid_t flooding = -1;
+    if (flooders && pipe(go) == 0) flooding = fork();
+    if (flooding == 0) {
+        flood(tr, flooders, message_size, flood_rate, go[0]);
+        _exit(0);
+    }
+    int failed = measure_latency(tr, samples, message_size, go[1], r) == -1;
+    if (flooding > 0) {
+        kill(flooding, SIGKILL);
+        waitpid(flooding, NULL, 0);
+    }
+    if (go[0] != -1) {
+        close(go[0]);
+        close(go[1]);
+    }
+    failed = failed || measure_throughput(tr, pairs, messages, message_size, r) == -1;
+    if (failed) {
+        fprintf(stderr, "%s: could not measure, is the server running?\n", tr->name);
+        return -1;
+    }
+    printf("%-5s latency p50 %7.1f us  p99 %7.1f us  max %8.1f us   "
+            "throughput %9.0f msgs/s %7.2f MB/s (%ld of %ld delivered)\n",
+            tr->name, r->p50_us, r->p99_us, r->max_us,
+            r->messages_per_second, r->megabytes_per_second, r->delivered, r->expected);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    struct transport tcp = {"tcp", AF_INET, "127.0.0.1", 0, NULL};
+    struct transport local = {"unix", AF_UNIX, NULL, 0, NULL};
+    struct transport ring = {"ring", AF_UNIX, NULL, 0, NULL, 1};
+    struct transport linked = {"link", AF_INET, "127.0.0.1", 0, NULL};
+    int rings_only = 0;
+    int pairs = 16;
+    int messages = 2000;
+    int message_size = 128;
+    int samples = 2000;
+    int flooders = 0;
+    long flood_rate = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "p:u:h:c:n:s:l:RP:H:r:")) != -1) {
+        switch (opt) {
+            case 'p': tcp.port = atoi(optarg);
+                break;
+            case 'u': local.path = ring.path = optarg;
+                break;
+            case 'R': rings_only = 1;
+                break;
+            case 'P': linked.receiver_port = atoi(optarg);
+                break;
+            case 'h': tcp.host = optarg;
+                break;
+            case 'c': pairs = atoi(optarg);
+                break;
+            case 'n': messages = atoi(optarg);
+                break;
+            case 's': message_size = atoi(optarg);
+                break;
+            case 'l': samples = atoi(optarg);
+                break;
+            case 'H': flooders = atoi(optarg);
+                break;
+            case 'r': flood_rate = atol(optarg);
+                break;
+            default: argc = 0;
+        }
+    }
+    if (argc == 0 || (tcp.port == 0 && local.path == NULL) || pairs < 1
+            || messages < 1 || samples < 1 || message_size < 48 || message_size > 1000 || flooders < 0 || flood_rate < 0) {
+        fprintf(stderr, "usage: loadgen [-p tcp port] [-u unix socket path] [-h host]\n"
+                "               [-c client pairs] [-n messages per pair] [-s message size (48-1000)]\n"
+                "               [-l latency samples] [-R (rings only)]\n"
+                "               [-P tcp port of a linked server] [-H flooding clients]\n"
+                "               [-r messages per second between the flooding clients]\n");
+        exit(-1);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("%d client pairs, %d messages each of %d bytes, %d latency samples, %d flooding clients",
+            pairs, messages, message_size, samples, flooders);
+    if (flooders && flood_rate) printf(" at %ld msgs/s", flood_rate);
+    printf("\n");
+    if (rings_only) tcp.port = 0;
+    linked.host = tcp.host;
+    linked.port = tcp.port;
+    struct result tcp_result, local_result, ring_result, linked_result;
+    int tcp_ok = tcp.port && run(&tcp, pairs, messages, message_size, samples, flooders, flood_rate, &tcp_result) == 0;
+    int linked_ok = tcp.port && linked.receiver_port
+            && run(&linked, pairs, messages, message_size, samples, flooders, flood_rate, &linked_result) == 0;
+    int local_ok = local.path && !rings_only
+            && run(&local, pairs, messages, message_size, samples, flooders, flood_rate, &local_result) == 0;
+    int ring_ok = ring.path && run(&ring, pairs, messages, message_size, samples, flooders, flood_rate, &ring_result) == 0;
+    if (tcp_ok && linked_ok) {
+        printf("link vs tcp: latency p50 %.1f us more, throughput %.2fx\n",
+                linked_result.p50_us - tcp_result.p50_us,
+                linked_result.messages_per_second / tcp_result.messages_per_second);
+    }
+    if (tcp_ok && local_ok) {
+        printf("unix vs tcp: latency p50 %.2fx lower, throughput %.2fx higher\n",
+                tcp_result.p50_us / local_result.p50_us,
+                local_result.messages_per_second / tcp_result.messages_per_second);
+    }
+    if (local_ok && ring_ok) {
+        printf("ring vs unix: latency p50 %.2fx lower, throughput %.2fx higher\n",
+                local_result.p50_us / ring_result.p50_us,
+                ring_result.messages_per_second / local_result.messages_per_second);
+    }
+    return (tcp.port && !tcp_ok) || (tcp.port && linked.receiver_port && !linked_ok)
+            || (local.path && !rings_only && !local_ok)
+            || (ring.path && !ring_ok) ? 1 : 0;
+}
@@ -0,0 +1,119 @@
+/*
+  Mailboxes between event loops for the NOS 2014 assignment IRC-like chat
+  service.
+
+  (C) Samuel Deane 2014.
+
+  With -e the connections are shared out among event loops, and a PRIVMSG
+  from a client of one loop to a client of another used to be queued by
+  the sending loop itself, under the shard lock of the receiving client,
+  writing to the out queue the receiving loop then reads.  The queue, the
+  lock and the client's cache lines went back and forth between the two
+  loops' cores for every message.  Instead each ordered pair of loops has
+  a mailbox, a single producer single consumer ring of messages from the
+  one to the other: the sending loop posts what is for the other loop's
+  clients into it and the receiving loop collects them at its next turn,
+  queueing each to its client locally.  Only the mailbox's cache lines move
+  between the cores, a few messages to a line.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+ */
+
+#ifndef MAILBOX_H
+#define MAILBOX_H
+
+// the messages a mailbox holds, a power of two.  A sender that finds it
+// full waits for the receiving loop to collect, as queueing the message
+// itself would put it ahead of those still in the mailbox, so this bounds
+// how far the receiving loop can fall behind before senders wait on it
+#define MAILBOX_SIZE 256
+// keeps what the producer writes and what the consumer writes on separate
+// cache lines
+#define MAILBOX_CACHE_LINE 64
+
+/**
+ * a message posted to another loop: who it is for and the outbuf, which
+ * the mailbox holds a reference to
+ */
+struct mail {
+    int to; // the client's id
+    unsigned int generation; // of the client's slot when it was posted
+    void *data;
+};
+
+/**
+ * messages from one loop to another, the counters only ever grow (wrapping
+ * at 2^32) and the messages between head and tail are waiting
+ */
+struct mailbox {
+    volatile unsigned int tail; // messages ever posted, only the producer changes it
+    unsigned int head_seen; // the producer's last look at head, so a post rarely reads it
+    char producer_pad[MAILBOX_CACHE_LINE - 2 * sizeof (unsigned int)];
+    volatile unsigned int head; // messages ever collected, only the consumer changes it
+    char consumer_pad[MAILBOX_CACHE_LINE - sizeof (unsigned int)];
+    struct mail slots[MAILBOX_SIZE];
+};
+
+/**
+ * Post a message
+ * @param m, the mailbox, which the caller must be the only producer of
+ * @param to, who it is for
+ * @param generation, of their slot
+ * @param data, the message
+ * @return 0 if posted or -1 if the mailbox is full
+ */
+static inline int mailbox_post(struct mailbox *m, int to, unsigned int generation, void *data) {
+    unsigned int tail = m->tail;
+    if (tail - m->head_seen == MAILBOX_SIZE) {
+        // only now look at the consumer's line, it has probably moved on
+        m->head_seen = __atomic_load_n(&m->head, __ATOMIC_ACQUIRE);
+        if (tail - m->head_seen == MAILBOX_SIZE) return -1;
+    }
+    struct mail *s = &m->slots[tail & (MAILBOX_SIZE - 1)];
+    s->to = to;
+    s->generation = generation;
+    s->data = data;
+    __atomic_store_n(&m->tail, tail + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/**
+ * @return 1 if there are messages waiting in a mailbox, otherwise 0
+ */
+static inline int mailbox_waiting(struct mailbox *m) {
+    return __atomic_load_n(&m->tail, __ATOMIC_ACQUIRE) != m->head;
+}
+
+/**
+ * Collect the messages waiting, as many as fit
+ * @param m, the mailbox, which the caller must be the only consumer of
+ * @param mail, where to put them
+ * @param max, the most to collect
+ * @return the number collected
+ */
+static inline int mailbox_collect(struct mailbox *m, struct mail *mail, int max) {
+    unsigned int head = m->head;
+    unsigned int waiting = __atomic_load_n(&m->tail, __ATOMIC_ACQUIRE) - head;
+    int n = waiting < (unsigned int) max ? (int) waiting : max;
+    int i;
+    for (i = 0; i < n; i++) {
+        mail[i] = m->slots[(head + i) & (MAILBOX_SIZE - 1)];
+    }
+    __atomic_store_n(&m->head, head + n, __ATOMIC_RELEASE);
+    return n;
+}
+
+#endif
@@ -0,0 +1,535 @@
+/*
+  Traffic replay for the NOS 2014 assignment IRC-like chat service.
+
+  (C) Samuel Deane 2014.
+
+  Plays back a capture file written by a server started with -T (see
+  capture.h) against a server: each captured connection is opened, sent
+  the lines it sent and closed, in the order they happened, at the speed
+  they happened (-s 1), scaled (-s 2 twice as fast, -s 0.5 half as fast)
+  or as fast as the server takes them (-s 0).  What the server sends back
+  is read and thrown away.  The same capture drives a server the same way
+  every time, so a slowdown seen in production can be repeated, and a
+  change checked against it.
+
+  Alongside the replayed connections a pair of probe clients of its own
+  sends a PRIVMSG one to the other every -l ms, carrying its send time,
+  for the latency through the server under that traffic, as loadgen
+  measures it.  It reports the lines replayed a second, how far behind the
+  capture's schedule they were sent, and the probe latencies.
+
+  usage: replay [-h host] [-p tcp port] [-s speed, 0 as fast as possible]
+                [-l ms between latency probes, 0 for none] capture file
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+
+#include "capture.h"
+
+#define READ_SIZE 65536
+// how long to wait for a probe's message, or the server to register a probe
+#define STALL_US 5000000
+// how long the server is listened to after the last line, for what it is
+// still sending
+#define DRAIN_US 500000
+
+/**
+ * a captured OPEN, LINE or CLOSE, its time made relative to the start of
+ * the capture
+ */
+struct event {
+    long long us;
+    long order; // its place in the file, as the tie break
+    int connection; // an index into connections
+    int type;
+    const char *data;
+    int length;
+};
+
+/**
+ * a replayed connection
+ */
+struct connection {
+    unsigned long long key; // the server it was captured on, and its number there
+    int fd; // -1 until it is opened, and once it is closed
+    int opened; // at its OPEN, or its first line if it was handed over in an upgrade
+};
+
+/**
+ * a probe client, as loadgen's
+ */
+struct probe {
+    int fd;
+    char nickname[32];
+    int length;
+    char buffer[READ_SIZE];
+};
+
+const char *host = "127.0.0.1";
+int port = 0;
+struct connection *connections;
+int connection_count = 0;
+struct probe probes[2];
+int probing = 0; // the probes are registered
+long long probe_sent_us = 0; // the probe message on its way, 0 if none is
+long long probe_next_us = 0;
+long long probe_interval_us = 10000;
+double *latencies;
+long latency_count = 0;
+long latency_size = 0;
+long long bytes_received = 0;
+
+/**
+ * @return the current time in microseconds
+ */
+long long now_us() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+/**
+ * Connect to the server
+ * @return the socket or -1 if it could not connect
+ */
+int connect_to() {
+    struct hostent *he = gethostbyname(host);
+    if (he == NULL) return -1;
+    struct sockaddr_in address;
+    bzero(&address, sizeof (address));
+    address.sin_family = AF_INET;
+    memcpy(&address.sin_addr, he->h_addr_list[0], he->h_length);
+    address.sin_port = htons(port);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1) return -1;
+    if (connect(fd, (struct sockaddr *) &address, sizeof (address)) == -1) {
+        close(fd);
+        return -1;
+    }
+    // as an interactive client would, so latency is not Nagle's delay
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof (on));
+    return fd;
+}
+
+/**
+ * Write all of a buffer
+ * @return 0 if it was written or -1 if the connection failed
+ */
+int write_all(int fd, const char *data, int length) {
+    while (length > 0) {
+        int n = write(fd, data, length);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += n;
+        length -= n;
+    }
+    return 0;
+}
+
+int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return x < y ? -1 : x > y;
+}
+
+int compare_events(const void *a, const void *b) {
+    const struct event *x = a;
+    const struct event *y = b;
+    if (x->us != y->us) return x->us < y->us ? -1 : 1;
+    return x->order < y->order ? -1 : x->order > y->order;
+}
+
+int compare_keys(const void *a, const void *b) {
+    unsigned long long x = *(const unsigned long long *) a;
+    unsigned long long y = *(const unsigned long long *) b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Read a capture file into events in the order to replay them
+ * @param data, the file's contents, which the events point into
+ * @param size, its size
+ * @param events, where to put the events, allocated here
+ * @return the number of events, or -1 if the file is not a capture
+ */
+long read_capture(const unsigned char *data, long size, struct event **events) {
+    // no record is shorter than 3 bytes
+    struct event *e = malloc((size / 3 + 1) * sizeof (struct event));
+    unsigned long long *keys = malloc((size / 3 + 1) * sizeof (unsigned long long));
+    if (e == NULL || keys == NULL) {
+        perror("malloc");
+        exit(-1);
+    }
+    long count = 0;
+    long offset = 0;
+    long long origin = -1; // the wall clock start of the first server's part
+    long long base = 0; // the current part's start, relative to that
+    while (offset < size) {
+        struct capture_record r;
+        int n = capture_get_record(data + offset, size - offset > (1 << 30) ? 1 << 30 : size - offset, &r);
+        if (n == 0) break; // cut short as the server was stopped
+        if (n == -1 || (origin == -1 && r.type != CAPTURE_START)) {
+            fprintf(stderr, "not a capture file, or damaged at byte %ld\n", offset);
+            free(e);
+            free(keys);
+            return -1;
+        }
+        offset += n;
+        if (r.type == CAPTURE_START) {
+            if (origin == -1) origin = r.us;
+            base = r.us - origin;
+            continue;
+        }
+        // an upgraded server carries on its predecessor's numbering, so a
+        // connection handed over keeps its number from one part to the next
+        keys[count] = r.connection;
+        e[count].us = base + r.us;
+        e[count].order = count;
+        e[count].type = r.type;
+        e[count].data = r.data;
+        e[count].length = r.length;
+        count++;
+    }
+
+    // number the connections in the order of their keys
+    unsigned long long *sorted = malloc((count + 1) * sizeof (unsigned long long));
+    memcpy(sorted, keys, count * sizeof (unsigned long long));
+    qsort(sorted, count, sizeof (unsigned long long), compare_keys);
+    long i;
+    for (i = 0; i < count; i++) {
+        if (connection_count == 0 || sorted[connection_count - 1] != sorted[i]) {
+            sorted[connection_count++] = sorted[i];
+        }
+    }
+    connections = calloc(connection_count + 1, sizeof (struct connection));
+    for (i = 0; i < connection_count; i++) {
+        connections[i].key = sorted[i];
+        connections[i].fd = -1;
+    }
+    for (i = 0; i < count; i++) {
+        unsigned long long *found = bsearch(&keys[i], sorted, connection_count,
+                sizeof (unsigned long long), compare_keys);
+        e[i].connection = found - sorted;
+    }
+    free(sorted);
+    free(keys);
+    qsort(e, count, sizeof (struct event), compare_events);
+    *events = e;
+    return count;
+}
+
+/**
+ * Read what has arrived for a probe, noting the latency of its messages
+ * @return 0, or -1 if the connection closed
+ */
+int probe_read(struct probe *p) {
+    int n = read(p->fd, p->buffer + p->length, READ_SIZE - 1 - p->length);
+    if (n <= 0) return -1;
+    p->length += n;
+    bytes_received += n;
+    int start = 0;
+    int i;
+    for (i = 0; i < p->length; i++) {
+        if (p->buffer[i] != '\n' && p->buffer[i] != '\r') continue;
+        p->buffer[i] = 0;
+        if (strncmp(p->buffer + start, "PING ", 5) == 0) { // a server started with -i
+            char pong[128];
+            int n = snprintf(pong, sizeof (pong), "PONG %.100s\r\n", p->buffer + start + 5);
+            if (write_all(p->fd, pong, n) == -1) return -1;
+        }
+        const char *text = strstr(p->buffer + start, " :replay ");
+        if (text != NULL && probe_sent_us) {
+            if (latency_count == latency_size) {
+                latency_size = latency_size ? latency_size * 2 : 4096;
+                latencies = realloc(latencies, latency_size * sizeof (double));
+                if (latencies == NULL) {
+                    perror("realloc");
+                    exit(-1);
+                }
+            }
+            latencies[latency_count++] = now_us() - atoll(text + 9);
+            probe_sent_us = 0;
+        }
+        start = i + 1;
+    }
+    memmove(p->buffer, p->buffer + start, p->length - start);
+    p->length -= start;
+    return 0;
+}
+
+/**
+ * Connect and register the probe clients
+ * @return 0, or -1 if the server did not welcome them
+ */
+int probe_start() {
+    int i;
+    for (i = 0; i < 2; i++) {
+        struct probe *p = &probes[i];
+        p->length = 0;
+        p->fd = connect_to();
+        if (p->fd == -1) return -1;
+        snprintf(p->nickname, sizeof (p->nickname), "rp%d_%d", (int) getpid() % 100000, i);
+        char line[128];
+        int n = snprintf(line, sizeof (line), "NICK %s\r\nUSER %s\r\n", p->nickname, p->nickname);
+        if (write_all(p->fd, line, n) == -1) return -1;
+        // the welcome ends with the 255
+        long long deadline = now_us() + STALL_US;
+        while (p->length < 5 || strstr(p->buffer, " 255 ") == NULL) {
+            struct pollfd pfd = {p->fd, POLLIN, 0};
+            if (now_us() > deadline || poll(&pfd, 1, 100) < 0) return -1;
+            if (!pfd.revents) continue;
+            n = read(p->fd, p->buffer + p->length, READ_SIZE - 1 - p->length);
+            if (n <= 0) return -1;
+            p->length += n;
+            p->buffer[p->length] = 0;
+        }
+        p->length = 0;
+    }
+    probing = 1;
+    return 0;
+}
+
+/**
+ * Send the next probe message if it is time
+ */
+void probe_send(long long now) {
+    if (!probing || probe_interval_us == 0) return;
+    if (probe_sent_us && now - probe_sent_us < STALL_US) return; // one at a time
+    if (now < probe_next_us) return;
+    char line[128];
+    int n = snprintf(line, sizeof (line), "PRIVMSG %s :replay %lld\r\n", probes[1].nickname, now);
+    if (write_all(probes[0].fd, line, n) == -1) {
+        probing = 0;
+        return;
+    }
+    probe_sent_us = now;
+    probe_next_us = now + probe_interval_us;
+}
+
+/**
+ * Read whatever the server has sent, to the replayed connections and the
+ * probes, for up to a while
+ * @param timeout_us, the longest to wait for something, 0 not to wait
+ */
+void service(long long timeout_us) {
+    static struct pollfd *polls;
+    static int *owners;
+    static char discard[READ_SIZE];
+    if (polls == NULL) {
+        polls = malloc((connection_count + 2) * sizeof (struct pollfd));
+        owners = malloc((connection_count + 2) * sizeof (int)); // -1 and -2 for the probes
+        if (polls == NULL || owners == NULL) {
+            perror("malloc");
+            exit(-1);
+        }
+    }
+    int n = 0;
+    int i;
+    for (i = 0; i < connection_count; i++) {
+        if (connections[i].fd == -1) continue;
+        polls[n].fd = connections[i].fd;
+        polls[n].events = POLLIN;
+        owners[n++] = i;
+    }
+    for (i = 0; probing && i < 2; i++) {
+        polls[n].fd = probes[i].fd;
+        polls[n].events = POLLIN;
+        owners[n++] = -1 - i;
+    }
+    long long now = now_us();
+    if (probing && probe_interval_us && probe_next_us - now < timeout_us) {
+        timeout_us = probe_next_us > now ? probe_next_us - now : 0;
+    }
+    int r = poll(polls, n, timeout_us / 1000);
+    for (i = 0; r > 0 && i < n; i++) {
+        if (!polls[i].revents) continue;
+        if (owners[i] < 0) {
+            if (probe_read(&probes[-1 - owners[i]]) == -1) probing = 0;
+            continue;
+        }
+        struct connection *c = &connections[owners[i]];
+        int got = read(c->fd, discard, sizeof (discard));
+        if (got > 0) {
+            bytes_received += got;
+        } else if (got == 0 || errno != EINTR) {
+            close(c->fd); // the server closed it, after a QUIT say
+            c->fd = -1;
+        }
+    }
+    probe_send(now_us());
+}
+
+/**
+ * @return a percentile of sorted values
+ */
+double percentile(double *values, long count, int p) {
+    return count ? values[count * p / 100 < count ? count * p / 100 : count - 1] : 0;
+}
+
+int main(int argc, char **argv) {
+    double speed = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "h:p:s:l:")) != -1) {
+        switch (opt) {
+            case 'h': host = optarg;
+                break;
+            case 'p': port = atoi(optarg);
+                break;
+            case 's': speed = atof(optarg);
+                break;
+            case 'l': probe_interval_us = atol(optarg) * 1000LL;
+                break;
+            default: argc = 0;
+        }
+    }
+    if (argc == 0 || optind != argc - 1 || port == 0 || speed < 0 || probe_interval_us < 0) {
+        fprintf(stderr, "usage: replay [-h host] [-p tcp port] [-s speed, 0 as fast as possible]\n"
+                "              [-l ms between latency probes, 0 for none] capture file\n");
+        exit(-1);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    int fd = open(argv[optind], O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        perror(argv[optind]);
+        exit(-1);
+    }
+    unsigned char *data = malloc(st.st_size + 1);
+    long size = 0;
+    while (data != NULL && size < st.st_size) {
+        int n = read(fd, data + size, st.st_size - size > (1 << 20) ? 1 << 20 : st.st_size - size);
+        if (n <= 0) break;
+        size += n;
+    }
+    close(fd);
+    if (data == NULL || size < st.st_size) {
+        perror(argv[optind]);
+        exit(-1);
+    }
+    struct event *events;
+    long count = read_capture(data, size, &events);
+    if (count == -1) exit(-1);
+    long lines = 0;
+    long i;
+    for (i = 0; i < count; i++) {
+        if (events[i].type == CAPTURE_LINE) lines++;
+    }
+    double captured_s = count ? events[count - 1].us / 1e6 : 0;
+    printf("%ld lines on %d connections over %.1f s captured, replaying ",
+            lines, connection_count, captured_s);
+    if (speed > 0) printf("at %gx speed\n", speed);
+    else printf("as fast as possible\n");
+
+    if (probe_interval_us && probe_start() == -1) {
+        fprintf(stderr, "the latency probes could not register, is the server running?\n");
+        exit(-1);
+    }
+
+    // each line is sent when it is due, and how late that was noted
+    double *lags = malloc((lines + 1) * sizeof (double));
+    long lag_count = 0;
+    long sent = 0;
+    long refused = 0; // connections that could not be opened
+    long unsent = 0; // lines for connections that could not be opened or the server closed
+    long long start = now_us();
+    for (i = 0; i < count; i++) {
+        struct event *e = &events[i];
+        long long due = speed > 0 ? start + (long long) (e->us / speed) : 0;
+        long long now;
+        while (speed > 0 && (now = now_us()) < due) service(due - now);
+        if (speed == 0 && i % 64 == 0) service(0);
+        struct connection *c = &connections[e->connection];
+        if (!c->opened && e->type != CAPTURE_CLOSE) {
+            c->opened = 1;
+            c->fd = connect_to();
+            if (c->fd == -1) refused++;
+        }
+        if (e->type == CAPTURE_LINE) {
+            if (c->fd == -1) {
+                unsent++;
+                continue;
+            }
+            char line[CAPTURE_LINE_MAX + 2];
+            memcpy(line, e->data, e->length);
+            line[e->length] = '\r';
+            line[e->length + 1] = '\n';
+            if (write_all(c->fd, line, e->length + 2) == -1) {
+                close(c->fd);
+                c->fd = -1;
+                unsent++;
+                continue;
+            }
+            sent++;
+            if (speed > 0) lags[lag_count++] = now_us() - due;
+        } else if (e->type == CAPTURE_CLOSE && c->fd != -1) {
+            close(c->fd);
+            c->fd = -1;
+        }
+    }
+    double elapsed_s = (now_us() - start) / 1e6;
+    long long drained = now_us() + DRAIN_US;
+    while (now_us() < drained) service(drained - now_us());
+    for (i = 0; i < connection_count; i++) {
+        if (connections[i].fd != -1) close(connections[i].fd);
+    }
+    if (probing) {
+        write_all(probes[0].fd, "QUIT\r\n", 6);
+        write_all(probes[1].fd, "QUIT\r\n", 6);
+    }
+
+    printf("sent %ld lines in %.2f s, %.0f lines/s, %lld bytes back\n",
+            sent, elapsed_s, elapsed_s > 0 ? sent / elapsed_s : 0, bytes_received);
+    if (refused || unsent) {
+        printf("%ld connections could not be opened, %ld lines went unsent\n", refused, unsent);
+    }
+    if (lag_count) {
+        qsort(lags, lag_count, sizeof (double), compare_doubles);
+        printf("behind schedule p50 %7.1f us  p99 %7.1f us  max %8.1f us\n",
+                percentile(lags, lag_count, 50), percentile(lags, lag_count, 99), lags[lag_count - 1]);
+    }
+    if (latency_count) {
+        qsort(latencies, latency_count, sizeof (double), compare_doubles);
+        printf("latency p50 %7.1f us  p99 %7.1f us  max %8.1f us (%ld probes)\n",
+                percentile(latencies, latency_count, 50), percentile(latencies, latency_count, 99),
+                latencies[latency_count - 1], latency_count);
+    }
+    free(lags);
+    free(latencies);
+    free(events);
+    free(connections);
+    free(data);
+    return 0;
+}
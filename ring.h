@@ -0,0 +1,189 @@
+/*
+  Shared memory ring transport for the NOS 2014 assignment IRC-like chat
+  service.
+
+  (C) Samuel Deane 2014.
+
+  A bot on the same host connects to the server's unix domain socket and
+  sends RING as its first command.  The server replies on the socket with a
+  line ":myserver.com RING <size>" carrying, with SCM_RIGHTS, a file holding
+  a ring_region: two single producer single consumer byte rings, one for
+  the bot's commands and one for the lines sent to it.  From then on both
+  sides map the file and exchange the same bytes they would have sent over
+  the socket through the rings instead, with no system call per message.
+
+  The socket stays open as the wakeup channel.  A consumer with nothing to
+  read sets consumer_waiting before sleeping in poll on the socket, and a
+  producer that finds it set clears it and writes a byte to the socket, so
+  there is a system call only when the consumer was idle.  Closing the
+  socket ends the connection.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+ */
+
+#ifndef RING_H
+#define RING_H
+
+#include <string.h>
+#include <unistd.h>
+
+#define RING_MAGIC 0x474e4952 // "RING"
+#define RING_VERSION 1
+// the size of each ring's data, a power of two
+#define RING_SIZE (1 << 20)
+// keeps what the producer writes and what the consumer writes on separate
+// cache lines, so the two sides do not take the line from each other
+#define RING_CACHE_LINE 64
+
+/**
+ * one direction of the transport, the counters only ever grow (wrapping at
+ * 2^32) and the bytes between head and tail are waiting to be read
+ */
+struct ring {
+    volatile unsigned int tail; // bytes ever written, only the producer changes it
+    char producer_pad[RING_CACHE_LINE - sizeof (unsigned int)];
+    volatile unsigned int head; // bytes ever read, only the consumer changes it
+    volatile int consumer_waiting; // the consumer is asleep, or about to be
+    char consumer_pad[RING_CACHE_LINE - sizeof (unsigned int) - sizeof (int)];
+};
+
+/**
+ * the shared file, the data of each ring follows it
+ */
+struct ring_region {
+    unsigned int magic;
+    unsigned int version;
+    unsigned int size; // the size of each ring's data, always RING_SIZE
+    char pad[RING_CACHE_LINE - 3 * sizeof (unsigned int)];
+    struct ring to_server; // commands from the bot
+    struct ring to_client; // lines for the bot
+};
+
+/**
+ * @return the size of the shared file
+ */
+static inline size_t ring_region_size(void) {
+    return sizeof (struct ring_region) + 2 * (size_t) RING_SIZE;
+}
+
+/**
+ * @return the data of one of the region's rings
+ */
+static inline char *ring_data(struct ring_region *region, struct ring *r) {
+    char *data = (char *) (region + 1);
+    return r == &region->to_server ? data : data + RING_SIZE;
+}
+
+/**
+ * Copy bytes into a ring, as many as there is room for
+ * @param region, the region holding the ring
+ * @param r, the ring, which the caller must be the only producer of
+ * @param buf, the bytes
+ * @param length, the number of bytes
+ * @return the number of bytes copied
+ */
+static inline int ring_write(struct ring_region *region, struct ring *r, const void *buf, int length) {
+    unsigned int tail = r->tail;
+    unsigned int used = tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    // the sizes come from RING_SIZE rather than the shared memory, and the
+    // counters are checked, so a misbehaving other side can only garble the
+    // bytes it exchanges and never make us copy outside the ring
+    unsigned int room = used > RING_SIZE ? 0 : RING_SIZE - used;
+    if (length > room) length = room;
+    char *data = ring_data(region, r);
+    unsigned int at = tail & (RING_SIZE - 1);
+    unsigned int first = RING_SIZE - at < length ? RING_SIZE - at : length;
+    memcpy(data + at, buf, first);
+    memcpy(data, (const char *) buf + first, length - first);
+    __atomic_store_n(&r->tail, tail + length, __ATOMIC_RELEASE);
+    return length;
+}
+
+/**
+ * Copy bytes out of a ring, as many as are waiting up to length
+ * @param region, the region holding the ring
+ * @param r, the ring, which the caller must be the only consumer of
+ * @param buf, where to put the bytes
+ * @param length, the most bytes to copy
+ * @return the number of bytes copied
+ */
+static inline int ring_read(struct ring_region *region, struct ring *r, void *buf, int length) {
+    unsigned int head = r->head;
+    unsigned int waiting = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) - head;
+    if (waiting > RING_SIZE) waiting = RING_SIZE; // see ring_write
+    if (length > waiting) length = waiting;
+    char *data = ring_data(region, r);
+    unsigned int at = head & (RING_SIZE - 1);
+    unsigned int first = RING_SIZE - at < length ? RING_SIZE - at : length;
+    memcpy(buf, data + at, first);
+    memcpy((char *) buf + first, data, length - first);
+    __atomic_store_n(&r->head, head + length, __ATOMIC_RELEASE);
+    return length;
+}
+
+/**
+ * Get ready to sleep until the producer writes, the consumer must then
+ * sleep in poll on the socket unless this finds bytes already waiting
+ * @param r, the ring the caller consumes
+ * @return 1 if there are bytes waiting (and so no need to sleep), otherwise 0
+ */
+static inline int ring_prepare_wait(struct ring *r) {
+    __atomic_store_n(&r->consumer_waiting, 1, __ATOMIC_SEQ_CST);
+    // checked after setting consumer_waiting, so a producer either sees it
+    // set and wakes us or wrote before this and its bytes are seen here
+    if (__atomic_load_n(&r->tail, __ATOMIC_SEQ_CST) != r->head) {
+        __atomic_store_n(&r->consumer_waiting, 0, __ATOMIC_RELAXED);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Stop waiting, after waking or finding something else to do
+ * @param r, the ring the caller consumes
+ */
+static inline void ring_end_wait(struct ring *r) {
+    __atomic_store_n(&r->consumer_waiting, 0, __ATOMIC_RELAXED);
+}
+
+/**
+ * Wake the consumer of a ring just written to, if it is asleep
+ * @param r, the ring
+ * @param fd, the socket to wake it through
+ */
+static inline void ring_wake(struct ring *r, int fd) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    // clearing it as well means only the first write after it went to sleep
+    // makes a system call
+    if (r->consumer_waiting && __sync_bool_compare_and_swap(&r->consumer_waiting, 1, 0)) {
+        char wake = 'w';
+        write(fd, &wake, 1);
+    }
+}
+
+/**
+ * Read and discard the wakeup bytes waiting on the socket
+ * @param fd, the socket, which must be non-blocking
+ * @return 0, or -1 if the other side has closed it
+ */
+static inline int ring_drain(int fd) {
+    char wakes[64];
+    int n;
+    while ((n = read(fd, wakes, sizeof (wakes))) > 0);
+    return n == 0 ? -1 : 0;
+}
+
+#endif
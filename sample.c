@@ -13,37 +13,115 @@
  *                       The thread on creation calls client_thread_entry
  * client_thread_entry ... Declares the thread alive and calls connection_main
  * connection_main ... Handles the requests of the client by reading off the 
- *                     socket (read_from_socket), performing operations such as
+ *                     socket (wait_for_input), splitting what was read into
+ *                     lines (split_lines) and handling each line
+ *                     (process_line), performing operations such as
  *                     logging-in, sending messages, joining groups and handling
  *                     message timeouts. Which it does by getting the recipient 
- *                     client thread (et_client_thread_by_nickname) and writing 
- *                     to its message buffer and setting its has_message to 
- *                     1. The recipient thread knowing it has a message, sends 
- *                     out the message in its own time, though currently this 
- *                     process is undefined for multiple simultaneous messages 
- *                     as the buffer could be overwritten before the message is 
- *                     sent. On a QUIT message or timeout closes the connection.
+ *                     client thread (get_client_thread_by_nickname) and 
+ *                     queueing the message to it (enqueue_message) which sets
+ *                     its has_next_message to 1. The recipient thread knowing
+ *                     it has a message, sends out its queue in its own time 
+ *                     (flush_messages). On a QUIT message or timeout closes 
+ *                     the connection.
  * client_thread_entry ... Declares the thread dead
  * handle_connection ... Places the id back onto the stack (push_stack) for reuse 
  * Main ... Closes the listening socket
   
  * problems, possible issues, limitations etc. 
- * - Does not handle global messages
- * - Multiple threads sending private messages to a single thread at the same 
- *   time is undefined as the current system relies on each thread having its own
- *   unsynchronised message buffer with a delayed write output.
- *      this can be solved by implementing a linked list of messages
- * - Legitimate joins are not handled 
- * - Recipient clients are found through iterating over an array (avg O(n/2)) 
- *   whereas a synchronised hashtable will have better performance (avg O(1)).
- *   the thread_client is of a set size and will thus be wasteful
+ * - the thread_client array is of a set size and will thus be wasteful
  * - No check is performed to see if a clients nickname is unique
- * - Private messages not preceeded by a pong have an extra byte than expected.
- *   So a hack is used to set the method length to 1 less on such a condition
  * - Commenting is deliberately excessive for demonstration of understanding
  
  * Features
  * - Uses a stack to hold available client thread ids
+ * - Messages for a client are queued in a ring guarded by the lock of the 
+ *   client's shard, so any number of threads can send to it at once.  What
+ *   a full socket will not take stays queued until poll says it has room
+ *   (out_blocked), and messages are only dropped, and counted in STATS, once
+ *   the queue itself is full
+ * - Server wide notices (WALLOPS from an operator) are formatted once and
+ *   queued to each shard's clients in parallel by the shard worker threads
+ * - Nicknames and channels are found through hash indexes (name_index) 
+ *   rather than by iterating over every client
+ * - ISON, WHOIS and WHO look a whole list of nicknames up at once in the
+ *   nickname index and send their answer in one write (reply_batch)
+ * - LIST picks its channels out of a directory kept sorted by name and by
+ *   member count (directory_add), so a name prefix or a least number of
+ *   users needs no look at every channel, and sends them a page at a time
+ *   as the client's socket has room (list_continue)
+ * - PRIVMSG looks nicknames up without taking a lock (name_index_lookup),
+ *   and a closed connection's id is only reused once every thread that may
+ *   have found it has moved on to a later epoch (epoch_retire)
+ * - PRIVMSG takes a comma separated list of nicknames and channels, looks
+ *   them all up at once and queues the messages a shard at a time
+ * - Connections are admitted against per address limits on open connections
+ *   and connection rate (admission_check), and each client's commands are
+ *   rate limited (throttle_commands), loopback clients are trusted unless -L
+ * - With -u clients on the same host can connect over a unix domain socket
+ *   instead of TCP, and are served exactly as TCP clients are
+ * - A bot on the unix socket can send RING to move onto a pair of shared
+ *   memory rings (ring.h), exchanging the same lines with no system call per
+ *   message
+ * - Servers link to each other (-l, -P) so users can be spread over several:
+ *   each tells the others the nicknames registered on it, and a PRIVMSG
+ *   to a nickname registered on another server is passed over the link to
+ *   it (route_privmsg, link_main) in batched binary frames (linkproto.h),
+ *   compressed with -z.  A server links only with one that shows the key
+ *   it was given with -K (link_hello_receive)
+ * - With -e the connections are served by that many event loops instead of a
+ *   thread each (event_loop_main), each turn of a loop giving every
+ *   connection with something to do a turn bounded by the -b budgets of
+ *   lines and bytes, so one client pipelining a flood of commands holds the
+ *   others up by no more than its share, lines left over wait for its next
+ *   turn (serve_input)
+ * - A loop posts a PRIVMSG for another loop's client to a mailbox from it to
+ *   that loop (mailbox.h, post_to_loops) rather than queue it itself, and
+ *   with -A each loop and shard worker is pinned to a CPU, allocating its
+ *   mailboxes and buffers once pinned so they are in its node's memory
+ * - A thread (overload_main) watches how far the server lags and how many
+ *   clients have output waiting, and past the -O limits sheds load a level
+ *   at a time: new connections are left in the listen backlog, then
+ *   registrations are refused (263), then the heaviest senders are
+ *   throttled, easing off a level at a time once it has caught up
+ * - With -i, registered clients are sent a PING every -i seconds from their deadline
+ *   (client_deadline), the PONG giving a smoothed round trip time for the
+ *   client and a sample for the histogram in STATS, and a client that sends
+ *   nothing after a PING is dropped after PING_TIMEOUT_MS
+ * - STATS reports the server's counters
+ * - Each connection counts what it costs the server (struct client_usage),
+ *   and TOP shows an operator the clients costing the most by each measure,
+ *   found with a bounded heap rather than a sort of every client
+ *   (top_clients), STATS naming the costliest by each
+ * - With -T every line a client sends is recorded, with when and on which
+ *   connection, in a compact capture file (capture.h) staged through the
+ *   log's rings, for replay to play back against a server
+ * - Diagnostics go through LOG, which stages each thread's lines in its own
+ *   ring for a writer thread to drain (log_flush), so no client thread
+ *   waits on stdout; -v sets the level and each site is rate limited
+ * - With -S the registry (nicknames and their channels) is kept in a memory
+ *   mapped snapshot file (snapshot.h), each record rewritten as it changes,
+ *   so a server restarted after a crash loads it in one pass and holds each
+ *   nickname for its client to reclaim, rejoining its channels
+ * - A warm standby (-F) follows a primary (-r), applying every change to the
+ *   registry as the primary streams them to it (replicate), and when the
+ *   primary goes takes over its port with the registry held the same way.
+ *   The primary streams only to a standby that shows the -K key
+ * - SIGUSR2 upgrades the server in place (upgrade_server): a new copy is
+ *   started from the same path and handed the listening socket, every
+ *   client socket and each client's state over a unix socket, so no
+ *   client sees a disconnect
+ * - SIGTERM stops the server through exit, so the log, the capture and an
+ *   instrumented build's profile are written out (make pgo)
+ * - An idle connection holds only its client_thread and client_hot entries,
+ *   input buffers and output queues are borrowed from pools (pool_get) while
+ *   a partial line or queued messages are in flight and handed back after
+ * - With a thread a client, a registered client idle for -H seconds gives
+ *   its thread (and stack) up, a single thread watching its socket
+ *   (hibernate_main) and starting it a thread again on its next line, a
+ *   message for it or its deadline
+ * - Replies are rendered from templates compiled once at startup 
+ *   (compile_reply_templates) so sending a reply needs no snprintf or strlen
  * - Passes all tests of test.c 
  
   Contains sections directly taken from test.c, (C) Paul Gardner-Stephen 
@@ -68,6 +146,8 @@
 //IRC references
 //http://www.anta.net/misc/telnet-troubleshooting/irc.shtml
 
+// for CPU_SET and pthread_setaffinity_np, where there are such things
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -84,23 +164,109 @@
 #include <errno.h>
 #include <pthread.h>
 #include <ctype.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <sys/un.h>
+#include <netinet/tcp.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <sched.h>
+#include <stddef.h>
+
+#include "linescan.h"
+#include "snapshot.h"
+#include "ring.h"
+#include "linkproto.h"
+#include "mailbox.h"
+#include "capture.h"
+
+/**
+ * a message waiting to be sent, a broadcast shares one of these between every
+ * client it goes to so it is formatted once however many clients there are,
+ * and it is freed when the last of them has sent it
+ */
+struct outbuf {
+    int refs; // the number of queues holding it, changed atomically
+    int length;
+    char data[];
+};
+
+// the most messages a client can have waiting, beyond which it is too slow to
+// keep up and further messages for it are dropped rather than held forever
+#define OUT_QUEUE_SIZE 64
+
+// the most channels one client can be in
+#define MAX_JOINED 16
+
+// the size of a client's input buffer, the longest line it can send
+#define IO_BUFFER_SIZE 8192
+
+/**
+ * a client's input, borrowed from input_pool only while a partial line is
+ * waiting to be completed, as most clients are idle most of the time
+ */
+struct io_buffer {
+    int length;
+    unsigned char data[IO_BUFFER_SIZE];
+};
+
+/**
+ * a ring of messages waiting to be sent to a client, borrowed from
+ * out_queue_pool while it has messages waiting
+ */
+struct out_queue {
+    unsigned int head; // the next message to send
+    unsigned int tail; // where the next message queued goes
+    int offset; // the bytes of the message at head already written
+    struct outbuf *items[OUT_QUEUE_SIZE];
+};
 
 /**
- * a structure for each message node, 
+ * the part of a client that is looked at most often, kept apart from the rest
+ * in the dense client_hot array so that looking over every client (for a
+ * broadcast, or for timeouts) reads a few cache lines rather than a page each
  */
-struct node {
-  char message[1024];
-  int messagelength;
-  struct node *n1ext;
+struct client_hot {
+    int fd;
+
+    // the mode of the connection, modes are:
+    // 0 unregistered
+    // 1 password supplied // skipped here?
+    // 2 nickname supplied
+    // 3 username supplied == registered
+    int mode;
+
+    unsigned int generation; // bumped each time the slot is reused
+    unsigned int nick_hash; // the hash of the nickname once registered
+    long deadline_ms; // when the connection times out unless it sends something
+};
+
+/**
+ * what a connection has cost the server, for TOP to find the clients
+ * responsible for its load.  Only the connection's own thread (or loop)
+ * writes them, except queue_high_water which is written under its shard
+ * lock, and they are read racily as they are only reported
+ */
+struct client_usage {
+    long lines_in; // commands handled
+    long bytes_in;
+    long bytes_out; // written to its socket or ring
+    long messages_routed; // PRIVMSGs it sent, one for each recipient
+    long queue_high_water; // the most messages ever waiting in its out queue
+    long handling_ns; // the thread CPU time spent handling its commands
 };
 
 /**
- * a structure for each thread
+ * a structure for each thread, the rest of a client's state
  */
 struct client_thread {
     pthread_t thread;
     int thread_id;
-    int fd;
 
     int nicknamelength;
     char nickname[32];
@@ -109,45 +275,118 @@ struct client_thread {
 
     int state;
 
-    // the mode of the connection, modes are:
-    // 0 unregistered
-    // 1 password supplied // skipped here?
-    // 2 nickname supplied
-    // 3 username supplied == registered
-    int mode;
-
     // the timeout length of the structure
     time_t timeout;
+    long last_input_ms; // when the client last sent something
+    long busy_ms; // when its thread last had something to do, see hibernate
+    long ping_next_ms; // when to PING it next, 0 until it registers
+    long ping_sent_us; // when the PING awaiting a PONG went, 0 if none is
+    long rtt_us; // its smoothed round trip time, 0 until a PONG has come
 
-    char line[1024];
-    int line_length;
-
-    unsigned char buffer[8192];
-    int buffer_length;
+    struct io_buffer *in; // NULL unless part of a line is waiting
+    // its last turn left whole lines in its input, by using up its budget or
+    // being throttled, to be handled before anything more is read
+    int unfinished;
+    long throttled_until_ms; // when a throttled client may go on, in an event loop
 
+    // set when messages are queued so the thread stops waiting to read
     int has_next_message;
-    int messagelength;
-    char message[1024];
-    struct node *first_message_node;
-    struct node *next_message_node; // pointer to the next message node to add
-    pthread_rwlock_t next_message_node_lock; // can only add one message to the linked
-    // list at one time, perhaps create a thread to wait if locked? so it dosen't
-    // hold up the thread that sent the message.
-    // non blocking i/o does not wait on a blocked thread
-    
-};
-
-//defines the maximum client threads
+    // the messages waiting to be sent to the client, guarded by the lock of
+    // the client's shard so any thread can queue to it, NULL if there are none
+    struct out_queue *out;
+    // its socket took only part of a write, nothing more is written to it
+    // until poll says it has room, only its serving thread touches this
+    int out_blocked;
+
+    int is_operator; // may send server wide notices (WALLOPS)
+
+    // the shared memory rings a local bot talks through instead of its
+    // socket (see ring.h), NULL for any other client
+    struct ring_region *ring;
+    int ring_fd; // the file holding them, kept to hand over on an upgrade
+
+    struct in_addr address; // where the client connected from
+    int limited; // whether admission and command rate limits apply to it
+    double command_tokens; // the commands it may send before being throttled
+    long command_refill_ms; // when command_tokens was last topped up
+    int commands_recent; // handled since the overload check last looked
+    int shed; // throttled as one of the heaviest senders while overloaded
+
+    // the channels the client has joined, as indexes into channel_list
+    int channels[MAX_JOINED];
+    int channel_count;
+
+    // a LIST still being sent, a page each time its socket has room, or
+    // NULL.  Not handed over in an upgrade, the client is left to ask again
+    struct list_cursor *listing;
+
+    unsigned int capture_id; // its number in the capture file, 0 until it has one
+
+    struct client_usage usage;
+};
+
+/**
+ * a free list of same sized blocks, so clients can borrow buffers while
+ * they have data in flight without a malloc and free every time
+ */
+struct pool {
+    int size; // the size of each block
+    int max_free; // the most blocks kept for reuse, the rest are freed
+    void *free_list; // each free block starts with a pointer to the next
+    long free_count;
+    long in_use;
+    pthread_mutex_t lock;
+};
+
+//defines the maximum client threads, can be raised when compiling
+#ifndef MAX_CLIENTS
 #define MAX_CLIENTS 100
+#endif
+
+// the most channels that can exist at once, can be raised when compiling
+#ifndef MAX_CHANNELS
+#define MAX_CHANNELS 1024
+#endif
+#define CHANNEL_NAME_SIZE 64
+
+// the most targets a single PRIVMSG can name
+#define MAX_TARGETS 32
+
+// the number of shards the clients are divided between, each with a worker
+// thread so a broadcast is queued to all the shards at once
+#define NUM_SHARDS 4
 
 //define the dead and alive thread states (no longer relied on) and some timeouts
 #define DEAD 1
 #define ALIVE 2
+#define PARKED 3 // its thread has stopped so the connection can be handed over
+#define HIBERNATING 4 // its thread has stopped while the client is idle (hibernate_main)
 #define REG_TIMEOUT 120
 #define NICK_TIMEOUT 30 //else 5
+// how long a registered client that has sent nothing since being sent a
+// PING is given to answer it before it is taken for dead
+#define PING_TIMEOUT_MS 15000
+// the round trip time over which a client is logged as slow
+#define RTT_SLOW_US 500000
+// the round trip time histogram, the upper bounds of its buckets in
+// microseconds, the last bucket takes the rest
+#define RTT_BUCKETS 14
+const long rtt_bucket_us[RTT_BUCKETS - 1] = {100, 250, 500, 1000, 2500, 5000, 10000, 25000,
+    50000, 100000, 250000, 500000, 1000000};
 
 // create an array of client threads
 struct client_thread threads[MAX_CLIENTS];
+// and the hot part of each, threads[i] goes with client_hot[i]
+struct client_hot client_hot[MAX_CLIENTS];
+
+#define HOT(t) (&client_hot[(t)->thread_id])
+
+// the buffers clients borrow
+struct pool input_pool = {sizeof (struct io_buffer), 64, NULL, 0, 0, PTHREAD_MUTEX_INITIALIZER};
+struct pool out_queue_pool = {sizeof (struct out_queue), 256, NULL, 0, 0, PTHREAD_MUTEX_INITIALIZER};
+
+// how much memory a connection holds while idle, for STATS
+long idle_connection_bytes = sizeof (struct client_thread) + sizeof (struct client_hot);
 
 // a stack to hold the unused threads
 int aval_thread_stack[MAX_CLIENTS];
@@ -158,418 +397,6617 @@ pthread_rwlock_t aval_thread_stack_lock;
 // a lock for the message
 pthread_rwlock_t message_log_lock;
 
-// the number of registered users 
+// the number of registered users
 int reg_users = 0; //not used will make atomic
 
+// the password clients give OPER to become operators, NULL if there is none
+char *operator_password = NULL;
+
+// sent to a client thread to interrupt its wait for input when a message is
+// queued to it, the handler does nothing as interrupting the poll is enough
+#define WAKE_SIGNAL SIGUSR1
+
+// set by SIGUSR2 to hand every connection over to a fresh copy of the server
+// (upgrade_server), so a new binary can be put in place without a disconnect
+volatile sig_atomic_t upgrade_requested = 0;
+// set by SIGTERM to stop the server through exit, so that what the log and
+// the capture hold and, in an instrumented build, the profile are written
+// out, all of which being killed by the signal would lose
+volatile sig_atomic_t stop_requested = 0;
+// set while the connections are being handed over, a client thread seeing it
+// parks its connection rather than handle any more of its input
+volatile int upgrading = 0;
+// the number of client threads that have parked their connection
+int parked_clients = 0;
+// a pipe every waiting client thread polls, written to when upgrading so they
+// all park at once rather than when their poll next times out
+int upgrade_wakeup[2];
+
+// -H, how long a registered client with a thread of its own sends nothing
+// before the thread is let go and its socket left to hibernate_main, 0 never
+int hibernate_after_ms = 10000;
+// the ids of clients that have hibernated, for hibernate_main
+int hibernate_pipe[2] = {-1, -1};
+// a pipe written to, without blocking, when a hibernating client is sent a
+// message.  Its write end is non-blocking and hibernate_poked set while a
+// byte is waiting, so at most one ever is and enqueue_locked never waits on
+// it under the shard lock
+int hibernate_wakeup[2] = {-1, -1};
+int hibernate_poked = 0;
+long clients_hibernating = 0; // now, only hibernate_main changes it
+
 /**
- * Attempt to read data from a socket (sock) into a buffer (buffer)
- * @param sock, the socket to read from
- * @param buffer, pointer to a buffer to write data into
- * @param count, pointer to the length of the buffer 
- * @param buffer_size, the total size or space avaliable for the buffer
- * @param timeout, the amount of time the socket can be read whilst idle
- * @param has_next_message, pointer used to stop the read as it has a write to perform 
- * (probably would give better performance is handled here but would mean re-writing the give function ... so no)
- * @return 0 if data is returned to the buffer otherwise -1 as a read error occured
+ * counters for the STATS command, updated atomically with STAT_ADD
  */
-int read_from_socket(int sock, unsigned char *buffer, int *count, int buffer_size, int timeout, int* has_next_message) {
+struct server_stats {
+    long connections_accepted;
+    long rejected_full; // no client thread free
+    long rejected_address_cap; // too many connections from one address
+    long rejected_accept_rate; // one address connecting too fast
+    long commands_throttled; // times a client was made to wait to send more
+    long admission_expired; // idle address entries dropped
+    long admission_untracked; // addresses admitted unchecked as the table was full
+    long rings_attached; // bots moved onto shared memory rings
+    long pings_sent;
+    long pings_answered; // by a PONG carrying their token
+    long pings_unanswered; // given up on after PING_TIMEOUT_MS
+    long ping_timeouts; // clients dropped for sending nothing after a PING
+    long rtt_histogram[RTT_BUCKETS]; // the round trip times of answered PINGs
+    long link_messages_out; // PRIVMSGs passed to other servers
+    long link_messages_in; // PRIVMSGs passed from other servers and delivered
+    long link_messages_undeliverable; // passed from other servers for nobody here
+    long link_writes; // writes to links, each carrying every record queued since the last
+    long link_bytes_records; // the records written to links
+    long link_bytes_written; // what they took in frames, after any compression
+    long link_frames_dropped; // not queued as the link was too far behind
+    long replication_batches; // writes of registry changes to the standby
+    long replication_bytes; // what they carried
+    long loop_turns; // passes of the event loops over their connections
+    long loop_busy_us; // spent serving connections rather than waiting
+    long loop_turn_max_us;
+    long loop_turns_over_1ms;
+    long line_budgets_used; // turns a connection stopped with commands left
+    long byte_budgets_used; // reads that took a connection's whole byte budget
+    long shed_raised; // times the server shed more load
+    long shed_lowered; // times it shed less
+    long registrations_refused; // while shedding load
+    long senders_shed; // clients throttled as the heaviest senders
+    long presence_queries; // ISON, WHOIS and WHO commands answered
+    long presence_lookups; // the nicknames they looked up
+    long lists; // LIST commands answered
+    long list_pages; // the pages of channels they were sent in
+    long lines_captured; // lines recorded in the -T capture file
+    long capture_dropped; // records lost to a full log ring
+    long mail_posted; // messages posted to another event loop's mailbox
+    long mail_full; // times a sender waited for a full mailbox to be collected
+    long lookup_retries; // lock free nickname lookups that raced a change
+    long epoch_advances;
+    long ids_retired; // closed connections' ids left until no thread holds them
+    long ids_reclaimed; // and then pushed back for reuse
+    long hibernations; // client threads let go while their clients were idle
+    long hibernation_wakeups; // and started again
+    long messages_dropped; // not queued to or kept for a client that could not keep up
+};
 
-    //set the socket flags to non blocking 
-    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, NULL) | O_NONBLOCK);
+struct server_stats stats;
 
-    int t = time(0) + timeout; // set the timeout time (timeout seconds from now)
-    if (*count >= buffer_size) { // got some data return zero
-        return 0;
-    }
+#define STAT_ADD(field, n) __sync_fetch_and_add(&stats.field, (n))
 
-    // else read and continue reading from the socket until data is found
-    int r = read(sock, &buffer[*count], buffer_size - *count);
-    //address of the 0th elem in the array buffer
-    while (r != 0) { // while no data continue to try and read
-        if (r > 0) {
-            (*count) += r;
-            break;
-        }
-        r = read(sock, &buffer[*count], buffer_size - *count);
-        if (r == -1 && errno != EAGAIN) { // no double error
-            perror("read() returned error. Stopping reading from socket.");
-            return -1;
-        } else if (*has_next_message) {
-            break;
-        } else { // sleep 
-            usleep(100000);
-        }
-        // timeout after a few seconds of nothing
-        if (*has_next_message || time(0) >= t) {
-            break;
-        } //check the timeout
+// the admission limits, set from the command line, 0 turns a limit off
+int max_connections_per_address = 16;
+double accepts_per_second = 10; // per address, with bursts of twice this
+double commands_per_second = 20; // per client, with bursts of twice this
+int limit_loopback = 0; // local bridges and bots are trusted unless this is set
+// -O, the lag (ms) and the number of clients with output queued past which
+// the server is overloaded and sheds load, 0 turns either off
+int overload_lag_ms = 50;
+int overload_queues = MAX_CLIENTS / 2;
+// -i, how often a registered client is sent a PING, off unless asked for as
+// the assignment's protocol has the server silent until a client times out
+int ping_interval_ms = 0;
+
+/**
+ * what is known about one address that has connected recently
+ */
+struct admission_entry {
+    in_addr_t address; // 0 for an empty slot, as 0.0.0.0 can never connect
+    int connections; // the connections it has open now
+    double tokens; // the connections it may open before being refused
+    long last_seen_ms;
+};
+
+// must be a power of two, entries idle this long are dropped
+#define ADMISSION_TABLE_SIZE 4096
+#define ADMISSION_IDLE_MS 60000
+
+// an open addressed hash table of the addresses seen recently, kept compact
+// (sixteen bytes an address) so a reconnect storm from many addresses stays
+// in cache, and pruned of idle addresses so it never fills with stale ones
+struct admission_entry admission_table[ADMISSION_TABLE_SIZE];
+int admission_count = 0;
+pthread_mutex_t admission_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * a group of clients whose outbound queues share a lock and a worker thread,
+ * client thread_id i belongs to shard i % NUM_SHARDS
+ */
+struct shard {
+    int index;
+    pthread_mutex_t lock; // guards the outbound queues of the shard's clients
+    pthread_cond_t work; // signalled when there is a broadcast to deliver
+    pthread_t worker;
+    struct outbuf *broadcast; // the broadcast being delivered, NULL when idle
+    int delivered; // the result of the last broadcast
+    int skipped;
+};
 
+struct shard shards[NUM_SHARDS];
+
+#define SHARD_OF(t) (&shards[(t)->thread_id % NUM_SHARDS])
+
+// the most event loops -e can start
+#define MAX_LOOPS 64
+
+/**
+ * a thread serving many connections in turn, client thread_id i belongs to
+ * loop i % loop_count as it does to shard i % NUM_SHARDS
+ */
+struct event_loop {
+    int index;
+    pthread_t thread;
+    int wakeup[2]; // a pipe written to when it has something new to do
+    int sleeping; // it is in poll, or about to be, and must be woken
+    unsigned int next; // the connection it starts its next turn with
+    long turn_max_us; // its longest turn since the overload check last looked
+};
+
+struct event_loop loops[MAX_LOOPS];
+// -e, the number of event loops, 0 gives each connection its own thread
+int loop_count = 0;
+// -b, what one connection may have handled in a turn of its event loop
+// before the others have theirs, lines (commands) and bytes read
+int loop_line_budget = 16;
+int loop_byte_budget = 4096;
+
+#define LOOP_OF(t) (&loops[(t)->thread_id % loop_count])
+
+/**
+ * Wake an event loop if it is asleep, after giving it something to do
+ * @param loop, the loop
+ */
+void loop_wake(struct event_loop *loop) {
+    // as for a ring (ring_wake), the loop sets sleeping before looking for
+    // work, so either it sees the work or we see it sleeping
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (loop->sleeping && __sync_bool_compare_and_swap(&loop->sleeping, 1, 0)) {
+        char wake = 'w';
+        write(loop->wakeup[1], &wake, 1);
     }
-    buffer[*count] = 0; //null the end of the string
-    return 0;
 }
 
+__thread struct event_loop *my_loop = NULL; // the loop the calling thread runs, if it is one
+// mailboxes[from][to], the messages one loop has for another's clients
+// (mailbox.h), each allocated by the loop it is to once that loop has
+// started
+struct mailbox *mailboxes[MAX_LOOPS][MAX_LOOPS];
+
+// -A, pin the event loops and then the shard workers each to a CPU of their
+// own, as far as there are CPUs.  A loop's clients, its mailboxes and what
+// it allocates then stay in its core's caches, and as it allocates them
+// once pinned (and memory is placed where it is first touched) in the
+// memory of its core's node
+int pin_threads = 0;
+int pin_cpus[MAX_LOOPS + NUM_SHARDS]; // the CPUs we may run on, taken in turn
+int pin_cpu_count = 0;
+
+// only one broadcast runs at a time, the broadcaster waits on broadcast_done
+// until every shard worker has finished (broadcast_pending is back to zero)
+pthread_mutex_t broadcast_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t broadcast_pending_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t broadcast_done = PTHREAD_COND_INITIALIZER;
+int broadcast_pending = 0;
+
+// the name the server prefixes its replies with
+#define SERVER_NAME "myserver.com"
+
 /**
- * create a POSIX socket (a type of Berkeley socket) to listen in on a particular port
- * @param port, the number of the port
- * @return -1 if can't create a socket, can't set re-use addresses, 
- *  can't set the file descriptor to nonblocking I/O, binding failed or can't listen to it
+ * one piece of a compiled reply template, either a run of constant text or a
+ * placeholder that gets spliced in when the reply is rendered
  */
-int create_listen_socket(int port) {
-    //open a socket stream
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock == -1) {
-        return -1;
-    }
+struct reply_part {
+    const char *text; // the constant text, NULL when this part is a placeholder
+    int length; // the length of the constant text
+    char arg; // the placeholder, 'n' nickname, 'u' username, 's' text, 't' target, '0'-'2' integers
+};
 
-    int on = 1;
-    // try to set the sockets's options at the SOL_SOCKET api level so that 
-    // address like 0.0.0.0:21 and 192.168.0.1:21 are not the same (0's not local wildcards?)
-    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (char *) &on, sizeof (on)) == -1) {
-        close(sock);
-        return -1;
-    }
+#define MAX_REPLY_PARTS 32
 
-    // try to set the file descriptor to nonblocking I/O
-    if (ioctl(sock, FIONBIO, (char *) &on) == -1) {
-        close(sock);
-        return -1;
-    }
+/**
+ * a reply template compiled once at startup, so rendering a reply is only
+ * memcpys of pre-measured fragments rather than re-parsing a format string
+ * (snprintf) and re-measuring the result (strlen) for every line sent
+ */
+struct reply_template {
+    const char *source; // the template text, '$' followed by the placeholder
+    int count;
+    struct reply_part parts[MAX_REPLY_PARTS];
+};
 
-    // Bind it to the next port we want to try. 
-    struct sockaddr_in address;
-    //zero it
-    bzero((char *) &address, sizeof (address));
-    address.sin_family = AF_INET; // set to use AF_INET internet protocol address
-    address.sin_addr.s_addr = INADDR_ANY; // receive all incomming packets
-    address.sin_port = htons(port); // set the port to the specified port in network byte order. 
+/**
+ * the values spliced into a reply template, lengths are passed in as callers
+ * already know them and measuring them again is what we are trying to avoid
+ */
+struct reply_args {
+    const char *nickname;
+    int nicknamelength;
+    const char *username;
+    int usernamelength;
+    const char *text;
+    int textlength;
+    const char *target;
+    int targetlength;
+    long num[3];
+};
 
-    if (bind(sock, (struct sockaddr *) &address, sizeof (address)) == -1) {
-        // bind failed ... close the socket
-        close(sock);
-        return -1;
-    }
+// the replies the server sends, compiled by compile_reply_templates
+struct reply_template reply_hello = {":" SERVER_NAME " 020 * :hello\n\r"};
+struct reply_template reply_timeout = {"ERROR :Closing Link: Connection timed out (bye bye)\n\r"};
+struct reply_template reply_ping = {"PING :$0\n\r"};
+struct reply_template reply_quit = {"ERROR :Closing Link: $n[$u@client.example.com] (I Quit)\n\r"};
+struct reply_template reply_join_unregistered = {":" SERVER_NAME " 241 $n :JOIN command sent before registration\n\r"};
+struct reply_template reply_privmsg_unregistered = {":" SERVER_NAME " 241 $n :PRIVMSG command sent before registration\n\r"};
+struct reply_template reply_privmsg_unknown = {":" SERVER_NAME " 241 $n :PRIVMSG unknown username $s \n\r"};
+struct reply_template reply_privmsg = {":" SERVER_NAME " PRIVMSG $n :$s\n\r"};
+struct reply_template reply_user_before_nick = {":" SERVER_NAME " 241 * :USER command sent before nickname (NICK aNickName)\n\r"};
+struct reply_template reply_user_before_pass = {":" SERVER_NAME " 241 * :USER command sent before password (PASS *) and nickname (NICK aNickName)\n\r"};
+struct reply_template reply_not_registered = {":" SERVER_NAME " 241 $n :$s command sent before registration\n\r"};
+struct reply_template reply_oper_ok = {":" SERVER_NAME " 381 $n :You are now an IRC operator\n\r"};
+struct reply_template reply_oper_bad = {":" SERVER_NAME " 464 $n :Password incorrect\n\r"};
+struct reply_template reply_not_operator = {":" SERVER_NAME " 481 $n :Permission Denied- You're not an IRC operator\n\r"};
+struct reply_template reply_notice_all = {":" SERVER_NAME " NOTICE * :$s\n\r"};
+struct reply_template reply_broadcast_done = {":" SERVER_NAME " NOTICE $n :Broadcast to $0 clients in $1 microseconds, $2 skipped as too far behind\n\r"};
+struct reply_template reply_join = {":$n!~$u@client." SERVER_NAME " JOIN $s\n\r"};
+struct reply_template reply_part = {":$n!~$u@client." SERVER_NAME " PART $s\n\r"};
+struct reply_template reply_channel_message = {":" SERVER_NAME " PRIVMSG $t :$s\n\r"};
+struct reply_template reply_no_such_channel = {":" SERVER_NAME " 403 $n $s :No such channel\n\r"};
+struct reply_template reply_too_many_channels = {":" SERVER_NAME " 405 $n $s :You have joined too many channels\n\r"};
+struct reply_template reply_server_channels_full = {":" SERVER_NAME " 405 $n $s :There are too many channels on this server\n\r"};
+struct reply_template reply_too_many_targets = {":" SERVER_NAME " 407 $n :Too many recipients, only the first $0 were sent the message\n\r"};
+struct reply_template reply_not_on_channel = {":" SERVER_NAME " 442 $n $s :You're not on that channel\n\r"};
+struct reply_template reply_stat = {":" SERVER_NAME " 249 $n :$s $0\n\r"};
+struct reply_template reply_stats_end = {":" SERVER_NAME " 219 $n * :End of STATS report\n\r"};
+struct reply_template reply_top = {":" SERVER_NAME " 249 $n :top $s $0 $t $1\n\r"};
+struct reply_template reply_top_end = {":" SERVER_NAME " 219 $n TOP :End of TOP report\n\r"};
+struct reply_template reply_top_unknown = {":" SERVER_NAME " 461 $n TOP :No such measure $s, try lines, bytes_in, bytes_out, routed, queue or cpu_us\n\r"};
+struct reply_template reply_ring = {":" SERVER_NAME " RING $0\n\r"};
+struct reply_template reply_ring_refused = {":" SERVER_NAME " 421 $n RING :Rings are only for bots on the unix socket\n\r"};
+struct reply_template reply_nick_reserved = {":" SERVER_NAME " 433 $n $s :Nickname is reserved, try again later\n\r"};
+struct reply_template reply_try_again = {":" SERVER_NAME " 263 $n USER :Server load is temporarily too heavy. Please wait a while and try again.\n\r"};
+struct reply_template reply_nick_remote = {":" SERVER_NAME " 433 $n $s :Nickname is in use on another server\n\r"};
+struct reply_template reply_nick_in_use = {":" SERVER_NAME " 433 $n $s :Nickname is already in use\n\r"};
+struct reply_template reply_ison = {":" SERVER_NAME " 303 $n :$s\n\r"};
+struct reply_template reply_whois_user = {":" SERVER_NAME " 311 $n $t ~$u client." SERVER_NAME " * :$u\n\r"};
+struct reply_template reply_whois_server = {":" SERVER_NAME " 312 $n $t $s :NOS 2014 chat server\n\r"};
+struct reply_template reply_whois_idle = {":" SERVER_NAME " 317 $n $t $0 :seconds idle\n\r"};
+struct reply_template reply_whois_end = {":" SERVER_NAME " 318 $n $t :End of WHOIS list\n\r"};
+struct reply_template reply_whois_channels = {":" SERVER_NAME " 319 $n $t :$s\n\r"};
+struct reply_template reply_who = {":" SERVER_NAME " 352 $n $t ~$u client." SERVER_NAME " " SERVER_NAME " $s H :0 $u\n\r"};
+struct reply_template reply_who_end = {":" SERVER_NAME " 315 $n $t :End of WHO list\n\r"};
+struct reply_template reply_no_such_nick = {":" SERVER_NAME " 401 $n $t :No such nick/channel\n\r"};
+struct reply_template reply_no_nickname_given = {":" SERVER_NAME " 431 $n :No nickname given\n\r"};
+struct reply_template reply_list_start = {":" SERVER_NAME " 321 $n Channel :Users Name\n\r"};
+struct reply_template reply_list = {":" SERVER_NAME " 322 $n $t $0 :\n\r"};
+struct reply_template reply_list_end = {":" SERVER_NAME " 323 $n :End of LIST\n\r"};
+struct reply_template reply_welcome = {
+    ":" SERVER_NAME " 001 $n :Welcome to the Internet Relay Network $n!~$u@client." SERVER_NAME "\n"
+    ":" SERVER_NAME " 002 $n :Your host is " SERVER_NAME ", running version 1.0\n"
+    ":" SERVER_NAME " 003 $n :This server was created a few seconds ago\n"
+    ":" SERVER_NAME " 004 $n :Your host is " SERVER_NAME ", running version 1.0\n"
+    ":" SERVER_NAME " 253 $n :I have $0 users\n"
+    ":" SERVER_NAME " 254 $n :I have $1 connections $2\n"
+    ":" SERVER_NAME " 255 $n :even some more statistics\n\r"
+};
 
-    if (listen(sock, 20) != -1) {
-        // can listen to the socket ... return it
-        return sock;
+/**
+ * Split a reply template into constant fragments and placeholders
+ * @param tpl, the template to compile, its source must outlive it
+ * @return 0 if compiled or -1 if the template has too many parts
+ */
+int compile_reply_template(struct reply_template *tpl) {
+    const char *s = tpl->source;
+    const char *run = s; // start of the current run of constant text
+    tpl->count = 0;
+    while (1) {
+        if (*s == '$' || *s == 0) {
+            // close off the constant text seen so far
+            if (s > run) {
+                if (tpl->count == MAX_REPLY_PARTS) return -1;
+                tpl->parts[tpl->count].text = run;
+                tpl->parts[tpl->count].length = s - run;
+                tpl->count++;
+            }
+            if (*s == 0) return 0;
+            if (tpl->count == MAX_REPLY_PARTS) return -1;
+            tpl->parts[tpl->count].text = NULL;
+            tpl->parts[tpl->count].arg = s[1];
+            tpl->count++;
+            s += 2;
+            run = s;
+        } else {
+            s++;
+        }
     }
-    //otherwise close the socket
-    close(sock);
-    return -1;
 }
 
 /**
- * Try to accept an incoming socket
- * @param sock, the socket to try to accept
- * @return file descriptor of the accepted socket or -1 if an error occurred
+ * Compile every reply template, done once before any client is served
  */
-int accept_incoming(int sock) {
-    struct sockaddr addr;
-    unsigned int addr_len = sizeof addr;
-    int asock;
-    if ((asock = accept(sock, &addr, &addr_len)) != -1) {
-        return asock;
+void compile_reply_templates() {
+    struct reply_template * all[] = {&reply_hello, &reply_timeout, &reply_ping, &reply_quit,
+        &reply_join_unregistered, &reply_privmsg_unregistered,
+        &reply_privmsg_unknown, &reply_privmsg, &reply_user_before_nick,
+        &reply_user_before_pass, &reply_welcome, &reply_not_registered,
+        &reply_oper_ok, &reply_oper_bad, &reply_not_operator, &reply_notice_all,
+        &reply_broadcast_done, &reply_join, &reply_part, &reply_channel_message,
+        &reply_no_such_channel, &reply_too_many_channels,
+        &reply_server_channels_full, &reply_too_many_targets,
+        &reply_not_on_channel, &reply_stat, &reply_stats_end, &reply_top,
+        &reply_top_end, &reply_top_unknown,
+        &reply_nick_reserved, &reply_ring, &reply_ring_refused,
+        &reply_nick_remote, &reply_nick_in_use, &reply_try_again, &reply_ison, &reply_whois_user,
+        &reply_whois_server, &reply_whois_idle, &reply_whois_end,
+        &reply_whois_channels, &reply_who, &reply_who_end, &reply_no_such_nick,
+        &reply_no_nickname_given, &reply_list_start, &reply_list, &reply_list_end};
+    int i;
+    for (i = 0; i < sizeof (all) / sizeof (all[0]); i++) {
+        if (compile_reply_template(all[i])) {
+            fprintf(stderr, "reply template too complex: %s\n", all[i]->source);
+            exit(-1);
+        }
     }
-    return -1;
 }
 
 /**
- * find which thread structure the nickname belongs to
- * @param nickname, a nickname of the user to find
- * @param nicknamelength, the length of the nickname (speeds up searching)
- * @return a pointer to the client thread or NULL if not found
+ * Write the decimal form of an integer without going through printf
+ * @param out, where to write the digits, needs room for 20 characters
+ * @param value, the integer to write
+ * @return the number of characters written
  */
-struct client_thread* get_client_thread_by_nickname(char* nickname, int nicknamelength) {
+int format_int(char *out, long value) {
+    char digits[20];
+    int n = 0;
+    unsigned long v = value < 0 ? -(unsigned long) value : value;
+    do { // digits come out backwards, so collect them then reverse
+        digits[n++] = '0' + v % 10;
+        v /= 10;
+    } while (v);
+    int length = 0;
+    if (value < 0) out[length++] = '-';
+    while (n) out[length++] = digits[--n];
+    return length;
+}
 
+/**
+ * Render a compiled reply template into a buffer
+ * @param out, the buffer to render into
+ * @param size, the size of the buffer, the reply is truncated to fit
+ * @param tpl, the compiled template
+ * @param args, the values for the placeholders
+ * @return the length of the rendered reply
+ */
+int render_reply(char *out, int size, const struct reply_template *tpl, const struct reply_args *args) {
+    int length = 0;
     int i;
-    for (i = 0; i < MAX_CLIENTS; i++) {
-        struct client_thread *t = &threads[i];
-        if (t->mode == 3) {//only check registered threads
-            //printf("ALIVETHREAD username %s with tlen %d and want %.*s with unlen %d\n", t->username, t->usernamelength, usernamelength, username, usernamelength);
-            if (t->nicknamelength == nicknamelength) {
-                if (strncmp(nickname, (char *) t->nickname, t->nicknamelength) == 0) {
-                    return t;
-                }
+    for (i = 0; i < tpl->count; i++) {
+        const struct reply_part *p = &tpl->parts[i];
+        const char *src = p->text;
+        int n = p->length;
+        char number[20];
+        if (src == NULL) {
+            switch (p->arg) {
+                case 'n': src = args->nickname;
+                    n = args->nicknamelength;
+                    break;
+                case 'u': src = args->username;
+                    n = args->usernamelength;
+                    break;
+                case 's': src = args->text;
+                    n = args->textlength;
+                    break;
+                case 't': src = args->target;
+                    n = args->targetlength;
+                    break;
+                default: // an integer placeholder
+                    src = number;
+                    n = format_int(number, args->num[p->arg - '0']);
+                    break;
             }
-        } else {
-            //printf("DEADTHREAD username %s with tlen %d and want %.*s with unlen %d\n", t->username, t->usernamelength, usernamelength, username, usernamelength);
         }
+        if (n > size - length) { // too long, a truncated reply beats an overrun
+            n = size - length;
+        }
+        memcpy(out + length, src, n);
+        length += n;
     }
-    return NULL;
+    return length;
 }
 
 /**
- * Populate the thread stack with MAX_CLIENT thread_ids
+ * @return the time in milliseconds on a clock that never goes backwards
  */
-void populate_stack() {
-    for (aval_thread_stack_size = 0; aval_thread_stack_size < MAX_CLIENTS; aval_thread_stack_size++) {//0-MAX_CLIENTS-1
-        aval_thread_stack[aval_thread_stack_size] = MAX_CLIENTS - 1 - aval_thread_stack_size; //MAX_CLIENTS-1-0 999 998 ... 1 0 //the top of the stake will be 
-    }
-    printf("aval_thread_stack_size is now %d\n", aval_thread_stack_size);
+long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
 }
 
 /**
- * Try to pop the first available thread of the available thread stack
- * @return an available thread_id or -1 if none are available
+ * @return the time in microseconds on the same clock as now_ms
  */
-int trypop_stack() {
-    int return_val;
-    pthread_rwlock_wrlock(&aval_thread_stack_lock);
-    if (aval_thread_stack_size == 0) { // all in use nothing to pop
-        return_val = -1;
-    } else { // pop the top value
-        aval_thread_stack_size--;
-        return_val = aval_thread_stack[aval_thread_stack_size];
-    }
-    pthread_rwlock_unlock(&aval_thread_stack_lock);
-    return return_val;
+long now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
 }
 
 /**
- * Pushes a released thread_id onto the available thread stack
- * @param thread_id, the thread id to add to the stack 
- * @return 0 if thread id was added to the stack
+ * @return the CPU time the calling thread has used in nanoseconds, or where
+ *  there is no such clock the time now, which overstates it by any waits
  */
-int push_stack(int thread_id) {
-    pthread_rwlock_wrlock(&aval_thread_stack_lock);
-    aval_thread_stack[aval_thread_stack_size] = thread_id;
-    aval_thread_stack_size++;
-    pthread_rwlock_unlock(&aval_thread_stack_lock);
-    return 0;
+long thread_cpu_ns() {
+    struct timespec ts;
+#ifdef CLOCK_THREAD_CPUTIME_ID
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
 }
 
+// logging: LOG formats a line into the calling thread's own staging ring,
+// with no lock, and a writer thread (log_main) drains every ring to stdout
+// each LOG_FLUSH_MS, so a thread never waits on stdout or on another thread
+// logging.  A line below log_level costs one compare, and each LOG site
+// logs at most LOG_BURST lines a second, counting the rest as suppressed.
+#define LOG_ERROR 0
+#define LOG_WARNING 1
+#define LOG_INFO 2
+#define LOG_DEBUG 3
+// not a level, an entry that is a record for the capture file (capture)
+#define LOG_CAPTURE 4
+// the bytes each thread's ring holds, a power of two
+#define LOG_RING_SIZE 16384
+// the most threads with a ring at once, beyond that lines are dropped
+#define LOG_MAX_RINGS (MAX_CLIENTS + 64)
+#define LOG_LINE_MAX 512
+#define LOG_FLUSH_MS 50
+#define LOG_BURST 10
+
+const char *log_level_names[] = {"error", "warning", "info", "debug"};
+int log_level = LOG_INFO; // -v
+long log_dropped = 0; // lines lost to a full ring
+long log_suppressed = 0; // lines over a site's LOG_BURST
+
+// -T, every line clients send is recorded in the capture file (capture.h)
+// through the log's rings, the writer writing out the records as it does
+// the log's lines
+int capture_fd = -1;
+long capture_started_us; // on now_us's clock, record times are since then
+unsigned int capture_connections = 0; // numbered from 1 as first captured
+
 /**
- * Handle the client thread connections request messages and responses 
- * @param t the client thread structure to handle
- * @return 0 the close of a connection
+ * a thread's staging ring, a single producer single consumer ring as in
+ * ring.h, holding log_entry headers each followed by its text
  */
-int connection_main(struct client_thread* t) {
-    //printf("I have now seen %d connections so far.\n",++connection_count);
+struct log_ring {
+    volatile unsigned int tail; // bytes ever written, only the owner changes it
+    char pad[60];
+    volatile unsigned int head; // bytes ever drained, only the drainer changes it
+    int in_use; // owned by a running thread
+    char data[LOG_RING_SIZE];
+};
 
-    // initial setup
-    snprintf(t->nickname, 1024, "*");
-    snprintf(t->username, 1024, "*");
-    t->nicknamelength = 1;
-    t->usernamelength = 1;
-    t->mode = 1; // make sure the mode (is set to unregistered  NICK or USER) ... pass is ignored ... so 1
-    t->timeout = 5; // give 5 seconds to live
-    t->has_next_message = 0; //make sure there are no messages to be sent yet ... probably not required
+struct log_entry {
+    long long wall_ms; // when it was logged, since the epoch
+    short length; // of the text
+    char level;
+};
 
-    snprintf(t->line, 28, ":myserver.com 020 * :hello\n\r"); // write output message to the line
-    write(t->fd, t->line, strlen(t->line)); // write the line to the file descriptor
+/**
+ * the rate limit of a LOG site, one a second
+ */
+struct log_site {
+    long second;
+    int count; // logged this second
+    int suppressed; // not logged since the last line that was
+};
 
-    while (1) {
-        //printf(" fd for id %d is %d\n", t->thread_id, t->fd);
-        t->buffer_length = 0;
-
-        //read the response from the socket, waiting until input or timeout
-        read_from_socket(t->fd, t->buffer, &t->buffer_length, 8192, t->timeout, &t->has_next_message);
-        char * buffer = (char*) t->buffer;
-        int bufferlength = t->buffer_length;
-
-        if (t->has_next_message) {
-            write(t->fd, t->message, strlen(t->message));
-            t->has_next_message = 0;
-            //printf("reply printed '%.*s'\n", strlen(t->message), t->message);
-            if (t->buffer_length == 0) { // continue reading
-                continue;
-            }
-        } else if (t->buffer_length == 0) { // nothing in the buffer ... must have timed out
-            snprintf(t->line, 1024, "ERROR :Closing Link: Connection timed out (bye bye)\n\r");
-            write(t->fd, t->line, strlen(t->line));
-            close(t->fd); //
-            return 0;
-        }
+struct log_ring *log_rings[LOG_MAX_RINGS];
+int log_ring_count = 0;
+pthread_key_t log_ring_key; // the ring of each thread, released when it exits
+__thread struct log_ring *my_log_ring = NULL;
+pthread_mutex_t log_drain_lock = PTHREAD_MUTEX_INITIALIZER; // one drainer at a time
+// a thread that must not lose what it stages wakes the writer and waits for
+// it to drain the rings (log_wait_for_room), never writing them out itself
+pthread_mutex_t log_wake_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t log_wake = PTHREAD_COND_INITIALIZER; // the writer waits on it
+pthread_cond_t log_drained = PTHREAD_COND_INITIALIZER; // and broadcasts it after each pass
+int log_wanted = 0; // a thread is waiting for the writer
+long log_passes = 0; // the writer's passes over the rings
 
-        //remove the end line char, couldn't do it if the buffer was empty
-        t->buffer[t->buffer_length - 1] = 0;
-        //t->buffer[t->buffer_length - 2] = 0;
+/**
+ * Log a line if its level is on, the arguments are evaluated only if it is
+ */
+#define LOG(level, ...) do { \
+        static struct log_site site_; \
+        if (__builtin_expect((level) <= log_level, 0)) log_line(&site_, (level), __VA_ARGS__); \
+    } while (0)
 
-        if (strncasecmp("QUIT", buffer, 4) == 0) {
-            // client has said they are going away
-            // needed to avoid SIGPIPE and the program will be killed on socket read
-            snprintf(t->line, 1024, "ERROR :Closing Link: %s[%s@client.example.com] (I Quit)\n\r", t->nickname, t->username);
-            write(t->fd, t->line, strlen(t->line));
-            close(t->fd);
-            return 0;
-        } else if (strncasecmp("PONG", buffer, 4) == 0) {
-            if (t->buffer_length == 6) {
-                continue;
-            } else { // adjust for any pong
-                buffer = buffer + 6;
-                bufferlength -= 6;
-                //... continue to process
-            }
-            //keep alive message received ... do nothing
+/**
+ * The destructor of log_ring_key, hands an exiting thread's ring on, the
+ * writer still drains what is left in it
+ */
+void log_release_ring(void *ring) {
+    __atomic_store_n(&((struct log_ring *) ring)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * @return the calling thread's ring, taking one if it has none, or NULL if
+ *  every ring is taken
+ */
+struct log_ring *log_my_ring() {
+    if (my_log_ring != NULL) return my_log_ring;
+    int i;
+    int count = __atomic_load_n(&log_ring_count, __ATOMIC_ACQUIRE);
+    for (i = 0; i < count; i++) {
+        struct log_ring *r = __atomic_load_n(&log_rings[i], __ATOMIC_ACQUIRE);
+        if (r != NULL && !r->in_use && __sync_bool_compare_and_swap(&r->in_use, 0, 1)) break;
+    }
+    if (i == count) {
+        struct log_ring *r = calloc(1, sizeof (struct log_ring));
+        if (r == NULL) return NULL;
+        r->in_use = 1;
+        // claim a slot, then publish the ring in it
+        i = __sync_fetch_and_add(&log_ring_count, 0);
+        while (i < LOG_MAX_RINGS && !__sync_bool_compare_and_swap(&log_ring_count, i, i + 1)) {
+            i = __sync_fetch_and_add(&log_ring_count, 0);
         }
-        if (strncasecmp("JOIN", buffer, 4) == 0) {
-            if (t->mode == 3) {
-                //@todo handle legit join here
-                // of form JOIN #twilight_zone
-            } else {
-                snprintf(t->line, 1024, ":myserver.com 241 %s :JOIN command sent before registration\n\r", t->nickname);
-                write(t->fd, t->line, strlen(t->line));
-            }
-        } else if (strncasecmp("PRIVMSG", buffer, 7) == 0) {
-            if (t->mode == 3) {
-
-                int unstart = (int) buffer + 7 + 1; // address + 8
-                int nicknamelength = (int) strchr((char*) unstart, ' ') - unstart; //length of the first word post space
-
-                int mstart = unstart + nicknamelength + 1 + 1; //skip over the username, a space and the colon
-                int messagelength = bufferlength - nicknamelength - 12; //get the remaining buffer size (start includes the buffer address)
-                /*
-                                printf("buffer is %s\n\
-                nickname to send to %.*s, length is %d\n\
-                message to send %.*s, length is %d\n"
-                                        , (char*) buffer
-                                        , nicknamelength, (char*) unstart, nicknamelength
-                                        , messagelength, (char*) mstart, messagelength);
-                 */
-
-                struct client_thread* ct = get_client_thread_by_nickname((char*) unstart, nicknamelength);
-                if (ct == NULL) {
-                    //printf("got null?\n");
-                    snprintf(t->line, 1024, ":myserver.com 241 %s :PRIVMSG unknown username %.*s \n\r", t->nickname, nicknamelength, (char*) unstart);
-                    write(t->fd, t->line, strlen(t->line));
-                } else {
-                    //printf("nickname is %.*s of length %d\n", ct->nicknamelength, ct->nickname, ct->nicknamelength);
-                    messagelength = 22 + ct->nicknamelength + 2 + messagelength + ((strncasecmp("PONG", (char*) t-> buffer, 4) == 0) ? 3 : 2);
-                    snprintf(ct->message, messagelength, ":myserver.com PRIVMSG %s :%s\n\r", ct->nickname, (char*) mstart);
-                    ct->messagelength = messagelength; // copy its length                    
-                    ct->has_next_message = 1; //say it has to send a message
-                }
-            } else { // not a registered user
-                snprintf(t->line, 1024, ":myserver.com 241 %s :PRIVMSG command sent before registration\n\r", t->nickname);
-                write(t->fd, t->line, strlen(t->line));
-            }
-        } else if (strncasecmp("NICK", buffer, 4) == 0) {
-            /* // not required? as no PASS message
-                        if (t->mode == 0) {
-                            snprintf(t->line, 1024, ":myserver.com 241 * :NICK command sent before password (PASS *)\n");
-                            write(t->fd, t->line, strlen(t->line));
-                        }
-             */
-            t->mode = 2;
-            t->timeout = NICK_TIMEOUT;
-            // copy the nickname off the buffer to the client_thread struct
-            t->nicknamelength = t->buffer_length - 7;
-            memcpy(t->nickname, t->buffer + 5, t->nicknamelength);
-            //printf("nickname for thread %d set to %s and should be %s\n", t->thread_id, t->nickname, t->buffer + 5);
-        } else if (strncasecmp("USER", buffer, 4) == 0) {
-            if (t->mode == 2) {
-                t->mode = 3;
-                t->timeout = REG_TIMEOUT;
-                // @todo check username in unique ... add to list
-                // copy the nickname off the buffer to the client_thread struct
-                t->usernamelength = t->buffer_length - 7;
-                memcpy(t->username, t->buffer + 5, t->usernamelength);
-                //printf("username for thread %d set to %s and should be %s\n", t->thread_id, t->username, t->buffer + 5);
-                //send welcome messages
-                snprintf(t->line, 1024,
-                        ":myserver.com 001 %s :Welcome to the Internet Relay Network %s!~%s@client.myserver.com\n\
-:myserver.com 002 %s :Your host is myserver.com, running version 1.0\n\
-:myserver.com 003 %s :This server was created a few seconds ago\n\
-:myserver.com 004 %s :Your host is myserver.com, running version 1.0\n\
-:myserver.com 253 %s :I have %d users\n\
-:myserver.com 254 %s :I have %d connections %d\n\
-:myserver.com 255 %s :even some more statistics\n\r"
-                        , t->nickname, t->nickname, t->username
-                        , t->nickname
-                        , t->nickname
-                        , t->nickname
-                        , t->nickname, reg_users
-                        , t->nickname, aval_thread_stack_size, MAX_CLIENTS
-                        , t->nickname
-                        );
-                write(t->fd, t->line, strlen(t->line));
-            } else if (t->mode == 1) { // password set but not nickname
-                snprintf(t->line, 1024, ":myserver.com 241 * :USER command sent before nickname (NICK aNickName)\n\r");
-                write(t->fd, t->line, strlen(t->line));
-            } else if (t->mode == 0) { // password set but not nickname
-                snprintf(t->line, 1024, ":myserver.com 241 * :USER command sent before password (PASS *) and nickname (NICK aNickName)\n\r");
-                write(t->fd, t->line, strlen(t->line));
-            }
-        } else if (strncasecmp("PASS", buffer, 4) == 0) {
-            if (t->mode == 0) {
-                t->mode++;
-                t->timeout = 30;
-                // there is no password ... continue
-            }
-            // already logged in ... do nothing        
-        } else {
-            printf("some other message received: %s", t->buffer);
-            //@todo handle unknown message
+        if (i == LOG_MAX_RINGS) {
+            free(r);
+            return NULL;
         }
+        __atomic_store_n(&log_rings[i], r, __ATOMIC_RELEASE);
     }
-    
-    // unreachable but here anyway
-    close(t->fd);
-    return 0;
+    my_log_ring = log_rings[i];
+    pthread_setspecific(log_ring_key, my_log_ring);
+    return my_log_ring;
 }
 
 /**
- * The entry point on the creation of a client thread
- * @param arg, the client thread structure
- * @return null on exit of the thread
+ * Put an entry into the calling thread's ring for the writer
+ * @param wall_ms, when it was logged, since the epoch
+ * @param level, its level, or LOG_CAPTURE for a capture record
+ * @param text, the line or record
+ * @param length, its length
+ * @return 0, or -1 if it was dropped as the ring is full
  */
-void* client_thread_entry(void * arg) {
-    struct client_thread *t = arg;
-
-    t->state = ALIVE; // mark it as alive ? ... doesn't really matter 
-    connection_main(t); // interact with the thread
-    t->state = DEAD; // mark it as dead ? ... doesn't really matter   
-    push_stack(t->thread_id); // push the thread id back onto the available thread ids stack
-
-    return NULL;
+int log_stage(long long wall_ms, int level, const char *text, int length) {
+    struct log_ring *r = log_my_ring();
+    struct log_entry e = {wall_ms, length, level};
+    unsigned int tail = r == NULL ? 0 : r->tail;
+    unsigned int need = sizeof (e) + length;
+    if (r == NULL || LOG_RING_SIZE - (tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)) < need) {
+        return -1;
+    }
+    const char *parts[2] = {(const char *) &e, text};
+    unsigned int lengths[2] = {sizeof (e), length};
+    int j;
+    for (j = 0; j < 2; j++) {
+        unsigned int at = tail & (LOG_RING_SIZE - 1);
+        unsigned int first = LOG_RING_SIZE - at < lengths[j] ? LOG_RING_SIZE - at : lengths[j];
+        memcpy(r->data + at, parts[j], first);
+        memcpy(r->data, parts[j] + first, lengths[j] - first);
+        tail += lengths[j];
+    }
+    __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+    return 0;
 }
 
 /**
- * Try to turn the connection into a connection thread
- * @param fd the file descriptor of the accepted socket
- * @return 0 if the connection was successfully created or -1 if it was not
+ * Format a line into the calling thread's ring, for LOG
+ * @param site, the rate limit of the LOG it came from
+ * @param level, its level
+ * @param format, a printf format
  */
-int handle_connection(int fd) {
+void log_line(struct log_site *site, int level, const char *format, ...) {
+    long second = now_ms() / 1000;
+    // the races here only let a line or two more or fewer through
+    if (site->second != second) {
+        site->second = second;
+        site->count = 0;
+    }
+    if (__sync_fetch_and_add(&site->count, 1) >= LOG_BURST) {
+        __sync_fetch_and_add(&site->suppressed, 1);
+        __sync_fetch_and_add(&log_suppressed, 1);
+        return;
+    }
+    char text[LOG_LINE_MAX];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(text, sizeof (text), format, args);
+    va_end(args);
+    if (length >= (int) sizeof (text)) length = sizeof (text) - 1;
+    int suppressed = site->suppressed ? __sync_lock_test_and_set(&site->suppressed, 0) : 0;
+    if (suppressed && length < (int) sizeof (text) - 1) {
+        length += snprintf(text + length, sizeof (text) - length, " (%d more like this not logged)", suppressed);
+        if (length >= (int) sizeof (text)) length = sizeof (text) - 1;
+    }
 
-    // get an available thread
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    if (log_stage(tv.tv_sec * 1000LL + tv.tv_usec / 1000, level, text, length) == -1) {
+        __sync_fetch_and_add(&log_dropped, 1);
+    }
+}
+
+/**
+ * Copy bytes out of a ring
+ */
+void log_copy_out(struct log_ring *r, unsigned int from, void *to, unsigned int length) {
+    unsigned int at = from & (LOG_RING_SIZE - 1);
+    unsigned int first = LOG_RING_SIZE - at < length ? LOG_RING_SIZE - at : length;
+    memcpy(to, r->data + at, first);
+    memcpy((char *) to + first, r->data, length - first);
+}
+
+/**
+ * Write out what the writer has gathered
+ * @param fd, where to
+ * @param p, the lines or records
+ * @param length, their length
+ */
+void log_write(int fd, const char *p, int length) {
+    while (length > 0) {
+        int n = write(fd, p, length);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) break; // nowhere to log to, so carry on without
+        p += n;
+        length -= n;
+    }
+}
+
+/**
+ * Write out every line staged in the rings, in one write a ring, and the
+ * capture records among them in another
+ */
+void log_flush() {
+    static char out[LOG_RING_SIZE * 2];
+    static char captured[LOG_RING_SIZE]; // no more than the ring held
+    pthread_mutex_lock(&log_drain_lock);
+    int count = __atomic_load_n(&log_ring_count, __ATOMIC_ACQUIRE);
+    int i;
+    for (i = 0; i < count; i++) {
+        struct log_ring *r = __atomic_load_n(&log_rings[i], __ATOMIC_ACQUIRE);
+        if (r == NULL) continue; // its slot is claimed but not yet filled
+        unsigned int head = r->head;
+        unsigned int tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+        int length = 0;
+        int capture_length = 0;
+        while (head != tail) {
+            struct log_entry e;
+            log_copy_out(r, head, &e, sizeof (e));
+            if (e.level == LOG_CAPTURE) {
+                log_copy_out(r, head + sizeof (e), captured + capture_length, e.length);
+                capture_length += e.length;
+                head += sizeof (e) + e.length;
+                continue;
+            }
+            char text[LOG_LINE_MAX];
+            log_copy_out(r, head + sizeof (e), text, e.length);
+            head += sizeof (e) + e.length;
+            time_t seconds = e.wall_ms / 1000;
+            struct tm tm;
+            localtime_r(&seconds, &tm);
+            length += snprintf(out + length, sizeof (out) - length, "%02d:%02d:%02d.%03d %s %.*s\n",
+                    tm.tm_hour, tm.tm_min, tm.tm_sec, (int) (e.wall_ms % 1000),
+                    log_level_names[(int) e.level], e.length, text);
+        }
+        __atomic_store_n(&r->head, head, __ATOMIC_RELEASE);
+        log_write(STDOUT_FILENO, out, length);
+        if (capture_length) log_write(capture_fd, captured, capture_length);
+    }
+    pthread_mutex_unlock(&log_drain_lock);
+}
+
+/**
+ * The log writer thread, draining the rings every LOG_FLUSH_MS or at once
+ * when a thread is waiting for room in its ring
+ * @param arg, unused
+ */
+void *log_main(void *arg) {
+    while (1) {
+        pthread_mutex_lock(&log_wake_lock);
+        if (!log_wanted) {
+            struct timeval tv;
+            gettimeofday(&tv, NULL);
+            long long ns = (tv.tv_usec + LOG_FLUSH_MS * 1000LL) * 1000;
+            struct timespec until = {tv.tv_sec + ns / 1000000000, ns % 1000000000};
+            pthread_cond_timedwait(&log_wake, &log_wake_lock, &until);
+        }
+        log_wanted = 0;
+        pthread_mutex_unlock(&log_wake_lock);
+        log_flush();
+        pthread_mutex_lock(&log_wake_lock);
+        log_passes++;
+        pthread_cond_broadcast(&log_drained);
+        pthread_mutex_unlock(&log_wake_lock);
+    }
+    return NULL;
+}
+
+/**
+ * Wait for the writer to make a pass over the rings, for a thread whose
+ * ring is full to stage what it must not lose
+ */
+void log_wait_for_room() {
+    pthread_mutex_lock(&log_wake_lock);
+    long pass = log_passes;
+    log_wanted = 1;
+    pthread_cond_signal(&log_wake);
+    while (log_passes == pass) pthread_cond_wait(&log_drained, &log_wake_lock);
+    pthread_mutex_unlock(&log_wake_lock);
+}
+
+/**
+ * Start the log writer, and flush the log on exit
+ * @return 0 or -1 if the writer could not be started
+ */
+int log_start() {
+    pthread_key_create(&log_ring_key, log_release_ring);
+    atexit(log_flush);
+    pthread_t writer;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int r = pthread_create(&writer, &attr, log_main, NULL);
+    pthread_attr_destroy(&attr);
+    return r == 0 ? 0 : -1;
+}
+
+/**
+ * Open the capture file and start this server's part of it, a server
+ * started for an upgrade adding its part to its predecessor's
+ * @param path, the file
+ * @param append, 1 to add to the file rather than start it again
+ * @return 0, or -1 if it could not be opened
+ */
+int capture_open(const char *path, int append) {
+    capture_fd = open(path, O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC), 0644);
+    if (capture_fd == -1) return -1;
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    capture_started_us = now_us();
+    unsigned char start[CAPTURE_START_SIZE];
+    capture_put_start(start, tv.tv_sec * 1000000ULL + tv.tv_usec);
+    log_write(capture_fd, (char *) start, sizeof (start));
+    return 0;
+}
+
+/**
+ * Record something a client did in the capture file, the caller having
+ * checked there is one (capture_fd)
+ * @param t, the client
+ * @param type, CAPTURE_OPEN, CAPTURE_LINE or CAPTURE_CLOSE
+ * @param line, a LINE's text, or NULL
+ * @param length, its length
+ */
+void capture(struct client_thread *t, int type, const char *line, int length) {
+    if (t->capture_id == 0) {
+        // a connection handed over by a server that was not capturing is
+        // first seen here
+        if (type == CAPTURE_CLOSE) return;
+        t->capture_id = __sync_add_and_fetch(&capture_connections, 1);
+        if (type != CAPTURE_OPEN) capture(t, CAPTURE_OPEN, NULL, 0);
+    }
+    unsigned char record[CAPTURE_RECORD_MAX];
+    int n = capture_put_record(record, type, t->capture_id, now_us() - capture_started_us, line, length);
+    // a client sending faster than the writer drains its thread's ring
+    // waits for the writer, as a capture missing lines replays as different
+    // traffic.  A pass already part way through may have gone by the ring,
+    // the one after it has not
+    int r = log_stage(0, LOG_CAPTURE, (char *) record, n);
+    int passes;
+    for (passes = 0; r == -1 && passes < 2 && log_my_ring() != NULL; passes++) {
+        log_wait_for_room();
+        r = log_stage(0, LOG_CAPTURE, (char *) record, n);
+    }
+    if (r == -1) {
+        STAT_ADD(capture_dropped, 1);
+    } else if (type == CAPTURE_LINE) {
+        STAT_ADD(lines_captured, 1);
+    }
+    if (type == CAPTURE_CLOSE) t->capture_id = 0;
+}
+
+/**
+ * Borrow a block from a pool
+ * @param p, the pool
+ * @return the block, or NULL if out of memory
+ */
+void *pool_get(struct pool *p) {
+    pthread_mutex_lock(&p->lock);
+    void *block = p->free_list;
+    if (block != NULL) {
+        p->free_list = *(void **) block;
+        p->free_count--;
+    }
+    p->in_use++;
+    pthread_mutex_unlock(&p->lock);
+    if (block == NULL) {
+        block = malloc(p->size);
+        if (block == NULL) {
+            pthread_mutex_lock(&p->lock);
+            p->in_use--;
+            pthread_mutex_unlock(&p->lock);
+        }
+    }
+    return block;
+}
+
+/**
+ * Give a block back to its pool, it is freed if the pool already has plenty
+ * so that memory used in a burst is handed back once the burst is over
+ * @param p, the pool
+ * @param block, the block
+ */
+void pool_put(struct pool *p, void *block) {
+    pthread_mutex_lock(&p->lock);
+    p->in_use--;
+    if (p->free_count < p->max_free) {
+        *(void **) block = p->free_list;
+        p->free_list = block;
+        p->free_count++;
+        block = NULL;
+    }
+    pthread_mutex_unlock(&p->lock);
+    free(block);
+}
+
+/**
+ * Allocate a message to be queued to one or more clients
+ * @param size, the most bytes the message can hold
+ * @return the message with no references yet, or NULL if out of memory
+ */
+struct outbuf *outbuf_new(int size) {
+    struct outbuf *b = malloc(sizeof (struct outbuf) + size);
+    if (b != NULL) {
+        b->refs = 0;
+        b->length = 0;
+    }
+    return b;
+}
+
+/**
+ * Drop a reference to a message, freeing it once no queue holds it
+ * @param b, the message
+ */
+void outbuf_release(struct outbuf *b) {
+    if (__sync_sub_and_fetch(&b->refs, 1) == 0) {
+        free(b);
+    }
+}
+
+// how long a bot that has stopped reading its ring is waited for before the
+// lines that do not fit are dropped, as they would be for a slow socket
+#define RING_FULL_MS 1000
+
+// the most buffers written by one writev, the least any system allows
+#define WRITEV_MAX 16
+
+/**
+ * Put messages a write did not finish back on a client's out queue, the
+ * caller must hold the client's shard lock.  Unlike enqueue_locked this is
+ * for the client's own thread, so it needs no waking, and a client not yet
+ * registered keeps its replies too
+ * @param t, the client
+ * @param bufs, the messages in the order they are to go, the queue takes
+ *  over the caller's references to them
+ * @param count, the number of messages
+ * @param offset, the bytes of the first already written
+ * @param front, 1 to go ahead of the messages queued since they were taken
+ *  off, 0 to go after them
+ */
+void out_keep_locked(struct client_thread *t, struct outbuf **bufs, int count, int offset, int front) {
+    int i;
+    if (t->out == NULL) {
+        t->out = pool_get(&out_queue_pool);
+        if (t->out == NULL) {
+            for (i = 0; i < count; i++) outbuf_release(bufs[i]);
+            STAT_ADD(messages_dropped, count);
+            return;
+        }
+        t->out->head = t->out->tail = 0;
+        t->out->offset = 0;
+    }
+    struct out_queue *q = t->out;
+    if (front) {
+        // those queued since go if there is not room, what was being
+        // written stays or the client is sent the end of a line alone
+        while (q->tail != q->head && q->tail - q->head + count > OUT_QUEUE_SIZE) {
+            q->tail--;
+            outbuf_release(q->items[q->tail % OUT_QUEUE_SIZE]);
+            STAT_ADD(messages_dropped, 1);
+        }
+        for (i = count - 1; i >= 0; i--) {
+            q->head--;
+            q->items[q->head % OUT_QUEUE_SIZE] = bufs[i];
+        }
+        q->offset = offset;
+    } else {
+        for (i = 0; i < count && q->tail - q->head < OUT_QUEUE_SIZE; i++) {
+            q->items[q->tail % OUT_QUEUE_SIZE] = bufs[i];
+            q->tail++;
+        }
+        for (; i < count; i++) {
+            outbuf_release(bufs[i]);
+            STAT_ADD(messages_dropped, 1);
+        }
+    }
+    t->has_next_message = 1;
+}
+
+/**
+ * Keep what could not be written to a client's socket yet, to be written
+ * once poll says it has room
+ * @param t, the client, this must be its own thread
+ * @param iov, the bytes that were to be written
+ * @param count, the number of buffers in iov
+ * @param skip, how many of the bytes were written
+ * @param front, 1 if they were written ahead of the client's out queue, 0 if
+ *  they were not as it is already waiting for room
+ */
+void client_keep_unsent(struct client_thread *t, struct iovec *iov, int count, int skip, int front) {
+    int length = -skip;
+    int i;
+    for (i = 0; i < count; i++) length += iov[i].iov_len;
+    struct outbuf *b = outbuf_new(length);
+    if (b == NULL) {
+        STAT_ADD(messages_dropped, 1);
+        return;
+    }
+    b->refs = 1;
+    for (i = 0; i < count; i++) {
+        int n = iov[i].iov_len;
+        if (skip >= n) {
+            skip -= n;
+            continue;
+        }
+        memcpy(b->data + b->length, (char *) iov[i].iov_base + skip, n - skip);
+        b->length += n - skip;
+        skip = 0;
+    }
+    struct shard *sh = SHARD_OF(t);
+    pthread_mutex_lock(&sh->lock);
+    out_keep_locked(t, &b, 1, 0, front);
+    pthread_mutex_unlock(&sh->lock);
+    t->out_blocked = 1;
+}
+
+/**
+ * Write to a client's socket as much as it will take without waiting
+ * @param t, the client
+ * @param iov, the bytes to write
+ * @param count, the number of buffers in iov
+ * @return the number of bytes written, short of them all if the socket is
+ *  full, or -1 on an error
+ */
+int socket_send(struct client_thread *t, struct iovec *iov, int count) {
+    int sent = 0;
+    int i = 0;
+    while (i < count) {
+        int parts = count - i < WRITEV_MAX ? count - i : WRITEV_MAX;
+        int n = writev(HOT(t)->fd, iov + i, parts);
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1) return errno == EAGAIN || errno == EWOULDBLOCK ? sent : -1;
+        sent += n;
+        t->usage.bytes_out += n;
+        // the next buffers only once these have all gone, a short write
+        // means the socket is full
+        int j;
+        for (j = i; j < i + parts && n >= (int) iov[j].iov_len; j++) n -= iov[j].iov_len;
+        if (j < i + parts) return sent;
+        i += parts;
+    }
+    return sent;
+}
+
+/**
+ * Send bytes to a client, through its ring if it has one otherwise its
+ * socket, what the socket will not take now is kept to go when it has room
+ * @param t, the client, this must be its own thread as it is the only
+ *  producer of its ring
+ * @param iov, the bytes to send
+ * @param count, the number of buffers in iov
+ * @return the number of bytes sent or -1 on an error
+ */
+int client_send(struct client_thread *t, struct iovec *iov, int count) {
+    int sent = 0;
+    int i;
+    if (t->ring == NULL) {
+        // behind what is already waiting, so lines go in the order sent
+        if (t->out_blocked) {
+            client_keep_unsent(t, iov, count, 0, 0);
+            return 0;
+        }
+        sent = socket_send(t, iov, count);
+        if (sent == -1) return -1;
+        int length = 0;
+        for (i = 0; i < count; i++) length += iov[i].iov_len;
+        if (sent < length) client_keep_unsent(t, iov, count, sent, 1);
+        return sent;
+    }
+    struct ring *r = &t->ring->to_client;
+    long give_up = 0;
+    for (i = 0; i < count; i++) {
+        const char *p = iov[i].iov_base;
+        int left = iov[i].iov_len;
+        while (left > 0) {
+            int n = ring_write(t->ring, r, p, left);
+            p += n;
+            left -= n;
+            sent += n;
+            t->usage.bytes_out += n;
+            if (left == 0) break;
+            // full, make sure the bot is awake to empty it and wait a little
+            ring_wake(r, HOT(t)->fd);
+            if (give_up == 0) give_up = now_ms() + RING_FULL_MS;
+            if (now_ms() > give_up) return sent;
+            usleep(50);
+        }
+    }
+    ring_wake(r, HOT(t)->fd);
+    return sent;
+}
+
+/**
+ * Render a reply to a client and send it to the client
+ * @param t, the client to reply to, it supplies the nickname and username
+ * @param tpl, the compiled template of the reply
+ * @param args, any text or integer values for the reply, or NULL if none
+ * @return the result of writing the reply to the client
+ */
+int send_reply(struct client_thread *t, const struct reply_template *tpl, struct reply_args *args) {
+    struct reply_args none;
+    if (args == NULL) {
+        bzero(&none, sizeof (none));
+        args = &none;
+    }
+    args->nickname = t->nickname;
+    args->nicknamelength = t->nicknamelength;
+    args->username = t->username;
+    args->usernamelength = t->usernamelength;
+    // rendered on the stack, so an idle client holds no line buffer
+    char line[1024];
+    struct iovec iov = {line, render_reply(line, sizeof (line), tpl, args)};
+    return client_send(t, &iov, 1);
+}
+
+/**
+ * the lines of an answer of many lines, rendered one after another to be
+ * sent in one write rather than a write each
+ */
+struct reply_batch {
+    struct client_thread *t; // the client the answer is for
+    int length;
+    char data[IO_BUFFER_SIZE];
+};
+
+/**
+ * Send the lines gathered so far
+ * @param rb, the batch
+ */
+void reply_batch_flush(struct reply_batch *rb) {
+    if (rb->length == 0) return;
+    struct iovec iov = {rb->data, rb->length};
+    client_send(rb->t, &iov, 1);
+    rb->length = 0;
+}
+
+/**
+ * Render a reply into a batch, as send_reply does except that the username
+ * is left as the caller gave it, for the lines about another client
+ * @param rb, the batch, sent first if it has not room for a line of 1024
+ * @param tpl, the compiled template of the reply
+ * @param args, its values
+ */
+void reply_batch_add(struct reply_batch *rb, const struct reply_template *tpl, struct reply_args *args) {
+    if (sizeof (rb->data) - rb->length < 1024) reply_batch_flush(rb);
+    args->nickname = rb->t->nickname;
+    args->nicknamelength = rb->t->nicknamelength;
+    rb->length += render_reply(rb->data + rb->length, sizeof (rb->data) - rb->length, tpl, args);
+}
+
+/**
+ * Queue a message to a client, the caller must hold the client's shard lock
+ * @param t, the client to send the message to
+ * @param b, the message, it gains a reference if queued
+ * @return 0 if queued or -1 if the client is not registered or its queue is full
+ */
+int enqueue_locked(struct client_thread *t, struct outbuf *b) {
+    if (HOT(t)->mode != 3) {
+        return -1;
+    }
+    if (t->out == NULL) {
+        t->out = pool_get(&out_queue_pool);
+        if (t->out == NULL) {
+            STAT_ADD(messages_dropped, 1);
+            return -1;
+        }
+        t->out->head = t->out->tail = 0;
+        t->out->offset = 0;
+    }
+    struct out_queue *q = t->out;
+    if (q->tail - q->head == OUT_QUEUE_SIZE) {
+        STAT_ADD(messages_dropped, 1);
+        return -1;
+    }
+    __sync_fetch_and_add(&b->refs, 1);
+    q->items[q->tail % OUT_QUEUE_SIZE] = b;
+    q->tail++;
+    if (q->tail - q->head > t->usage.queue_high_water) t->usage.queue_high_water = q->tail - q->head;
+    if (!t->has_next_message) {
+        t->has_next_message = 1; //say it has to send a message
+        // interrupt the client thread's wait for input so it sends the message
+        // now, its own messages it sends once it has handled the line.  A
+        // client being taken over in an upgrade has no thread yet, and one
+        // parked for an upgrade no longer has one, either finds
+        // has_next_message set when its thread starts
+        if (t->state == ALIVE && !pthread_equal(t->thread, pthread_self())) {
+            if (loop_count) {
+                loop_wake(LOOP_OF(t));
+            } else {
+                pthread_kill(t->thread, WAKE_SIGNAL);
+            }
+        } else if (t->state == HIBERNATING) {
+            // hibernate_main clears hibernate_poked before looking at every
+            // client, so either it sees has_next_message or we see it clear
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            if (!hibernate_poked && __sync_bool_compare_and_swap(&hibernate_poked, 0, 1)) {
+                char wake = 'w';
+                write(hibernate_wakeup[1], &wake, 1);
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * Queue a message to a client
+ * @param t, the client to send the message to
+ * @param b, the message, it gains a reference if queued
+ * @return 0 if queued or -1 if it could not be
+ */
+int enqueue_message(struct client_thread *t, struct outbuf *b) {
+    struct shard *sh = SHARD_OF(t);
+    pthread_mutex_lock(&sh->lock);
+    int r = enqueue_locked(t, b);
+    pthread_mutex_unlock(&sh->lock);
+    return r;
+}
+
+/**
+ * Send every message queued to a client, or discard them if fd is -1.  What
+ * the socket will not take now stays queued, and the client waits for room
+ * @param t, the client whose queue to empty
+ * @param fd, the client's socket, or -1 to discard the messages
+ */
+void flush_messages(struct client_thread *t, int fd) {
+    struct outbuf * pending[OUT_QUEUE_SIZE];
+    int count = 0;
+    int offset = 0;
+    // take the messages off the queue and write them after unlocking, so a
+    // slow socket never holds up the other threads queueing to the shard
+    struct shard *sh = SHARD_OF(t);
+    pthread_mutex_lock(&sh->lock);
+    struct out_queue *q = t->out;
+    if (q != NULL) {
+        offset = q->offset;
+        while (q->head != q->tail) {
+            pending[count++] = q->items[q->head % OUT_QUEUE_SIZE];
+            q->head++;
+        }
+        t->out = NULL; // handed back below, the client is idle again
+    }
+    t->has_next_message = 0;
+    pthread_mutex_unlock(&sh->lock);
+    if (q != NULL) pool_put(&out_queue_pool, q);
+
+    // write them all with as few system calls (and so packets) as possible
+    int i;
+    int done = count;
+    t->out_blocked = 0;
+    if (fd != -1 && count > 0) {
+        struct iovec iov[OUT_QUEUE_SIZE];
+        for (i = 0; i < count; i++) {
+            iov[i].iov_base = pending[i]->data;
+            iov[i].iov_len = pending[i]->length;
+        }
+        iov[0].iov_base = pending[0]->data + offset;
+        iov[0].iov_len -= offset;
+        if (t->ring != NULL) {
+            client_send(t, iov, count);
+        } else {
+            int sent = socket_send(t, iov, count);
+            // the rest stay, the first of them part written
+            for (done = 0; sent != -1 && done < count && sent >= (int) iov[done].iov_len; done++) {
+                sent -= iov[done].iov_len;
+            }
+            if (sent != -1 && done < count) {
+                pthread_mutex_lock(&sh->lock);
+                out_keep_locked(t, pending + done, count - done, (done == 0 ? offset : 0) + sent, 1);
+                pthread_mutex_unlock(&sh->lock);
+                t->out_blocked = 1;
+            } else {
+                done = count;
+            }
+        }
+    }
+    for (i = 0; i < done; i++) {
+        outbuf_release(pending[i]);
+    }
+}
+
+/**
+ * Find the CPUs threads can be pinned to
+ * @return 0, or -1 if threads cannot be pinned here
+ */
+int find_pin_cpus() {
+#ifdef CPU_SET
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof (set), &set) == -1) return -1;
+    int cpu;
+    for (cpu = 0; cpu < CPU_SETSIZE && pin_cpu_count < MAX_LOOPS + NUM_SHARDS; cpu++) {
+        if (CPU_ISSET(cpu, &set)) pin_cpus[pin_cpu_count++] = cpu;
+    }
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+/**
+ * Pin the calling thread to a CPU, if -A asked for it
+ * @param n, which of the CPUs found by find_pin_cpus, wrapping around
+ */
+void pin_thread(int n) {
+    if (pin_cpu_count == 0) return;
+#ifdef CPU_SET
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(pin_cpus[n % pin_cpu_count], &set);
+    int r = pthread_setaffinity_np(pthread_self(), sizeof (set), &set);
+    if (r != 0) LOG(LOG_WARNING, "could not pin a thread to CPU %d: %s", pin_cpus[n % pin_cpu_count], strerror(r));
+#endif
+}
+
+/**
+ * Deliver broadcasts to the clients of one shard, so that a broadcast to
+ * every client is spread over NUM_SHARDS threads
+ * @param arg, the shard
+ * @return never returns
+ */
+void *shard_worker(void *arg) {
+    struct shard *sh = arg;
+    pin_thread(loop_count + sh->index);
+    pthread_mutex_lock(&sh->lock);
+    while (1) {
+        while (sh->broadcast == NULL) {
+            pthread_cond_wait(&sh->work, &sh->lock);
+        }
+        // the shard lock is held for the whole pass, one lock per shard
+        // instead of one per client is what makes the broadcast cheap
+        sh->delivered = 0;
+        sh->skipped = 0;
+        int i;
+        for (i = sh->index; i < MAX_CLIENTS; i += NUM_SHARDS) {
+            if (client_hot[i].mode != 3) continue;
+            if (enqueue_locked(&threads[i], sh->broadcast) == 0) {
+                sh->delivered++;
+            } else {
+                sh->skipped++;
+            }
+        }
+        sh->broadcast = NULL;
+
+        pthread_mutex_lock(&broadcast_pending_lock);
+        if (--broadcast_pending == 0) {
+            pthread_cond_signal(&broadcast_done);
+        }
+        pthread_mutex_unlock(&broadcast_pending_lock);
+    }
+    return NULL;
+}
+
+/**
+ * Start the shard worker threads
+ */
+void start_shards() {
+    int i;
+    for (i = 0; i < NUM_SHARDS; i++) {
+        shards[i].index = i;
+        pthread_mutex_init(&shards[i].lock, NULL);
+        pthread_cond_init(&shards[i].work, NULL);
+        pthread_create(&shards[i].worker, NULL, shard_worker, &shards[i]);
+    }
+}
+
+/**
+ * Queue a message to every registered client, all shards in parallel
+ * @param b, the message, it is released once queued everywhere
+ * @param skipped, set to the number of clients too far behind to take it
+ * @param micros, set to how long the broadcast took
+ * @return the number of clients the message was queued to
+ */
+int broadcast_message(struct outbuf *b, int *skipped, long *micros) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    // hold a reference of our own so the message can't be freed by a client
+    // sending it before the other shards have queued it
+    __sync_fetch_and_add(&b->refs, 1);
+
+    pthread_mutex_lock(&broadcast_lock);
+    broadcast_pending = NUM_SHARDS;
+    int i;
+    for (i = 0; i < NUM_SHARDS; i++) {
+        pthread_mutex_lock(&shards[i].lock);
+        shards[i].broadcast = b;
+        pthread_cond_signal(&shards[i].work);
+        pthread_mutex_unlock(&shards[i].lock);
+    }
+    pthread_mutex_lock(&broadcast_pending_lock);
+    while (broadcast_pending) {
+        pthread_cond_wait(&broadcast_done, &broadcast_pending_lock);
+    }
+    pthread_mutex_unlock(&broadcast_pending_lock);
+
+    int delivered = 0;
+    *skipped = 0;
+    for (i = 0; i < NUM_SHARDS; i++) {
+        delivered += shards[i].delivered;
+        *skipped += shards[i].skipped;
+    }
+    pthread_mutex_unlock(&broadcast_lock);
+
+    outbuf_release(b);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    *micros = (end.tv_sec - start.tv_sec) * 1000000L + (end.tv_nsec - start.tv_nsec) / 1000;
+    return delivered;
+}
+
+/**
+ * create a POSIX socket (a type of Berkeley socket) to listen in on a particular port
+ * @param port, the number of the port
+ * @return -1 if can't create a socket, can't set re-use addresses, 
+ *  can't set the file descriptor to nonblocking I/O, binding failed or can't listen to it
+ */
+int create_listen_socket(int port) {
+    //open a socket stream
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock == -1) {
+        return -1;
+    }
+
+    int on = 1;
+    // try to set the sockets's options at the SOL_SOCKET api level so that 
+    // address like 0.0.0.0:21 and 192.168.0.1:21 are not the same (0's not local wildcards?)
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (char *) &on, sizeof (on)) == -1) {
+        close(sock);
+        return -1;
+    }
+
+    // try to set the file descriptor to nonblocking I/O
+    if (ioctl(sock, FIONBIO, (char *) &on) == -1) {
+        close(sock);
+        return -1;
+    }
+    // a copy of the server started for an upgrade is given the socket
+    // explicitly, it must not also inherit it
+    fcntl(sock, F_SETFD, FD_CLOEXEC);
+
+    // Bind it to the next port we want to try. 
+    struct sockaddr_in address;
+    //zero it
+    bzero((char *) &address, sizeof (address));
+    address.sin_family = AF_INET; // set to use AF_INET internet protocol address
+    address.sin_addr.s_addr = INADDR_ANY; // receive all incomming packets
+    address.sin_port = htons(port); // set the port to the specified port in network byte order. 
+
+    if (bind(sock, (struct sockaddr *) &address, sizeof (address)) == -1) {
+        // bind failed ... close the socket
+        close(sock);
+        return -1;
+    }
+
+    // a deep backlog so a burst of connections between accepts is queued
+    // rather than dropped and retried by the client a second later
+    if (listen(sock, SOMAXCONN) != -1) {
+        // can listen to the socket ... return it
+        return sock;
+    }
+    //otherwise close the socket
+    close(sock);
+    return -1;
+}
+
+/**
+ * create a unix domain socket for clients on the same host (bridges, bots),
+ * which skip the TCP stack but are otherwise served as any other client
+ * @param path, where to put the socket, anything already there is replaced
+ * @return the socket or -1 if an error occurred
+ */
+int create_local_listen_socket(const char *path) {
+    struct sockaddr_un address;
+    if (strlen(path) >= sizeof (address.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == -1) {
+        return -1;
+    }
+    int on = 1;
+    if (ioctl(sock, FIONBIO, (char *) &on) == -1) {
+        close(sock);
+        return -1;
+    }
+    fcntl(sock, F_SETFD, FD_CLOEXEC);
+
+    bzero((char *) &address, sizeof (address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+    // a server that crashed leaves its socket behind, which would stop bind
+    unlink(path);
+    if (bind(sock, (struct sockaddr *) &address, sizeof (address)) == -1
+            || listen(sock, SOMAXCONN) == -1) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+/**
+ * Send a message along with a file descriptor over a unix socket
+ * @param link, the unix socket
+ * @param data, the message
+ * @param length, the length of the message
+ * @param fd, the file descriptor to pass
+ * @return 0 if it was sent or -1 if not
+ */
+int send_with_fd(int link, void *data, int length, int fd) {
+    struct iovec iov = {data, length};
+    char control[CMSG_SPACE(sizeof (int))];
+    struct msghdr msg;
+    bzero(&msg, sizeof (msg));
+    bzero(control, sizeof (control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof (control);
+    struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof (int));
+    memcpy(CMSG_DATA(c), &fd, sizeof (int));
+    return sendmsg(link, &msg, 0) == length ? 0 : -1;
+}
+
+/**
+ * Receive a message sent by send_with_fd
+ * @param link, the unix socket
+ * @param data, where to put the message
+ * @param length, the length of the message
+ * @return the file descriptor passed with it or -1 if there was none
+ */
+int receive_with_fd(int link, void *data, int length) {
+    struct iovec iov = {data, length};
+    char control[CMSG_SPACE(sizeof (int))];
+    struct msghdr msg;
+    bzero(&msg, sizeof (msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof (control);
+    if (recvmsg(link, &msg, MSG_WAITALL) != length) return -1;
+    struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    if (c == NULL || c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) return -1;
+    int fd;
+    memcpy(&fd, CMSG_DATA(c), sizeof (int));
+    fcntl(fd, F_SETFD, FD_CLOEXEC); // as for the sockets the server opens itself
+    return fd;
+}
+
+/**
+ * Top up a token bucket for the time passed since it was last topped up
+ * @param tokens, the bucket
+ * @param last_ms, when it was last topped up, updated to now
+ * @param rate, the tokens added a second, the bucket holds twice this
+ * @param now, the time now in milliseconds
+ */
+void refill_tokens(double *tokens, long *last_ms, double rate, long now) {
+    *tokens += (now - *last_ms) * rate / 1000.0;
+    if (*tokens > 2 * rate) *tokens = 2 * rate;
+    *last_ms = now;
+}
+
+/**
+ * Find the slot for an address in the admission table, the caller must hold
+ * admission_lock
+ * @return the slot holding the address, or the empty slot where it would go
+ */
+int admission_slot(in_addr_t address) {
+    unsigned int i = (address * 2654435761u) & (ADMISSION_TABLE_SIZE - 1);
+    while (admission_table[i].address != 0 && admission_table[i].address != address) {
+        i = (i + 1) & (ADMISSION_TABLE_SIZE - 1);
+    }
+    return i;
+}
+
+/**
+ * Empty a slot of the admission table, shifting later entries of its probe
+ * back so lookups never need tombstones, the caller must hold admission_lock
+ * @param i, the slot to empty
+ */
+void admission_remove(int i) {
+    int j = i;
+    while (1) {
+        j = (j + 1) & (ADMISSION_TABLE_SIZE - 1);
+        if (admission_table[j].address == 0) break;
+        int home = (admission_table[j].address * 2654435761u) & (ADMISSION_TABLE_SIZE - 1);
+        if ((j > i && (home <= i || home > j)) || (j < i && (home <= i && home > j))) {
+            admission_table[i] = admission_table[j];
+            i = j;
+        }
+    }
+    admission_table[i].address = 0;
+    admission_count--;
+}
+
+/**
+ * Drop the addresses with no connections that have been idle a while
+ */
+void admission_expire() {
+    long now = now_ms();
+    int expired = 0;
+    pthread_mutex_lock(&admission_lock);
+    int i = 0;
+    while (i < ADMISSION_TABLE_SIZE) {
+        struct admission_entry *e = &admission_table[i];
+        if (e->address != 0 && e->connections == 0 && now - e->last_seen_ms > ADMISSION_IDLE_MS) {
+            admission_remove(i); // another entry may have moved into i, so look again
+            expired++;
+        } else {
+            i++;
+        }
+    }
+    pthread_mutex_unlock(&admission_lock);
+    if (expired) STAT_ADD(admission_expired, expired);
+}
+
+/**
+ * Decide whether to let a new connection in, and count it against its address
+ * @param address, where the connection is from
+ * @return 0 if admitted, -1 if the address has too many connections open or
+ *  -2 if it is connecting too fast
+ */
+int admission_check(struct in_addr address) {
+    long now = now_ms();
+    int r = 0;
+    pthread_mutex_lock(&admission_lock);
+    int i = admission_slot(address.s_addr);
+    struct admission_entry *e = &admission_table[i];
+    if (e->address == 0) {
+        if (admission_count >= ADMISSION_TABLE_SIZE * 3 / 4) {
+            // rather than turn away every new address, let it in unchecked,
+            // the idle ones will be expired soon enough
+            pthread_mutex_unlock(&admission_lock);
+            STAT_ADD(admission_untracked, 1);
+            return 0;
+        }
+        e->address = address.s_addr;
+        e->connections = 0;
+        e->tokens = 2 * accepts_per_second;
+        e->last_seen_ms = now;
+        admission_count++;
+    }
+    if (accepts_per_second > 0) {
+        refill_tokens(&e->tokens, &e->last_seen_ms, accepts_per_second, now);
+    }
+    e->last_seen_ms = now;
+    if (max_connections_per_address > 0 && e->connections >= max_connections_per_address) {
+        r = -1;
+    } else if (accepts_per_second > 0 && e->tokens < 1) {
+        r = -2;
+    } else {
+        e->tokens -= 1;
+        e->connections++;
+    }
+    pthread_mutex_unlock(&admission_lock);
+    return r;
+}
+
+/**
+ * Stop counting a closed connection against its address
+ * @param address, where the connection was from
+ */
+void admission_release(struct in_addr address) {
+    pthread_mutex_lock(&admission_lock);
+    struct admission_entry *e = &admission_table[admission_slot(address.s_addr)];
+    // an untracked address has no entry, so there is nothing to release
+    if (e->address != 0 && e->connections > 0) {
+        e->connections--;
+        e->last_seen_ms = now_ms();
+    }
+    pthread_mutex_unlock(&admission_lock);
+}
+
+/**
+ * Count a connection handed over from before an upgrade against its address,
+ * without the limits as it is already open
+ * @param address, where the connection is from
+ */
+void admission_adopt(struct in_addr address) {
+    pthread_mutex_lock(&admission_lock);
+    int i = admission_slot(address.s_addr);
+    struct admission_entry *e = &admission_table[i];
+    if (e->address == 0 && admission_count < ADMISSION_TABLE_SIZE * 3 / 4) {
+        e->address = address.s_addr;
+        e->connections = 0;
+        e->tokens = 2 * accepts_per_second;
+        admission_count++;
+    }
+    if (e->address != 0) {
+        e->connections++;
+        e->last_seen_ms = now_ms();
+    }
+    pthread_mutex_unlock(&admission_lock);
+}
+
+// how far the server goes to shed load, each level doing what the one
+// before does as well
+#define SHED_NONE 0
+#define SHED_ACCEPTS 1 // new connections are left waiting in the listen backlog
+#define SHED_REGISTRATIONS 2 // clients registering are told to try again later
+#define SHED_SENDERS 3 // the heaviest senders are throttled
+const char *shed_level_names[] = {"nothing", "new connections", "new registrations",
+    "the heaviest senders"};
+// how often the lag probe wakes, and how often the load is looked at
+#define OVERLOAD_PROBE_MS 10
+#define OVERLOAD_TICK_MS 100
+// the load must stay under half the limits this long before it is shed less
+#define SHED_CALM_MS 1000
+// the most senders throttled at once, the rate they are held to, and the
+// rate under which a client is never taken for one, as a person typing or
+// a bot answering is well under it and a flood well over
+#define SHED_HEAVIEST 8
+#define SHED_COMMANDS_PER_SECOND 10
+#define SHED_MIN_COMMANDS_PER_SECOND 200
+
+long shed_level = SHED_NONE; // read by the main thread to pause accepts
+long overload_lag_now_ms; // the worst lag seen in the last tick, for STATS
+
+/**
+ * Make a client wait until it may send another command, so one flooding
+ * client slows only itself (the unread commands back up in its socket)
+ * rather than hogging the server
+ * @param t, the client about to have a command handled
+ * @param may_wait, 0 if the caller serves other clients too and must not
+ *  sleep, the command is then left until t->throttled_until_ms
+ * @return 0 if the command may be handled now or -1 if it must wait
+ */
+int throttle_commands(struct client_thread *t, int may_wait) {
+    // even a trusted client is held back when it is overloading the server
+    double rate = t->limited ? commands_per_second : 0;
+    if (t->shed && (rate <= 0 || rate > SHED_COMMANDS_PER_SECOND)) rate = SHED_COMMANDS_PER_SECOND;
+    if (rate <= 0) return 0;
+    long now = now_ms();
+    refill_tokens(&t->command_tokens, &t->command_refill_ms, rate, now);
+    if (t->command_tokens < 1) {
+        STAT_ADD(commands_throttled, 1);
+        long wait_us = (1 - t->command_tokens) * 1000000 / rate;
+        if (!may_wait) {
+            t->throttled_until_ms = now + wait_us / 1000 + 1;
+            return -1;
+        }
+        usleep(wait_us);
+        refill_tokens(&t->command_tokens, &t->command_refill_ms, rate, now_ms());
+    }
+    t->command_tokens -= 1;
+    return 0;
+}
+
+/**
+ * Throttle the clients that sent the most commands since the last tick, up
+ * to SHED_HEAVIEST of them, keeping those already throttled until the load
+ * eases, as once held back they no longer look heavy
+ * @param shedding, 0 to release every throttled client
+ */
+void shed_senders(int shedding) {
+    // the heaviest few found with an insertion into a short sorted list,
+    // rather than sorting every client
+    int heaviest[SHED_HEAVIEST];
+    int counts[SHED_HEAVIEST];
+    int found = 0;
+    int room = SHED_HEAVIEST;
+    int i;
+    for (i = 0; i < MAX_CLIENTS; i++) {
+        int count = threads[i].commands_recent;
+        threads[i].commands_recent = 0;
+        if (!shedding || client_hot[i].mode == 0) {
+            threads[i].shed = 0;
+            continue;
+        }
+        if (threads[i].shed) {
+            room--;
+            continue;
+        }
+        if (count * 1000 / OVERLOAD_TICK_MS < SHED_MIN_COMMANDS_PER_SECOND) continue;
+        if (found == SHED_HEAVIEST && count <= counts[found - 1]) continue;
+        int at = found < SHED_HEAVIEST ? found++ : found - 1;
+        while (at > 0 && counts[at - 1] < count) {
+            heaviest[at] = heaviest[at - 1];
+            counts[at] = counts[at - 1];
+            at--;
+        }
+        heaviest[at] = i;
+        counts[at] = count;
+    }
+    for (i = 0; i < found && i < room; i++) {
+        struct client_thread *t = &threads[heaviest[i]];
+        t->shed = 1;
+        STAT_ADD(senders_shed, 1);
+        LOG(LOG_WARNING, "throttling %s, it sent %d commands in %d ms", t->nickname,
+                counts[i], OVERLOAD_TICK_MS);
+    }
+}
+
+/**
+ * Watch for the server falling behind and shed load while it is: the lag
+ * is how late a thread that slept wakes (the scheduler's backlog) or the
+ * longest event loop turn (how long a ready connection waits), the queue
+ * depth is the number of clients with output waiting to be sent
+ * @param arg, unused
+ * @return never returns
+ */
+void *overload_main(void *arg) {
+    long lag_max_us = 0;
+    long tick_ms = now_ms() + OVERLOAD_TICK_MS;
+    long calm_since_ms = now_ms();
+    while (1) {
+        long before = now_us();
+        usleep(OVERLOAD_PROBE_MS * 1000);
+        long late = now_us() - before - OVERLOAD_PROBE_MS * 1000;
+        if (late > lag_max_us) lag_max_us = late;
+        long now = now_ms();
+        if (now < tick_ms) continue;
+        tick_ms = now + OVERLOAD_TICK_MS;
+
+        int i;
+        for (i = 0; i < loop_count; i++) {
+            if (loops[i].turn_max_us > lag_max_us) lag_max_us = loops[i].turn_max_us;
+            loops[i].turn_max_us = 0;
+        }
+        long lag = lag_max_us / 1000;
+        lag_max_us = 0;
+        overload_lag_now_ms = lag;
+        pthread_mutex_lock(&out_queue_pool.lock);
+        long queues = out_queue_pool.in_use;
+        pthread_mutex_unlock(&out_queue_pool.lock);
+
+        int over = (overload_lag_ms && lag > overload_lag_ms)
+                || (overload_queues && queues > overload_queues);
+        int calm = (!overload_lag_ms || lag * 2 < overload_lag_ms)
+                && (!overload_queues || queues * 2 < overload_queues);
+        if (!calm) calm_since_ms = now;
+        // up a level a tick while overloaded, down one once calm a while
+        long level = shed_level;
+        if (over && level < SHED_SENDERS) {
+            level++;
+            STAT_ADD(shed_raised, 1);
+            LOG(LOG_WARNING, "overloaded, %ld ms lag and %ld clients with output waiting, now shedding %s",
+                    lag, queues, shed_level_names[level]);
+        } else if (calm && level > SHED_NONE && now - calm_since_ms >= SHED_CALM_MS) {
+            level--;
+            calm_since_ms = now;
+            STAT_ADD(shed_lowered, 1);
+            LOG(LOG_WARNING, "load easing, now shedding %s", shed_level_names[level]);
+        }
+        shed_level = level;
+        shed_senders(level >= SHED_SENDERS);
+    }
+    return NULL;
+}
+
+/**
+ * Try to accept an incoming socket
+ * @param sock, the socket to try to accept
+ * @param address, set to the address the connection is from, 127.0.0.1 for
+ *  a unix domain socket
+ * @return file descriptor of the accepted socket or -1 if an error occurred
+ */
+int accept_incoming(int sock, struct in_addr *address) {
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof addr;
+    int asock;
+    if ((asock = accept(sock, (struct sockaddr *) &addr, &addr_len)) != -1) {
+        if (addr.ss_family == AF_INET) {
+            *address = ((struct sockaddr_in *) &addr)->sin_addr;
+            // replies go out as soon as they are written, rather than wait
+            // for the client's delayed ack of the last one (up to 40ms)
+            int on = 1;
+            setsockopt(asock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof (on));
+        } else {
+            // a unix socket client is on this host, so it counts as loopback
+            address->s_addr = htonl(INADDR_LOOPBACK);
+        }
+        fcntl(asock, F_SETFD, FD_CLOEXEC); // as for the listening socket
+        return asock;
+    }
+    return -1;
+}
+
+/**
+ * an open addressed hash index from names to ids, the names themselves are
+ * kept in whatever the ids refer to (client threads or channels) so the
+ * index holds only ids and hashes and a probe touches one small array
+ */
+struct name_index {
+    unsigned int mask; // the size less one, the size is a power of two
+    unsigned int *hashes;
+    int *ids; // -1 for an empty slot
+    const char *(*name_of)(int id, int *length);
+    pthread_rwlock_t lock;
+    // odd while a writer is changing the table, bumped on every change so a
+    // lookup that takes no lock (name_index_lookup) can tell it raced one
+    volatile unsigned int sequence;
+};
+
+/**
+ * a channel, members are client thread ids
+ */
+struct channel {
+    char name[CHANNEL_NAME_SIZE];
+    int namelength;
+    int member_count;
+    int member_size; // the space allocated for members
+    int *members;
+    // bumped each time the entry is taken for a new channel, so a LIST
+    // part way through can tell the channel it chose has gone
+    unsigned int generation;
+};
+
+// the registered nicknames, ids are client thread ids
+struct name_index nick_index;
+// the channels, ids are indexes into channel_list, guarded by channel_index.lock
+struct name_index channel_index;
+struct channel channel_list[MAX_CHANNELS];
+int free_channels[MAX_CHANNELS]; // a stack of the unused channel_list entries
+int free_channel_count = 0;
+// the channel directory LIST answers from, guarded by channel_index.lock
+// too: every channel sorted by name (ignoring case) and by member count,
+// busiest first, so a name prefix or a least number of users picks its
+// channels out with a binary search rather than a look at every channel
+int channels_by_name[MAX_CHANNELS];
+int channels_by_users[MAX_CHANNELS];
+int channel_users_at[MAX_CHANNELS]; // where each channel is in channels_by_users
+int directory_count = 0;
+
+/**
+ * Hash a name ignoring case, as IRC names are case insensitive (FNV-1a)
+ * @param name, the name to hash
+ * @param length, the length of the name
+ * @return the hash of the name
+ */
+unsigned int name_hash(const char *name, int length) {
+    unsigned int h = 2166136261u;
+    int i;
+    for (i = 0; i < length; i++) {
+        h = (h ^ (unsigned char) tolower((unsigned char) name[i])) * 16777619u;
+    }
+    return h;
+}
+
+/**
+ * Set up an empty index
+ * @param ix, the index
+ * @param capacity, the most names it will hold, the table is at least double
+ *  this so probe sequences stay short
+ * @param name_of, gets the name of an id
+ */
+void name_index_init(struct name_index *ix, int capacity, const char *(*name_of)(int, int *)) {
+    unsigned int size = 16;
+    while (size < 2 * capacity) size *= 2;
+    ix->mask = size - 1;
+    ix->hashes = calloc(size, sizeof (unsigned int));
+    ix->ids = malloc(size * sizeof (int));
+    if (ix->hashes == NULL || ix->ids == NULL) {
+        perror("could not allocate a name index");
+        exit(-1);
+    }
+    memset(ix->ids, -1, size * sizeof (int));
+    ix->name_of = name_of;
+    pthread_rwlock_init(&ix->lock, NULL);
+}
+
+/**
+ * Find the slot holding a name, the caller must hold the index lock
+ * @param ix, the index
+ * @param name, the name to find
+ * @param length, the length of the name
+ * @param hash, the hash of the name (from name_hash)
+ * @return the slot of the name, or of the empty slot ending its probe
+ */
+unsigned int name_index_slot(struct name_index *ix, const char *name, int length, unsigned int hash) {
+    unsigned int i = hash & ix->mask;
+    while (ix->ids[i] != -1) {
+        if (ix->hashes[i] == hash) {
+            int n;
+            const char *other = ix->name_of(ix->ids[i], &n);
+            if (n == length && strncasecmp(other, name, length) == 0) {
+                return i;
+            }
+        }
+        i = (i + 1) & ix->mask;
+    }
+    return i;
+}
+
+/**
+ * Find the id a name belongs to, the caller must hold the index lock
+ * @return the id or -1 if the name is not in the index
+ */
+int name_index_find(struct name_index *ix, const char *name, int length, unsigned int hash) {
+    return ix->ids[name_index_slot(ix, name, length, hash)];
+}
+
+/**
+ * Find the id a name belongs to without taking the index lock, looking again
+ * if a writer changed the table meanwhile, as a remove shifting entries back
+ * could hide a name that is there.  Nothing stops the id being removed and
+ * reused once found, see epoch_enter for the nickname index
+ * @return the id or -1 if the name is not in the index
+ */
+int name_index_lookup(struct name_index *ix, const char *name, int length, unsigned int hash) {
+    while (1) {
+        unsigned int sequence = __atomic_load_n(&ix->sequence, __ATOMIC_ACQUIRE);
+        if (!(sequence & 1)) {
+            int id = name_index_find(ix, name, length, hash);
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&ix->sequence, __ATOMIC_RELAXED) == sequence) return id;
+        }
+        STAT_ADD(lookup_retries, 1);
+        sched_yield(); // the writer may be waiting for this CPU
+    }
+}
+
+/**
+ * Mark the start of a change to the table, for name_index_lookup
+ */
+void name_index_write_begin(struct name_index *ix) {
+    __atomic_store_n(&ix->sequence, ix->sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/**
+ * Mark the end of a change to the table
+ */
+void name_index_write_end(struct name_index *ix) {
+    __atomic_store_n(&ix->sequence, ix->sequence + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Add an id under its name, replacing any id already under that name,
+ * the caller must hold the index write lock
+ * @param ix, the index
+ * @param id, the id to add, its name must already be set
+ */
+void name_index_insert(struct name_index *ix, int id) {
+    int length;
+    const char *name = ix->name_of(id, &length);
+    unsigned int hash = name_hash(name, length);
+    unsigned int i = name_index_slot(ix, name, length, hash);
+    name_index_write_begin(ix);
+    ix->hashes[i] = hash;
+    ix->ids[i] = id;
+    name_index_write_end(ix);
+}
+
+/**
+ * Remove an id from the index, if it is still the one under its name,
+ * the caller must hold the index write lock
+ * @param ix, the index
+ * @param id, the id to remove
+ */
+void name_index_remove(struct name_index *ix, int id) {
+    int length;
+    const char *name = ix->name_of(id, &length);
+    unsigned int i = name_index_slot(ix, name, length, name_hash(name, length));
+    if (ix->ids[i] != id) return;
+    name_index_write_begin(ix);
+    // shift later entries of the probe back into the gap, rather than leave a
+    // tombstone, so that lookups of missing names always reach an empty slot
+    unsigned int j = i;
+    while (1) {
+        j = (j + 1) & ix->mask;
+        if (ix->ids[j] == -1) break;
+        unsigned int home = ix->hashes[j] & ix->mask;
+        // the entry at j can fill the gap at i unless its home lies
+        // cyclically within (i, j]
+        if ((j > i && (home <= i || home > j)) || (j < i && (home <= i && home > j))) {
+            ix->hashes[i] = ix->hashes[j];
+            ix->ids[i] = ix->ids[j];
+            i = j;
+        }
+    }
+    ix->ids[i] = -1;
+    name_index_write_end(ix);
+}
+
+/**
+ * @return the nickname of a client thread id, for the nickname index
+ */
+const char *nickname_of(int id, int *length) {
+    *length = threads[id].nicknamelength;
+    return threads[id].nickname;
+}
+
+/**
+ * @return the name of a channel id, for the channel index
+ */
+const char *channel_name_of(int id, int *length) {
+    *length = channel_list[id].namelength;
+    return channel_list[id].name;
+}
+
+// server links: with -l the server takes links from other servers and with
+// -P it dials them.  Linked servers tell each other the nicknames registered
+// on them, and a PRIVMSG to a nickname registered on another server goes
+// over the link to it, in the frames of linkproto.h.  Frames are not passed
+// on, so every server must be linked to every other, and the -l port must
+// only be reachable by them.
+#define MAX_LINKS 8
+#define MAX_REMOTE_NICKS 4096
+// a link whose output backs up past this is too far behind, and frames for
+// it are dropped until it catches up
+#define LINK_OUT_MAX (4 << 20)
+// how long before a lost link this server dialled is dialled again
+#define LINK_RETRY_MS 1000
+// how long a server connecting to -l has to show the link key
+#define LINK_HELLO_MS 5000
+
+/**
+ * a link to another server.  Its thread (link_main) reads and handles the
+ * frames the other server sends, and a writer thread (link_writer) sends
+ * what is queued to it, so queueing a record is a few bytes encoded under
+ * the lock and all the records queued while one write is in progress go in
+ * the frames of the next
+ */
+struct server_link {
+    int in_use;
+    char peer[64]; // the host:port dialled, empty for a link accepted on -l
+    int accepted_fd; // the socket of a link accepted on -l
+    char name[LINK_NAME_SIZE]; // the other server's name, from its SERVER record
+    pthread_mutex_t lock; // guards fd, the output and interns
+    pthread_cond_t queued; // records have been queued, or the link has gone down
+    int fd; // -1 unless the link is up
+    unsigned char *out; // records waiting to be written
+    int out_length;
+    int out_size;
+    struct link_interns *interns; // the ids we have given nicknames sent to it
+};
+
+/**
+ * a nickname registered on another server
+ */
+struct remote_nick {
+    char nickname[32];
+    int nicknamelength;
+    int link; // the link to the server it is registered on, -1 if unused
+};
+
+struct server_link server_links[MAX_LINKS];
+pthread_mutex_t server_links_lock = PTHREAD_MUTEX_INITIALIZER; // guards in_use
+char server_link_name[64]; // this server's name, sent in its SERVER records
+long links_up = 0;
+int compress_links = 0; // -z, compress large batches to linked servers
+// -K, the secret a server must show to link with this one and a standby to
+// follow it, anyone able to connect could otherwise inject nicknames and
+// messages or be sent the registry
+char *link_key = NULL;
+
+// the nicknames registered on other servers, ids index remote_nicks,
+// guarded by remote_index.lock
+struct name_index remote_index;
+struct remote_nick remote_nicks[MAX_REMOTE_NICKS];
+int free_remote[MAX_REMOTE_NICKS];
+int free_remote_count = 0;
+long remote_nick_count = 0;
+
+/**
+ * @return the nickname of a remote nickname id, for the remote index
+ */
+const char *remote_name_of(int id, int *length) {
+    *length = remote_nicks[id].nicknamelength;
+    return remote_nicks[id].nickname;
+}
+
+/**
+ * Set up the nickname and channel directories
+ */
+void init_directories() {
+    name_index_init(&nick_index, MAX_CLIENTS, nickname_of);
+    name_index_init(&channel_index, MAX_CHANNELS, channel_name_of);
+    for (free_channel_count = 0; free_channel_count < MAX_CHANNELS; free_channel_count++) {
+        free_channels[free_channel_count] = MAX_CHANNELS - 1 - free_channel_count;
+    }
+    name_index_init(&remote_index, MAX_REMOTE_NICKS, remote_name_of);
+    for (free_remote_count = 0; free_remote_count < MAX_REMOTE_NICKS; free_remote_count++) {
+        free_remote[free_remote_count] = MAX_REMOTE_NICKS - 1 - free_remote_count;
+        remote_nicks[free_remote_count].link = -1;
+    }
+    int i;
+    for (i = 0; i < MAX_LINKS; i++) {
+        server_links[i].fd = -1;
+        pthread_mutex_init(&server_links[i].lock, NULL);
+        pthread_cond_init(&server_links[i].queued, NULL);
+    }
+}
+
+/**
+ * Make room at the end of a link's output for records, the caller must
+ * hold the link's lock and then call link_commit with their length
+ * @param l, the link
+ * @param room, the most bytes the records will take
+ * @return where to write the records, or NULL if the link is down or too
+ *  far behind
+ */
+unsigned char *link_reserve(struct server_link *l, int room) {
+    if (l->fd == -1) return NULL;
+    if (l->out_length + room > l->out_size) {
+        int size = l->out_size ? l->out_size : LINK_FRAME_MAX;
+        while (size < l->out_length + room) size *= 2;
+        unsigned char *bigger = size > LINK_OUT_MAX ? NULL : realloc(l->out, size);
+        if (bigger == NULL) {
+            STAT_ADD(link_frames_dropped, 1);
+            return NULL;
+        }
+        l->out = bigger;
+        l->out_size = size;
+    }
+    return l->out + l->out_length;
+}
+
+/**
+ * Add a record written where link_reserve said to the link's output
+ * @param l, the link, the caller must hold its lock
+ * @param length, the length of the record
+ */
+void link_commit(struct server_link *l, int length) {
+    // the writer only waits when there was nothing queued
+    if (l->out_length == 0) pthread_cond_signal(&l->queued);
+    l->out_length += length;
+}
+
+/**
+ * Queue a SERVER, NICK or QUIT record to another server
+ * @param l, the link to the server
+ * @param type, the record type
+ * @param name, the name it carries
+ * @param length, the length of the name
+ * @return 0 if it was queued or -1 if the link is down or too far behind
+ */
+int link_queue_name(struct server_link *l, int type, const char *name, int length) {
+    pthread_mutex_lock(&l->lock);
+    unsigned char *p = link_reserve(l, 2 + LINK_NAME_SIZE);
+    if (p != NULL) link_commit(l, link_put_name(p, type, name, length));
+    pthread_mutex_unlock(&l->lock);
+    return p == NULL ? -1 : 0;
+}
+
+/**
+ * Queue a PRIVMSG to another server, naming its target by the id it was
+ * given when first sent, or defining one
+ * @param l, the link to the server
+ * @param target, the nickname it is for
+ * @param text, the message
+ * @return 0 if it was queued or -1 if the link is down or too far behind
+ */
+int link_queue_privmsg(struct server_link *l, struct line_view target, struct line_view text) {
+    if (text.length > LINK_TEXT_MAX) text.length = LINK_TEXT_MAX;
+    pthread_mutex_lock(&l->lock);
+    // room for all three records at once, so an id is never given out
+    // without its DEFINE going with it
+    unsigned char *p = link_reserve(l, 1 + 4 + LINK_NAME_SIZE + LINK_RECORD_MAX);
+    if (p != NULL) {
+        int n = 0;
+        int is_new;
+        int id = link_intern(l->interns, target.start, target.length, &is_new);
+        if (id == -1) { // out of ids, start again
+            p[n++] = LINK_RECORD_RESET;
+            link_interns_reset(l->interns);
+            id = link_intern(l->interns, target.start, target.length, &is_new);
+        }
+        if (is_new) n += link_put_define(p + n, id, target.start, target.length);
+        n += link_put_privmsg(p + n, id, text.start, text.length);
+        link_commit(l, n);
+    }
+    pthread_mutex_unlock(&l->lock);
+    return p == NULL ? -1 : 0;
+}
+
+/**
+ * Tell every linked server a client has registered or stopped being
+ * registered, the caller must hold the nickname index write lock so the
+ * records for a nickname go out in the order it changed
+ * @param t, the client
+ * @param registered, 1 if it has registered, 0 if it no longer is
+ */
+void link_announce(struct client_thread *t, int registered) {
+    int i;
+    for (i = 0; i < MAX_LINKS; i++) {
+        if (server_links[i].fd == -1) continue;
+        link_queue_name(&server_links[i], registered ? LINK_RECORD_NICK : LINK_RECORD_QUIT,
+                t->nickname, t->nicknamelength);
+    }
+}
+
+/**
+ * Find the server a nickname is registered on
+ * @return the link to it, or -1 if it is not registered on any linked server
+ */
+int find_remote_nick(const char *name, int length, unsigned int hash) {
+    pthread_rwlock_rdlock(&remote_index.lock);
+    int id = name_index_find(&remote_index, name, length, hash);
+    int link = id == -1 ? -1 : remote_nicks[id].link;
+    pthread_rwlock_unlock(&remote_index.lock);
+    return link;
+}
+
+// the registry snapshot (see snapshot.h), NULL unless started with -S
+struct snapshot_header *snapshot = NULL;
+
+// the snapshot records are copied straight from the client and channel structs
+_Static_assert(CHANNEL_NAME_SIZE == SNAPSHOT_CHANNEL_NAME_SIZE && MAX_JOINED == SNAPSHOT_MAX_JOINED,
+        "snapshot records do not match the server's structures");
+
+// warm standby replication: with -r the server takes a standby (a server
+// started with -F) on that port and streams it every change to the
+// registry, in order, as the snapshot records each change rewrites.  The
+// standby applies them to its own copy of the registry, and when the stream
+// ends and the port comes free it takes the port over with that registry
+// reserved, as a server restarted on a snapshot does.  Queueing a change is
+// a memcpy under a lock and a writer thread sends what is queued in
+// batches, so the primary never waits on its standby.
+//   standby to primary: first a repl_hello showing the link key (-K)
+//   primary to standby: repl_batch, then length bytes of records, each a
+//                       repl_record then the snapshot record of its type
+//   standby to primary: a repl_ack once it has applied each batch
+// The records are the server's own structs, so both must be the same build.
+#define REPL_MAGIC 0x4c504552 // "REPL"
+#define REPL_CLIENT 1 // a snapshot_client record, at its client id
+#define REPL_CHANNEL 2 // a snapshot_channel record, at its channel id
+#define REPL_SYNCED 3 // the records before it were the whole registry
+// a standby whose changes back up past this is dropped, to start following
+// again from a fresh copy of the registry
+#define REPL_OUT_MAX (16 << 20)
+// the batches written and not yet acknowledged that are tracked for the lag
+#define REPL_IN_FLIGHT 64
+
+/**
+ * the start of each batch of changes
+ */
+struct repl_batch {
+    unsigned int magic;
+    unsigned int version; // SNAPSHOT_VERSION, of the records
+    int length; // of the records that follow
+    int pad;
+    long long seq; // the number of changes sent, up to the end of this batch
+    long long queued_ms; // when its first change was queued, on the primary's clock
+};
+
+/**
+ * the start of each change
+ */
+struct repl_record {
+    int type;
+    int id;
+};
+
+/**
+ * what a standby sends first, so the registry only goes to one with our key
+ */
+struct repl_hello {
+    unsigned int magic; // REPL_MAGIC
+    int length; // of the key
+    char key[LINK_NAME_SIZE];
+};
+
+// how many standbys connecting to -r are waited on for their key at once
+#define REPL_HELLOS_MAX 4
+
+/**
+ * the standby has applied a batch, echoing its seq and queued_ms
+ */
+struct repl_ack {
+    long long seq;
+    long long queued_ms;
+};
+
+/**
+ * the standby following this server, if any
+ */
+struct standby_link {
+    pthread_mutex_t lock; // guards everything here
+    pthread_cond_t queued; // changes have been queued, or the standby has gone
+    int fd; // -1 unless a standby is following
+    char *out; // a repl_batch to fill in, then the changes queued since the last write
+    int out_length;
+    int out_size;
+    long long seq; // changes queued since the standby connected
+    long long acked; // changes the standby has applied
+    long out_ms; // when the first change in out was queued
+    // the batches in flight, as the seq they end at and when they started
+    long long flight_seq[REPL_IN_FLIGHT];
+    long flight_ms[REPL_IN_FLIGHT];
+    int flight_first;
+    int flight_count;
+};
+
+struct standby_link standby = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, -1};
+int standby_taken = 0; // only one standby follows at once
+int standby_hellos = 0; // standbys connected and not yet checked
+long standby_following = 0;
+long replication_lag_changes = 0; // queued and not yet applied by the standby
+long replication_lag_ms = 0; // how long the oldest of them has waited
+
+/**
+ * Queue a change to the registry to the standby, the caller must hold the
+ * lock the change was made under so changes are queued in the order made
+ * @param type, the record type
+ * @param id, the client or channel id
+ * @param record, the record, NULL for REPL_SYNCED
+ * @param size, the size of the record
+ */
+void replicate(int type, int id, const void *record, int size) {
+    if (standby.fd == -1) return;
+    pthread_mutex_lock(&standby.lock);
+    int need = sizeof (struct repl_record) + size;
+    if (standby.fd != -1 && standby.out_length + need + (int) sizeof (struct repl_batch) > standby.out_size) {
+        int length = standby.out_size ? standby.out_size : 65536;
+        while (length < standby.out_length + need + (int) sizeof (struct repl_batch)) length *= 2;
+        char *bigger = length > REPL_OUT_MAX ? NULL : realloc(standby.out, length);
+        if (bigger == NULL) {
+            // a standby that has missed a change is no use, so it must start again
+            shutdown(standby.fd, SHUT_RDWR);
+            standby.fd = -1;
+            pthread_cond_signal(&standby.queued);
+        } else {
+            standby.out = bigger;
+            standby.out_size = length;
+        }
+    }
+    if (standby.fd != -1) {
+        if (standby.out_length == 0) {
+            standby.out_length = sizeof (struct repl_batch); // filled in by the writer
+            standby.out_ms = now_ms();
+            pthread_cond_signal(&standby.queued);
+        }
+        struct repl_record r = {type, id};
+        memcpy(standby.out + standby.out_length, &r, sizeof (r));
+        if (size) memcpy(standby.out + standby.out_length + sizeof (r), record, size);
+        standby.out_length += need;
+        standby.seq++;
+        replication_lag_changes = standby.seq - standby.acked;
+    }
+    pthread_mutex_unlock(&standby.lock);
+}
+
+/**
+ * Fill in a registered client's registry record
+ * @param t, the client
+ * @param r, the record
+ */
+void registry_client_record(struct client_thread *t, struct snapshot_client *r) {
+    bzero(r, sizeof (*r));
+    r->address = t->address.s_addr;
+    r->nicknamelength = t->nicknamelength;
+    memcpy(r->nickname, t->nickname, SNAPSHOT_NAME_SIZE);
+    r->usernamelength = t->usernamelength;
+    memcpy(r->username, t->username, SNAPSHOT_NAME_SIZE);
+    r->channel_count = t->channel_count;
+    memcpy(r->channels, t->channels, sizeof (r->channels));
+    r->sum = snapshot_sum(r, sizeof (*r));
+}
+
+/**
+ * Fill in a channel's registry record
+ * @param id, the channel id
+ * @param r, the record
+ */
+void registry_channel_record(int id, struct snapshot_channel *r) {
+    bzero(r, sizeof (*r));
+    r->namelength = channel_list[id].namelength;
+    memcpy(r->name, channel_list[id].name, channel_list[id].namelength);
+    r->sum = snapshot_sum(r, sizeof (*r));
+}
+
+/**
+ * Rewrite a record of the snapshot in place
+ * @param to, the record in the snapshot
+ * @param from, the new record, with its sum
+ * @param size, the size of the record
+ */
+void snapshot_rewrite(void *to, const void *from, size_t size) {
+    unsigned int *sum = to;
+    *sum = 0; // a crash from here until the new sum is written leaves it torn
+    __sync_synchronize();
+    memcpy(sum + 1, (const unsigned int *) from + 1, size - sizeof (*sum));
+    __sync_synchronize();
+    *sum = *(const unsigned int *) from;
+}
+
+/**
+ * Note a client's registry record has changed, rewriting it in the snapshot
+ * and queueing it to the standby, the caller must hold a lock that stops
+ * the client's channels changing underneath it
+ * @param t, the client
+ * @param registered, 0 to clear the record as the client is no longer registered
+ */
+void registry_client_changed(struct client_thread *t, int registered) {
+    if (snapshot == NULL && standby.fd == -1) return;
+    struct snapshot_client r;
+    if (registered) registry_client_record(t, &r);
+    else bzero(&r, sizeof (r));
+    if (snapshot != NULL) snapshot_rewrite(&snapshot_clients(snapshot)[t->thread_id], &r, sizeof (r));
+    replicate(REPL_CLIENT, t->thread_id, &r, sizeof (r));
+}
+
+/**
+ * Note a channel's registry record has changed, see registry_client_changed,
+ * the caller must hold the channel index write lock
+ * @param id, the channel id
+ * @param live, 0 to clear the record as the channel has gone
+ */
+void registry_channel_changed(int id, int live) {
+    if (snapshot == NULL && standby.fd == -1) return;
+    struct snapshot_channel r;
+    if (live) registry_channel_record(id, &r);
+    else bzero(&r, sizeof (r));
+    if (snapshot != NULL) snapshot_rewrite(&snapshot_channels(snapshot)[id], &r, sizeof (r));
+    replicate(REPL_CHANNEL, id, &r, sizeof (r));
+}
+
+/**
+ * Make a client findable by its nickname, done when it registers
+ * @param t, the client
+ * @return 0, or -1 if another client has registered the nickname
+ */
+int register_nickname(struct client_thread *t) {
+    pthread_rwlock_wrlock(&nick_index.lock);
+    // NICK looked, but another client may have registered it since
+    int holder = name_index_find(&nick_index, t->nickname, t->nicknamelength,
+            name_hash(t->nickname, t->nicknamelength));
+    if (holder != -1 && holder != t->thread_id) {
+        pthread_rwlock_unlock(&nick_index.lock);
+        return -1;
+    }
+    name_index_insert(&nick_index, t->thread_id);
+    HOT(t)->nick_hash = name_hash(t->nickname, t->nicknamelength);
+    reg_users++;
+    registry_client_changed(t, 1);
+    link_announce(t, 1);
+    pthread_rwlock_unlock(&nick_index.lock);
+    return 0;
+}
+
+/**
+ * Check whether a nickname is registered here by another client
+ * @param t, the client wanting the nickname
+ * @param name, the nickname
+ * @return 1 if another client holds it, otherwise 0
+ */
+int nickname_in_use(struct client_thread *t, struct line_view name) {
+    int length = name.length < (int) sizeof (t->nickname) - 1 ? name.length : (int) sizeof (t->nickname) - 1;
+    pthread_rwlock_rdlock(&nick_index.lock);
+    int holder = name_index_find(&nick_index, name.start, length, name_hash(name.start, length));
+    pthread_rwlock_unlock(&nick_index.lock);
+    return holder != -1 && holder != t->thread_id;
+}
+
+/**
+ * Stop a registered client being findable by its nickname, done before its
+ * nickname changes or it goes away
+ * @param t, the client
+ */
+void unregister_nickname(struct client_thread *t) {
+    pthread_rwlock_wrlock(&nick_index.lock);
+    name_index_remove(&nick_index, t->thread_id);
+    reg_users--;
+    registry_client_changed(t, 0);
+    // unless a client that has since taken the nickname still holds it
+    if (name_index_find(&nick_index, t->nickname, t->nicknamelength, HOT(t)->nick_hash) == -1) {
+        link_announce(t, 0);
+    }
+    pthread_rwlock_unlock(&nick_index.lock);
+}
+
+/**
+ * find which thread structure the nickname belongs to, the caller must be in
+ * an epoch (epoch_enter) for as long as it uses it
+ * @param nickname, a nickname of the user to find
+ * @param nicknamelength, the length of the nickname
+ * @return a pointer to the client thread or NULL if not found
+ */
+struct client_thread* get_client_thread_by_nickname(char* nickname, int nicknamelength) {
+    unsigned int hash = name_hash(nickname, nicknamelength);
+    int id = name_index_lookup(&nick_index, nickname, nicknamelength, hash);
+    return id == -1 ? NULL : &threads[id];
+}
+
+/**
+ * Compare two names as the channel directory orders them, ignoring case
+ * @return less than, equal to or greater than 0 as a sorts before, with or
+ *  after b
+ */
+int channel_name_compare(const char *a, int alength, const char *b, int blength) {
+    int r = strncasecmp(a, b, alength < blength ? alength : blength);
+    return r ? r : alength - blength;
+}
+
+/**
+ * Find where a name is or would go in the directory by name, the caller
+ * must hold the channel index lock
+ * @param name, the name, or a prefix of names
+ * @param length, its length
+ * @return the position of the first channel not sorting before it
+ */
+int directory_find_name(const char *name, int length) {
+    int low = 0;
+    int high = directory_count;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        struct channel *c = &channel_list[channels_by_name[mid]];
+        if (channel_name_compare(c->name, c->namelength, name, length) < 0) low = mid + 1;
+        else high = mid;
+    }
+    return low;
+}
+
+/**
+ * Find the end of the channels whose names start with a prefix, the caller
+ * must hold the channel index lock
+ * @param from, the position of the first of them (directory_find_name)
+ * @param prefix, the prefix
+ * @param length, its length
+ * @return the position after the last of them
+ */
+int directory_prefix_end(int from, const char *prefix, int length) {
+    int low = from;
+    int high = directory_count;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        struct channel *c = &channel_list[channels_by_name[mid]];
+        int n = c->namelength < length ? c->namelength : length;
+        if (channel_name_compare(c->name, n, prefix, length) <= 0) low = mid + 1;
+        else high = mid;
+    }
+    return low;
+}
+
+/**
+ * Count the channels with at least a number of members, the caller must
+ * hold the channel index lock
+ * @param users, the least number of members
+ * @return the count, they are the first that many of channels_by_users
+ */
+int directory_busier_than(int users) {
+    int low = 0;
+    int high = directory_count;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (channel_list[channels_by_users[mid]].member_count >= users) low = mid + 1;
+        else high = mid;
+    }
+    return low;
+}
+
+/**
+ * Put a channel into the directory when it is created, with no members yet
+ * so last by member count, the caller must hold the channel index write lock
+ * @param id, the channel
+ */
+void directory_add(int id) {
+    struct channel *c = &channel_list[id];
+    int at = directory_find_name(c->name, c->namelength);
+    memmove(channels_by_name + at + 1, channels_by_name + at, (directory_count - at) * sizeof (int));
+    channels_by_name[at] = id;
+    channels_by_users[directory_count] = id;
+    channel_users_at[id] = directory_count;
+    directory_count++;
+}
+
+/**
+ * Take a channel out of the directory when it is removed, with no members
+ * left so last by member count, the caller must hold the channel index
+ * write lock
+ * @param id, the channel
+ */
+void directory_remove(int id) {
+    struct channel *c = &channel_list[id];
+    int at = directory_find_name(c->name, c->namelength);
+    memmove(channels_by_name + at, channels_by_name + at + 1, (directory_count - at - 1) * sizeof (int));
+    at = channel_users_at[id];
+    memmove(channels_by_users + at, channels_by_users + at + 1, (directory_count - at - 1) * sizeof (int));
+    directory_count--;
+    for (; at < directory_count; at++) {
+        channel_users_at[channels_by_users[at]] = at;
+    }
+}
+
+/**
+ * Keep the directory by member count in order once a member has joined or
+ * left a channel, the caller must hold the channel index write lock.  The
+ * channel swaps places with the first (or last) of those that had as many
+ * members as it had, so a join or part moves only two entries.
+ * @param id, the channel
+ * @param old_count, the members it had before
+ */
+void directory_count_changed(int id, int old_count) {
+    int at = channel_users_at[id];
+    int to;
+    if (channel_list[id].member_count > old_count) {
+        // the first of those ahead of it with no more members than it had
+        int low = 0;
+        int high = at;
+        while (low < high) {
+            int mid = (low + high) / 2;
+            if (channel_list[channels_by_users[mid]].member_count > old_count) low = mid + 1;
+            else high = mid;
+        }
+        to = low;
+    } else {
+        // the last of those after it with no fewer members than it had
+        int low = at + 1;
+        int high = directory_count;
+        while (low < high) {
+            int mid = (low + high) / 2;
+            if (channel_list[channels_by_users[mid]].member_count >= old_count) low = mid + 1;
+            else high = mid;
+        }
+        to = low - 1;
+    }
+    int other = channels_by_users[to];
+    channels_by_users[at] = other;
+    channel_users_at[other] = at;
+    channels_by_users[to] = id;
+    channel_users_at[id] = to;
+}
+
+/**
+ * Add a client to a channel, creating the channel if it does not exist,
+ * the caller must hold the channel index write lock
+ * @param t, the client joining
+ * @param name, the channel name
+ * @return the channel id, -1 if the client is in too many channels or
+ *  -2 if there are too many channels
+ */
+int join_channel_locked(struct client_thread *t, struct line_view name) {
+    if (name.length >= CHANNEL_NAME_SIZE) name.length = CHANNEL_NAME_SIZE - 1;
+    unsigned int hash = name_hash(name.start, name.length);
+    int id = name_index_find(&channel_index, name.start, name.length, hash);
+    int i;
+    if (id != -1) {
+        for (i = 0; i < t->channel_count; i++) {
+            if (t->channels[i] == id) return id; // already a member
+        }
+    }
+    if (t->channel_count == MAX_JOINED) return -1;
+    if (id == -1) {
+        if (free_channel_count == 0) return -2;
+        id = free_channels[--free_channel_count];
+        struct channel *c = &channel_list[id];
+        memcpy(c->name, name.start, name.length);
+        c->name[name.length] = 0;
+        c->namelength = name.length;
+        c->member_count = 0;
+        c->generation++;
+        name_index_insert(&channel_index, id);
+        directory_add(id);
+        registry_channel_changed(id, 1);
+    }
+    struct channel *c = &channel_list[id];
+    if (c->member_count == c->member_size) {
+        int size = c->member_size ? c->member_size * 2 : 8;
+        int *members = realloc(c->members, size * sizeof (int));
+        if (members == NULL) return -2;
+        c->members = members;
+        c->member_size = size;
+    }
+    c->members[c->member_count++] = t->thread_id;
+    directory_count_changed(id, c->member_count - 1);
+    t->channels[t->channel_count++] = id;
+    registry_client_changed(t, 1);
+    return id;
+}
+
+/**
+ * Take a client out of a channel, removing the channel once it is empty,
+ * the caller must hold the channel index write lock
+ * @param t, the client leaving
+ * @param id, the channel id
+ * @return 0 if the client left or -1 if it was not a member
+ */
+int part_channel_locked(struct client_thread *t, int id) {
+    int i;
+    for (i = 0; i < t->channel_count; i++) {
+        if (t->channels[i] == id) break;
+    }
+    if (i == t->channel_count) return -1;
+    t->channels[i] = t->channels[--t->channel_count];
+
+    struct channel *c = &channel_list[id];
+    for (i = 0; i < c->member_count; i++) {
+        if (c->members[i] == t->thread_id) {
+            c->members[i] = c->members[--c->member_count];
+            directory_count_changed(id, c->member_count + 1);
+            break;
+        }
+    }
+    if (c->member_count == 0) {
+        directory_remove(id);
+        name_index_remove(&channel_index, id);
+        free_channels[free_channel_count++] = id;
+        registry_channel_changed(id, 0);
+    }
+    registry_client_changed(t, 1);
+    return 0;
+}
+
+/**
+ * Take a client out of every channel it is in, done when it goes away
+ * @param t, the client
+ */
+void part_all_channels(struct client_thread *t) {
+    pthread_rwlock_wrlock(&channel_index.lock);
+    while (t->channel_count) {
+        part_channel_locked(t, t->channels[0]);
+    }
+    pthread_rwlock_unlock(&channel_index.lock);
+}
+
+/**
+ * Populate the thread stack with MAX_CLIENT thread_ids
+ */
+void populate_stack() {
+    for (aval_thread_stack_size = 0; aval_thread_stack_size < MAX_CLIENTS; aval_thread_stack_size++) {//0-MAX_CLIENTS-1
+        aval_thread_stack[aval_thread_stack_size] = MAX_CLIENTS - 1 - aval_thread_stack_size; //MAX_CLIENTS-1-0 999 998 ... 1 0 //the top of the stake will be 
+    }
+    LOG(LOG_DEBUG, "aval_thread_stack_size is now %d", aval_thread_stack_size);
+}
+
+/**
+ * Try to pop the first available thread of the available thread stack
+ * @return an available thread_id or -1 if none are available
+ */
+int trypop_stack() {
+    int return_val;
+    pthread_rwlock_wrlock(&aval_thread_stack_lock);
+    if (aval_thread_stack_size == 0) { // all in use nothing to pop
+        return_val = -1;
+    } else { // pop the top value
+        aval_thread_stack_size--;
+        return_val = aval_thread_stack[aval_thread_stack_size];
+    }
+    pthread_rwlock_unlock(&aval_thread_stack_lock);
+    return return_val;
+}
+
+/**
+ * Pushes a released thread_id onto the available thread stack
+ * @param thread_id, the thread id to add to the stack 
+ * @return 0 if thread id was added to the stack
+ */
+int push_stack(int thread_id) {
+    pthread_rwlock_wrlock(&aval_thread_stack_lock);
+    aval_thread_stack[aval_thread_stack_size] = thread_id;
+    aval_thread_stack_size++;
+    pthread_rwlock_unlock(&aval_thread_stack_lock);
+    return 0;
+}
+
+// epoch based reclamation of client ids.  PRIVMSG looks nicknames up without
+// the index lock (name_index_lookup) and goes on to render and queue to the
+// clients it found, so a closed connection's id must not be reused, and its
+// slot wiped for the next connection, while a sender may still hold it.  A
+// thread announces the epoch while it holds ids (epoch_enter), a closed
+// connection's id is retired in the epoch it closed in (epoch_retire), and
+// the epoch only moves on once every thread holding ids has announced the
+// current one, so once it has moved on twice no thread can still hold the
+// id and it goes back on the stack (epoch_reclaim)
+#define EPOCH_MAX_THREADS (MAX_CLIENTS + MAX_LOOPS + MAX_LINKS + 8)
+
+/**
+ * a thread's announcement, a cache line each as its owner writes it on every
+ * lookup
+ */
+struct epoch_record {
+    volatile unsigned long epoch; // the epoch announced, 0 while holding no ids
+    int in_use; // owned by a running thread
+    char pad[64 - sizeof (unsigned long) - sizeof (int)];
+};
+
+/**
+ * the id of a closed connection, waiting for the epoch to move on
+ */
+struct retired_id {
+    int thread_id;
+    unsigned long epoch; // the epoch it was retired in
+};
+
+volatile unsigned long global_epoch = 1;
+struct epoch_record epoch_records[EPOCH_MAX_THREADS];
+int epoch_record_count = 0; // past the last record ever taken
+pthread_key_t epoch_record_key; // the record of each thread, released when it exits
+__thread struct epoch_record *my_epoch_record = NULL;
+int epoch_unrecorded = 0; // threads holding ids that found no record free
+struct retired_id retired_ids[MAX_CLIENTS]; // an id is retired at most once before reuse
+int retired_count = 0;
+pthread_mutex_t retired_lock = PTHREAD_MUTEX_INITIALIZER; // guards retired_ids and the epoch moving on
+
+/**
+ * The destructor of epoch_record_key, frees an exiting thread's record
+ */
+void epoch_release_record(void *record) {
+    __atomic_store_n(&((struct epoch_record *) record)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * @return the calling thread's record, taking one if it has none, or NULL if
+ *  every record is taken
+ */
+struct epoch_record *epoch_my_record() {
+    if (my_epoch_record != NULL) return my_epoch_record;
+    int i;
+    for (i = 0; i < EPOCH_MAX_THREADS; i++) {
+        struct epoch_record *r = &epoch_records[i];
+        if (!r->in_use && __sync_bool_compare_and_swap(&r->in_use, 0, 1)) break;
+    }
+    if (i == EPOCH_MAX_THREADS) return NULL;
+    // epoch_advance only looks at the records below the count
+    int count = __sync_fetch_and_add(&epoch_record_count, 0);
+    while (count <= i && !__sync_bool_compare_and_swap(&epoch_record_count, count, i + 1)) {
+        count = __sync_fetch_and_add(&epoch_record_count, 0);
+    }
+    my_epoch_record = &epoch_records[i];
+    pthread_setspecific(epoch_record_key, my_epoch_record);
+    return my_epoch_record;
+}
+
+/**
+ * Start holding client ids found without a lock, until epoch_exit.  Not
+ * nested, and nothing that waits for long should be done in between as
+ * closed connections' ids are not reused until it is over
+ */
+void epoch_enter() {
+    struct epoch_record *r = epoch_my_record();
+    if (r == NULL) {
+        // counted instead, which holds the epoch where it is just the same
+        __sync_fetch_and_add(&epoch_unrecorded, 1);
+        return;
+    }
+    __atomic_store_n(&r->epoch, global_epoch, __ATOMIC_RELAXED);
+    // announced before anything is looked up, so either epoch_advance sees
+    // the announcement or the lookups see every id it could free removed
+    __sync_synchronize();
+}
+
+/**
+ * Stop holding client ids
+ */
+void epoch_exit() {
+    struct epoch_record *r = my_epoch_record;
+    if (r == NULL) {
+        __sync_fetch_and_sub(&epoch_unrecorded, 1);
+        return;
+    }
+    __atomic_store_n(&r->epoch, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * Move the epoch on if every thread holding ids has announced it, the caller
+ * must hold retired_lock
+ * @return 1 if it moved on, otherwise 0
+ */
+int epoch_advance() {
+    unsigned long epoch = global_epoch;
+    __sync_synchronize();
+    if (__atomic_load_n(&epoch_unrecorded, __ATOMIC_ACQUIRE)) return 0;
+    int count = __atomic_load_n(&epoch_record_count, __ATOMIC_ACQUIRE);
+    int i;
+    for (i = 0; i < count; i++) {
+        unsigned long announced = __atomic_load_n(&epoch_records[i].epoch, __ATOMIC_ACQUIRE);
+        if (announced != 0 && announced != epoch) return 0;
+    }
+    __atomic_store_n(&global_epoch, epoch + 1, __ATOMIC_SEQ_CST);
+    STAT_ADD(epoch_advances, 1);
+    return 1;
+}
+
+/**
+ * Push back for reuse the retired ids no thread can hold any more, moving
+ * the epoch on first if it can
+ * @return the number of ids pushed back
+ */
+int epoch_reclaim() {
+    int freed = 0;
+    pthread_mutex_lock(&retired_lock);
+    if (retired_count > 0) {
+        // an id retired in this epoch is free once it has moved on twice
+        if (epoch_advance()) epoch_advance();
+        int kept = 0;
+        int i;
+        for (i = 0; i < retired_count; i++) {
+            if (retired_ids[i].epoch + 2 <= global_epoch) {
+                push_stack(retired_ids[i].thread_id);
+                freed++;
+            } else {
+                retired_ids[kept++] = retired_ids[i];
+            }
+        }
+        retired_count = kept;
+    }
+    pthread_mutex_unlock(&retired_lock);
+    if (freed) STAT_ADD(ids_reclaimed, freed);
+    return freed;
+}
+
+/**
+ * Free a closed connection's id once no thread can hold it, its nickname and
+ * channels must already have been given up so it can no longer be found
+ * @param thread_id, the id
+ */
+void epoch_retire(int thread_id) {
+    pthread_mutex_lock(&retired_lock);
+    retired_ids[retired_count].thread_id = thread_id;
+    retired_ids[retired_count++].epoch = global_epoch;
+    pthread_mutex_unlock(&retired_lock);
+    STAT_ADD(ids_retired, 1);
+    epoch_reclaim();
+}
+
+// the most lines handled from one read before looking for more, bounds the
+// line views kept on the thread's stack
+#define MAX_LINES_PER_READ 64
+
+// true if a command's verb is v, which must be a string literal
+#define VERB_IS(cmd, v) ((cmd)->verb.length == sizeof (v) - 1 \
+        && strncasecmp((cmd)->verb.start, v, sizeof (v) - 1) == 0)
+
+/**
+ * Copy a word from a command into a fixed size name field
+ * @param name, the field to copy into, it is left nul terminated
+ * @param size, the size of the field, longer words are cut short rather than
+ *  overrunning into the rest of the client structure
+ * @param word, the word to copy
+ * @return the length of the name
+ */
+int copy_name(char *name, int size, struct line_view word) {
+    int length = word.length < size - 1 ? word.length : size - 1;
+    memcpy(name, word.start, length);
+    name[length] = 0;
+    return length;
+}
+
+/**
+ * a message bound for one client, gathered up by route_privmsg so that all
+ * the messages for a shard are queued under a single hold of its lock
+ */
+struct delivery {
+    int thread_id;
+    struct outbuf *b;
+    unsigned int generation; // of the client's slot when it was looked up
+};
+
+/**
+ * Render a message into a new outbuf that the caller holds a reference to
+ * @return the outbuf or NULL if out of memory
+ */
+struct outbuf *render_outbuf(const struct reply_template *tpl, const struct reply_args *args) {
+    struct outbuf *b = outbuf_new(1024);
+    if (b != NULL) {
+        b->refs = 1;
+        b->length = render_reply(b->data, 1024, tpl, args);
+    }
+    return b;
+}
+
+/**
+ * Split a comma separated list of targets, dropping repeats so a target
+ * named twice gets the message once
+ * @param list, the list
+ * @param targets, where to put the targets
+ * @param hashes, where to put the hash of each target (from name_hash)
+ * @param dropped, set to the number of targets beyond MAX_TARGETS
+ * @return the number of targets
+ */
+int split_targets(struct line_view list, struct line_view *targets, unsigned int *hashes, int *dropped) {
+    int count = 0;
+    *dropped = 0;
+    while (list.length > 0) {
+        int n = find_byte(list.start, list.length, ',');
+        struct line_view target = {list.start, n};
+        list.start += n + 1;
+        list.length -= n + 1;
+        if (target.length == 0) continue;
+        unsigned int hash = name_hash(target.start, target.length);
+        int i;
+        for (i = 0; i < count; i++) {
+            if (hashes[i] == hash && targets[i].length == target.length
+                    && strncasecmp(targets[i].start, target.start, target.length) == 0) break;
+        }
+        if (i < count) continue;
+        if (count == MAX_TARGETS) {
+            (*dropped)++;
+            continue;
+        }
+        hashes[count] = hash;
+        targets[count++] = target;
+    }
+    return count;
+}
+
+/**
+ * Queue a batch of messages, locking each shard once for all of its clients
+ * @param deliveries, the messages and who they are for
+ * @param count, the number of messages
+ */
+void queue_batch(struct delivery *deliveries, int count) {
+    int s;
+    for (s = 0; s < NUM_SHARDS && count > 0; s++) {
+        int locked = 0;
+        int i;
+        for (i = 0; i < count; i++) {
+            if (deliveries[i].thread_id % NUM_SHARDS != s) continue;
+            if (!locked) {
+                pthread_mutex_lock(&shards[s].lock);
+                locked = 1;
+            }
+            // posted from another loop after the client went and its slot
+            // was reused, too late for the epoch to have kept it
+            if (client_hot[deliveries[i].thread_id].generation != deliveries[i].generation) continue;
+            enqueue_locked(&threads[deliveries[i].thread_id], deliveries[i].b);
+        }
+        if (locked) pthread_mutex_unlock(&shards[s].lock);
+    }
+}
+
+/**
+ * Queue the messages the other loops have posted for this loop's clients
+ * @param loop, the caller's loop
+ */
+void loop_collect(struct event_loop *loop) {
+    struct mail mail[MAX_TARGETS];
+    struct delivery batch[MAX_TARGETS];
+    int from;
+    for (from = 0; from < loop_count; from++) {
+        struct mailbox *m = mailboxes[from][loop->index];
+        if (m == NULL) continue;
+        int n;
+        while ((n = mailbox_collect(m, mail, MAX_TARGETS)) > 0) {
+            int i;
+            for (i = 0; i < n; i++) {
+                batch[i].thread_id = mail[i].to;
+                batch[i].generation = mail[i].generation;
+                batch[i].b = mail[i].data;
+            }
+            queue_batch(batch, n);
+            for (i = 0; i < n; i++) {
+                outbuf_release(batch[i].b);
+            }
+        }
+    }
+}
+
+/**
+ * Post the messages for other loops' clients to those loops' mailboxes, for
+ * the caller's loop to queue only its own clients' messages
+ * @param deliveries, the messages, those left for the caller to queue are
+ *  moved to the front
+ * @param count, the number of messages
+ * @return the number left to queue, this loop's own
+ */
+int post_to_loops(struct delivery *deliveries, int count) {
+    unsigned long long posted = 0; // the loops posted to, to wake
+    int left = 0;
+    int i;
+    for (i = 0; i < count; i++) {
+        int to = deliveries[i].thread_id % loop_count;
+        struct mailbox *m = to == my_loop->index ? NULL
+                : __atomic_load_n(&mailboxes[my_loop->index][to], __ATOMIC_ACQUIRE);
+        if (m != NULL) {
+            // the mailbox's reference, taken first as the other loop may
+            // queue the message and let go of it as soon as it is posted
+            __sync_fetch_and_add(&deliveries[i].b->refs, 1);
+            if (mailbox_post(m, deliveries[i].thread_id, deliveries[i].generation, deliveries[i].b) == -1) {
+                // queueing it ourselves would put it ahead of those still in
+                // the mailbox, so wait for the other loop to collect, taking
+                // in what is posted to us meanwhile as it may be waiting on us
+                STAT_ADD(mail_full, 1);
+                do {
+                    loop_wake(&loops[to]);
+                    loop_collect(my_loop);
+                    sched_yield();
+                } while (mailbox_post(m, deliveries[i].thread_id, deliveries[i].generation, deliveries[i].b) == -1);
+            }
+            posted |= 1ULL << to;
+            continue;
+        }
+        deliveries[left++] = deliveries[i];
+    }
+    for (i = 0; posted != 0; i++, posted >>= 1) {
+        if (posted & 1) loop_wake(&loops[i]);
+    }
+    if (count > left) STAT_ADD(mail_posted, count - left);
+    return left;
+}
+
+/**
+ * Queue a batch of messages, locking each shard once for all of its clients,
+ * from an event loop those for another loop's clients are posted to it
+ * @param deliveries, the messages and who they are for
+ * @param count, the number of messages
+ */
+void deliver_batch(struct delivery *deliveries, int count) {
+    if (my_loop != NULL && loop_count > 1) count = post_to_loops(deliveries, count);
+    queue_batch(deliveries, count);
+}
+
+/**
+ * Send a PRIVMSG to a comma separated list of nicknames and channels. All the
+ * nicknames are looked up under one hold of the index lock, a channel's line
+ * is rendered once and shared by all its members, and the messages are
+ * queued a shard at a time
+ * @param t, the client sending the message
+ * @param cmd, the PRIVMSG command
+ */
+void route_privmsg(struct client_thread *t, struct command *cmd) {
+    struct line_view targets[MAX_TARGETS];
+    unsigned int hashes[MAX_TARGETS];
+    int ids[MAX_TARGETS];
+    int dropped;
+    int count = split_targets(cmd->param, targets, hashes, &dropped);
+    int i;
+
+    // resolve every nickname at once, taking no lock, the epoch keeps the
+    // clients found from being reused while their messages are rendered.
+    // Nothing that may wait is done in it: the messages are queued once out
+    // of it, queue_batch passing over any client whose slot has been reused
+    // since (its generation) or closed
+    epoch_enter();
+    for (i = 0; i < count; i++) {
+        ids[i] = targets[i].start[0] == '#' || targets[i].start[0] == '&' ? -1
+                : name_index_lookup(&nick_index, targets[i].start, targets[i].length, hashes[i]);
+    }
+
+    struct delivery local[MAX_TARGETS];
+    struct delivery *deliveries = local;
+    int size = MAX_TARGETS;
+    int n = 0;
+    struct outbuf * rendered[MAX_TARGETS]; // our references, released at the end
+    int rendered_count = 0;
+    int missing[MAX_TARGETS]; // the channels there are not, answered once unlocked
+    int missing_count = 0;
+
+    for (i = 0; i < count; i++) {
+        if (targets[i].start[0] == '#' || targets[i].start[0] == '&') continue;
+        if (ids[i] == -1) continue; // looked for on the links once out of the epoch
+        struct client_thread *ct = &threads[ids[i]];
+        struct reply_args args = {ct->nickname, ct->nicknamelength, NULL, 0,
+            cmd->trailing.start, cmd->trailing.length};
+        struct outbuf *b = render_outbuf(&reply_privmsg, &args);
+        if (b == NULL) continue;
+        rendered[rendered_count++] = b;
+        deliveries[n].thread_id = ids[i];
+        deliveries[n].generation = client_hot[ids[i]].generation;
+        deliveries[n++].b = b;
+    }
+
+    epoch_exit();
+
+    // then every channel, copying out the members under one hold of its lock.
+    // Out of the epoch, as a client leaves its channels before its id is
+    // retired and queue_batch passes over one closed since
+    pthread_rwlock_rdlock(&channel_index.lock);
+    for (i = 0; i < count; i++) {
+        if (targets[i].start[0] != '#' && targets[i].start[0] != '&') continue;
+        int id = name_index_find(&channel_index, targets[i].start, targets[i].length, hashes[i]);
+        if (id == -1) {
+            missing[missing_count++] = i;
+            continue;
+        }
+        struct channel *c = &channel_list[id];
+        struct reply_args args = {.text = cmd->trailing.start, .textlength = cmd->trailing.length,
+            .target = c->name, .targetlength = c->namelength};
+        struct outbuf *b = render_outbuf(&reply_channel_message, &args);
+        if (b == NULL) continue;
+        rendered[rendered_count++] = b;
+        if (n + c->member_count > size) {
+            size = (n + c->member_count) * 2;
+            struct delivery *bigger = malloc(size * sizeof (struct delivery));
+            if (bigger == NULL) break;
+            memcpy(bigger, deliveries, n * sizeof (struct delivery));
+            if (deliveries != local) free(deliveries);
+            deliveries = bigger;
+        }
+        int m;
+        for (m = 0; m < c->member_count; m++) {
+            if (c->members[m] == t->thread_id) continue; // not echoed to the sender
+            deliveries[n].thread_id = c->members[m];
+            deliveries[n].generation = client_hot[c->members[m]].generation;
+            deliveries[n++].b = b;
+        }
+    }
+    pthread_rwlock_unlock(&channel_index.lock);
+
+    deliver_batch(deliveries, n);
+    t->usage.messages_routed += n;
+
+    for (i = 0; i < rendered_count; i++) {
+        outbuf_release(rendered[i]);
+    }
+    if (deliveries != local) free(deliveries);
+    // what may wait, on a link's lock or a write to the sender, is done out
+    // of the epoch and with the channel index unlocked
+    for (i = 0; i < count; i++) {
+        if (targets[i].start[0] == '#' || targets[i].start[0] == '&' || ids[i] != -1) continue;
+        // not registered here, but perhaps on a linked server
+        int link = find_remote_nick(targets[i].start, targets[i].length, hashes[i]);
+        if (link != -1) {
+            if (link_queue_privmsg(&server_links[link], targets[i], cmd->trailing) == 0) {
+                STAT_ADD(link_messages_out, 1);
+                t->usage.messages_routed++;
+            }
+            continue;
+        }
+        struct reply_args args = {.text = targets[i].start, .textlength = targets[i].length};
+        send_reply(t, &reply_privmsg_unknown, &args);
+    }
+    for (i = 0; i < missing_count; i++) {
+        struct reply_args args = {.text = targets[missing[i]].start, .textlength = targets[missing[i]].length};
+        send_reply(t, &reply_no_such_channel, &args);
+    }
+    if (dropped) {
+        struct reply_args args = {.num = {MAX_TARGETS}};
+        send_reply(t, &reply_too_many_targets, &args);
+    }
+}
+
+/**
+ * Join or leave a comma separated list of channels
+ * @param t, the client joining or leaving
+ * @param list, the channels
+ * @param joining, 1 to join the channels or 0 to leave them
+ */
+void join_or_part(struct client_thread *t, struct line_view list, int joining) {
+    while (list.length > 0) {
+        int n = find_byte(list.start, list.length, ',');
+        struct line_view name = {list.start, n};
+        list.start += n + 1;
+        list.length -= n + 1;
+        if (name.length == 0) continue;
+        struct reply_args args = {.text = name.start, .textlength = name.length};
+        if (name.start[0] != '#' && name.start[0] != '&') {
+            send_reply(t, &reply_no_such_channel, &args);
+            continue;
+        }
+        pthread_rwlock_wrlock(&channel_index.lock);
+        int r;
+        if (joining) {
+            r = join_channel_locked(t, name);
+        } else {
+            r = name_index_find(&channel_index, name.start, name.length, name_hash(name.start, name.length));
+            if (r != -1) r = part_channel_locked(t, r);
+        }
+        pthread_rwlock_unlock(&channel_index.lock);
+        if (joining) {
+            send_reply(t, r >= 0 ? &reply_join : r == -1 ? &reply_too_many_channels
+                    : &reply_server_channels_full, &args);
+        } else {
+            send_reply(t, r == 0 ? &reply_part : &reply_not_on_channel, &args);
+        }
+    }
+}
+
+// ISON, WHOIS and WHO answer from the nickname and channel indexes,
+// looking a list of nicknames up all at once without a lock and sending
+// every line of the answer in as few writes as will hold it (reply_batch),
+// so a client polling a long contact list costs one command and one write
+#define ISON_CHUNK 64 // the nicknames of an ISON looked up at once
+
+/**
+ * Add the registered nicknames of part of an ISON list to its answer, the
+ * nicknames as they were asked for
+ * @param names, the nicknames
+ * @param count, the number of them, at most ISON_CHUNK
+ * @param online, the answer
+ * @param size, the size of the answer
+ * @param length, the length of the answer so far, updated
+ */
+void ison_lookup(struct line_view *names, int count, char *online, int size, int *length) {
+    unsigned int hashes[ISON_CHUNK];
+    int ids[ISON_CHUNK];
+    int i;
+    for (i = 0; i < count; i++) {
+        hashes[i] = name_hash(names[i].start, names[i].length);
+    }
+    // only whether each is there is wanted, so no epoch is needed to keep
+    // the clients found
+    for (i = 0; i < count; i++) {
+        ids[i] = name_index_lookup(&nick_index, names[i].start, names[i].length, hashes[i]);
+    }
+    for (i = 0; i < count; i++) {
+        if (ids[i] == -1 && find_remote_nick(names[i].start, names[i].length, hashes[i]) == -1) continue;
+        if (*length + 1 + names[i].length > size) break;
+        if (*length) online[(*length)++] = ' ';
+        memcpy(online + *length, names[i].start, names[i].length);
+        *length += names[i].length;
+    }
+    STAT_ADD(presence_lookups, count);
+}
+
+/**
+ * Answer ISON with the nicknames of a list that are registered, here or on a
+ * linked server, in one line
+ * @param t, the client asking
+ * @param list, the nicknames separated by spaces, the last ones may follow
+ *  a ':' as trailing text
+ */
+void send_ison(struct client_thread *t, struct line_view list) {
+    struct reply_batch rb;
+    rb.t = t;
+    rb.length = 0;
+    char online[IO_BUFFER_SIZE - 64]; // room left in the batch for the rest of the line
+    int length = 0;
+    struct line_view names[ISON_CHUNK];
+    int count = 0;
+    while (list.length > 0) {
+        int n = find_byte(list.start, list.length, ' ');
+        struct line_view name = {list.start, n};
+        list.start += n + 1;
+        list.length -= n + 1;
+        if (name.length > 0 && name.start[0] == ':') {
+            name.start++;
+            name.length--;
+        }
+        if (name.length == 0) continue;
+        names[count++] = name;
+        if (count == ISON_CHUNK) {
+            ison_lookup(names, count, online, sizeof (online), &length);
+            count = 0;
+        }
+    }
+    ison_lookup(names, count, online, sizeof (online), &length);
+    struct reply_args args = {.text = online, .textlength = length};
+    reply_batch_add(&rb, &reply_ison, &args);
+    reply_batch_flush(&rb);
+    STAT_ADD(presence_queries, 1);
+}
+
+/**
+ * Put the names of the channels a client is in in a WHOIS answer, the caller
+ * must hold the channel index lock
+ * @param joined, the ids of the channels, copied out while the epoch kept
+ *  the client
+ * @param count, the number of them
+ * @param out, where to put the names separated by spaces
+ * @param size, the size of out, names that do not fit are left off
+ * @return the length of the names
+ */
+int whois_channels_locked(const int *joined, int count, char *out, int size) {
+    int length = 0;
+    int i;
+    for (i = 0; i < count; i++) {
+        struct channel *c = &channel_list[joined[i]];
+        if (c->member_count == 0) continue; // emptied and removed since
+        if (length + 1 + c->namelength > size) break;
+        if (length) out[length++] = ' ';
+        memcpy(out + length, c->name, c->namelength);
+        length += c->namelength;
+    }
+    return length;
+}
+
+/**
+ * what WHO and WHOIS tell of a client, copied out while the epoch keeps it
+ * so the answer is sent once out of the epoch
+ */
+struct presence {
+    char nickname[32];
+    int nicknamelength;
+    char username[32];
+    int usernamelength;
+    long idle_s; // seconds since it last sent something
+};
+
+/**
+ * Copy out what WHO and WHOIS tell of a client
+ * @param p, where to
+ * @param ct, the client, which the caller's epoch must be keeping
+ * @param now, now_ms(), for how long it has been idle
+ */
+void presence_copy(struct presence *p, struct client_thread *ct, long now) {
+    p->nicknamelength = ct->nicknamelength;
+    memcpy(p->nickname, ct->nickname, ct->nicknamelength);
+    p->usernamelength = ct->usernamelength;
+    memcpy(p->username, ct->username, ct->usernamelength);
+    p->idle_s = (now - ct->last_input_ms) / 1000;
+}
+
+/**
+ * Answer WHOIS for each nickname of a comma separated list: its user, its
+ * server, how long it has been idle and its channels, or that there is no
+ * such nickname
+ * @param t, the client asking
+ * @param list, the nicknames
+ */
+void send_whois(struct client_thread *t, struct line_view list) {
+    struct line_view names[MAX_TARGETS];
+    unsigned int hashes[MAX_TARGETS];
+    int ids[MAX_TARGETS];
+    int dropped;
+    int count = split_targets(list, names, hashes, &dropped);
+    if (count == 0) {
+        send_reply(t, &reply_no_nickname_given, NULL);
+        return;
+    }
+    struct presence found[MAX_TARGETS];
+    int joined[MAX_TARGETS][MAX_JOINED];
+    int joined_count[MAX_TARGETS];
+    char channels[MAX_TARGETS][MAX_JOINED * CHANNEL_NAME_SIZE];
+    int channelslength[MAX_TARGETS];
+    long now = now_ms();
+    int i;
+    // the epoch keeps the clients found until what is told of them, and the
+    // ids of their channels, is copied out.  The channels' names are read
+    // under the channel index lock once out of it
+    epoch_enter();
+    for (i = 0; i < count; i++) {
+        ids[i] = name_index_lookup(&nick_index, names[i].start, names[i].length, hashes[i]);
+        if (ids[i] == -1) continue;
+        struct client_thread *ct = &threads[ids[i]];
+        presence_copy(&found[i], ct, now);
+        joined_count[i] = ct->channel_count;
+        if (joined_count[i] > MAX_JOINED) joined_count[i] = MAX_JOINED;
+        memcpy(joined[i], ct->channels, joined_count[i] * sizeof (int));
+    }
+    epoch_exit();
+
+    pthread_rwlock_rdlock(&channel_index.lock);
+    for (i = 0; i < count; i++) {
+        if (ids[i] == -1) continue;
+        channelslength[i] = whois_channels_locked(joined[i], joined_count[i],
+                channels[i], sizeof (channels[i]));
+    }
+    pthread_rwlock_unlock(&channel_index.lock);
+
+    struct reply_batch rb;
+    rb.t = t;
+    rb.length = 0;
+    for (i = 0; i < count; i++) {
+        struct reply_args args = {.target = names[i].start, .targetlength = names[i].length};
+        if (ids[i] != -1) {
+            struct reply_args about = {.target = found[i].nickname, .targetlength = found[i].nicknamelength,
+                .username = found[i].username, .usernamelength = found[i].usernamelength,
+                .text = SERVER_NAME, .textlength = sizeof (SERVER_NAME) - 1,
+                .num = {found[i].idle_s}};
+            reply_batch_add(&rb, &reply_whois_user, &about);
+            reply_batch_add(&rb, &reply_whois_server, &about);
+            reply_batch_add(&rb, &reply_whois_idle, &about);
+            about.textlength = channelslength[i];
+            about.text = channels[i];
+            if (about.textlength) reply_batch_add(&rb, &reply_whois_channels, &about);
+        } else {
+            int link = find_remote_nick(names[i].start, names[i].length, hashes[i]);
+            if (link == -1) {
+                reply_batch_add(&rb, &reply_no_such_nick, &args);
+            } else {
+                // all we know of it is where it is
+                args.text = server_links[link].name;
+                args.textlength = strlen(server_links[link].name);
+                reply_batch_add(&rb, &reply_whois_server, &args);
+            }
+        }
+        reply_batch_add(&rb, &reply_whois_end, &args);
+    }
+    reply_batch_flush(&rb);
+    STAT_ADD(presence_queries, 1);
+    STAT_ADD(presence_lookups, count);
+}
+
+/**
+ * Answer WHO for a channel, a line for each of its members, or for a comma
+ * separated list of nicknames, a line for each registered here.  Masks
+ * with wildcards are not looked up, as they would need every client
+ * scanned, and are answered with no lines
+ * @param t, the client asking
+ * @param mask, the channel or nicknames
+ */
+void send_who(struct client_thread *t, struct line_view mask) {
+    struct line_view names[MAX_TARGETS];
+    unsigned int hashes[MAX_TARGETS];
+    int local[MAX_TARGETS];
+    int *ids = local;
+    struct presence found_local[MAX_TARGETS];
+    struct presence *found = found_local;
+    int count = 0;
+    char channel[CHANNEL_NAME_SIZE] = "*";
+    int channellength = 1;
+    int i;
+    // the epoch keeps the clients found, and a channel's members copied
+    // out, until what is told of them is copied out, the answer is sent
+    // once out of it
+    epoch_enter();
+    if (mask.length && (mask.start[0] == '#' || mask.start[0] == '&')) {
+        pthread_rwlock_rdlock(&channel_index.lock);
+        int id = name_index_find(&channel_index, mask.start, mask.length, name_hash(mask.start, mask.length));
+        if (id != -1) {
+            struct channel *c = &channel_list[id];
+            if (c->member_count > MAX_TARGETS) {
+                ids = malloc(c->member_count * sizeof (int));
+                found = malloc(c->member_count * sizeof (struct presence));
+            }
+            if (ids != NULL && found != NULL) {
+                count = c->member_count;
+                memcpy(ids, c->members, count * sizeof (int));
+            }
+            channellength = c->namelength;
+            memcpy(channel, c->name, channellength);
+        }
+        pthread_rwlock_unlock(&channel_index.lock);
+    } else if (find_byte(mask.start, mask.length, '*') == mask.length
+            && find_byte(mask.start, mask.length, '?') == mask.length) {
+        int dropped;
+        count = split_targets(mask, names, hashes, &dropped);
+        for (i = 0; i < count; i++) {
+            ids[i] = name_index_lookup(&nick_index, names[i].start, names[i].length, hashes[i]);
+        }
+    }
+    for (i = 0; i < count; i++) {
+        if (ids[i] != -1) presence_copy(&found[i], &threads[ids[i]], 0);
+    }
+    epoch_exit();
+
+    struct reply_batch rb;
+    rb.t = t;
+    rb.length = 0;
+    for (i = 0; i < count; i++) {
+        if (ids[i] == -1) continue;
+        struct reply_args args = {.target = channel, .targetlength = channellength,
+            .text = found[i].nickname, .textlength = found[i].nicknamelength,
+            .username = found[i].username, .usernamelength = found[i].usernamelength};
+        reply_batch_add(&rb, &reply_who, &args);
+    }
+    if (ids != local && ids != NULL) free(ids);
+    if (found != found_local && found != NULL) free(found);
+    struct reply_args args = {.target = mask.length ? mask.start : "*", .targetlength = mask.length ? mask.length : 1};
+    reply_batch_add(&rb, &reply_who_end, &args);
+    reply_batch_flush(&rb);
+    STAT_ADD(presence_queries, 1);
+    STAT_ADD(presence_lookups, count);
+}
+
+// LIST chooses its channels from the directory when it is sent, keeping
+// only their ids, and sends them a page at a time as the client's socket
+// has room for one, so listing every channel neither holds the channel
+// lock for long nor builds the whole answer in memory.  A channel that
+// goes, or falls under the least number of users asked for, before its
+// page is sent is left out.
+// a page is no more than the room poll promises when it says a socket is
+// writable: the default send low water mark, 2048 bytes, where there is one
+// (linux has none and waits for a third of the buffer to be free), so the
+// page's write does not wait and no socket option is changed for it
+#define LIST_PAGE_SIZE 2048
+#define LIST_ITEMS 32 // the most names and prefixes a LIST can give
+
+/**
+ * a channel chosen for a LIST
+ */
+struct list_entry {
+    int id;
+    unsigned int generation; // of the channel_list entry when it was chosen
+};
+
+/**
+ * a LIST part way through being sent
+ */
+struct list_cursor {
+    int min_users;
+    int count;
+    int next; // the first not yet sent
+    struct list_entry entries[];
+};
+
+/**
+ * Add a channel to a LIST unless it is already in it
+ * @param c, the LIST
+ * @param id, the channel
+ * @param chosen, marks the channels already in it, or NULL if there can be
+ *  none as only one name was given
+ */
+void list_choose(struct list_cursor *c, int id, char *chosen) {
+    if (chosen != NULL) {
+        if (chosen[id]) return;
+        chosen[id] = 1;
+    }
+    c->entries[c->count].id = id;
+    c->entries[c->count].generation = channel_list[id].generation;
+    c->count++;
+}
+
+/**
+ * Choose the channels a LIST asks for
+ * @param filters, the comma separated channel names, name prefixes ending
+ *  in '*' and ">N" for more than N users, every channel if it names none
+ * @return the channels, or NULL if out of memory
+ */
+struct list_cursor *list_select(struct line_view filters) {
+    struct line_view names[LIST_ITEMS];
+    int prefix[LIST_ITEMS];
+    int count = 0;
+    int min_users = 0;
+    while (filters.length > 0) {
+        int n = find_byte(filters.start, filters.length, ',');
+        struct line_view item = {filters.start, n};
+        filters.start += n + 1;
+        filters.length -= n + 1;
+        if (item.length == 0) continue;
+        if (item.start[0] == '>') {
+            int users = 0;
+            int i;
+            for (i = 1; i < item.length && item.start[i] >= '0' && item.start[i] <= '9' && users < MAX_CLIENTS; i++) {
+                users = users * 10 + item.start[i] - '0';
+            }
+            if (users + 1 > min_users) min_users = users + 1;
+        } else if (count < LIST_ITEMS) {
+            prefix[count] = item.start[item.length - 1] == '*';
+            item.length -= prefix[count];
+            names[count++] = item;
+        }
+    }
+    if (count == 0) { // every channel, whose names all start with ""
+        names[0].start = "";
+        names[0].length = 0;
+        prefix[0] = 1;
+        count = 1;
+    }
+
+    pthread_rwlock_rdlock(&channel_index.lock);
+    struct list_cursor *c = malloc(sizeof (struct list_cursor) + directory_count * sizeof (struct list_entry));
+    char *chosen = count > 1 ? calloc(MAX_CHANNELS, 1) : NULL;
+    if (c == NULL || (count > 1 && chosen == NULL)) {
+        pthread_rwlock_unlock(&channel_index.lock);
+        free(c);
+        return NULL;
+    }
+    c->min_users = min_users;
+    c->count = 0;
+    c->next = 0;
+    int i;
+    for (i = 0; i < count; i++) {
+        const char *name = names[i].start;
+        int length = names[i].length;
+        if (!prefix[i]) {
+            int id = name_index_find(&channel_index, name, length, name_hash(name, length));
+            if (id != -1 && channel_list[id].member_count >= min_users) list_choose(c, id, chosen);
+            continue;
+        }
+        int from = directory_find_name(name, length);
+        int to = directory_prefix_end(from, name, length);
+        int busy = min_users ? directory_busier_than(min_users) : directory_count;
+        int j;
+        if (busy < to - from) {
+            // fewer channels have the users than have the name, go through those
+            for (j = 0; j < busy; j++) {
+                struct channel *ch = &channel_list[channels_by_users[j]];
+                if (ch->namelength >= length && strncasecmp(ch->name, name, length) == 0) {
+                    list_choose(c, channels_by_users[j], chosen);
+                }
+            }
+        } else {
+            for (j = from; j < to; j++) {
+                if (channel_list[channels_by_name[j]].member_count >= min_users) {
+                    list_choose(c, channels_by_name[j], chosen);
+                }
+            }
+        }
+    }
+    pthread_rwlock_unlock(&channel_index.lock);
+    free(chosen);
+    return c;
+}
+
+/**
+ * Let go of a client's LIST, sent or not
+ * @param t, the client
+ */
+void list_end(struct client_thread *t) {
+    free(t->listing);
+    t->listing = NULL;
+}
+
+/**
+ * Send the next page of a client's LIST, and the end of it once it is all
+ * sent, called when the client's socket has room
+ * @param t, the client, which must be sending a LIST
+ */
+void list_continue(struct client_thread *t) {
+    struct list_cursor *c = t->listing;
+    struct reply_batch rb;
+    rb.t = t;
+    rb.length = 0;
+    pthread_rwlock_rdlock(&channel_index.lock);
+    // a line of the LIST is well under 256 bytes, so a page stays under
+    // LIST_PAGE_SIZE and the batch is never sent while the lock is held
+    while (c->next < c->count && rb.length < LIST_PAGE_SIZE - 256) {
+        struct list_entry *e = &c->entries[c->next++];
+        struct channel *ch = &channel_list[e->id];
+        if (ch->generation != e->generation || ch->member_count == 0
+                || ch->member_count < c->min_users) continue;
+        struct reply_args args = {.target = ch->name, .targetlength = ch->namelength,
+            .num = {ch->member_count}};
+        reply_batch_add(&rb, &reply_list, &args);
+    }
+    pthread_rwlock_unlock(&channel_index.lock);
+    if (c->next == c->count) {
+        struct reply_args none;
+        bzero(&none, sizeof (none));
+        reply_batch_add(&rb, &reply_list_end, &none);
+        list_end(t);
+    }
+    reply_batch_flush(&rb);
+    STAT_ADD(list_pages, 1);
+}
+
+/**
+ * Answer a LIST, sending its first page now and the rest as the client's
+ * socket has room (list_continue)
+ * @param t, the client
+ * @param filters, what to list (list_select)
+ */
+void list_start(struct client_thread *t, struct line_view filters) {
+    list_end(t); // a LIST still being sent is replaced
+    send_reply(t, &reply_list_start, NULL);
+    STAT_ADD(lists, 1);
+    t->listing = list_select(filters);
+    if (t->listing == NULL) {
+        send_reply(t, &reply_list_end, NULL);
+        return;
+    }
+    // a socket already full is sent the first page once it has room
+    if (!t->out_blocked) list_continue(t);
+}
+
+// how long a server restarted from a snapshot holds each nickname in it for
+// the client to reconnect and claim it, with its channels
+#define RESERVATION_MS 300000
+
+/**
+ * a registration from before the restart, waiting for its client
+ */
+struct reservation {
+    char nickname[SNAPSHOT_NAME_SIZE];
+    int nicknamelength;
+    in_addr_t address; // only a client from the same address may claim it
+    int channel_count;
+    int channels[SNAPSHOT_MAX_JOINED]; // indexes into reserved_channels
+};
+
+struct reservation *reservations = NULL;
+long reservation_count = 0;
+// the names of the snapshot's channels, by their id in the snapshot
+char (*reserved_channels)[SNAPSHOT_CHANNEL_NAME_SIZE] = NULL;
+// the reservations by nickname, its lock also guards reservations
+struct name_index reservation_index;
+long reservations_expire_ms = 0;
+
+/**
+ * The name function of reservation_index
+ */
+const char *reservation_name_of(int id, int *length) {
+    *length = reservations[id].nicknamelength;
+    return reservations[id].nickname;
+}
+
+/**
+ * Turn the records of a snapshot left by an earlier server into reservations
+ * @param header, the snapshot mapped into memory
+ * @param size, the size of the snapshot file
+ * @return the number of channels found, or -1 if it is not a usable snapshot
+ */
+int load_reservations(struct snapshot_header *header, size_t size) {
+    if (header->magic != SNAPSHOT_MAGIC || header->version != SNAPSHOT_VERSION
+            || size != snapshot_size(header->client_slots, header->channel_slots)) {
+        return -1;
+    }
+    struct snapshot_channel *channels = snapshot_channels(header);
+    reserved_channels = calloc(header->channel_slots + 1, SNAPSHOT_CHANNEL_NAME_SIZE);
+    reservations = malloc((header->client_slots + 1) * sizeof (struct reservation));
+    if (reserved_channels == NULL || reservations == NULL) {
+        free(reserved_channels);
+        free(reservations);
+        reserved_channels = NULL;
+        reservations = NULL;
+        return -1;
+    }
+    int channel_count = 0;
+    unsigned int i;
+    for (i = 0; i < header->channel_slots; i++) {
+        struct snapshot_channel *c = &channels[i];
+        // skip empty slots and any record torn by the crash
+        if (c->sum == 0 || c->sum != snapshot_sum(c, sizeof (*c))) continue;
+        if (c->namelength < 1 || c->namelength >= SNAPSHOT_CHANNEL_NAME_SIZE) continue;
+        memcpy(reserved_channels[i], c->name, c->namelength);
+        channel_count++;
+    }
+
+    struct snapshot_client *clients = snapshot_clients(header);
+    reservation_count = 0;
+    for (i = 0; i < header->client_slots; i++) {
+        struct snapshot_client *c = &clients[i];
+        if (c->sum == 0 || c->sum != snapshot_sum(c, sizeof (*c))) continue;
+        if (c->nicknamelength < 1 || c->nicknamelength >= SNAPSHOT_NAME_SIZE) continue;
+        struct reservation *r = &reservations[reservation_count];
+        memcpy(r->nickname, c->nickname, SNAPSHOT_NAME_SIZE);
+        r->nickname[c->nicknamelength] = 0;
+        r->nicknamelength = c->nicknamelength;
+        r->address = c->address;
+        r->channel_count = 0;
+        int j;
+        for (j = 0; j < c->channel_count && j < SNAPSHOT_MAX_JOINED; j++) {
+            unsigned int id = c->channels[j];
+            if (id < header->channel_slots && reserved_channels[id][0]) {
+                r->channels[r->channel_count++] = id;
+            }
+        }
+        reservation_count++;
+    }
+    name_index_init(&reservation_index, reservation_count, reservation_name_of);
+    for (i = 0; i < reservation_count; i++) {
+        name_index_insert(&reservation_index, i);
+    }
+    reservations_expire_ms = now_ms() + RESERVATION_MS;
+    return channel_count;
+}
+
+/**
+ * Map the snapshot file, first taking reservations from what an earlier
+ * server left in it, and start it afresh for this server to keep up to date
+ * @param path, the snapshot file
+ * @param load, 0 to ignore what is in the file (when taking over from an
+ *  upgrade the clients themselves are handed over)
+ * @return 0 if the snapshot is mapped or -1 if not
+ */
+int open_snapshot(const char *path, int load) {
+    long start = now_ms();
+    int fd = open(path, O_RDWR | O_CREAT, 0600);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) return -1;
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    unsigned int generation = 0;
+    if (st.st_size >= sizeof (struct snapshot_header)) {
+        struct snapshot_header *old = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (old != MAP_FAILED) {
+            generation = old->generation;
+            if (load) {
+                int channels = load_reservations(old, st.st_size);
+                if (channels == -1) {
+                    LOG(LOG_WARNING, "ignoring %s, it is not a usable snapshot", path);
+                } else {
+                    LOG(LOG_INFO, "loaded %ld nicknames and %d channels from %s in %ld ms",
+                            reservation_count, channels, path, now_ms() - start);
+                }
+            }
+            munmap(old, st.st_size);
+        }
+    }
+
+    // emptying the file then growing it leaves every record zero, which is empty
+    size_t size = snapshot_size(MAX_CLIENTS, MAX_CHANNELS);
+    if (ftruncate(fd, 0) == -1 || ftruncate(fd, size) == -1) {
+        close(fd);
+        return -1;
+    }
+    struct snapshot_header *header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd); // the mapping keeps the file
+    if (header == MAP_FAILED) return -1;
+    header->version = SNAPSHOT_VERSION;
+    header->client_slots = MAX_CLIENTS;
+    header->channel_slots = MAX_CHANNELS;
+    header->generation = generation + 1;
+    header->started = time(NULL);
+    __sync_synchronize();
+    header->magic = SNAPSHOT_MAGIC; // last, so a half written header is not taken for one
+    snapshot = header;
+    return 0;
+}
+
+/**
+ * Drop the reservations once their clients have had time to claim them
+ */
+void expire_reservations() {
+    if (reservations == NULL || now_ms() < reservations_expire_ms) return;
+    pthread_rwlock_wrlock(&reservation_index.lock);
+    LOG(LOG_INFO, "%ld reserved nicknames were not claimed", reservation_count);
+    free(reservations);
+    free(reserved_channels);
+    free(reservation_index.hashes);
+    free(reservation_index.ids);
+    reservations = NULL;
+    reserved_channels = NULL;
+    reservation_count = 0;
+    pthread_rwlock_unlock(&reservation_index.lock);
+}
+
+/**
+ * Find the reservation of a nickname, the caller must hold the lock of
+ * reservation_index
+ * @return the reservation or NULL if the nickname is not reserved
+ */
+struct reservation *find_reservation(const char *nickname, int length) {
+    if (reservations == NULL || now_ms() >= reservations_expire_ms) return NULL;
+    int id = name_index_find(&reservation_index, nickname, length, name_hash(nickname, length));
+    return id == -1 ? NULL : &reservations[id];
+}
+
+/**
+ * Check whether a nickname is held for another client to reclaim
+ * @param t, the client wanting the nickname
+ * @param name, the nickname
+ * @return 1 if the nickname is reserved for a client elsewhere, otherwise 0
+ */
+int nickname_reserved(struct client_thread *t, struct line_view name) {
+    if (reservations == NULL) return 0;
+    int length = name.length < SNAPSHOT_NAME_SIZE - 1 ? name.length : SNAPSHOT_NAME_SIZE - 1;
+    pthread_rwlock_rdlock(&reservation_index.lock);
+    struct reservation *r = find_reservation(name.start, length);
+    int reserved = r != NULL && r->address != t->address.s_addr;
+    pthread_rwlock_unlock(&reservation_index.lock);
+    return reserved;
+}
+
+/**
+ * Give a client that has just registered back the channels it was in before
+ * the restart, if its nickname is reserved for it
+ * @param t, the client
+ */
+void claim_reservation(struct client_thread *t) {
+    if (reservations == NULL) return;
+    pthread_rwlock_wrlock(&reservation_index.lock);
+    struct reservation *r = find_reservation(t->nickname, t->nicknamelength);
+    if (r == NULL || r->address != t->address.s_addr) {
+        pthread_rwlock_unlock(&reservation_index.lock);
+        return;
+    }
+    name_index_remove(&reservation_index, r - reservations);
+    // the channel names copied out, as expire_reservations frees them, so
+    // the joins and their replies (which may wait on the client's socket)
+    // are made with the lock let go, the accept loop expiring under it
+    int count = r->channel_count;
+    char names[SNAPSHOT_MAX_JOINED][SNAPSHOT_CHANNEL_NAME_SIZE];
+    int i;
+    for (i = 0; i < count; i++) {
+        memcpy(names[i], reserved_channels[r->channels[i]], SNAPSHOT_CHANNEL_NAME_SIZE);
+    }
+    pthread_rwlock_unlock(&reservation_index.lock);
+    for (i = 0; i < count; i++) {
+        struct line_view name = {names[i], strlen(names[i])};
+        pthread_rwlock_wrlock(&channel_index.lock);
+        int joined = join_channel_locked(t, name);
+        pthread_rwlock_unlock(&channel_index.lock);
+        if (joined >= 0) {
+            struct reply_args args = {.text = name.start, .textlength = name.length};
+            send_reply(t, &reply_join, &args);
+        }
+    }
+}
+
+/**
+ * Move a bot on the unix socket onto a pair of shared memory rings (RING),
+ * after which everything it sends and is sent goes through them
+ * @param t, the client
+ * @return 0 if it was moved or -1 if not
+ */
+int attach_ring(struct client_thread *t) {
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof (addr);
+    if (t->ring != NULL || getsockname(HOT(t)->fd, (struct sockaddr *) &addr, &addr_len) == -1
+            || addr.ss_family != AF_UNIX) {
+        return -1;
+    }
+    // unlinked at once, the bot is given the open file through the socket
+    char path[] = "/tmp/ircringXXXXXX";
+    int fd = mkstemp(path);
+    if (fd == -1) return -1;
+    unlink(path);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    struct ring_region *region = MAP_FAILED;
+    if (ftruncate(fd, ring_region_size()) == 0) {
+        region = mmap(NULL, ring_region_size(), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (region == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    region->magic = RING_MAGIC;
+    region->version = RING_VERSION;
+    region->size = RING_SIZE;
+
+    char line[64];
+    struct reply_args args = {.num = {RING_SIZE}};
+    int length = render_reply(line, sizeof (line), &reply_ring, &args);
+    if (send_with_fd(HOT(t)->fd, line, length, fd) == -1) {
+        munmap(region, ring_region_size());
+        close(fd);
+        return -1;
+    }
+    t->ring = region;
+    t->ring_fd = fd;
+    STAT_ADD(rings_attached, 1);
+    return 0;
+}
+
+/**
+ * Unmap a client's rings, done when it goes away
+ * @param t, the client
+ */
+void detach_ring(struct client_thread *t) {
+    if (t->ring == NULL) return;
+    munmap(t->ring, ring_region_size());
+    close(t->ring_fd);
+    t->ring = NULL;
+}
+
+/**
+ * a measure of what clients cost the server, that TOP ranks them by
+ */
+struct usage_metric {
+    const char *name;
+    size_t offset; // of its counter in struct client_usage
+    long divisor; // to report it in the units of its name
+};
+
+struct usage_metric usage_metrics[] = {
+    {"lines", offsetof(struct client_usage, lines_in), 1},
+    {"bytes_in", offsetof(struct client_usage, bytes_in), 1},
+    {"bytes_out", offsetof(struct client_usage, bytes_out), 1},
+    {"routed", offsetof(struct client_usage, messages_routed), 1},
+    {"queue", offsetof(struct client_usage, queue_high_water), 1},
+    {"cpu_us", offsetof(struct client_usage, handling_ns), 1000},
+};
+
+#define USAGE_METRICS (sizeof (usage_metrics) / sizeof (usage_metrics[0]))
+// the most clients TOP lists for a measure
+#define TOP_MAX 50
+
+/**
+ * a client and its count of a measure, an entry of the heap top_clients
+ * keeps
+ */
+struct top_entry {
+    long value;
+    int id;
+};
+
+/**
+ * Move an entry down the heap until neither of its children is smaller
+ * @param heap, a heap with the smallest value at the top
+ * @param count, the entries in it
+ * @param at, the entry to move
+ */
+void top_sift_down(struct top_entry *heap, int count, int at) {
+    while (1) {
+        int smallest = at;
+        int child = 2 * at + 1;
+        if (child < count && heap[child].value < heap[smallest].value) smallest = child;
+        if (child + 1 < count && heap[child + 1].value < heap[smallest].value) smallest = child + 1;
+        if (smallest == at) return;
+        struct top_entry swap = heap[at];
+        heap[at] = heap[smallest];
+        heap[smallest] = swap;
+        at = smallest;
+    }
+}
+
+/**
+ * Find the clients with the highest counts of a measure, keeping the best
+ * n seen so far in a heap with the least of them at the top, so each client
+ * costs one comparison unless it displaces that one, rather than sorting
+ * every client
+ * @param metric, the measure, an index into usage_metrics
+ * @param top, where to put them, n entries, highest first
+ * @param n, how many to find
+ * @return the number found, fewer than n if fewer clients have any
+ */
+int top_clients(int metric, struct top_entry *top, int n) {
+    int count = 0;
+    int i;
+    for (i = 0; i < MAX_CLIENTS; i++) {
+        if (client_hot[i].mode == 0) continue;
+        long value = *(long *) ((char *) &threads[i].usage + usage_metrics[metric].offset);
+        if (value == 0) continue;
+        if (count < n) {
+            // added at the bottom and moved up past any larger parent
+            int at = count++;
+            while (at > 0 && top[(at - 1) / 2].value > value) {
+                top[at] = top[(at - 1) / 2];
+                at = (at - 1) / 2;
+            }
+            top[at].value = value;
+            top[at].id = i;
+        } else if (value > top[0].value) {
+            top[0].value = value;
+            top[0].id = i;
+            top_sift_down(top, count, 0);
+        }
+    }
+    // take the least off the top in turn, filling in from the end
+    for (i = count - 1; i > 0; i--) {
+        struct top_entry least = top[0];
+        top[0] = top[i];
+        top[i] = least;
+        top_sift_down(top, i, 0);
+    }
+    return count;
+}
+
+/**
+ * Send a client the clients costing the server the most
+ * @param t, the client asking
+ * @param metric, the measure to rank them by, or -1 for each in turn
+ * @param n, how many of them for each measure
+ */
+void send_top(struct client_thread *t, int metric, int n) {
+    struct top_entry top[TOP_MAX];
+    struct reply_batch rb;
+    rb.t = t;
+    rb.length = 0;
+    int m;
+    for (m = 0; m < USAGE_METRICS; m++) {
+        if (metric != -1 && m != metric) continue;
+        int found = top_clients(m, top, n);
+        int i;
+        for (i = 0; i < found; i++) {
+            struct client_thread *ct = &threads[top[i].id];
+            struct reply_args args = {.text = usage_metrics[m].name,
+                .textlength = strlen(usage_metrics[m].name),
+                .target = ct->nickname, .targetlength = ct->nicknamelength,
+                .num = {i + 1, top[i].value / usage_metrics[m].divisor}};
+            reply_batch_add(&rb, &reply_top, &args);
+        }
+    }
+    reply_batch_flush(&rb);
+}
+
+/**
+ * Answer TOP, for an operator
+ * @param t, the client asking
+ * @param cmd, of form TOP [measure|*] [count]
+ */
+void top_command(struct client_thread *t, struct command *cmd) {
+    int metric = -1;
+    if (cmd->param.length && !(cmd->param.length == 1 && cmd->param.start[0] == '*')) {
+        for (metric = 0; metric < USAGE_METRICS; metric++) {
+            const char *name = usage_metrics[metric].name;
+            if (strlen(name) == cmd->param.length
+                    && strncasecmp(name, cmd->param.start, cmd->param.length) == 0) break;
+        }
+        if (metric == USAGE_METRICS) {
+            struct reply_args args = {.text = cmd->param.start, .textlength = cmd->param.length};
+            send_reply(t, &reply_top_unknown, &args);
+            return;
+        }
+    }
+    int n = 0;
+    int i;
+    for (i = 0; i < cmd->trailing.length && isdigit((unsigned char) cmd->trailing.start[i]); i++) {
+        n = n * 10 + cmd->trailing.start[i] - '0';
+        if (n > TOP_MAX) break;
+    }
+    if (n < 1) n = 10;
+    if (n > TOP_MAX) n = TOP_MAX;
+    send_top(t, metric, n);
+    send_reply(t, &reply_top_end, NULL);
+}
+
+/**
+ * a line of the STATS report
+ */
+struct stat_line {
+    const char *name;
+    long *value;
+};
+
+/**
+ * Send the server's counters to a client, one line each
+ * @param t, the client asking
+ */
+void send_stats(struct client_thread *t) {
+    // the clients' smoothed round trip times, read racily as they are only
+    // reported
+    long rtt_clients = 0;
+    long rtt_total_us = 0;
+    long rtt_max_us = 0;
+    int i;
+    for (i = 0; i < MAX_CLIENTS; i++) {
+        long rtt = client_hot[i].mode == 3 ? threads[i].rtt_us : 0;
+        if (rtt == 0) continue;
+        rtt_clients++;
+        rtt_total_us += rtt;
+        if (rtt > rtt_max_us) rtt_max_us = rtt;
+    }
+    long rtt_mean_us = rtt_clients ? rtt_total_us / rtt_clients : 0;
+    struct stat_line lines[] = {
+        {"connections accepted", &stats.connections_accepted},
+        {"connections rejected, server full", &stats.rejected_full},
+        {"connections rejected, too many from one address", &stats.rejected_address_cap},
+        {"connections rejected, address reconnecting too fast", &stats.rejected_accept_rate},
+        {"clients throttled for sending commands too fast", &stats.commands_throttled},
+        {"idle addresses expired from the admission table", &stats.admission_expired},
+        {"addresses admitted unchecked, admission table full", &stats.admission_untracked},
+        {"bots attached through shared memory rings", &stats.rings_attached},
+        {"event loop turns", &stats.loop_turns},
+        {"event loop time serving connections in us", &stats.loop_busy_us},
+        {"longest event loop turn in us", &stats.loop_turn_max_us},
+        {"event loop turns over 1 ms", &stats.loop_turns_over_1ms},
+        {"turns a client used up its line budget", &stats.line_budgets_used},
+        {"reads that used up a client's byte budget", &stats.byte_budgets_used},
+        {"load being shed, 0 none to 3 the heaviest senders", &shed_level},
+        {"worst lag in the last 100 ms in ms", &overload_lag_now_ms},
+        {"times more load was shed", &stats.shed_raised},
+        {"times less load was shed", &stats.shed_lowered},
+        {"registrations refused while shedding load", &stats.registrations_refused},
+        {"clients throttled as the heaviest senders", &stats.senders_shed},
+        {"presence queries (ISON, WHOIS, WHO)", &stats.presence_queries},
+        {"nicknames looked up by presence queries", &stats.presence_lookups},
+        {"LIST commands answered", &stats.lists},
+        {"pages of channels sent for LIST", &stats.list_pages},
+        {"lines captured", &stats.lines_captured},
+        {"capture records lost to a full log ring", &stats.capture_dropped},
+        {"messages posted to another event loop", &stats.mail_posted},
+        {"times a loop waited for a full mailbox", &stats.mail_full},
+        {"messages dropped for clients that could not keep up", &stats.messages_dropped},
+        {"nickname lookups that raced a change", &stats.lookup_retries},
+        {"epoch advances", &stats.epoch_advances},
+        {"client ids retired", &stats.ids_retired},
+        {"client ids reclaimed", &stats.ids_reclaimed},
+        {"pings sent", &stats.pings_sent},
+        {"pings answered", &stats.pings_answered},
+        {"pings not answered in time", &stats.pings_unanswered},
+        {"clients dropped for not answering a ping", &stats.ping_timeouts},
+        {"pings answered in under 100 us", &stats.rtt_histogram[0]},
+        {"pings answered in under 250 us", &stats.rtt_histogram[1]},
+        {"pings answered in under 500 us", &stats.rtt_histogram[2]},
+        {"pings answered in under 1 ms", &stats.rtt_histogram[3]},
+        {"pings answered in under 2.5 ms", &stats.rtt_histogram[4]},
+        {"pings answered in under 5 ms", &stats.rtt_histogram[5]},
+        {"pings answered in under 10 ms", &stats.rtt_histogram[6]},
+        {"pings answered in under 25 ms", &stats.rtt_histogram[7]},
+        {"pings answered in under 50 ms", &stats.rtt_histogram[8]},
+        {"pings answered in under 100 ms", &stats.rtt_histogram[9]},
+        {"pings answered in under 250 ms", &stats.rtt_histogram[10]},
+        {"pings answered in under 500 ms", &stats.rtt_histogram[11]},
+        {"pings answered in under 1 s", &stats.rtt_histogram[12]},
+        {"pings answered in 1 s or more", &stats.rtt_histogram[13]},
+        {"clients with a smoothed rtt", &rtt_clients},
+        {"their mean smoothed rtt in us", &rtt_mean_us},
+        {"the highest smoothed rtt of a client in us", &rtt_max_us},
+        {"server links up", &links_up},
+        {"nicknames registered on linked servers", &remote_nick_count},
+        {"messages passed to linked servers", &stats.link_messages_out},
+        {"messages passed from linked servers", &stats.link_messages_in},
+        {"messages from linked servers for nobody here", &stats.link_messages_undeliverable},
+        {"writes to linked servers", &stats.link_writes},
+        {"bytes of records for linked servers", &stats.link_bytes_records},
+        {"bytes written to linked servers", &stats.link_bytes_written},
+        {"records dropped, linked server too far behind", &stats.link_frames_dropped},
+        {"standby following", &standby_following},
+        {"writes of registry changes to the standby", &stats.replication_batches},
+        {"bytes of registry changes written to the standby", &stats.replication_bytes},
+        {"registry changes the standby has not yet applied", &replication_lag_changes},
+        {"replication lag in ms", &replication_lag_ms},
+        {"log lines dropped, staging ring full", &log_dropped},
+        {"log lines not logged as one of many alike", &log_suppressed},
+        {"bytes held per idle connection", &idle_connection_bytes},
+        {"clients hibernating, their threads let go", &clients_hibernating},
+        {"times a client thread was let go while idle", &stats.hibernations},
+        {"times a hibernating client's thread was started again", &stats.hibernation_wakeups},
+        {"nicknames reserved from the snapshot", &reservation_count},
+        {"input buffers lent to clients", &input_pool.in_use},
+        {"input buffers free", &input_pool.free_count},
+        {"output queues lent to clients", &out_queue_pool.in_use},
+        {"output queues free", &out_queue_pool.free_count},
+    };
+    for (i = 0; i < sizeof (lines) / sizeof (lines[0]); i++) {
+        struct reply_args args = {.text = lines[i].name, .textlength = strlen(lines[i].name),
+            .num = {*lines[i].value}};
+        send_reply(t, &reply_stat, &args);
+    }
+    // and to an operator, the client responsible for the most of each
+    if (t->is_operator) send_top(t, -1, 1);
+    send_reply(t, &reply_stats_end, NULL);
+}
+
+/**
+ * Take a PONG, measuring the round trip if it answers our PING
+ * @param t, the client it came from
+ * @param token, what it carried
+ */
+void pong_received(struct client_thread *t, struct line_view token) {
+    if (t->ping_sent_us == 0) return; // unprompted, a keep alive only
+    long sent = 0;
+    int i;
+    for (i = 0; i < token.length && i < 20 && isdigit((unsigned char) token.start[i]); i++) {
+        sent = sent * 10 + token.start[i] - '0';
+    }
+    if (i == 0 || i != token.length || sent != t->ping_sent_us) return; // not ours, or an old one
+    long rtt = now_us() - sent;
+    t->ping_sent_us = 0;
+    // smoothed as TCP does, each sample counting an eighth
+    t->rtt_us = t->rtt_us ? t->rtt_us + (rtt - t->rtt_us) / 8 : rtt;
+    int bucket;
+    for (bucket = 0; bucket < RTT_BUCKETS - 1 && rtt >= rtt_bucket_us[bucket]; bucket++);
+    STAT_ADD(pings_answered, 1);
+    STAT_ADD(rtt_histogram[bucket], 1);
+    if (t->rtt_us > RTT_SLOW_US) {
+        LOG(LOG_WARNING, "%s is slow, its smoothed round trip time is %ld ms", t->nickname, t->rtt_us / 1000);
+    }
+}
+
+/**
+ * @return when the client next needs looking at: it times out, is due a
+ *  PING, or has not answered one in time
+ */
+long client_deadline(struct client_thread *t) {
+    long deadline = t->last_input_ms + t->timeout * 1000;
+    if (HOT(t)->mode != 3 || ping_interval_ms == 0) return deadline;
+    if (t->ping_next_ms == 0) t->ping_next_ms = now_ms() + ping_interval_ms; // just registered
+    long ping = t->ping_sent_us ? t->ping_sent_us / 1000 + PING_TIMEOUT_MS : t->ping_next_ms;
+    return ping < deadline ? ping : deadline;
+}
+
+/**
+ * Do what is due once a client's deadline has passed
+ * @param t, the client
+ * @return 1 if it has timed out, otherwise 0
+ */
+int client_deadline_passed(struct client_thread *t) {
+    long now = now_ms();
+    if (now >= t->last_input_ms + t->timeout * 1000) return 1;
+    if (HOT(t)->mode != 3 || ping_interval_ms == 0) return 0;
+    if (t->ping_sent_us && now >= t->ping_sent_us / 1000 + PING_TIMEOUT_MS) {
+        STAT_ADD(pings_unanswered, 1);
+        // a client that has sent nothing at all since is gone, one that has
+        // just does not answer PINGs
+        if (t->last_input_ms < t->ping_sent_us / 1000) {
+            STAT_ADD(ping_timeouts, 1);
+            return 1;
+        }
+        t->ping_sent_us = 0;
+    }
+    if (t->ping_sent_us == 0 && now >= t->ping_next_ms) {
+        t->ping_sent_us = now_us();
+        t->ping_next_ms = now + ping_interval_ms;
+        struct reply_args args = {.num = {t->ping_sent_us}};
+        send_reply(t, &reply_ping, &args);
+        STAT_ADD(pings_sent, 1);
+    }
+    return 0;
+}
+
+/**
+ * Handle one command line from a client
+ * @param t, the client the line came from
+ * @param line, the line without its line ending
+ * @return 1 if the connection should now be closed otherwise 0
+ */
+int process_line(struct client_thread* t, struct line_view line) {
+    struct command cmd;
+    parse_command(line, &cmd);
+
+    if (VERB_IS(&cmd, "QUIT")) {
+        // client has said they are going away
+        // needed to avoid SIGPIPE and the program will be killed on socket read
+        send_reply(t, &reply_quit, NULL);
+        return 1;
+    } else if (VERB_IS(&cmd, "PONG")) {
+        // a keep alive, and the answer to our PING if it carries its token
+        pong_received(t, cmd.trailing.length ? cmd.trailing : cmd.param);
+    } else if (VERB_IS(&cmd, "JOIN")) {
+        if (HOT(t)->mode == 3) {
+            // of form JOIN #twilight_zone,#other_zone
+            join_or_part(t, cmd.param, 1);
+        } else {
+            send_reply(t, &reply_join_unregistered, NULL);
+        }
+    } else if (VERB_IS(&cmd, "PART")) {
+        if (HOT(t)->mode == 3) {
+            join_or_part(t, cmd.param, 0);
+        } else {
+            struct reply_args args = {.text = "PART", .textlength = 4};
+            send_reply(t, &reply_not_registered, &args);
+        }
+    } else if (VERB_IS(&cmd, "PRIVMSG")) {
+        if (HOT(t)->mode == 3) {
+            // of form PRIVMSG nickname,#channel,... :message
+            route_privmsg(t, &cmd);
+        } else { // not a registered user
+            send_reply(t, &reply_privmsg_unregistered, NULL);
+        }
+    } else if (VERB_IS(&cmd, "NICK") && nickname_reserved(t, cmd.param)) {
+        // held for the client that had it before the restart
+        struct reply_args args = {.text = cmd.param.start, .textlength = cmd.param.length};
+        send_reply(t, &reply_nick_reserved, &args);
+    } else if (VERB_IS(&cmd, "NICK") && find_remote_nick(cmd.param.start, cmd.param.length,
+            name_hash(cmd.param.start, cmd.param.length)) != -1) {
+        struct reply_args args = {.text = cmd.param.start, .textlength = cmd.param.length};
+        send_reply(t, &reply_nick_remote, &args);
+    } else if (VERB_IS(&cmd, "NICK") && nickname_in_use(t, cmd.param)) {
+        struct reply_args args = {.text = cmd.param.start, .textlength = cmd.param.length};
+        send_reply(t, &reply_nick_in_use, &args);
+    } else if (VERB_IS(&cmd, "NICK")) {
+        if (HOT(t)->mode == 3) {
+            // registering again under the new nickname, so stop the old one
+            // being found and any messages queued under it
+            part_all_channels(t);
+            unregister_nickname(t);
+        }
+        HOT(t)->mode = 2;
+        t->timeout = NICK_TIMEOUT;
+        // copy the nickname off the buffer to the client_thread struct
+        t->nicknamelength = copy_name(t->nickname, sizeof (t->nickname), cmd.param);
+    } else if (VERB_IS(&cmd, "USER") && HOT(t)->mode == 2 && shed_level >= SHED_REGISTRATIONS) {
+        // left with its nickname given, so it can send USER again later
+        STAT_ADD(registrations_refused, 1);
+        send_reply(t, &reply_try_again, NULL);
+    } else if (VERB_IS(&cmd, "USER")) {
+        if (HOT(t)->mode == 2) {
+            HOT(t)->mode = 3;
+            t->timeout = REG_TIMEOUT;
+            // @todo check username in unique ... add to list
+            // copy the username off the buffer to the client_thread struct
+            t->usernamelength = copy_name(t->username, sizeof (t->username),
+                    cmd.param.length ? cmd.param : cmd.trailing);
+            if (register_nickname(t) == -1) {
+                // taken by another client since its NICK, it must choose again
+                HOT(t)->mode = 1;
+                t->timeout = NICK_TIMEOUT;
+                struct reply_args args = {.text = t->nickname, .textlength = t->nicknamelength};
+                send_reply(t, &reply_nick_in_use, &args);
+            } else {
+                //send welcome messages
+                struct reply_args args = {.num =
+                    {reg_users, aval_thread_stack_size, MAX_CLIENTS}};
+                send_reply(t, &reply_welcome, &args);
+                claim_reservation(t);
+            }
+        } else if (HOT(t)->mode == 1) { // password set but not nickname
+            send_reply(t, &reply_user_before_nick, NULL);
+        } else if (HOT(t)->mode == 0) { // password set but not nickname
+            send_reply(t, &reply_user_before_pass, NULL);
+        }
+    } else if (VERB_IS(&cmd, "OPER")) {
+        // of form OPER name password, the name is not checked as there is
+        // only the one operator password
+        if (HOT(t)->mode != 3) {
+            struct reply_args args = {.text = "OPER", .textlength = 4};
+            send_reply(t, &reply_not_registered, &args);
+        } else if (operator_password != NULL
+                && cmd.trailing.length == strlen(operator_password)
+                && memcmp(cmd.trailing.start, operator_password, cmd.trailing.length) == 0) {
+            t->is_operator = 1;
+            send_reply(t, &reply_oper_ok, NULL);
+        } else {
+            send_reply(t, &reply_oper_bad, NULL);
+        }
+    } else if (VERB_IS(&cmd, "WALLOPS")) {
+        // of form WALLOPS :message, a notice to every registered client
+        if (HOT(t)->mode != 3) {
+            struct reply_args args = {.text = "WALLOPS", .textlength = 7};
+            send_reply(t, &reply_not_registered, &args);
+        } else if (!t->is_operator) {
+            send_reply(t, &reply_not_operator, NULL);
+        } else {
+            struct line_view text = cmd.trailing.length ? cmd.trailing : cmd.param;
+            struct reply_args args = {.text = text.start, .textlength = text.length};
+            struct outbuf *b = outbuf_new(1024);
+            if (b != NULL) {
+                b->refs = 1;
+                b->length = render_reply(b->data, 1024, &reply_notice_all, &args);
+                int skipped;
+                long micros;
+                int delivered = broadcast_message(b, &skipped, &micros);
+                outbuf_release(b);
+                LOG(LOG_INFO, "broadcast to %d clients in %ld microseconds, %d skipped", delivered, micros, skipped);
+                struct reply_args report = {.num = {delivered, micros, skipped}};
+                send_reply(t, &reply_broadcast_done, &report);
+            }
+        }
+    } else if (VERB_IS(&cmd, "RING")) {
+        // of form RING, from a bot on the unix socket wanting shared memory
+        if (attach_ring(t) == -1) send_reply(t, &reply_ring_refused, NULL);
+    } else if (VERB_IS(&cmd, "STATS")) {
+        if (HOT(t)->mode != 3) {
+            struct reply_args args = {.text = "STATS", .textlength = 5};
+            send_reply(t, &reply_not_registered, &args);
+        } else {
+            send_stats(t);
+        }
+    } else if (VERB_IS(&cmd, "TOP")) {
+        // of form TOP [measure] [count], the clients costing the most
+        if (HOT(t)->mode != 3) {
+            struct reply_args args = {.text = "TOP", .textlength = 3};
+            send_reply(t, &reply_not_registered, &args);
+        } else if (!t->is_operator) {
+            send_reply(t, &reply_not_operator, NULL);
+        } else {
+            top_command(t, &cmd);
+        }
+    } else if (VERB_IS(&cmd, "ISON") || VERB_IS(&cmd, "WHOIS") || VERB_IS(&cmd, "WHO")) {
+        if (HOT(t)->mode != 3) {
+            struct reply_args args = {.text = cmd.verb.start, .textlength = cmd.verb.length};
+            send_reply(t, &reply_not_registered, &args);
+        } else if (VERB_IS(&cmd, "ISON")) {
+            // of form ISON nick nick nick ..., those online are echoed back,
+            // taken from the whole line as parse_command keeps only the
+            // first parameter
+            int skip = cmd.verb.length < line.length ? cmd.verb.length + 1 : line.length;
+            struct line_view list = {line.start + skip, line.length - skip};
+            send_ison(t, list);
+        } else if (VERB_IS(&cmd, "WHOIS")) {
+            // of form WHOIS nick,nick,...
+            send_whois(t, cmd.param);
+        } else {
+            // of form WHO #channel or WHO nick,nick,...
+            send_who(t, cmd.param);
+        }
+    } else if (VERB_IS(&cmd, "LIST")) {
+        if (HOT(t)->mode != 3) {
+            struct reply_args args = {.text = cmd.verb.start, .textlength = cmd.verb.length};
+            send_reply(t, &reply_not_registered, &args);
+        } else {
+            // of form LIST [#channel,#prefix*,>users,...]
+            list_start(t, cmd.param);
+        }
+    } else if (VERB_IS(&cmd, "PASS")) {
+        if (HOT(t)->mode == 0) {
+            HOT(t)->mode++;
+            t->timeout = 30;
+            // there is no password ... continue
+        }
+        // already logged in ... do nothing
+    } else {
+        LOG(LOG_DEBUG, "some other message received: %.*s", line.length, line.start);
+        //@todo handle unknown message
+    }
+    return 0;
+}
+
+// how often a waiting client thread looks for messages queued to it, in case
+// a WAKE_SIGNAL arrived just before it started waiting and was missed
+#define MESSAGE_POLL_MS 100
+
+/**
+ * The WAKE_SIGNAL handler, it only has to interrupt the poll
+ */
+void wake_client(int sig) {
+}
+
+/**
+ * Wait until a client sends something, has messages queued to it or times out
+ * @param t, the client to wait for
+ * @return 1 if there is input, 0 if there are messages or a page of a LIST
+ *  to send, -1 if the client has timed out, -2 if the server is being
+ *  upgraded or -3 if the client has been idle long enough to hibernate
+ */
+int wait_for_input(struct client_thread *t) {
+    while (1) {
+        if (upgrading) return -2;
+        // messages waiting on a full socket wait for room (out_blocked)
+        if (t->has_next_message && !t->out_blocked) return 0;
+        // a bot on a ring is sent a page of a LIST each time round, the
+        // ring holding it up while it is full
+        if (t->listing != NULL && t->ring != NULL) return 0;
+        if (t->unfinished) return 1; // lines handed over from the old server
+        long left = HOT(t)->deadline_ms - now_ms();
+        if (left <= 0) return -1;
+        // a bot on a ring is left its thread, it is woken through the ring
+        if (hibernate_after_ms && HOT(t)->mode == 3 && t->ring == NULL && t->listing == NULL
+                && t->in == NULL && !t->out_blocked && now_ms() - t->busy_ms >= hibernate_after_ms) return -3;
+        // a bot on a ring wakes us through its socket, but only once told
+        // we are going to sleep
+        if (t->ring != NULL && ring_prepare_wait(&t->ring->to_server)) return 1;
+        struct pollfd p[2] = {
+            {HOT(t)->fd, t->listing != NULL || t->out_blocked ? POLLIN | POLLOUT : POLLIN, 0},
+            {upgrade_wakeup[0], POLLIN, 0}
+        };
+        int r = poll(p, 2, left < MESSAGE_POLL_MS ? left : MESSAGE_POLL_MS);
+        if (t->ring != NULL) ring_end_wait(&t->ring->to_server);
+        // what is waiting goes before any more input is answered
+        if (r > 0 && (p[0].revents & POLLOUT) && t->out_blocked) {
+            t->out_blocked = 0;
+            return 0;
+        }
+        if (r > 0 && (p[0].revents & ~POLLOUT)) return 1;
+        if (r > 0 && p[0].revents) return 0; // room for the next page of a LIST
+        if (r == -1 && errno != EINTR) return -1;
+    }
+}
+
+/**
+ * Set up a new connection and greet the client
+ * @param t, the client
+ */
+void connection_start(struct client_thread *t) {
+    snprintf(t->nickname, sizeof (t->nickname), "*");
+    snprintf(t->username, sizeof (t->username), "*");
+    t->nicknamelength = 1;
+    t->usernamelength = 1;
+    HOT(t)->mode = 1; // make sure the mode (is set to unregistered  NICK or USER) ... pass is ignored ... so 1
+    t->timeout = 5; // give 5 seconds to live
+    t->last_input_ms = now_ms();
+    bzero(&t->usage, sizeof (t->usage));
+
+    // reads must never block, a read only happens once poll says there is
+    // input but the client might be gone again by the time it is read
+    fcntl(HOT(t)->fd, F_SETFL, fcntl(HOT(t)->fd, F_GETFL, NULL) | O_NONBLOCK);
+
+    if (capture_fd != -1) capture(t, CAPTURE_OPEN, NULL, 0);
+    send_reply(t, &reply_hello, NULL); // greet the client
+}
+
+/**
+ * Read what a client has sent and handle the commands in it, within a
+ * budget so that a thread serving many clients is not held up by one
+ * pipelining a flood of commands while the others wait.  Lines left over
+ * when the budget runs out (t->unfinished) are handled before the next read.
+ * @param t, the client, with input waiting or lines left from before
+ * @param line_budget, the most commands to handle
+ * @param byte_budget, the most bytes to read
+ * @return 1 if the connection has been closed, -1 if there was no memory
+ *  to read into or 0 otherwise
+ */
+int serve_input(struct client_thread *t, int line_budget, int byte_budget) {
+    int fd = HOT(t)->fd;
+    // borrow an input buffer only now there is something to put in it
+    if (t->in == NULL) {
+        t->in = pool_get(&input_pool);
+        if (t->in == NULL) return -1; // out of memory, leave the input until there is some
+        t->in->length = 0;
+    }
+    if (!t->unfinished) {
+        int room = IO_BUFFER_SIZE - t->in->length;
+        if (room > byte_budget) room = byte_budget;
+        int n;
+        if (t->ring != NULL) {
+            // the socket of a bot on a ring carries only wakeups, and its
+            // closing, the commands themselves come through the ring
+            n = ring_drain(fd);
+            if (n == 0) {
+                n = ring_read(t->ring, &t->ring->to_server, t->in->data + t->in->length, room);
+                if (n == 0) { // woken with nothing new, as for a socket
+                    n = -1;
+                    errno = EAGAIN;
+                }
+            } else {
+                n = 0;
+            }
+        } else {
+            n = read(fd, t->in->data + t->in->length, room);
+        }
+        if (n == 0 || (n == -1 && errno != EAGAIN && errno != EINTR)) {
+            // the client has gone away without a QUIT
+            close(fd);
+            return 1;
+        }
+        if (n > 0) {
+            t->in->length += n;
+            t->usage.bytes_in += n;
+            t->last_input_ms = now_ms();
+            if (n == byte_budget && byte_budget < IO_BUFFER_SIZE) STAT_ADD(byte_budgets_used, 1);
+        }
+    }
+    t->unfinished = 0;
+
+    // a client may pipeline many commands into one read, so split
+    // everything read into lines in one pass and handle each in turn
+    struct line_view lines[MAX_LINES_PER_READ];
+    int consumed;
+    int count;
+    int max;
+    // read once for the whole turn, the clock costs a system call on some
+    // systems and a turn is usually a line or two
+    long cpu_start_ns = thread_cpu_ns();
+    do {
+        max = line_budget < MAX_LINES_PER_READ ? line_budget : MAX_LINES_PER_READ;
+        count = split_lines((char*) t->in->data, t->in->length, lines, max, &consumed);
+        int i;
+        for (i = 0; i < count; i++) {
+            if (throttle_commands(t, loop_count == 0) == -1) {
+                // left for a later turn, from this line on
+                consumed = lines[i].start - (char *) t->in->data;
+                t->unfinished = 1;
+                break;
+            }
+            t->commands_recent++;
+            t->usage.lines_in++;
+            if (capture_fd != -1) capture(t, CAPTURE_LINE, lines[i].start, lines[i].length);
+            if (process_line(t, lines[i])) {
+                close(fd);
+                return 1;
+            }
+        }
+        // keep any partial line to be completed by the next read
+        memmove(t->in->data, t->in->data + consumed, t->in->length - consumed);
+        t->in->length -= consumed;
+        line_budget -= count;
+    } while (count == max && line_budget > 0 && !t->unfinished);
+    t->usage.handling_ns += thread_cpu_ns() - cpu_start_ns;
+    if (count == max && line_budget == 0) {
+        // there may be more, the other clients have their turn first
+        t->unfinished = 1;
+        STAT_ADD(line_budgets_used, 1);
+    }
+
+    if (t->in->length == IO_BUFFER_SIZE && !t->unfinished) {
+        // a line that fills the whole buffer can never be completed,
+        // drop it rather than stop reading from the client altogether
+        t->in->length = 0;
+    }
+    if (t->in->length == 0) { // nothing in flight, hand the buffer back
+        pool_put(&input_pool, t->in);
+        t->in = NULL;
+    }
+    return 0;
+}
+
+/**
+ * Let go of an idle client's thread, leaving its socket to hibernate_main,
+ * unless a message has been queued to it since it last looked
+ * @param t, the client, whose thread is the caller
+ * @return 1 if it has hibernated, the caller must then leave the client be,
+ *  otherwise 0
+ */
+int hibernate(struct client_thread *t) {
+    int id = t->thread_id;
+    // under the shard lock, so a message queued from here on finds it
+    // hibernating and tells hibernate_main rather than signal this thread
+    struct shard *sh = SHARD_OF(t);
+    pthread_mutex_lock(&sh->lock);
+    int idle = !t->has_next_message;
+    if (idle) t->state = HIBERNATING;
+    pthread_mutex_unlock(&sh->lock);
+    if (idle) {
+        STAT_ADD(hibernations, 1);
+        write(hibernate_pipe[1], &id, sizeof (id));
+    }
+    return idle;
+}
+
+/**
+ * Handle the client thread connections request messages and responses 
+ * @param t the client thread structure to handle
+ * @return 0 the close of a connection, 1 if the connection was parked, still
+ *  open, for the server to be upgraded or 2 if it has hibernated
+ */
+int connection_main(struct client_thread* t) {
+    int fd = HOT(t)->fd;
+
+    // a connection carried on from before an upgrade (or a failed one) is
+    // already set up and greeted
+    if (HOT(t)->mode == 0) {
+        connection_start(t);
+    }
+
+    // a client woken from hibernating keeps its thread a while, so one sent
+    // a steady trickle of messages does not start a thread for each
+    t->busy_ms = now_ms();
+    while (1) {
+        HOT(t)->deadline_ms = client_deadline(t);
+        int r = wait_for_input(t);
+        if (r == -2) {
+            return 1; // leave the connection open, it is being handed over
+        } else if (r == -3) {
+            if (hibernate(t)) return 2;
+            continue; // a message came, it is sent next time round
+        } else if (r == 0) {
+            t->busy_ms = now_ms();
+            if (t->has_next_message) flush_messages(t, fd);
+            if (t->listing != NULL && !t->out_blocked) list_continue(t);
+            continue;
+        } else if (r == -1 && !client_deadline_passed(t)) {
+            continue; // sent a PING
+        } else if (r == -1) { // nothing read for too long
+            send_reply(t, &reply_timeout, NULL);
+            close(fd);
+            return 0;
+        }
+
+        // with a thread of its own a client has no one to share with
+        t->busy_ms = now_ms();
+        r = serve_input(t, INT_MAX, IO_BUFFER_SIZE);
+        if (r == 1) {
+            return 0;
+        } else if (r == -1) {
+            usleep(MESSAGE_POLL_MS * 1000);
+        }
+    }
+}
+
+/**
+ * Let go of everything a closed connection held and free its id
+ * @param t, the client, whose socket has been closed
+ */
+void connection_closed(struct client_thread *t) {
+    t->state = DEAD; // mark it as dead ? ... doesn't really matter   
+    // stop messages being queued to the client and free any still waiting,
+    // under the shard lock so no thread is part way through queueing one
+    struct shard *sh = SHARD_OF(t);
+    if (HOT(t)->mode == 3) {
+        // channels first, as leaving one rewrites the client's snapshot record
+        part_all_channels(t);
+        unregister_nickname(t);
+    }
+    pthread_mutex_lock(&sh->lock);
+    HOT(t)->mode = 0;
+    pthread_mutex_unlock(&sh->lock);
+    flush_messages(t, -1);
+    list_end(t);
+    if (capture_fd != -1) capture(t, CAPTURE_CLOSE, NULL, 0);
+    if (t->in != NULL) { // a partial line was left when the client went
+        pool_put(&input_pool, t->in);
+        t->in = NULL;
+    }
+    detach_ring(t);
+    if (t->limited) admission_release(t->address);
+    // the thread id goes back onto the available thread ids stack once no
+    // sender can still be holding it
+    epoch_retire(t->thread_id);
+}
+
+/**
+ * The entry point on the creation of a client thread
+ * @param arg, the client thread structure
+ * @return null on exit of the thread
+ */
+void* client_thread_entry(void * arg) {
+    struct client_thread *t = arg;
+
+    t->state = ALIVE; // mark it as alive ? ... doesn't really matter 
+    int r = connection_main(t); // interact with the thread
+    if (r == 2) {
+        // hibernating, hibernate_main may already have started it again
+        return NULL;
+    } else if (r == 1) {
+        // parked for an upgrade, everything is left as it is to be handed over
+        t->state = PARKED;
+        __sync_fetch_and_add(&parked_clients, 1);
+        return NULL;
+    }
+    connection_closed(t);
+    return NULL;
+}
+
+/**
+ * Start the thread that looks after a client
+ * @param thread_id, the client's id
+ * @return 0 if the thread started, otherwise the pthread_create error
+ */
+int start_client_thread(int thread_id) {
+    //create the thread, detached as nothing waits for it to finish and an
+    // unjoined thread keeps its stack until the process exits
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int r = pthread_create(&threads[thread_id].thread, &attr,
+            client_thread_entry, &threads[thread_id]);
+    pthread_attr_destroy(&attr);
+    return r;
+}
+
+/**
+ * Start a hibernating client's thread again, or leave it hibernating for
+ * the next try if there is no thread to be had
+ * @param id, the client's id
+ * @return 0 if its thread started, otherwise -1
+ */
+int hibernation_wake(int id) {
+    int r = start_client_thread(id);
+    if (r != 0) {
+        LOG(LOG_ERROR, "could not start a client thread: %s", strerror(r));
+        return -1;
+    }
+    STAT_ADD(hibernation_wakeups, 1);
+    return 0;
+}
+
+/**
+ * Watch the sockets of the hibernating clients, starting a client's thread
+ * again once it sends something, is sent a message or its deadline comes
+ * round, so an idle client holds no thread and no stack
+ * @param arg, unused
+ * @return never returns
+ */
+void *hibernate_main(void *arg) {
+    // the hibernating clients, then the pipes and the upgrade wakeup
+    static int ids[MAX_CLIENTS];
+    static char watched[MAX_CLIENTS];
+    static struct pollfd polls[MAX_CLIENTS + 3];
+    int count = 0;
+    while (1) {
+        int got[256];
+        int n = read(hibernate_pipe[0], got, sizeof (got));
+        int i;
+        for (i = 0; i < n / (int) sizeof (int); i++) {
+            if (!watched[got[i]]) {
+                watched[got[i]] = 1;
+                ids[count++] = got[i];
+            }
+        }
+        // one sent a message is looked at below anyway
+        __atomic_store_n(&hibernate_poked, 0, __ATOMIC_SEQ_CST);
+        ring_drain(hibernate_wakeup[0]);
+        if (upgrading) {
+            // parked for the new server as the clients' threads park, and
+            // started again by start_client if the upgrade fails
+            for (i = 0; i < count; i++) {
+                watched[ids[i]] = 0;
+                threads[ids[i]].state = PARKED;
+                __sync_fetch_and_add(&parked_clients, 1);
+            }
+            count = 0;
+            clients_hibernating = 0;
+            usleep(1000);
+            continue;
+        }
+
+        long now = now_ms();
+        long wake_ms = now + MESSAGE_POLL_MS * 10;
+        int kept = 0;
+        int failed = 0;
+        for (i = 0; i < count; i++) {
+            struct client_thread *t = &threads[ids[i]];
+            if (t->has_next_message || HOT(t)->deadline_ms <= now) {
+                watched[ids[i]] = 0;
+                if (hibernation_wake(ids[i]) == 0) continue;
+                watched[ids[i]] = 1;
+                failed = 1;
+            }
+            if (HOT(t)->deadline_ms < wake_ms) wake_ms = HOT(t)->deadline_ms;
+            polls[kept].fd = HOT(t)->fd;
+            polls[kept].events = POLLIN;
+            ids[kept++] = ids[i];
+        }
+        count = kept;
+        clients_hibernating = count;
+        // out of threads for now, wait for some of those ending to go
+        if (failed) usleep(MESSAGE_POLL_MS * 1000);
+        polls[count].fd = hibernate_pipe[0];
+        polls[count].events = POLLIN;
+        polls[count + 1].fd = hibernate_wakeup[0];
+        polls[count + 1].events = POLLIN;
+        polls[count + 2].fd = upgrade_wakeup[0];
+        polls[count + 2].events = POLLIN;
+        if (poll(polls, count + 3, wake_ms > now ? wake_ms - now : 0) <= 0) continue;
+        kept = 0;
+        for (i = 0; i < count; i++) {
+            if (polls[i].revents) {
+                watched[ids[i]] = 0;
+                if (hibernation_wake(ids[i]) == 0) continue;
+                watched[ids[i]] = 1;
+            }
+            polls[kept] = polls[i];
+            ids[kept++] = ids[i];
+        }
+        count = kept;
+        clients_hibernating = count;
+    }
+    return NULL;
+}
+
+/**
+ * Start the thread that watches hibernating clients
+ * @return 0 if it started, otherwise -1
+ */
+int start_hibernation() {
+    if (pipe(hibernate_pipe) == -1 || pipe(hibernate_wakeup) == -1) return -1;
+    fcntl(hibernate_pipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(hibernate_pipe[1], F_SETFD, FD_CLOEXEC);
+    fcntl(hibernate_wakeup[0], F_SETFD, FD_CLOEXEC);
+    fcntl(hibernate_wakeup[1], F_SETFD, FD_CLOEXEC);
+    // read whenever there is time, a pass looks at every client regardless.
+    // The ids from hibernate are written blocking as each must arrive, the
+    // pokes never block as one waiting is as good as many
+    fcntl(hibernate_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(hibernate_wakeup[0], F_SETFL, O_NONBLOCK);
+    fcntl(hibernate_wakeup[1], F_SETFL, O_NONBLOCK);
+    pthread_t thread;
+    return pthread_create(&thread, NULL, hibernate_main, NULL) == 0 ? 0 : -1;
+}
+
+/**
+ * Serve one turn of an event loop's connection: handle its input, send what
+ * is queued to it and see to its deadline
+ * @param t, the client
+ * @param input, 1 if there is input waiting or lines left to handle
+ * @param writable, 1 if there is room for what is waiting or a page of a LIST
+ * @return 1 if the connection has been closed, otherwise 0
+ */
+int loop_serve(struct client_thread *t, int input, int writable) {
+    if (input && serve_input(t, loop_line_budget, loop_byte_budget) == 1) return 1;
+    // anything answered above went behind what was waiting, so it is all
+    // written in order
+    if (writable) t->out_blocked = 0;
+    if (t->has_next_message && !t->out_blocked) flush_messages(t, HOT(t)->fd);
+    if (writable && t->listing != NULL && !t->out_blocked) list_continue(t);
+    if (now_ms() >= HOT(t)->deadline_ms && client_deadline_passed(t)) {
+        send_reply(t, &reply_timeout, NULL);
+        close(HOT(t)->fd);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Serve a share of the connections, those of ids loop->index modulo
+ * loop_count, waiting on all of them in one poll and giving each with
+ * something to do a turn, bounded by the budgets, before any has another
+ * @param arg, the event loop
+ * @return never returns
+ */
+void *event_loop_main(void *arg) {
+    struct event_loop *loop = arg;
+    my_loop = loop;
+    pin_thread(loop->index);
+    int from;
+    for (from = 0; from < loop_count; from++) {
+        if (from == loop->index) continue;
+        // allocated here, after pinning, for the memory to be our node's
+        struct mailbox *m = calloc(1, sizeof (struct mailbox));
+        if (m != NULL) __atomic_store_n(&mailboxes[from][loop->index], m, __ATOMIC_RELEASE);
+    }
+    int capacity = MAX_CLIENTS / loop_count + 1;
+    struct pollfd *polls = malloc((capacity + 2) * sizeof (struct pollfd));
+    struct client_thread **polled = malloc(capacity * sizeof (struct client_thread *));
+    char *ready = malloc(capacity);
+    if (polls == NULL || polled == NULL || ready == NULL) {
+        LOG(LOG_ERROR, "event loop %d could not start, out of memory", loop->index);
+        return NULL;
+    }
+    while (1) {
+        if (upgrading) {
+            // park every connection for the new server, and carry on serving
+            // them if the upgrade fails and start_client hands them back
+            loop_collect(loop);
+            int i;
+            for (i = loop->index; i < MAX_CLIENTS; i += loop_count) {
+                if (threads[i].state != ALIVE) continue;
+                threads[i].state = PARKED;
+                __sync_fetch_and_add(&parked_clients, 1);
+            }
+            // still collecting, a loop part way through a turn may be waiting
+            // for room in a mailbox to us before it can park
+            while (upgrading) {
+                loop_collect(loop);
+                usleep(1000);
+            }
+            continue;
+        }
+
+        // anything given to us from here on either is seen below or wakes us
+        __atomic_store_n(&loop->sleeping, 1, __ATOMIC_SEQ_CST);
+        loop_collect(loop);
+        long now = now_ms();
+        long wake_ms = now + MESSAGE_POLL_MS * 10;
+        int busy = 0;
+        int n = 0;
+        int i;
+        for (i = loop->index; i < MAX_CLIENTS; i += loop_count) {
+            struct client_thread *t = &threads[i];
+            if (t->state != ALIVE) continue;
+            if (HOT(t)->mode == 0) connection_start(t);
+            HOT(t)->deadline_ms = client_deadline(t);
+            if (HOT(t)->deadline_ms < wake_ms) wake_ms = HOT(t)->deadline_ms;
+            // nothing more is read from a client with lines left to handle
+            ready[n] = t->unfinished && t->throttled_until_ms <= now;
+            if (t->unfinished && !ready[n] && t->throttled_until_ms < wake_ms) {
+                wake_ms = t->throttled_until_ms;
+            }
+            if (!t->unfinished && t->ring != NULL) ready[n] = ring_prepare_wait(&t->ring->to_server);
+            // a bot on a ring is sent a page of a LIST each turn
+            busy |= ready[n] || (t->has_next_message && !t->out_blocked)
+                    || (t->listing != NULL && t->ring != NULL);
+            polls[n].fd = HOT(t)->fd;
+            polls[n].events = t->unfinished ? 0 : POLLIN;
+            if ((t->listing != NULL && t->ring == NULL) || t->out_blocked) polls[n].events |= POLLOUT;
+            polled[n++] = t;
+        }
+        polls[n].fd = loop->wakeup[0];
+        polls[n].events = POLLIN;
+        polls[n + 1].fd = upgrade_wakeup[0];
+        polls[n + 1].events = POLLIN;
+        long timeout = busy ? 0 : wake_ms - now;
+        int r = poll(polls, n + 2, timeout < 0 ? 0 : timeout);
+        __atomic_store_n(&loop->sleeping, 0, __ATOMIC_RELAXED);
+        if (r == -1 && errno != EINTR) {
+            LOG(LOG_ERROR, "event loop %d: poll: %s", loop->index, strerror(errno));
+            usleep(MESSAGE_POLL_MS * 1000);
+            continue;
+        }
+        if (r > 0 && polls[n].revents) ring_drain(loop->wakeup[0]);
+
+        // start each turn one further on, so no connection is always first
+        long start = now_us();
+        int first = n ? loop->next++ % n : 0;
+        int j;
+        for (j = 0; j < n; j++) {
+            int k = (first + j) % n;
+            struct client_thread *t = polled[k];
+            if (t->ring != NULL) ring_end_wait(&t->ring->to_server);
+            int input = ready[k] || (r > 0 && (polls[k].revents & ~POLLOUT));
+            int writable = t->ring != NULL || (r > 0 && (polls[k].revents & POLLOUT));
+            if (loop_serve(t, input, writable)) connection_closed(t);
+        }
+        long took = now_us() - start;
+        STAT_ADD(loop_turns, 1);
+        STAT_ADD(loop_busy_us, took);
+        if (took > 1000) STAT_ADD(loop_turns_over_1ms, 1);
+        if (took > loop->turn_max_us) loop->turn_max_us = took;
+        long max = stats.loop_turn_max_us;
+        while (took > max && !__sync_bool_compare_and_swap(&stats.loop_turn_max_us, max, took)) {
+            max = stats.loop_turn_max_us;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Start the event loops, if -e asked for any
+ * @return 0 if they started or -1 if not
+ */
+int start_loops() {
+    int i;
+    for (i = 0; i < loop_count; i++) {
+        loops[i].index = i;
+        if (pipe(loops[i].wakeup) == -1) return -1;
+        fcntl(loops[i].wakeup[0], F_SETFL, O_NONBLOCK);
+        fcntl(loops[i].wakeup[0], F_SETFD, FD_CLOEXEC);
+        fcntl(loops[i].wakeup[1], F_SETFD, FD_CLOEXEC);
+        if (pthread_create(&loops[i].thread, NULL, event_loop_main, &loops[i]) != 0) return -1;
+    }
+    return 0;
+}
+
+/**
+ * Start serving a client, with a thread of its own or in its event loop
+ * @param thread_id, the client's id
+ * @return 0 if it is being served, otherwise the pthread_create error
+ */
+int start_client(int thread_id) {
+    if (loop_count == 0) return start_client_thread(thread_id);
+    struct client_thread *t = &threads[thread_id];
+    struct event_loop *loop = LOOP_OF(t);
+    // so enqueue_locked knows the loop need not be woken to serve its own
+    t->thread = loop->thread;
+    __sync_synchronize(); // everything set up before the loop can see it
+    t->state = ALIVE;
+    loop_wake(loop);
+    return 0;
+}
+
+/**
+ * Try to turn the connection into a connection thread
+ * @param fd the file descriptor of the accepted socket
+ * @param address, where the connection is from
+ * @return 0 if the connection was successfully created or -1 if it was not
+ */
+int handle_connection(int fd, struct in_addr address) {
+    STAT_ADD(connections_accepted, 1);
+
+    // check the address is not hogging connections before giving it a thread
+    int limited = limit_loopback || (ntohl(address.s_addr) >> 24) != 127;
+    if (limited) {
+        int r = admission_check(address);
+        if (r == -1) {
+            STAT_ADD(rejected_address_cap, 1);
+            static const char msg[] = "ERROR :Closing Link: too many connections from your address\n\r";
+            write(fd, msg, sizeof (msg) - 1);
+            close(fd);
+            return -1;
+        } else if (r == -2) {
+            STAT_ADD(rejected_accept_rate, 1);
+            static const char msg[] = "ERROR :Closing Link: reconnecting too fast\n\r";
+            write(fd, msg, sizeof (msg) - 1);
+            close(fd);
+            return -1;
+        }
+    }
+
+    // get an available thread, or one closed but not yet pushed back
     int thread_id = trypop_stack();
+    if (thread_id == -1 && epoch_reclaim() > 0) thread_id = trypop_stack();
+
+    // check if got a thread id
+    if (thread_id == -1) {
+        // couldn't get a thread id
+        STAT_ADD(rejected_full, 1);
+        if (limited) admission_release(address);
+        write(fd, "QUIT: too many connections:\n", 29);
+        close(fd);
+        return -1;
+    } // else got a thread id
+
+    //wipe out the structure before reusing it, holding the shard lock as a
+    // shard worker may be looking at it for a broadcast
+    struct shard *sh = &shards[thread_id % NUM_SHARDS];
+    pthread_mutex_lock(&sh->lock);
+    bzero(&threads[thread_id], sizeof (struct client_thread));
+    client_hot[thread_id].fd = fd;
+    client_hot[thread_id].mode = 0;
+    client_hot[thread_id].nick_hash = 0;
+    client_hot[thread_id].deadline_ms = 0;
+    // kept across reuse so a stale reference to the slot can be told apart
+    client_hot[thread_id].generation++;
+    pthread_mutex_unlock(&sh->lock);
+    // set the threads id
+    threads[thread_id].thread_id = thread_id;
+    threads[thread_id].address = address;
+    threads[thread_id].limited = limited;
+    threads[thread_id].command_tokens = 2 * commands_per_second;
+    threads[thread_id].command_refill_ms = now_ms();
+    int r = start_client(thread_id);
+    if (r != 0) {
+        LOG(LOG_ERROR, "could not start a client thread: %s", strerror(r));
+        if (limited) admission_release(address);
+        close(fd);
+        client_hot[thread_id].mode = 0;
+        push_stack(thread_id);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Read exactly length bytes, waiting for them to arrive
+ * @return 0 if they were read or -1 if the other end went away first
+ */
+int read_all(int fd, void *data, int length) {
+    char *p = data;
+    while (length > 0) {
+        int n = read(fd, p, length);
+        if (n <= 0) {
+            if (n == -1 && errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        length -= n;
+    }
+    return 0;
+}
+
+/**
+ * Write exactly length bytes, waiting for room for them
+ * @return 0 if they were written or -1 on an error
+ */
+int write_all(int fd, const void *data, int length) {
+    const char *p = data;
+    while (length > 0) {
+        int n = write(fd, p, length);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        length -= n;
+    }
+    return 0;
+}
+
+/**
+ * Add a nickname registered on a linked server, or move it to that server
+ * @param link, the link to the server
+ * @param name, the nickname
+ */
+void remote_nick_add(int link, struct line_view name) {
+    if (name.length == 0 || name.length >= sizeof (remote_nicks[0].nickname)) return;
+    unsigned int hash = name_hash(name.start, name.length);
+    pthread_rwlock_wrlock(&remote_index.lock);
+    int id = name_index_find(&remote_index, name.start, name.length, hash);
+    if (id != -1) {
+        remote_nicks[id].link = link;
+    } else if (free_remote_count > 0) {
+        id = free_remote[--free_remote_count];
+        memcpy(remote_nicks[id].nickname, name.start, name.length);
+        remote_nicks[id].nickname[name.length] = 0;
+        remote_nicks[id].nicknamelength = name.length;
+        remote_nicks[id].link = link;
+        name_index_insert(&remote_index, id);
+        remote_nick_count++;
+    }
+    pthread_rwlock_unlock(&remote_index.lock);
+}
+
+/**
+ * Forget a remote nickname, the caller must hold the remote index write lock
+ * @param id, the remote nickname id
+ */
+void remote_nick_forget(int id) {
+    name_index_remove(&remote_index, id);
+    remote_nicks[id].link = -1;
+    free_remote[free_remote_count++] = id;
+    remote_nick_count--;
+}
+
+/**
+ * Handle one record from a linked server
+ * @param link, the link it came over
+ * @param r, the record
+ * @param names, the nicknames the other server has defined ids for
+ */
+void handle_link_record(int link, struct link_record *r, struct link_names *names) {
+    struct line_view name = {r->data, r->length};
+    if (r->type == LINK_RECORD_PRIVMSG) {
+        // for a client registered here, sent on as if from a local client
+        int length = names->lengths[r->id];
+        const char *target = names->names[r->id];
+        unsigned int hash = name_hash(target, length);
+        epoch_enter();
+        int id = length ? name_index_lookup(&nick_index, target, length, hash) : -1;
+        if (id == -1) {
+            epoch_exit();
+            STAT_ADD(link_messages_undeliverable, 1);
+            return;
+        }
+        struct client_thread *ct = &threads[id];
+        struct reply_args args = {ct->nickname, ct->nicknamelength, NULL, 0, r->data, r->length};
+        struct outbuf *b = render_outbuf(&reply_privmsg, &args);
+        if (b != NULL && enqueue_message(ct, b) == 0) STAT_ADD(link_messages_in, 1);
+        epoch_exit();
+        if (b != NULL) outbuf_release(b);
+    } else if (r->type == LINK_RECORD_DEFINE) {
+        memcpy(names->names[r->id], r->data, r->length);
+        names->lengths[r->id] = r->length;
+    } else if (r->type == LINK_RECORD_RESET) {
+        memset(names->lengths, 0, sizeof (names->lengths));
+    } else if (r->type == LINK_RECORD_NICK) {
+        remote_nick_add(link, name);
+    } else if (r->type == LINK_RECORD_QUIT) {
+        unsigned int hash = name_hash(name.start, name.length);
+        pthread_rwlock_wrlock(&remote_index.lock);
+        int id = name_index_find(&remote_index, name.start, name.length, hash);
+        // unless it has since registered on another server
+        if (id != -1 && remote_nicks[id].link == link) remote_nick_forget(id);
+        pthread_rwlock_unlock(&remote_index.lock);
+    }
+}
+
+/**
+ * Write out what is queued to a link until it goes down, cutting it into
+ * frames and compressing them with -z
+ * @param arg, the link
+ */
+void *link_writer(void *arg) {
+    struct server_link *l = arg;
+    unsigned char *spare = NULL;
+    int spare_size = 0;
+    unsigned char *frames = NULL;
+    int frames_size = 0;
+    pthread_mutex_lock(&l->lock);
+    while (1) {
+        while (l->out_length == 0 && l->fd != -1) pthread_cond_wait(&l->queued, &l->lock);
+        if (l->fd == -1) break;
+        // take everything queued, leaving the spare buffer to queue into
+        // while it is written
+        unsigned char *batch = l->out;
+        int length = l->out_length;
+        int size = l->out_size;
+        int fd = l->fd;
+        l->out = spare;
+        l->out_size = spare_size;
+        l->out_length = 0;
+        pthread_mutex_unlock(&l->lock);
+
+        // a frame holds at least LINK_FRAME_MAX - LINK_RECORD_MAX bytes of
+        // records, so this is room for every frame's header
+        int need = length + (length / (LINK_FRAME_MAX - LINK_RECORD_MAX) + 1) * LINK_FRAME_HEADER;
+        if (need > frames_size) {
+            free(frames);
+            frames_size = need;
+            frames = malloc(frames_size);
+        }
+        int r = frames == NULL ? -1 : 0;
+        int out = 0;
+        int at = 0;
+        while (r == 0 && at < length) {
+            int count;
+            int n = link_frame_fit(batch + at, length - at, &count);
+            if (n == 0) break; // cannot happen, the records are our own
+            out += link_put_frame(frames + out, batch + at, n, count, compress_links);
+            at += n;
+        }
+        if (r == 0) r = write_all(fd, frames, out);
+        STAT_ADD(link_writes, 1);
+        STAT_ADD(link_bytes_records, length);
+        STAT_ADD(link_bytes_written, out);
+        spare = batch;
+        spare_size = size;
+        pthread_mutex_lock(&l->lock);
+        if (r == -1) {
+            shutdown(fd, SHUT_RDWR); // so the link's thread sees it go down
+            break;
+        }
+    }
+    pthread_mutex_unlock(&l->lock);
+    free(spare);
+    free(frames);
+    return NULL;
+}
+
+/**
+ * Dial a server to link with
+ * @param peer, its host:port
+ * @return the socket or -1 if it could not be reached
+ */
+int dial_link(const char *peer) {
+    char host[64];
+    const char *colon = strrchr(peer, ':');
+    if (colon == NULL || colon - peer >= sizeof (host)) return -1;
+    memcpy(host, peer, colon - peer);
+    host[colon - peer] = 0;
+    struct addrinfo hints, *found;
+    bzero(&hints, sizeof (hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, colon + 1, &hints, &found) != 0) return -1;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd != -1 && connect(fd, found->ai_addr, found->ai_addrlen) == -1) {
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(found);
+    if (fd != -1) fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return fd;
+}
+
+/**
+ * Check a key shown by another server against ours, taking as long whatever
+ * it has right so the time taken does not give the key away a byte at a time
+ * @param key, the key shown
+ * @param length, its length
+ * @return 1 if it is our key, otherwise 0
+ */
+int link_key_matches(const char *key, int length) {
+    int ours = strlen(link_key);
+    int differ = length != ours;
+    int i;
+    for (i = 0; i < length; i++) {
+        differ |= key[i] ^ link_key[i % ours];
+    }
+    return !differ;
+}
+
+/**
+ * Send our first frame on a link, SERVER and KEY
+ * @param fd, the link's socket
+ * @return 0 if it was sent or -1 on an error
+ */
+int link_hello_send(int fd) {
+    unsigned char hello[LINK_FRAME_HEADER + 2 * (2 + LINK_NAME_SIZE)];
+    int n = link_put_name(hello + LINK_FRAME_HEADER, LINK_RECORD_SERVER,
+            server_link_name, strlen(server_link_name));
+    n += link_put_name(hello + LINK_FRAME_HEADER + n, LINK_RECORD_KEY, link_key, strlen(link_key));
+    link_put_header(hello, n, 2, 0);
+    return write_all(fd, hello, LINK_FRAME_HEADER + n);
+}
+
+/**
+ * Read the other server's first frame on a link and check its key, giving
+ * it LINK_HELLO_MS to send it
+ * @param l, the link, given the other server's name
+ * @param fd, the link's socket
+ * @param payload, room for a frame
+ * @param raw, room for a frame uncompressed
+ * @return 0 if it showed our key, otherwise -1
+ */
+int link_hello_receive(struct server_link *l, int fd, unsigned char *payload, unsigned char *raw) {
+    struct timeval limit = {LINK_HELLO_MS / 1000, LINK_HELLO_MS % 1000 * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &limit, sizeof (limit));
+    unsigned char header[LINK_FRAME_HEADER];
+    int flags;
+    if (read_all(fd, header, LINK_FRAME_HEADER) == -1) return -1;
+    int length = link_get_header(header, &flags);
+    if (length == -1 || read_all(fd, payload, length) == -1) return -1;
+    const unsigned char *records;
+    length = link_get_records(payload, length, flags, raw, &records);
+    struct link_record server, key;
+    int n = length == -1 || link_get16(header + 4) != 2 ? -1 : link_get_record(records, length, &server);
+    if (n == -1 || server.type != LINK_RECORD_SERVER
+            || link_get_record(records + n, length - n, &key) == -1 || key.type != LINK_RECORD_KEY
+            || !link_key_matches(key.data, key.length)) {
+        if (l->peer[0]) {
+            LOG(LOG_WARNING, "link with %s refused, it did not show the link key", l->peer);
+        } else {
+            LOG(LOG_WARNING, "a server linking on -l was refused, it did not show the link key");
+        }
+        return -1;
+    }
+    struct line_view name = {server.data, server.length};
+    copy_name(l->name, sizeof (l->name), name);
+    limit.tv_sec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &limit, sizeof (limit));
+    return 0;
+}
+
+/**
+ * Run a link until it goes down: show the link key and check the other
+ * server's, announce ourselves and every nickname registered here, then
+ * handle the other server's frames
+ * @param link, the link
+ * @param fd, its socket
+ */
+void run_link(int link, int fd) {
+    struct server_link *l = &server_links[link];
+    // an accepted socket can inherit the listening socket's non-blocking mode
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, NULL) & ~O_NONBLOCK);
+    // the writer batches records itself, so each write should go at once
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof (on));
+    // the ids each side gives nicknames last as long as the connection
+    struct link_interns *interns = malloc(sizeof (struct link_interns));
+    struct link_names *names = calloc(1, sizeof (struct link_names));
+    unsigned char *payload = malloc(LINK_FRAME_MAX + 4);
+    unsigned char *raw = malloc(LINK_FRAME_MAX);
+    // the server that dialled shows its key first, so ours only goes to a
+    // server that knows it already
+    int dialled = l->peer[0] != 0;
+    if (interns == NULL || names == NULL || payload == NULL || raw == NULL
+            || (dialled && link_hello_send(fd) == -1)
+            || link_hello_receive(l, fd, payload, raw) == -1
+            || (!dialled && link_hello_send(fd) == -1)) {
+        free(interns);
+        free(names);
+        free(payload);
+        free(raw);
+        close(fd);
+        return;
+    }
+    LOG(LOG_INFO, "linked with %s", l->name);
+    link_interns_reset(interns);
 
-    // check if got a thread id
-    if (thread_id == -1) {
-        // couldn't get a thread id
+    // bring the link up and queue the nicknames under the index lock, so a
+    // client registering meanwhile is either in the burst or announced after
+    pthread_rwlock_rdlock(&nick_index.lock);
+    pthread_mutex_lock(&l->lock);
+    l->fd = fd;
+    l->out_length = 0;
+    l->interns = interns;
+    pthread_mutex_unlock(&l->lock);
+    unsigned int i;
+    for (i = 0; i <= nick_index.mask; i++) {
+        if (nick_index.ids[i] == -1) continue;
+        struct client_thread *t = &threads[nick_index.ids[i]];
+        link_queue_name(l, LINK_RECORD_NICK, t->nickname, t->nicknamelength);
+    }
+    pthread_rwlock_unlock(&nick_index.lock);
+    __sync_fetch_and_add(&links_up, 1);
+    pthread_t writer;
+    int writing = pthread_create(&writer, NULL, link_writer, l) == 0;
+
+    // handle frames until the link goes down or sends one we cannot read
+    while (writing) {
+        unsigned char header[LINK_FRAME_HEADER];
+        int flags;
+        if (read_all(fd, header, LINK_FRAME_HEADER) == -1) break;
+        int length = link_get_header(header, &flags);
+        if (length == -1 || read_all(fd, payload, length) == -1) break;
+        const unsigned char *records;
+        length = link_get_records(payload, length, flags, raw, &records);
+        int count = link_get16(header + 4);
+        int at = 0;
+        struct link_record r;
+        while (length != -1 && count-- > 0) {
+            int size = link_get_record(records + at, length - at, &r);
+            if (size == -1) length = -1;
+            else handle_link_record(link, &r, names);
+            at += size;
+        }
+        if (length == -1) break;
+    }
+
+    // down, stop the writer before closing the socket it may be writing to
+    pthread_mutex_lock(&l->lock);
+    l->fd = -1;
+    l->out_length = 0;
+    l->interns = NULL;
+    pthread_cond_signal(&l->queued);
+    pthread_mutex_unlock(&l->lock);
+    shutdown(fd, SHUT_RDWR);
+    if (writing) pthread_join(writer, NULL);
+    close(fd);
+    free(interns);
+    free(names);
+    free(payload);
+    free(raw);
+    __sync_fetch_and_sub(&links_up, 1);
+
+    // and forget the nicknames registered on the other server
+    pthread_rwlock_wrlock(&remote_index.lock);
+    int id;
+    for (id = 0; id < MAX_REMOTE_NICKS; id++) {
+        if (remote_nicks[id].link == link) remote_nick_forget(id);
+    }
+    pthread_rwlock_unlock(&remote_index.lock);
+    LOG(LOG_WARNING, "link with %s down", l->name[0] ? l->name : l->peer);
+}
+
+/**
+ * The thread of a link: run it, and for a link this server dialled dial it
+ * again whenever it goes down
+ * @param arg, the link
+ */
+void *link_main(void *arg) {
+    struct server_link *l = arg;
+    int link = l - server_links;
+    while (1) {
+        int fd = l->peer[0] ? dial_link(l->peer) : l->accepted_fd;
+        if (fd != -1) run_link(link, fd);
+        // an accepted link is for the server that dialled it to redial
+        if (!l->peer[0]) break;
+        usleep(LINK_RETRY_MS * 1000);
+    }
+    l->name[0] = 0;
+    pthread_mutex_lock(&server_links_lock);
+    l->in_use = 0;
+    pthread_mutex_unlock(&server_links_lock);
+    return NULL;
+}
+
+/**
+ * Start a link, dialling a server or on a socket accepted from one
+ * @param peer, the host:port to dial, or NULL for an accepted link
+ * @param fd, the accepted socket, if peer is NULL
+ * @return 0 if it was started or -1 if there are too many links
+ */
+int start_link(const char *peer, int fd) {
+    pthread_mutex_lock(&server_links_lock);
+    int i;
+    for (i = 0; i < MAX_LINKS && server_links[i].in_use; i++);
+    if (i < MAX_LINKS) server_links[i].in_use = 1;
+    pthread_mutex_unlock(&server_links_lock);
+    if (i == MAX_LINKS) return -1;
+    struct server_link *l = &server_links[i];
+    snprintf(l->peer, sizeof (l->peer), "%s", peer != NULL ? peer : "");
+    l->accepted_fd = fd;
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int r = pthread_create(&thread, &attr, link_main, l);
+    pthread_attr_destroy(&attr);
+    if (r != 0) {
+        pthread_mutex_lock(&server_links_lock);
+        l->in_use = 0;
+        pthread_mutex_unlock(&server_links_lock);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Write out the changes queued to the standby until it goes, a batch at a
+ * time, noting each batch written for the lag
+ * @param arg, unused
+ */
+void *replication_writer(void *arg) {
+    char *spare = NULL;
+    int spare_size = 0;
+    pthread_mutex_lock(&standby.lock);
+    while (1) {
+        while (standby.out_length == 0 && standby.fd != -1) pthread_cond_wait(&standby.queued, &standby.lock);
+        if (standby.fd == -1) break;
+        char *batch = standby.out;
+        int length = standby.out_length;
+        int size = standby.out_size;
+        int fd = standby.fd;
+        struct repl_batch header = {REPL_MAGIC, SNAPSHOT_VERSION,
+            length - sizeof (struct repl_batch), 0, standby.seq, standby.out_ms};
+        memcpy(batch, &header, sizeof (header));
+        if (standby.flight_count == REPL_IN_FLIGHT) {
+            // too many to track, so the newest one grows to end here
+            int last = (standby.flight_first + REPL_IN_FLIGHT - 1) % REPL_IN_FLIGHT;
+            standby.flight_seq[last] = standby.seq;
+        } else {
+            int next = (standby.flight_first + standby.flight_count++) % REPL_IN_FLIGHT;
+            standby.flight_seq[next] = standby.seq;
+            standby.flight_ms[next] = standby.out_ms;
+        }
+        standby.out = spare;
+        standby.out_size = spare_size;
+        standby.out_length = 0;
+        pthread_mutex_unlock(&standby.lock);
+
+        int r = write_all(fd, batch, length);
+        STAT_ADD(replication_batches, 1);
+        STAT_ADD(replication_bytes, length);
+        spare = batch;
+        spare_size = size;
+        pthread_mutex_lock(&standby.lock);
+        if (r == -1) {
+            shutdown(fd, SHUT_RDWR); // so the standby's thread sees it go
+            break;
+        }
+    }
+    pthread_mutex_unlock(&standby.lock);
+    free(spare);
+    return NULL;
+}
+
+/**
+ * Update the replication lag from the oldest change the standby has not
+ * applied, called each second so a stalled standby shows as lagging even
+ * though it sends nothing
+ */
+void replication_tick() {
+    pthread_mutex_lock(&standby.lock);
+    long oldest = standby.flight_count ? standby.flight_ms[standby.flight_first]
+            : standby.out_length ? standby.out_ms : 0;
+    if (oldest && now_ms() - oldest > replication_lag_ms) replication_lag_ms = now_ms() - oldest;
+    pthread_mutex_unlock(&standby.lock);
+}
+
+/**
+ * Read the repl_hello a standby sends first and check its key, giving it
+ * LINK_HELLO_MS to send it
+ * @param fd, the standby's socket
+ * @return 0 if it showed our key, otherwise -1
+ */
+int standby_hello_receive(int fd) {
+    struct timeval limit = {LINK_HELLO_MS / 1000, LINK_HELLO_MS % 1000 * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &limit, sizeof (limit));
+    struct repl_hello hello;
+    if (read_all(fd, &hello, sizeof (hello)) == -1 || hello.magic != REPL_MAGIC
+            || hello.length < 0 || hello.length >= LINK_NAME_SIZE
+            || !link_key_matches(hello.key, hello.length)) {
+        LOG(LOG_WARNING, "a standby connecting on -r was refused, it did not show the link key");
+        return -1;
+    }
+    limit.tv_sec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &limit, sizeof (limit));
+    return 0;
+}
+
+/**
+ * The thread of a standby following this server: send it the registry as
+ * it is, then every change to it, and take its acknowledgements
+ * @param arg, the standby's socket
+ */
+void *replication_main(void *arg) {
+    int fd = (long) arg;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, NULL) & ~O_NONBLOCK);
+    // anyone can connect to -r, only a standby with our key is followed, so
+    // a stranger can neither read the registry nor keep the standby out
+    int r = standby_hello_receive(fd);
+    __sync_fetch_and_sub(&standby_hellos, 1);
+    if (r == -1 || __sync_lock_test_and_set(&standby_taken, 1)) {
+        close(fd);
+        return NULL;
+    }
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof (on));
+    long start = now_ms();
+
+    // every change holds one of these for writing, so none is missed or
+    // sent twice between the copy and the changes that follow it
+    pthread_rwlock_rdlock(&nick_index.lock);
+    pthread_rwlock_rdlock(&channel_index.lock);
+    pthread_mutex_lock(&standby.lock);
+    standby.fd = fd;
+    standby.out_length = 0;
+    standby.seq = 0;
+    standby.acked = 0;
+    standby.flight_count = 0;
+    pthread_mutex_unlock(&standby.lock);
+    unsigned int i;
+    for (i = 0; i <= channel_index.mask; i++) {
+        if (channel_index.ids[i] == -1) continue;
+        struct snapshot_channel c;
+        registry_channel_record(channel_index.ids[i], &c);
+        replicate(REPL_CHANNEL, channel_index.ids[i], &c, sizeof (c));
+    }
+    for (i = 0; i <= nick_index.mask; i++) {
+        if (nick_index.ids[i] == -1) continue;
+        struct snapshot_client c;
+        registry_client_record(&threads[nick_index.ids[i]], &c);
+        replicate(REPL_CLIENT, nick_index.ids[i], &c, sizeof (c));
+    }
+    replicate(REPL_SYNCED, 0, NULL, 0);
+    long long copied = standby.seq;
+    pthread_rwlock_unlock(&channel_index.lock);
+    pthread_rwlock_unlock(&nick_index.lock);
+    standby_following = 1;
+    LOG(LOG_INFO, "standby following, sent %lld records of the registry in %ld ms",
+            copied - 1, now_ms() - start);
+
+    pthread_t writer;
+    int writing = pthread_create(&writer, NULL, replication_writer, NULL) == 0;
+    struct repl_ack ack;
+    while (writing && read_all(fd, &ack, sizeof (ack)) == 0) {
+        pthread_mutex_lock(&standby.lock);
+        while (standby.flight_count && standby.flight_seq[standby.flight_first] <= ack.seq) {
+            standby.flight_first = (standby.flight_first + 1) % REPL_IN_FLIGHT;
+            standby.flight_count--;
+        }
+        standby.acked = ack.seq;
+        replication_lag_changes = standby.seq - standby.acked;
+        replication_lag_ms = now_ms() - ack.queued_ms;
+        pthread_mutex_unlock(&standby.lock);
+    }
+
+    pthread_mutex_lock(&standby.lock);
+    standby.fd = -1;
+    standby.out_length = 0;
+    pthread_cond_signal(&standby.queued);
+    pthread_mutex_unlock(&standby.lock);
+    shutdown(fd, SHUT_RDWR);
+    if (writing) pthread_join(writer, NULL);
+    close(fd);
+    LOG(LOG_WARNING, "standby gone");
+    standby_following = 0;
+    replication_lag_changes = 0;
+    replication_lag_ms = 0;
+    __sync_lock_release(&standby_taken);
+    return NULL;
+}
+
+/**
+ * Start following a standby on a socket accepted from it, once it has shown
+ * the link key (replication_main)
+ * @param fd, the socket
+ * @return 0 if it was started or -1 if too many are being checked already
+ */
+int start_standby(int fd) {
+    if (__sync_fetch_and_add(&standby_hellos, 1) >= REPL_HELLOS_MAX) {
+        __sync_fetch_and_sub(&standby_hellos, 1);
+        return -1;
+    }
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int r = pthread_create(&thread, &attr, replication_main, (void *) (long) fd);
+    pthread_attr_destroy(&attr);
+    if (r != 0) {
+        __sync_fetch_and_sub(&standby_hellos, 1);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Apply one batch of changes from the primary to a copy of the registry
+ * @param registry, the copy
+ * @param p, the records
+ * @param length, their length
+ * @return 1 if the batch ended the primary's copy of its registry, 0 if
+ *  not, or -1 if it is malformed
+ */
+int apply_changes(struct snapshot_header *registry, const char *p, int length) {
+    int synced = 0;
+    while (length > 0) {
+        struct repl_record r;
+        if (length < sizeof (r)) return -1;
+        memcpy(&r, p, sizeof (r));
+        p += sizeof (r);
+        length -= sizeof (r);
+        if (r.type == REPL_SYNCED) {
+            synced = 1;
+        } else if (r.type == REPL_CLIENT && r.id >= 0 && r.id < MAX_CLIENTS
+                && length >= sizeof (struct snapshot_client)) {
+            memcpy(&snapshot_clients(registry)[r.id], p, sizeof (struct snapshot_client));
+            p += sizeof (struct snapshot_client);
+            length -= sizeof (struct snapshot_client);
+        } else if (r.type == REPL_CHANNEL && r.id >= 0 && r.id < MAX_CHANNELS
+                && length >= sizeof (struct snapshot_channel)) {
+            memcpy(&snapshot_channels(registry)[r.id], p, sizeof (struct snapshot_channel));
+            p += sizeof (struct snapshot_channel);
+            length -= sizeof (struct snapshot_channel);
+        } else {
+            return -1;
+        }
+    }
+    return synced;
+}
+
+/**
+ * Follow a primary server as its warm standby, keeping a copy of its
+ * registry, until it goes and its port comes free.  The port staying taken
+ * means the primary is still there (an upgrade drops the standby, say), so
+ * the standby follows it again.  Started on another host, a standby takes
+ * over whenever it loses the primary.
+ * @param primary, the host:port of the primary's -r port
+ * @param port, the tcp port to take over
+ * @return the listening socket, with the primary's registry reserved for
+ *  its clients to reclaim
+ */
+int follow_primary(const char *primary, int port) {
+    size_t size = snapshot_size(MAX_CLIENTS, MAX_CHANNELS);
+    // the last whole copy of the registry, and the one being received
+    struct snapshot_header *registry = calloc(1, size);
+    struct snapshot_header *copying = calloc(1, size);
+    char *batch = NULL;
+    int batch_size = 0;
+    if (registry == NULL || copying == NULL) return -1;
+    // headers as a snapshot of this server would have, for finding the
+    // records and for load_reservations
+    struct snapshot_header header = {SNAPSHOT_MAGIC, SNAPSHOT_VERSION, MAX_CLIENTS, MAX_CHANNELS};
+    int synced = 0;
+    long long applied = 0;
+    struct repl_hello hello = {REPL_MAGIC, strlen(link_key)};
+    memcpy(hello.key, link_key, hello.length);
+    while (1) {
+        int fd = dial_link(primary);
+        if (fd != -1 && write_all(fd, &hello, sizeof (hello)) == -1) {
+            close(fd);
+            fd = -1;
+        }
+        if (fd != -1) {
+            long start = now_ms();
+            struct snapshot_header *to = copying;
+            memset(copying, 0, size);
+            *copying = header;
+            struct repl_batch b;
+            while (read_all(fd, &b, sizeof (b)) == 0) {
+                if (b.magic != REPL_MAGIC || b.version != SNAPSHOT_VERSION
+                        || b.length < 0 || b.length > REPL_OUT_MAX) break;
+                if (b.length > batch_size) {
+                    free(batch);
+                    batch_size = b.length;
+                    batch = malloc(batch_size);
+                    if (batch == NULL) batch_size = 0;
+                }
+                if (batch == NULL || read_all(fd, batch, b.length) == -1) break;
+                int r = apply_changes(to, batch, b.length);
+                if (r == -1) break;
+                if (r == 1) {
+                    // the copy is whole, so from here on the changes go
+                    // straight into the registry
+                    memcpy(registry, copying, size);
+                    to = registry;
+                    synced = 1;
+                    LOG(LOG_INFO, "following %s, copied its registry in %ld ms", primary, now_ms() - start);
+                }
+                applied = b.seq;
+                struct repl_ack ack = {b.seq, b.queued_ms};
+                if (write_all(fd, &ack, sizeof (ack)) == -1) break;
+            }
+            close(fd);
+        }
+        if (synced) {
+            int listener = create_listen_socket(port);
+            if (listener != -1) {
+                int channels = load_reservations(registry, size);
+                LOG(LOG_WARNING, "%s has gone after %lld changes, took over port %d with %ld nicknames"
+                        " and %d channels", primary, applied, port, reservation_count, channels);
+                free(registry);
+                free(copying);
+                free(batch);
+                return listener;
+            }
+        }
+        usleep(LINK_RETRY_MS * 1000);
+    }
+}
+
+// identifies the start of a handover, and changes whenever handoff_client
+// does so a new binary never misreads what an old one sends
+#define HANDOFF_MAGIC 0x49524342
+
+/**
+ * the first message of a handover, sent with the listening socket
+ */
+struct handoff_header {
+    int magic;
+    int clients; // the number of handoff_client records that follow
+    int local_listener; // 1 if the unix domain listening socket follows
+    int link_listener; // 1 if the server link listening socket follows that
+    int replication_listener; // 1 if the standby listening socket follows that
+    unsigned int capture_connections; // so the capture's numbering carries on
+    struct server_stats stats; // so the counters carry on
+};
+
+/**
+ * a client's state as handed over to the new server, sent with the client's
+ * socket and followed by its channel names (CHANNEL_NAME_SIZE bytes each),
+ * its partial input line and the output still waiting to be sent, then for
+ * a bot on a ring a message carrying the ring's file
+ */
+struct handoff_client {
+    int mode;
+    int ring; // 1 if the client talks through a shared memory ring
+    int is_operator;
+    int limited;
+    struct in_addr address;
+    time_t timeout;
+    long last_input_ms; // CLOCK_MONOTONIC is the same clock in both servers
+    long ping_next_ms;
+    long ping_sent_us;
+    long rtt_us;
+    unsigned int capture_id;
+    struct client_usage usage;
+    int nicknamelength;
+    char nickname[32];
+    int usernamelength;
+    char username[32];
+    int channel_count;
+    int input_length;
+    int output_length;
+};
+
+/**
+ * Hand one parked client over to the new server
+ * @param link, the unix socket to the new server
+ * @param t, the client
+ * @return 0 if it was handed over or -1 if the new server went away
+ */
+int hand_over_client(int link, struct client_thread *t) {
+    struct handoff_client h;
+    bzero(&h, sizeof (h));
+    h.mode = HOT(t)->mode;
+    h.is_operator = t->is_operator;
+    h.limited = t->limited;
+    h.address = t->address;
+    h.timeout = t->timeout;
+    h.last_input_ms = t->last_input_ms;
+    h.ping_next_ms = t->ping_next_ms;
+    h.ping_sent_us = t->ping_sent_us;
+    h.rtt_us = t->rtt_us;
+    h.capture_id = t->capture_id;
+    h.usage = t->usage;
+    h.nicknamelength = t->nicknamelength;
+    memcpy(h.nickname, t->nickname, sizeof (h.nickname));
+    h.usernamelength = t->usernamelength;
+    memcpy(h.username, t->username, sizeof (h.username));
+    h.channel_count = t->channel_count;
+    h.input_length = t->in ? t->in->length : 0;
+    h.ring = t->ring != NULL;
+
+    // gather the waiting output into one block, which the new server queues
+    // as a single message, less what of the first has been written
+    struct shard *sh = SHARD_OF(t);
+    pthread_mutex_lock(&sh->lock);
+    if (t->out != NULL) {
+        unsigned int i;
+        for (i = t->out->head; i != t->out->tail; i++) {
+            h.output_length += t->out->items[i % OUT_QUEUE_SIZE]->length;
+        }
+        if (h.output_length) h.output_length -= t->out->offset;
+    }
+    int size = t->channel_count * CHANNEL_NAME_SIZE + h.input_length + h.output_length;
+    char *payload = malloc(size ? size : 1);
+    if (payload == NULL) {
+        pthread_mutex_unlock(&sh->lock);
+        return -1;
+    }
+    char *p = payload;
+    int i;
+    for (i = 0; i < t->channel_count; i++) {
+        memcpy(p, channel_list[t->channels[i]].name, CHANNEL_NAME_SIZE);
+        p += CHANNEL_NAME_SIZE;
+    }
+    if (h.input_length) {
+        memcpy(p, t->in->data, h.input_length);
+        p += h.input_length;
+    }
+    if (t->out != NULL) {
+        unsigned int j;
+        for (j = t->out->head; j != t->out->tail; j++) {
+            struct outbuf *b = t->out->items[j % OUT_QUEUE_SIZE];
+            int skip = j == t->out->head ? t->out->offset : 0;
+            memcpy(p, b->data + skip, b->length - skip);
+            p += b->length - skip;
+        }
+    }
+    pthread_mutex_unlock(&sh->lock);
+
+    int r = send_with_fd(link, &h, sizeof (h), HOT(t)->fd);
+    if (r == 0) r = write_all(link, payload, size);
+    if (r == 0 && t->ring != NULL) {
+        int marker = 0; // there must be at least a byte to carry the file
+        r = send_with_fd(link, &marker, sizeof (marker), t->ring_fd);
+    }
+    free(payload);
+    return r;
+}
+
+/**
+ * Take over a client handed over by the old server, its thread is left for
+ * the caller to start
+ * @param link, the unix socket to the old server
+ * @return the client's thread id if it was taken over, -2 if it was turned
+ *  away as this server is full, or -1 if the old server went away
+ */
+int take_over_client(int link) {
+    struct handoff_client h;
+    int fd = receive_with_fd(link, &h, sizeof (h));
+    if (fd == -1) return -1;
+    int size = h.channel_count * CHANNEL_NAME_SIZE + h.input_length + h.output_length;
+    char *payload = malloc(size ? size : 1);
+    if (payload == NULL || read_all(link, payload, size) == -1) {
+        free(payload);
+        close(fd);
+        return -1;
+    }
+    struct ring_region *ring = NULL;
+    int ring_fd = -1;
+    if (h.ring) {
+        int marker;
+        ring_fd = receive_with_fd(link, &marker, sizeof (marker));
+        if (ring_fd == -1) {
+            free(payload);
+            close(fd);
+            return -1;
+        }
+        ring = mmap(NULL, ring_region_size(), PROT_READ | PROT_WRITE, MAP_SHARED, ring_fd, 0);
+        if (ring == MAP_FAILED) { // the bot's connection cannot be carried on
+            ring = NULL;
+            close(ring_fd);
+            close(fd);
+            free(payload);
+            return -2;
+        }
+    }
+
+    int thread_id = trypop_stack();
+    if (thread_id == -1) { // built with a smaller MAX_CLIENTS than the old one
+        if (ring != NULL) {
+            munmap(ring, ring_region_size());
+            close(ring_fd);
+        }
+        free(payload);
         write(fd, "QUIT: too many connections:\n", 29);
         close(fd);
+        return -2;
+    }
+    struct client_thread *t = &threads[thread_id];
+    bzero(t, sizeof (struct client_thread));
+    t->thread_id = thread_id;
+    client_hot[thread_id].fd = fd;
+    client_hot[thread_id].mode = h.mode;
+    client_hot[thread_id].generation++;
+    t->is_operator = h.is_operator;
+    t->limited = h.limited;
+    t->address = h.address;
+    t->timeout = h.timeout;
+    t->last_input_ms = h.last_input_ms;
+    t->ping_next_ms = h.ping_next_ms;
+    t->ping_sent_us = h.ping_sent_us;
+    t->rtt_us = h.rtt_us;
+    t->capture_id = h.capture_id;
+    t->usage = h.usage;
+    t->nicknamelength = h.nicknamelength;
+    memcpy(t->nickname, h.nickname, sizeof (t->nickname));
+    t->usernamelength = h.usernamelength;
+    memcpy(t->username, h.username, sizeof (t->username));
+    t->command_tokens = 2 * commands_per_second;
+    t->command_refill_ms = now_ms();
+    t->ring = ring;
+    t->ring_fd = ring_fd;
+    if (t->limited) admission_adopt(t->address);
+    if (h.mode == 3) register_nickname(t);
+
+    char *p = payload;
+    int i;
+    pthread_rwlock_wrlock(&channel_index.lock);
+    for (i = 0; i < h.channel_count; i++) {
+        struct line_view name = {p, strnlen(p, CHANNEL_NAME_SIZE)};
+        join_channel_locked(t, name);
+        p += CHANNEL_NAME_SIZE;
+    }
+    pthread_rwlock_unlock(&channel_index.lock);
+    if (h.input_length) {
+        t->in = pool_get(&input_pool);
+        if (t->in != NULL) {
+            memcpy(t->in->data, p, h.input_length);
+            t->in->length = h.input_length;
+            t->unfinished = 1; // it may hold whole lines, handled before any more is read
+        }
+        p += h.input_length;
+    }
+    if (h.output_length) {
+        struct outbuf *b = outbuf_new(h.output_length);
+        if (b != NULL) {
+            memcpy(b->data, p, h.output_length);
+            b->length = h.output_length;
+            if (enqueue_message(t, b) == -1) free(b);
+        }
+    }
+    free(payload);
+    return thread_id;
+}
+
+/**
+ * Take over the listening sockets and every client from the old server, then
+ * tell it to exit
+ * @param link, the unix socket to the old server
+ * @param local_socket, set to the unix domain listening socket, -1 if none
+ * @param link_socket, set to the server link listening socket, -1 if none
+ * @param replication_socket, set to the standby listening socket, -1 if none
+ * @return the listening socket or -1 if the handover failed
+ */
+int take_over(int link, int *local_socket, int *link_socket, int *replication_socket) {
+    long start = now_ms();
+    struct handoff_header header;
+    int master_socket = receive_with_fd(link, &header, sizeof (header));
+    if (master_socket == -1 || header.magic != HANDOFF_MAGIC) {
+        LOG(LOG_ERROR, "handover from the old server failed");
         return -1;
-    } // else got a thread id
+    }
+    *local_socket = -1;
+    if (header.local_listener) {
+        int marker;
+        *local_socket = receive_with_fd(link, &marker, sizeof (marker));
+        if (*local_socket == -1) {
+            LOG(LOG_ERROR, "handover from the old server failed");
+            return -1;
+        }
+    }
+    *link_socket = -1;
+    if (header.link_listener) {
+        int marker;
+        *link_socket = receive_with_fd(link, &marker, sizeof (marker));
+        if (*link_socket == -1) {
+            LOG(LOG_ERROR, "handover from the old server failed");
+            return -1;
+        }
+    }
+    *replication_socket = -1;
+    if (header.replication_listener) {
+        int marker;
+        *replication_socket = receive_with_fd(link, &marker, sizeof (marker));
+        if (*replication_socket == -1) {
+            LOG(LOG_ERROR, "handover from the old server failed");
+            return -1;
+        }
+    }
+    stats = header.stats;
+    capture_connections = header.capture_connections;
+    // the threads only start once every client is registered, so none finds
+    // another it is talking to missing and drops what it sends to it
+    int *taken_ids = malloc((header.clients ? header.clients : 1) * sizeof (int));
+    if (taken_ids == NULL) {
+        LOG(LOG_ERROR, "handover from the old server failed, out of memory");
+        return -1;
+    }
+    int taken = 0;
+    int i;
+    for (i = 0; i < header.clients; i++) {
+        int r = take_over_client(link);
+        if (r == -1) {
+            LOG(LOG_ERROR, "handover from the old server failed after %d clients", i);
+            return -1;
+        }
+        if (r >= 0) taken_ids[taken++] = r;
+    }
+    for (i = 0; i < taken; i++) {
+        int r = start_client(taken_ids[i]);
+        if (r != 0) {
+            LOG(LOG_ERROR, "could not start a client thread: %s", strerror(r));
+            close(client_hot[taken_ids[i]].fd);
+        }
+    }
+    free(taken_ids);
+    char done = 1;
+    write_all(link, &done, 1);
+    close(link);
+    LOG(LOG_INFO, "took over %d of %d connections in %ld ms", taken, header.clients, now_ms() - start);
+    return master_socket;
+}
 
-    //wipe out the structure before reusing it    
-    bzero(&threads[thread_id], sizeof (struct client_thread));
-    // set the threads file description & id
-    threads[thread_id].fd = fd;
-    threads[thread_id].thread_id = thread_id;
-    //create the thread
-    pthread_create(&threads[thread_id].thread, NULL,
-            client_thread_entry, &threads[thread_id]);
+/**
+ * Hand the listening sockets and every connection to a fresh copy of the
+ * server, started from the same path, then exit.  The clients see no
+ * disconnect, and connections arriving meanwhile wait in the listen backlog.
+ * If the new server fails to start or take over, carry on as before.
+ * @param master_socket, the listening socket
+ * @param local_socket, the unix domain listening socket or -1 if none
+ * @param link_socket, the server link listening socket or -1 if none, the
+ *  links themselves go down and are dialled again by the new server and the
+ *  other servers
+ * @param replication_socket, the standby listening socket or -1 if none,
+ *  the standby loses the stream and follows the new server from a fresh copy
+ * @param argv, the arguments the server was started with
+ */
+void upgrade_server(int master_socket, int local_socket, int link_socket, int replication_socket,
+        char **argv) {
+    long start = now_ms();
+    int link[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, link) == -1) {
+        LOG(LOG_ERROR, "upgrade failed, socketpair: %s", strerror(errno));
+        return;
+    }
+    fcntl(link[0], F_SETFD, FD_CLOEXEC);
 
-    return 0;
+    // the new server's arguments are the old ones, less any -U of an earlier
+    // upgrade, with -U giving it its end of the link
+    int argc = 0;
+    while (argv[argc] != NULL) argc++;
+    char **new_argv = malloc((argc + 3) * sizeof (char *));
+    char link_arg[16];
+    snprintf(link_arg, sizeof (link_arg), "%d", link[1]);
+    int n = 0;
+    new_argv[n++] = argv[0];
+    new_argv[n++] = "-U";
+    new_argv[n++] = link_arg;
+    int i;
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-U") == 0) {
+            i++;
+            continue;
+        }
+        new_argv[n++] = argv[i];
+    }
+    new_argv[n] = NULL;
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        execvp(new_argv[0], new_argv);
+        _exit(127);
+    }
+    free(new_argv);
+    close(link[1]);
+    if (pid == -1) {
+        LOG(LOG_ERROR, "upgrade failed, fork: %s", strerror(errno));
+        close(link[0]);
+        return;
+    }
+
+    // stop every client thread, each parks at its next wait for input
+    upgrading = 1;
+    char wake = 1;
+    write(upgrade_wakeup[1], &wake, 1);
+    int clients;
+    while (1) {
+        pthread_rwlock_rdlock(&aval_thread_stack_lock);
+        clients = MAX_CLIENTS - aval_thread_stack_size;
+        pthread_rwlock_unlock(&aval_thread_stack_lock);
+        if (__sync_fetch_and_add(&parked_clients, 0) == clients) break;
+        epoch_reclaim(); // the ids of connections closed since are counted until pushed back
+        usleep(1000);
+    }
+    long parked_ms = now_ms();
+
+    struct handoff_header header;
+    bzero(&header, sizeof (header));
+    header.magic = HANDOFF_MAGIC;
+    header.clients = clients;
+    header.capture_connections = capture_connections;
+    header.stats = stats;
+    header.local_listener = local_socket != -1;
+    header.link_listener = link_socket != -1;
+    header.replication_listener = replication_socket != -1;
+    int r = send_with_fd(link[0], &header, sizeof (header), master_socket);
+    int marker = 0; // there must be at least a byte to carry a socket
+    if (r == 0 && local_socket != -1) {
+        r = send_with_fd(link[0], &marker, sizeof (marker), local_socket);
+    }
+    if (r == 0 && link_socket != -1) {
+        r = send_with_fd(link[0], &marker, sizeof (marker), link_socket);
+    }
+    if (r == 0 && replication_socket != -1) {
+        r = send_with_fd(link[0], &marker, sizeof (marker), replication_socket);
+    }
+    for (i = 0; i < MAX_CLIENTS && r == 0; i++) {
+        if (threads[i].state == PARKED) r = hand_over_client(link[0], &threads[i]);
+    }
+    char done;
+    if (r == 0 && read_all(link[0], &done, 1) == 0) {
+        LOG(LOG_INFO, "handed over %d connections in %ld ms (%ld ms stopping client threads)",
+                clients, now_ms() - start, parked_ms - start);
+        exit(0);
+    }
+
+    // the new server did not take over, so put it down and carry on
+    LOG(LOG_ERROR, "upgrade failed, carrying on");
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    close(link[0]);
+    upgrading = 0;
+    read(upgrade_wakeup[0], &wake, 1);
+    parked_clients = 0;
+    for (i = 0; i < MAX_CLIENTS; i++) {
+        if (threads[i].state == PARKED) start_client(i);
+    }
+}
+
+/**
+ * Note an upgrade has been asked for, it is done by the main thread
+ */
+void request_upgrade(int sig) {
+    upgrade_requested = 1;
+}
+
+/**
+ * Note a stop has been asked for, it is done by the main thread
+ */
+void request_stop(int sig) {
+    stop_requested = 1;
 }
 
 int main(int argc, char **argv) {
     // ignore sigpipe errors such as writing to a closed pipe
     signal(SIGPIPE, SIG_IGN); 
+    // SIGUSR2 hands the connections over to a new copy of the server
+    signal(SIGUSR2, request_upgrade);
+    signal(SIGTERM, request_stop);
+    // without SA_RESTART, so the signal interrupts a waiting client's poll
+    struct sigaction wake;
+    bzero(&wake, sizeof (wake));
+    wake.sa_handler = wake_client;
+    sigaction(WAKE_SIGNAL, &wake, NULL);
+
+    // take any options, leaving only the port
+    int opt;
+    int upgrade_link = -1; // given to a server started by upgrade_server
+    char *snapshot_path = NULL;
+    char *capture_path = NULL;
+    char *local_path = NULL;
+    int link_port = 0;
+    char *peers[MAX_LINKS];
+    int peer_count = 0;
+    int replication_port = 0;
+    char *primary = NULL;
+    while ((opt = getopt(argc, argv, "o:C:R:M:LU:S:u:l:P:K:zr:F:v:i:e:b:O:AT:H:")) != -1) {
+        switch (opt) {
+            case 'o': operator_password = optarg;
+                break;
+            case 'C': max_connections_per_address = atoi(optarg);
+                break;
+            case 'R': accepts_per_second = atof(optarg);
+                break;
+            case 'M': commands_per_second = atof(optarg);
+                break;
+            case 'L': limit_loopback = 1;
+                break;
+            case 'U': upgrade_link = atoi(optarg);
+                break;
+            case 'S': snapshot_path = optarg;
+                break;
+            case 'u': local_path = optarg;
+                break;
+            case 'l': link_port = atoi(optarg);
+                break;
+            case 'P': if (peer_count < MAX_LINKS) peers[peer_count++] = optarg;
+                break;
+            case 'K': link_key = optarg;
+                break;
+            case 'z': compress_links = 1;
+                break;
+            case 'r': replication_port = atoi(optarg);
+                break;
+            case 'F': primary = optarg;
+                break;
+            case 'i': ping_interval_ms = atoi(optarg) * 1000;
+                break;
+            case 'O': if (sscanf(optarg, "%d:%d", &overload_lag_ms, &overload_queues) != 2
+                        || overload_lag_ms < 0 || overload_queues < 0) argc = 0;
+                break;
+            case 'e': loop_count = atoi(optarg);
+                if (loop_count < 0 || loop_count > MAX_LOOPS) argc = 0;
+                break;
+            case 'b': if (sscanf(optarg, "%d:%d", &loop_line_budget, &loop_byte_budget) != 2
+                        || loop_line_budget < 1 || loop_byte_budget < 1) argc = 0;
+                break;
+            case 'T': capture_path = optarg;
+                break;
+            case 'H': hibernate_after_ms = atoi(optarg) * 1000;
+                if (hibernate_after_ms < 0) argc = 0;
+                break;
+            case 'A': pin_threads = 1;
+                break;
+            case 'v': for (log_level = LOG_DEBUG; log_level > LOG_ERROR; log_level--) {
+                    if (strcmp(optarg, log_level_names[log_level]) == 0) break;
+                }
+                break;
+            default: argc = 0; // force the usage message
+        }
+    }
 
-    // check that has 2 and only two input arguments
-    if (argc != 2) {
-        fprintf(stderr, "usage: sample <tcp port>\n");
+    // check that there is one and only one port left, and that a server
+    // taking links has a key for them
+    if ((link_port || peer_count || replication_port || primary != NULL)
+            && (link_key == NULL || link_key[0] == 0)) argc = 0;
+    if (link_key != NULL && strlen(link_key) >= LINK_NAME_SIZE) argc = 0; // it would not fit a KEY record
+    if (argc - optind != 1) {
+        fprintf(stderr, "usage: sample [-o operator password] [-C connections per address]\n"
+                "              [-R connects per second per address] [-M commands per second per client]\n"
+                "              [-L (limit loopback clients too)] [-S snapshot file]\n"
+                "              [-u unix socket path] [-l server link port]\n"
+                "              [-P host:port of a server to link with]... [-z (compress links)]\n"
+                "              [-K key of up to 63 bytes linked servers and standbys share,\n"
+                "               needed with -l, -P, -r or -F]\n"
+                "              [-r standby port] [-F host:port of a primary to stand by for]\n"
+                "              [-v error|warning|info|debug (log level)]\n"
+                "              [-i seconds between pings, 0 for none]\n"
+                "              [-e event loops, 0 for a thread per client]\n"
+                "              [-b lines:bytes a client may have handled per turn of its loop]\n"
+                "              [-O lag ms:clients with output waiting, to shed load past, 0 for no limit]\n"
+                "              [-A (pin event loops and shard workers to CPUs)]\n"
+                "              [-T file to capture the lines clients send to, see replay.c]\n"
+                "              [-H seconds idle before a client's thread is let go, 0 never]\n"
+                "              <tcp port>\n");
         exit(-1);
     }
 
-    // set the master listening socket
-    int master_socket = create_listen_socket(atoi(argv[1]));
+    // from here on diagnostics go through the log, fatal errors at startup
+    // still go straight to stderr
+    if (log_start() == -1) {
+        perror("could not start the log writer");
+        exit(-1);
+    }
+    if (pin_threads && find_pin_cpus() == -1) {
+        LOG(LOG_WARNING, "threads cannot be pinned to CPUs here, -A is ignored");
+    }
+    if (capture_path != NULL && capture_open(capture_path, upgrade_link != -1) == -1) {
+        perror(capture_path);
+        exit(-1);
+    }
 
-    //set the file status flags, checking for blocking
-    fcntl(master_socket, F_SETFL, fcntl(master_socket, F_GETFL, NULL)&(~O_NONBLOCK));
+    // set the master listening socket, it stays non-blocking so that each
+    // wakeup can accept everything waiting and stop when there is no more
+    int master_socket = -1;
+    int local_socket = -1; // for clients on this host, if -u was given
+    int link_socket = -1; // for links from other servers, if -l was given
+    int replication_socket = -1; // for a standby, if -r was given
+    if (upgrade_link == -1) {
+        // a standby waits here until its primary has gone
+        master_socket = primary != NULL ? follow_primary(primary, atoi(argv[optind]))
+                : create_listen_socket(atoi(argv[optind]));
+        if (master_socket == -1) {
+            perror("could not listen on the port");
+            exit(-1);
+        }
+        if (local_path != NULL) {
+            local_socket = create_local_listen_socket(local_path);
+            if (local_socket == -1) {
+                perror(local_path);
+                exit(-1);
+            }
+        }
+        if (link_port != 0) {
+            link_socket = create_listen_socket(link_port);
+            if (link_socket == -1) {
+                perror("could not listen on the server link port");
+                exit(-1);
+            }
+        }
+        if (replication_port != 0) {
+            replication_socket = create_listen_socket(replication_port);
+            if (replication_socket == -1) {
+                perror("could not listen on the standby port");
+                exit(-1);
+            }
+        }
+    }
 
     // initialise the available thread stack lock
     pthread_rwlock_init(&aval_thread_stack_lock, NULL);
@@ -577,16 +7015,117 @@ int main(int argc, char **argv) {
     // populate the available thread id stack with ids
     populate_stack();
 
+    // compile the reply templates before any client needs one
+    compile_reply_templates();
+
+    // pick the fastest line scanner this CPU supports
+    LOG(LOG_INFO, "using %s line scanning", linescan_init(0));
+
+    // set up the nickname and channel directories
+    init_directories();
+    pthread_key_create(&epoch_record_key, epoch_release_record);
+
+    // start the shard workers that deliver broadcasts
+    start_shards();
+
+    // keep the registry in the snapshot file, reserving what a crashed server
+    // left in it for its clients to reclaim, unless a standby has the
+    // primary's registry reserved already
+    if (snapshot_path != NULL && open_snapshot(snapshot_path, upgrade_link == -1 && primary == NULL) == -1) {
+        perror(snapshot_path);
+        exit(-1);
+    }
+
+    if (pipe(upgrade_wakeup) == -1) {
+        perror("pipe");
+        exit(-1);
+    }
+    fcntl(upgrade_wakeup[0], F_SETFD, FD_CLOEXEC);
+    fcntl(upgrade_wakeup[1], F_SETFD, FD_CLOEXEC);
+
+    // the event loops are running before any connection is taken over
+    if (start_loops() == -1) {
+        perror("could not start the event loops");
+        exit(-1);
+    }
+
+    // with a thread a client, an idle client gives its thread up
+    if (loop_count == 0 && hibernate_after_ms && start_hibernation() == -1) {
+        perror("could not start the hibernation thread");
+        exit(-1);
+    }
+
+    // watch for the server falling behind
+    pthread_t overload_thread;
+    if ((overload_lag_ms || overload_queues)
+            && pthread_create(&overload_thread, NULL, overload_main, NULL) != 0) {
+        perror("could not start the overload check");
+        exit(-1);
+    }
+
+    // take over from the old server when started for an upgrade
+    if (upgrade_link != -1) {
+        master_socket = take_over(upgrade_link, &local_socket, &link_socket, &replication_socket);
+        if (master_socket == -1) exit(-1);
+    }
+
+    // link with the other servers, named by where clients reach us
+    char host[32];
+    if (gethostname(host, sizeof (host)) == -1) strcpy(host, "localhost");
+    host[sizeof (host) - 1] = 0;
+    snprintf(server_link_name, sizeof (server_link_name), "%s:%s", host, argv[optind]);
+    int i;
+    for (i = 0; i < peer_count; i++) {
+        start_link(peers[i], -1);
+    }
+
+    long next_expiry_ms = now_ms() + 1000;
     while (1) {
-        // try to accept an incoming connection
-        int client_sock = accept_incoming(master_socket);
-        // if there is a connection ... handle it
-        if (client_sock != -1) {
-            handle_connection(client_sock);
-        } else {
-            usleep(10000);   
+        // wait for connections, waking each second to expire idle addresses,
+        // while shedding load clients are left waiting in the listen backlog
+        int accepting = shed_level < SHED_ACCEPTS;
+        struct pollfd listeners[4] = {
+            {accepting ? master_socket : -1, POLLIN, 0},
+            {accepting ? local_socket : -1, POLLIN, 0}, // ignored by poll when -1
+            {link_socket, POLLIN, 0},
+            {replication_socket, POLLIN, 0}
+        };
+        poll(listeners, 4, accepting ? 1000 : OVERLOAD_TICK_MS);
+        // accept every connection waiting, as in a reconnect storm they
+        // arrive faster than one a wakeup
+        struct in_addr address;
+        int client_sock;
+        while (accepting && (client_sock = accept_incoming(master_socket, &address)) != -1) {
+            handle_connection(client_sock, address);
+        }
+        while (accepting && local_socket != -1 && (client_sock = accept_incoming(local_socket, &address)) != -1) {
+            handle_connection(client_sock, address);
+        }
+        while (link_socket != -1 && (client_sock = accept_incoming(link_socket, &address)) != -1) {
+            if (start_link(NULL, client_sock) == -1) close(client_sock);
+        }
+        while (replication_socket != -1 && (client_sock = accept_incoming(replication_socket, &address)) != -1) {
+            if (start_standby(client_sock) == -1) close(client_sock);
+        }
+        if (now_ms() >= next_expiry_ms) {
+            admission_expire();
+            expire_reservations();
+            replication_tick();
+            // start writing the snapshot back, so it survives the machine
+            // going down as well as the server
+            if (snapshot != NULL) {
+                msync(snapshot, snapshot_size(MAX_CLIENTS, MAX_CHANNELS), MS_ASYNC);
+            }
+            next_expiry_ms = now_ms() + 1000;
+        }
+        if (upgrade_requested) {
+            upgrade_requested = 0;
+            upgrade_server(master_socket, local_socket, link_socket, replication_socket, argv);
+        }
+        if (stop_requested) {
+            LOG(LOG_INFO, "stopping on SIGTERM");
+            exit(0);
         }
-        //close(client_sock);        
     }
 
     //destroy the available thread stack lock
@@ -0,0 +1,253 @@
+/*
+  Cross-shard delivery benchmark for the NOS 2014 assignment IRC-like chat
+  service.
+
+  (C) Samuel Deane 2014.
+
+  Measures what it costs to deliver a message to a client of the same
+  event loop against a client of another, the ways the server does it:
+
+    same loop      the sender queues the message to the client's out
+                   queue itself, under the client's shard lock, and the
+                   same loop later takes it off the queue.
+    cross locked   the sender, on one core, queues it the same way to a
+                   client whose loop runs on another core, the queue and
+                   lock passing between the two (what the server did
+                   before mailboxes).
+    cross mailbox  the sender posts it to the mailbox (mailbox.h) from
+                   its loop to the other, which queues it locally.
+
+  Pin the two threads to cores on the same or different nodes with -p and
+  -c to see the cost of the distance between them.
+
+  The sender waits when the mailbox is full, as the server's loops do, and
+  the receiver checks every client is handed its messages in the order they
+  were sent; the run fails if one is not.
+
+  usage: shardbench [-n messages] [-p sender cpu] [-c receiver cpu]
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+ */
+
+// for CPU_SET and pthread_setaffinity_np, where there are such things
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/time.h>
+
+#include "mailbox.h"
+
+// as in the server
+#define OUT_QUEUE_SIZE 64
+#define CLIENTS 64 // receiving clients, messages go to each in turn
+
+/**
+ * a client's out queue, as in the server, guarded by its shard lock
+ */
+struct out_queue {
+    unsigned int head;
+    unsigned int tail;
+    void *items[OUT_QUEUE_SIZE];
+};
+
+struct out_queue queues[CLIENTS];
+pthread_mutex_t shard_lock = PTHREAD_MUTEX_INITIALIZER;
+long count = 10000000;
+int sender_cpu = -1;
+int receiver_cpu = -1;
+struct mailbox *box;
+volatile int done = 0;
+long received = 0;
+long last[CLIENTS]; // the last message each client was handed by the mailbox
+long full = 0; // times the sender found the mailbox full
+long out_of_order = 0;
+
+/**
+ * @return the time now in nanoseconds
+ */
+long long now_ns() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000000LL + tv.tv_usec * 1000LL;
+}
+
+/**
+ * Pin the calling thread to a CPU
+ * @param cpu, the CPU or -1 to leave it to the scheduler
+ */
+void pin(int cpu) {
+#ifdef CPU_SET
+    if (cpu < 0) return;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof (set), &set) != 0) {
+        fprintf(stderr, "could not pin to CPU %d\n", cpu);
+    }
+#endif
+}
+
+/**
+ * Queue a message to a client, the caller must hold the shard lock
+ * @return 0 if queued or -1 if the queue is full
+ */
+int enqueue_locked(struct out_queue *q, void *b) {
+    if (q->tail - q->head == OUT_QUEUE_SIZE) return -1;
+    q->items[q->tail % OUT_QUEUE_SIZE] = b;
+    q->tail++;
+    return 0;
+}
+
+/**
+ * Take everything queued to the clients, as their loop sends it
+ * @return the number of messages taken
+ */
+long drain_queues() {
+    long n = 0;
+    int i;
+    pthread_mutex_lock(&shard_lock);
+    for (i = 0; i < CLIENTS; i++) {
+        n += queues[i].tail - queues[i].head;
+        queues[i].head = queues[i].tail;
+    }
+    pthread_mutex_unlock(&shard_lock);
+    return n;
+}
+
+/**
+ * The receiving loop of the locked test, sending what is queued
+ */
+void *locked_receiver(void *arg) {
+    pin(receiver_cpu);
+    while (!done || received < count) {
+        long n = drain_queues();
+        received += n;
+        if (n == 0) sched_yield(); // where the server's loop would sleep in poll
+    }
+    return NULL;
+}
+
+/**
+ * The receiving loop of the mailbox test, collecting what is posted and
+ * queueing it to its clients
+ */
+void *mailbox_receiver(void *arg) {
+    pin(receiver_cpu);
+    struct mail mail[64];
+    while (!done || received < count) {
+        int n = mailbox_collect(box, mail, 64);
+        int i;
+        pthread_mutex_lock(&shard_lock); // uncontended, only this loop takes it here
+        for (i = 0; i < n; i++) {
+            long message = (long) mail[i].data;
+            if (message <= last[mail[i].to]) out_of_order++;
+            last[mail[i].to] = message;
+            enqueue_locked(&queues[mail[i].to], mail[i].data);
+        }
+        pthread_mutex_unlock(&shard_lock);
+        received += n;
+        if (n) drain_queues();
+        else sched_yield();
+    }
+    return NULL;
+}
+
+/**
+ * Run one of the tests
+ * @param test, 0 same loop, 1 cross locked, 2 cross mailbox
+ * @return the nanoseconds per message
+ */
+double run(int test) {
+    memset(queues, 0, sizeof (queues));
+    memset(last, 0, sizeof (last));
+    done = 0;
+    received = 0;
+    full = 0;
+    out_of_order = 0;
+    pthread_t receiver;
+    if (test == 1) pthread_create(&receiver, NULL, locked_receiver, NULL);
+    if (test == 2) pthread_create(&receiver, NULL, mailbox_receiver, NULL);
+    long long start = now_ns();
+    long i;
+    for (i = 0; i < count; i++) {
+        int to = i % CLIENTS;
+        void *b = (void *) (i + 1);
+        if (test == 2) {
+            if (mailbox_post(box, to, 0, b) == 0) continue;
+            full++;
+            while (mailbox_post(box, to, 0, b) == -1) sched_yield();
+            continue;
+        }
+        pthread_mutex_lock(&shard_lock);
+        int r = enqueue_locked(&queues[to], b);
+        pthread_mutex_unlock(&shard_lock);
+        if (r == -1) {
+            // the receiver is behind, where the server would drop the
+            // message this waits so that every test delivers them all
+            if (test == 0) received += drain_queues();
+            else sched_yield();
+            i--;
+        }
+        if (test == 0 && to == CLIENTS - 1) received += drain_queues();
+    }
+    done = 1;
+    if (test == 0) received += drain_queues();
+    else pthread_join(receiver, NULL);
+    return (double) (now_ns() - start) / count;
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "n:p:c:")) != -1) {
+        switch (opt) {
+            case 'n': count = atol(optarg);
+                break;
+            case 'p': sender_cpu = atoi(optarg);
+                break;
+            case 'c': receiver_cpu = atoi(optarg);
+                break;
+            default: count = 0;
+        }
+    }
+    if (count < 1) {
+        fprintf(stderr, "usage: shardbench [-n messages] [-p sender cpu] [-c receiver cpu]\n");
+        exit(-1);
+    }
+    box = calloc(1, sizeof (struct mailbox));
+    if (box == NULL) {
+        perror("calloc");
+        exit(-1);
+    }
+    pin(sender_cpu);
+
+    printf("%ld messages to %d clients, sender on CPU %d, receiver on CPU %d\n",
+            count, CLIENTS, sender_cpu, receiver_cpu);
+    const char *tests[] = {"same loop", "cross locked", "cross mailbox"};
+    double same = 0;
+    int t;
+    for (t = 0; t < 3; t++) {
+        double ns = run(t);
+        if (t == 0) same = ns;
+        printf("%-14s %8.1f ns/msg %7.2fx\n", tests[t], ns, ns / same);
+    }
+    printf("mailbox full %ld times, %ld messages out of order\n", full, out_of_order);
+    free(box);
+    return out_of_order ? 1 : 0;
+}
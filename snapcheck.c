@@ -0,0 +1,207 @@
+/*
+  Snapshot checker for the NOS 2014 assignment IRC-like chat service.
+
+  (C) Samuel Deane 2014.
+
+  Validates a registry snapshot file written by the server (see snapshot.h):
+  the header, the file size, every record's checksum and bounds, and that
+  every channel a client is recorded in exists.  Torn records (a checksum
+  mismatch) are what a crash part way through an update leaves behind, the
+  server drops them on loading, so they are reported but are only an error
+  with -s.
+
+  usage: snapcheck [-s (strict)] [-v (list the records)] <snapshot file>
+
+  exits 0 if the file is valid, 1 if it is not and 2 if it cannot be read
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "snapshot.h"
+
+int errors = 0;
+int torn = 0;
+
+/**
+ * Report a problem with the file
+ */
+void problem(const char *what, unsigned int slot, const char *detail) {
+    printf("%s %u: %s\n", what, slot, detail);
+    errors++;
+}
+
+/**
+ * Check a record's checksum
+ * @return 1 if the record is in use and intact, otherwise 0
+ */
+int check_sum(const char *what, unsigned int slot, const void *record, size_t size, unsigned int sum) {
+    if (sum == 0) {
+        // an empty slot must be all zero, anything else is a half cleared one
+        const unsigned char *p = record;
+        size_t i;
+        for (i = 0; i < size; i++) {
+            if (p[i]) {
+                printf("%s %u: torn, empty but not cleared\n", what, slot);
+                torn++;
+                return 0;
+            }
+        }
+        return 0;
+    }
+    if (snapshot_sum(record, size) != sum) {
+        printf("%s %u: torn, checksum mismatch\n", what, slot);
+        torn++;
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * @return 1 if a name of the given length fits and has no bytes a client
+ *  could not have sent
+ */
+int valid_name(const char *name, int length, int size) {
+    if (length < 1 || length >= size) return 0;
+    int i;
+    for (i = 0; i < length; i++) {
+        if (name[i] == 0 || name[i] == ' ' || name[i] == '\r' || name[i] == '\n') return 0;
+    }
+    return name[length] == 0;
+}
+
+int main(int argc, char **argv) {
+    int strict = 0;
+    int verbose = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "sv")) != -1) {
+        switch (opt) {
+            case 's': strict = 1;
+                break;
+            case 'v': verbose = 1;
+                break;
+            default: argc = 0;
+        }
+    }
+    if (argc - optind != 1) {
+        fprintf(stderr, "usage: snapcheck [-s (strict)] [-v (list the records)] <snapshot file>\n");
+        exit(2);
+    }
+
+    int fd = open(argv[optind], O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        perror(argv[optind]);
+        exit(2);
+    }
+    if (st.st_size < sizeof (struct snapshot_header)) {
+        printf("too short for a snapshot header (%ld bytes)\n", (long) st.st_size);
+        exit(1);
+    }
+    struct snapshot_header *header = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (header == MAP_FAILED) {
+        perror("mmap");
+        exit(2);
+    }
+    if (header->magic != SNAPSHOT_MAGIC) {
+        printf("not a snapshot, bad magic %08x\n", header->magic);
+        exit(1);
+    }
+    if (header->version != SNAPSHOT_VERSION) {
+        printf("snapshot version %u, this checker reads version %u\n", header->version, SNAPSHOT_VERSION);
+        exit(1);
+    }
+    size_t expected = snapshot_size(header->client_slots, header->channel_slots);
+    if (st.st_size != expected) {
+        printf("file is %ld bytes, %u client and %u channel slots need %lu\n", (long) st.st_size,
+                header->client_slots, header->channel_slots, (unsigned long) expected);
+        exit(1);
+    }
+    time_t started = header->started;
+    printf("snapshot version %u generation %u, %u client and %u channel slots, server started %s",
+            header->version, header->generation, header->client_slots, header->channel_slots,
+            ctime(&started));
+
+    // the channels, noting which are live for checking the clients against
+    struct snapshot_channel *channels = snapshot_channels(header);
+    char *live = calloc(header->channel_slots ? header->channel_slots : 1, 1);
+    int channel_count = 0;
+    unsigned int i;
+    for (i = 0; i < header->channel_slots; i++) {
+        struct snapshot_channel *c = &channels[i];
+        if (!check_sum("channel", i, c, sizeof (*c), c->sum)) continue;
+        if (!valid_name(c->name, c->namelength, SNAPSHOT_CHANNEL_NAME_SIZE)) {
+            problem("channel", i, "bad name");
+            continue;
+        }
+        live[i] = 1;
+        channel_count++;
+        if (verbose) printf("channel %u: %s\n", i, c->name);
+    }
+
+    struct snapshot_client *clients = snapshot_clients(header);
+    int client_count = 0;
+    int membership = 0;
+    for (i = 0; i < header->client_slots; i++) {
+        struct snapshot_client *t = &clients[i];
+        if (!check_sum("client", i, t, sizeof (*t), t->sum)) continue;
+        if (!valid_name(t->nickname, t->nicknamelength, SNAPSHOT_NAME_SIZE)) {
+            problem("client", i, "bad nickname");
+            continue;
+        }
+        if (!valid_name(t->username, t->usernamelength, SNAPSHOT_NAME_SIZE)) {
+            problem("client", i, "bad username");
+        }
+        if (t->channel_count < 0 || t->channel_count > SNAPSHOT_MAX_JOINED) {
+            problem("client", i, "bad channel count");
+            continue;
+        }
+        int j;
+        for (j = 0; j < t->channel_count; j++) {
+            if (t->channels[j] < 0 || t->channels[j] >= header->channel_slots) {
+                problem("client", i, "channel id out of range");
+            } else if (!live[t->channels[j]]) {
+                // a channel torn by a crash takes its members' entries with it
+                if (strict) problem("client", i, "in a channel that does not exist");
+            } else {
+                membership++;
+            }
+        }
+        client_count++;
+        if (verbose) {
+            struct in_addr address = {t->address};
+            printf("client %u: %s (%s) from %s in %d channels\n", i, t->nickname,
+                    t->username, inet_ntoa(address), t->channel_count);
+        }
+    }
+
+    printf("%d nicknames, %d channels, %d channel memberships, %d torn records, %d errors\n",
+            client_count, channel_count, membership, torn, errors);
+    free(live);
+    munmap(header, st.st_size);
+    close(fd);
+    return errors || (strict && torn) ? 1 : 0;
+}
@@ -0,0 +1,123 @@
+/*
+  Registry snapshot file format for the NOS 2014 assignment IRC-like chat
+  service.
+
+  (C) Samuel Deane 2014.
+
+  The server keeps the registry (registered nicknames and the channels they
+  are in) in a memory mapped file, rewriting a client's or a channel's record
+  in place whenever it changes.  The records live in the page cache, so they
+  survive the server crashing, and a restarted server maps the file and has
+  the state back in one pass instead of waiting for every client to
+  reconnect and rejoin.  snapcheck validates a file.
+
+  The file is a snapshot_header, then header.channel_slots snapshot_channel
+  records (indexed by channel id), then header.client_slots snapshot_client
+  records (indexed by client id).  Each record carries a checksum of the
+  rest of it, 0 for an empty slot, so a record torn by a crash part way
+  through writing it is recognised and dropped.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+ */
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stddef.h>
+
+#define SNAPSHOT_MAGIC 0x50414e53 // "SNAP"
+// changes whenever a record layout does, a file of another version is ignored
+#define SNAPSHOT_VERSION 1
+
+#define SNAPSHOT_NAME_SIZE 32
+#define SNAPSHOT_CHANNEL_NAME_SIZE 64
+#define SNAPSHOT_MAX_JOINED 16
+
+/**
+ * the start of a snapshot file
+ */
+struct snapshot_header {
+    unsigned int magic;
+    unsigned int version;
+    unsigned int client_slots; // the number of snapshot_client records
+    unsigned int channel_slots; // the number of snapshot_channel records
+    unsigned int generation; // bumped each time a server starts on the file
+    long long started; // when that server started, in seconds since the epoch
+};
+
+/**
+ * a channel that exists, at its channel id
+ */
+struct snapshot_channel {
+    unsigned int sum; // snapshot_sum of the rest of the record, 0 if empty
+    int namelength;
+    char name[SNAPSHOT_CHANNEL_NAME_SIZE];
+};
+
+/**
+ * a registered client, at its client id
+ */
+struct snapshot_client {
+    unsigned int sum; // snapshot_sum of the rest of the record, 0 if empty
+    unsigned int address; // where it connected from, in network byte order
+    int nicknamelength;
+    char nickname[SNAPSHOT_NAME_SIZE];
+    int usernamelength;
+    char username[SNAPSHOT_NAME_SIZE];
+    int channel_count;
+    int channels[SNAPSHOT_MAX_JOINED]; // the ids of the channels it is in
+};
+
+/**
+ * @return the size of a snapshot file with the given number of slots
+ */
+static inline size_t snapshot_size(unsigned int client_slots, unsigned int channel_slots) {
+    return sizeof (struct snapshot_header)
+            + channel_slots * sizeof (struct snapshot_channel)
+            + client_slots * sizeof (struct snapshot_client);
+}
+
+/**
+ * @return the channel records of the snapshot starting at header
+ */
+static inline struct snapshot_channel *snapshot_channels(struct snapshot_header *header) {
+    return (struct snapshot_channel *) (header + 1);
+}
+
+/**
+ * @return the client records of the snapshot starting at header
+ */
+static inline struct snapshot_client *snapshot_clients(struct snapshot_header *header) {
+    return (struct snapshot_client *) (snapshot_channels(header) + header->channel_slots);
+}
+
+/**
+ * Checksum a record, everything after its leading sum field
+ * @param record, the record
+ * @param size, the size of the record
+ * @return the checksum, never 0 so that 0 can mean an empty slot
+ */
+static inline unsigned int snapshot_sum(const void *record, size_t size) {
+    const unsigned char *p = (const unsigned char *) record + sizeof (unsigned int);
+    unsigned int h = 2166136261u;
+    size_t i;
+    for (i = sizeof (unsigned int); i < size; i++) {
+        h = (h ^ *p++) * 16777619u;
+    }
+    return h ? h : 1;
+}
+
+#endif
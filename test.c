@@ -1,820 +1,1378 @@
-/*
-  Test program for NOS 2014 assignment: implement a simple multi-threaded 
-  IRC-like chat service.
-
-  (C) Paul Gardner-Stephen 2014.
-
-  This program is free software; you can redistribute it and/or
-  modify it under the terms of the GNU General Public License
-  as published by the Free Software Foundation; either version 2
-  of the License, or (at your option) any later version.
-
-  This program is distributed in the hope that it will be useful,
-  but WITHOUT ANY WARRANTY; without even the implied warranty of
-  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
-  GNU General Public License for more details.
-
-  You should have received a copy of the GNU General Public License
-  along with this program; if not, write to the Free Software
-  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
-
- */
-
-#include <stdio.h>
-#include <stdlib.h>
-#include <unistd.h>
-#include <sys/socket.h>
-#include <sys/filio.h>
-#include <sys/ioctl.h>
-#include <fcntl.h>
-#include <netinet/in.h>
-#include <string.h>
-#include <strings.h>
-#include <signal.h>
-#include <netdb.h>
-#include <time.h>
-#include <errno.h>
-
-#define TOTAL_TESTS 59
-
-pid_t student_pid = -1;
-int student_port;
-int success = 0;
-int connections = 1000;
-
-char *gradeOf(int score) // works out grade
-{
-    if (score < 50) return "F";
-    if (score < 65) return "P";
-    if (score < 75) return "CR";
-    if (score < 85) return "DN";
-    return "HD";
-}
-
-int create_listen_socket(int port) // listen on port for incomming connection
-{
-    int sock = socket(AF_INET, SOCK_STREAM, 0); //create a ipv4 socket (INET), TCP (SOCK_STREAM), 0 default protocol
-    if (sock == -1) return -1; //fails
-
-    int on = 1;
-    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (char *) &on, sizeof (on)) == -1) {
-        close(sock);
-        return -1; // time out extra packets?
-    }
-    if (ioctl(sock, FIONBIO, (char *) &on) == -1) { //File I/O non blockin I/O
-        close(sock);
-        return -1; //nothing to get close
-    }
-
-    /* Bind it to the next port we want to try. */
-    struct sockaddr_in address;
-    bzero((char *) &address, sizeof (address)); //write zeros to address ... clear it
-    address.sin_family = AF_INET; // ipv4
-    address.sin_addr.s_addr = INADDR_ANY; // accept any connection on this port
-    address.sin_port = htons(port); // orders the bytes to go out on the network (high or low byte consistancy)
-    if (bind(sock, (struct sockaddr *) &address, sizeof (address)) == -1) { // bind the socket and address togeather
-        close(sock);
-        return -1; // send to address recived by this address
-    }
-
-    if (listen(sock, 20) != -1) return sock; // listen to 20 connections in the queue
-    //return the sock which is ready of connections
-    close(sock);
-    return -1;
-}
-
-int accept_incoming(int sock) //try to accept an incoming connection
-{
-    struct sockaddr addr; // hold the remote address
-    unsigned int addr_len = sizeof addr; // the size of the address
-    int asock; // hold socket number
-    if ((asock = accept(sock, &addr, &addr_len)) != -1) { // return an accepted connection
-        return asock;
-    }
-
-    return -1;
-}
-
-int connect_to_port(int port) //connect to port on the local machine
-{
-    struct hostent *hostent;
-    hostent = gethostbyname("127.0.0.1"); // the loopback 'local' address
-    if (!hostent) {
-        return -1;
-    }
-
-    struct sockaddr_in addr;
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(port);
-    addr.sin_addr = *((struct in_addr *) hostent->h_addr);
-    bzero(&(addr.sin_zero), 8);
-
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock == -1) {
-        perror("Failed to create a socket.");
-        return -1;
-    }
-
-    if (connect(sock, (struct sockaddr *) &addr, sizeof (struct sockaddr)) == -1) {
-        perror("connect() to port failed");
-        close(sock);
-        return -1;
-    }
-    return sock;
-}
-
-int read_from_socket(int sock, unsigned char *buffer, int *count, int buffer_size,
-        int timeout) {
-    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, NULL) | O_NONBLOCK); // make sure sock wont block
-
-
-    int t = time(0) + timeout;
-    if (*count >= buffer_size) return 0; // got some data return zero
-    int r = read(sock, &buffer[*count], buffer_size - *count);
-    //address of the 0th elem in the array buffer
-    while (r != 0) {
-        if (r > 0) {
-            (*count) += r;
-            break;
-        }
-        r = read(sock, &buffer[*count], buffer_size - *count);
-        if (r == -1 && errno != EAGAIN) { // no double error
-            perror("read() returned error. Stopping reading from socket.");
-            return -1;
-        } else usleep(100000); // sleep 
-        // timeout after a few seconds of nothing
-        if (time(0) >= t) break; //check the timeout
-    }
-    buffer[*count] = 0; //null the end of the string
-    return 0;
-}
-
-int launch_student_programme(const char *executable) {
-    // Find a free TCP port for the student programme to listen on
-    // that is not currently in use.
-    student_port = (getpid() | 0x8000)&0xffff; //process id or 80000 and make sure is <64k
-    int portclear = 0;
-    while (!portclear && (student_port < 65536)) { // all go get a clear port no
-        int sock = connect_to_port(student_port);
-        if (sock == -1) portclear = 1;
-        else close(sock);
-    }
-    fprintf(stderr, "Port %d is available for use by student programme.\n",
-            student_port);
-
-    pid_t child_pid = fork(); // now to programs
-
-    if (child_pid == -1) {
-        perror("fork");
-        return -1;
-    }
-    char port[128];
-    snprintf(port, 128, "%d", student_port); //
-    const char *const args[] = {executable, port, NULL, NULL}; //
-
-    if (!child_pid) {
-        // as the child: so exec() to the student's program
-        execv(executable, (char **) args);
-        /* execv doesn't return if it is successful */
-        perror("execv");
-        return -1;
-    }
-    /*
-      parent: just remember the PID so that we can kill it later
-     */
-    student_pid = child_pid;
-    return 0;
-}
-
-int test_listensonport() // see if program will listen on a port
-{
-    /* Test that student programme accepts a connection on the port */
-    int i;
-    for (i = 0; i < 10; i++) {
-        int sock = connect_to_port(student_port);
-        if (sock>-1) {
-            close(sock);
-            printf("SUCCESS: Accepts connections on specified TCP port\n");
-            success++;
-            return 0;
-        }
-        // allow some time for the student programme to get sorted.
-        // 100ms x 10 times should be enough
-        usleep(100000);
-    }
-    printf("FAIL: Accepting connection on a TCP port.\n");
-    return -1;
-}
-
-int test_acceptmultipleconnections() {
-    /* Test that student programme accepts 1,000 successive connections.
-       Further test that it can do so within a minute. */
-    int start_time = time(0);
-    int i;    
-    for (i = 0; i <= connections; i++) {
-        int sock = connect_to_port(student_port);
-        // Be merciful with student programs that are too slow to take 1,000 connections
-        // coming in really fast.
-        if (sock == -1) {
-            if (i < 10) usleep(100000);
-            else usleep(1000);
-            sock = connect_to_port(student_port);
-        }
-        if (sock == -1) {
-            printf("FAIL: Accepting multiple connections on a TCP port (failed on attempt %d).\n", i);
-            return -1;
-        }
-        write(sock, "QUIT\n\r", 6);
-        close(sock);
-        printf("\rMade %d/%d connections", i, connections);
-        fflush(stdout);
-        // allow upto 5 minutes to handle the 1,000 connections.
-        if (time(0) - start_time > 300) break;
-    }
-    printf("\n");
-
-    int end_time = time(0);
-
-    if (i == connections + 1) {
-        printf("SUCCESS: Accepting multiple connections on a TCP port\n");
-        success++;
-    } else
-        printf("FAIL: Accepting multiple connections on a TCP port. Did not complete 1,000 connections in less than 5 minutes.\n");
-
-    if (end_time - start_time > 60)
-        printf("FAIL: Accept 1,000 connections in less than a minute.\n");
-    else {
-        printf("SUCCESS: Accepted 1,000 connections in less than a minute.\n");
-        success++;
-    }
-    if (end_time - start_time > 30)
-        printf("FAIL: Accept 1,000 connections in less than 30 seconds.\n");
-    else {
-        printf("SUCCESS: Accepted 1,000 connections in less than 30 seconds.\n");
-        success++;
-    }
-    if (end_time - start_time > 10)
-        printf("FAIL: Accept 1,000 connections in less than 10 seconds.\n");
-    else {
-        printf("SUCCESS: Accepted 1,000 connections in less than 10 seconds.\n");
-        success++;
-    }
-    if (end_time - start_time > 3)
-        printf("FAIL: Accept 1,000 connections in less than 3 seconds.\n");
-    else {
-        printf("SUCCESS: Accepted 1,000 connections in less than 3 seconds.\n");
-        success++;
-    }
-
-    return 0;
-}
-
-int test_next_response_is(char *code, char *mynick, char *buffer, int *bytes,
-        char *inresponseto, char *expectedbody, int silentP) {
-    if ((*bytes) < 10) {
-        if (!silentP)
-            printf("FAIL: Too few bytes from server (%d) when looking for"
-                " server message '%s' in response to %s\n",
-                *bytes, code, inresponseto);
-        return -1;
-    } else {
-        if (!silentP)
-            printf("PROGRESS: There are at least 10 bytes when looking for server message '%s' in response to %s\n", code, inresponseto);
-    }
-    int n = 0;
-    char thecode[1024];
-    char serverid[*bytes];
-    char thenick[*bytes];
-    char themessage[*bytes];
-    int r = sscanf(buffer, ":%[^ ] %s %s %[^\n]%*[\n\r]%n",
-            serverid, thecode, thenick, themessage, &n);
-
-    if (r != 4) {
-        if (!silentP) {
-            printf("FAIL: Could not parse server message in response to %s (parsed %d out of %d fields)\n",
-                    inresponseto, r, 4);
-            printf("      This is what the server sent me: '%s'\n", buffer);
-        }
-        return -1;
-    } else {
-        if (!silentP)
-            printf("PROGRESS: Could parse server message in response to %s (saw message type '%s')\n", inresponseto, thecode);
-    }
-
-    if (n > 0 && (n <= (*bytes))) {
-        bcopy(&buffer[n], &buffer[0], (*bytes) - n);
-        (*bytes) = (*bytes) - n;
-        if (!silentP)
-            printf("PROGRESS: Server message in response to %s was a sensible length.\n",
-                inresponseto);
-    } else {
-        if (!silentP) {
-            printf("FAIL: Server message in response to %s was not a sensible length (length was %d).\n", inresponseto, n);
-            printf("      This is what the server sent me: '%s'\n", buffer);
-        }
-        *bytes = 0;
-        return -1;
-    }
-
-    if (strcasecmp(mynick, thenick)) {
-        if (!silentP)
-            printf("FAIL: Server message in response to %s contains wrong nick name (saw '%s' instead of '%s').\n", inresponseto, thenick, mynick);
-        return -1;
-    } else {
-        if (!silentP)
-            printf("PROGRESS: Server message in response to %s contains correct nick name ('%s').\n", inresponseto, mynick);
-    }
-    if (strcasecmp(code, thecode)) {
-        if (!silentP)
-            printf("FAIL: Server message in response to %s contains wrong code (saw '%s' instead of '%s').\n",
-                inresponseto, thecode, code);
-        return -1;
-    } else {
-        if (!silentP) {
-            printf("SUCCESS: Server message in response to %s contains correct response code ('%s').\n", inresponseto, code);
-            success++;
-        }
-    }
-
-    if (expectedbody != NULL) {
-        if (strcasecmp(code, thecode)) {
-            printf("FAIL: Server message in response to %s contains body (saw '%s' instead of '%s').\n",
-                    inresponseto, themessage, expectedbody);
-            return -1;
-        } else {
-            printf("SUCCESS: Server message in response to %s contains correct response body ('%s').\n", inresponseto, expectedbody);
-            success++;
-        }
-
-    }
-
-    return 0;
-}
-
-int test_next_response_is_error(char *message, char *buffer, int *bytes,
-        char *inresponseto) {
-    if ((*bytes) < 10) {
-        printf("FAIL: Too few bytes from server (%d) when looking for server error '%s' in response to %s\n",
-                *bytes, message, inresponseto);
-        return -1;
-    } else {
-        printf("PROGRESS: There are at least 10 bytes when looking for server error '%s' in response to %s\n", message, inresponseto);
-    }
-    int n = 0;
-    char themessage[*bytes];
-    int r = sscanf(buffer, "ERROR :%[^:]: %*[^\n]%*[\n\r]%n",
-            themessage, &n);
-    if (n > 0 && (n <= (*bytes))) {
-        bcopy(&buffer[n], &buffer[0], (*bytes) - n);
-        (*bytes) = (*bytes) - n;
-        printf("PROGRESS: Server ERROR message in response to %s was a sensible length.\n", inresponseto);
-    } else {
-        printf("FAIL: Server ERROR message in response to %s was not a sensible length (length was %d).\n", inresponseto, n);
-        printf("      This is what the server sent me: '%s'\n", buffer);
-        printf("      Don't forget errors like like 'ERROR :foo: bar (quux)'\n");
-        *bytes = 0;
-        return -1;
-    }
-
-    if (r != 1) {
-        printf("FAIL: Could not parse server error message in response to %s (parsed %d out of %d fields)\n", inresponseto, r, 1);
-        return -1;
-    } else {
-        printf("PROGRESS: Saw well-formed server error in response to %s (saw '%s')\n",
-                inresponseto, themessage);
-    }
-    if (strcasecmp(message, themessage)) {
-        printf("FAIL: Server error in response to %s contains wrong message (saw '%s' instead of '%s').\n", inresponseto, themessage, message);
-        return -1;
-    } else {
-        printf("SUCCESS: Server error in response to %s contains correct message.\n",
-                inresponseto);
-        success++;
-    }
-    return 0;
-}
-
-int failif(int failuretest, char *failmsg, char *successmsg) {
-    if (failuretest) {
-        printf("FAIL: %s\n", failmsg);
-        return -1;
-    } else {
-        printf("SUCCESS: %s\n", successmsg);
-        success++;
-        return 0;
-    }
-}
-
-char *channel_names[] = {"#deutsch", "#koeln", "#leipzig", "#bonn"};
-char *greetings[] = {"Hallo alle", "Guten abend", "Wie geht's alle?", "moin",
-    "Gibt es jemand hier?", "Ich bin eine Kartoffel",
-    "Pausenzeit", "Kann mir jemand helfen mit meinem Auftragt?"};
-char *nick_names[] = {"agentsmith", "neo", "trinity", "sportacus",
-    "yogibear", "silvester", "daffy", "wecoyote"};
-char *real_names[] = {"Sabina Müller", "Michael J. Fox", "A. Troll", "Tony Abbott",
-    "Queen Elizabeth, Lord of Mann", "Bob the Tomato",
-    "Napoleon Bonaparte", "Valgerður Gunnarsdóttir"};
-
-int test_beforeregistration() {
-    /* Test that student programme accepts 1,000 successive connections.
-       Further test that it can do so within a minute. */
-    int sock = connect_to_port(student_port);
-    if (sock == -1) {
-        printf("FAIL: Could not connect to server\n");
-        return -1;
-    } else {
-        printf("SUCCESS: Connected to server\n");
-        success++;
-    }
-
-    char buffer[8192];
-    int bytes = 0;
-    int r;
-    char cmd[8192];
-
-    // Check for server response
-    r = read_from_socket(sock, (unsigned char *) buffer, &bytes, sizeof (buffer), 2);
-    if (r || (bytes < 1)) {
-        close(sock);
-        printf("FAIL: No greeting received from server.\n");
-        return -1;
-    } else {
-        printf("SUCCESS: Server said something\n");
-        success++;
-    }
-    if (bytes > 8191) bytes = 8191;
-    if (bytes >= 0 && bytes < 8192) buffer[bytes] = 0;
-    // Check for initial server greeting
-    test_next_response_is("020", "*", buffer, &bytes, "newly created connection", NULL, 0);
-    // check that there is nothing more in there    
-    if (failif(bytes > 0,
-            "Extraneous server message(s)",
-            "Server said nothing else before registration")) {
-        printf("FAIL: There are %d extra bytes: '%s'\n", bytes, buffer);
-        return -1;
-    }
-    r = read_from_socket(sock, (unsigned char *) buffer, &bytes, sizeof (buffer), 6);
-    test_next_response_is_error("Closing Link", buffer, &bytes,
-            "waiting 5 seconds for the connection to timeout");
-    if (failif(bytes > 0,
-            "Extraneous server message(s) after timeout ERROR message",
-            "Server said nothing else before registration")) {
-        printf("FAIL: There are %d extra bytes: '%s'\n", bytes, buffer);
-        return -1;
-    }
-
-    // connections should have timed out, so get a fresh one
-    close(sock);
-    sock = connect_to_port(student_port);
-    if (sock == -1) {
-        printf("FAIL: Could not connect to server\n");
-        return -1;
-    } else {
-        printf("SUCCESS: Connected to server\n");
-        success++;
-    }
-    r = read_from_socket(sock, (unsigned char *) buffer, &bytes, sizeof (buffer), 2);
-    test_next_response_is("020", "*", buffer, &bytes, "initial connection", NULL, 0);
-
-    // Confirm that we can't send JOIN or MSG before registering
-    sprintf(cmd, "JOIN %s\n\r", channel_names[getpid()&3]);
-    int w = write(sock, cmd, strlen(cmd));
-    // expect a 241 complaint message
-    r = read_from_socket(sock, (unsigned char *) buffer, &bytes, sizeof (buffer), 2);
-    test_next_response_is("241", "*", buffer, &bytes,
-            "JOIN command sent before registration", NULL, 0);
-    sprintf(cmd, "PRIVMSG %s :%s\n\r",
-            channel_names[getpid()&3],
-            greetings[time(0)&7]);
-    w = write(sock, cmd, strlen(cmd));
-    // expect a 241 complaint message
-    r = read_from_socket(sock, (unsigned char *) buffer, &bytes, sizeof (buffer), 2);
-    test_next_response_is("241", "*", buffer, &bytes,
-            "PRIVMSG command send before registration", NULL, 0);
-
-    w = write(sock, "PONG\r\n", 6);
-    // expect nothing
-    r = read_from_socket(sock, (unsigned char *) buffer, &bytes, sizeof (buffer), 2);
-    failif(bytes > 0, "Server said something in response to PONG command",
-            "Server correctly said nothing in response to PONG");
-
-
-    w = write(sock, "QUIT\r\n", 6);
-    // expect nothing
-    r = read_from_socket(sock, (unsigned char *) buffer, &bytes, sizeof (buffer), 7);
-    test_next_response_is_error("Closing Link", buffer, &bytes,
-            "QUIT command closes connection");
-    close(sock);
-
-    return 0;
-}
-
-int test_registration() {
-    /* Test that student programme accepts 1,000 successive connections.
-       Further test that it can do so within a minute. */
-    int sock = connect_to_port(student_port);
-    if (sock == -1) {
-        printf("FAIL: Could not connect to server\n");
-        return -1;
-    } else {
-        printf("SUCCESS: Connected to server\n");
-        success++;
-    }
-
-    char buffer[8192];
-    int bytes = 0;
-    int r;
-    char cmd[8192];
-
-    // Check for initial server response
-    r = read_from_socket(sock, (unsigned char *) buffer, &bytes, sizeof (buffer), 2);
-    if (r || (bytes < 1)) {
-        close(sock);
-        printf("FAIL: No greeting received from server.\n");
-        return -1;
-    } else {
-        printf("SUCCESS: Server said something\n");
-        success++;
-    }
-    if (bytes > 8191) bytes = 8191;
-    if (bytes >= 0 && bytes < 8192) buffer[bytes] = 0;
-    // Check for initial server greeting
-    test_next_response_is("020", "*", buffer, &bytes, "initial connection", NULL, 0);
-    // check that there is nothing more in there    
-    if (failif(bytes > 0,
-            "Extraneous server message(s)",
-            "Server said nothing else before registration")) {
-        printf("FAIL: There are %d extra bytes: '%s'\n", bytes, buffer);
-        return -1;
-    }
-
-    // Now send NICK & USER commands to register.
-
-    char *mynickname = nick_names[random()&7];
-
-    sprintf(cmd, "NICK %s\n\r", mynickname);
-    int w = write(sock, cmd, strlen(cmd));
-    r = read_from_socket(sock, (unsigned char *) buffer, &bytes, sizeof (buffer), 2);
-    if (failif(bytes > 0,
-            "Extraneous server message(s) after NICK but before USER was sent",
-            "Server said nothing extra during registration")) {
-        printf("FAIL: There are %d extra bytes: '%s'\n", bytes, buffer);
-        return -1;
-    }
-
-    sprintf(cmd, "USER %s\n\r", channel_names[getpid()&3]);
-    w = write(sock, cmd, strlen(cmd));
-    // expect registration messages
-    r = read_from_socket(sock, (unsigned char *) buffer, &bytes, sizeof (buffer), 2);
-    // Expect 4 greeting lines (a little arbitrary, but that's okay for an assignment)
-    test_next_response_is("001", mynickname, buffer, &bytes, "USER", NULL, 0);
-    test_next_response_is("002", mynickname, buffer, &bytes, "USER", NULL, 0);
-    test_next_response_is("003", mynickname, buffer, &bytes, "USER", NULL, 0);
-    test_next_response_is("004", mynickname, buffer, &bytes, "USER", NULL, 0);
-    // Also expect 3 (again an arbitrary number) of statistics lines
-    test_next_response_is("253", mynickname, buffer, &bytes, "USER", NULL, 0);
-    test_next_response_is("254", mynickname, buffer, &bytes, "USER", NULL, 0);
-    test_next_response_is("255", mynickname, buffer, &bytes, "USER", NULL, 0);
-
-    // Make sure connection doesn't time out after 5 seconds once registered
-    // (is supposed to be 60 seconds, but we will jsut check 30 so that the tests
-    // don't take too long to run.
-    r = read_from_socket(sock, (unsigned char *) buffer, &bytes, sizeof (buffer), 35);
-    failif(bytes > 0, "Server said something or timed out too quickly after registration",
-            "Server correctly said nothing while idle for several seconds after registration");
-    if (bytes > 0) {
-        printf("FAIL: There are %d extra bytes: '%s'\n", bytes, buffer);
-        close(sock);
-        return -1;
-    }
-
-    // Now that we are registered, try sending ourselves a message
-    char *greeting = greetings[time(0)&7];
-    sprintf(cmd, "PRIVMSG %s :%s\n\r", mynickname, greeting);
-    w = write(sock, cmd, strlen(cmd));
-    // Check that we get a message sent back to us
-    r = read_from_socket(sock, (unsigned char *) buffer, &bytes, sizeof (buffer), 2);
-    test_next_response_is("PRIVMSG", mynickname, buffer, &bytes, "PRIVMSG to self",
-            greeting, 0);
-    if (failif(bytes > 0,
-            "Extraneous server message(s) after incoming PRIVMSG",
-            "Server said nothing after incoming PRIVMSG")) {
-        printf("FAIL: These are the %d extra bytes: '%s'\n", bytes, buffer);
-        return -1;
-    }
-    // Make sure connection doesn't time out after 5 seconds once registered
-    // (is supposed to be 60 seconds, but we will jsut check 30 so that the tests
-    // don't take too long to run.  We have to test again here, because the previous
-    // test is immediately after registration completes, where as here the timeout
-    // should be based on having received input from us. We use 35 seconds so that if
-    // the timeout was just set to t+60 seconds at registration, the 35 seconds here
-    // plus the 35 seconds waited earlier will trigger that.
-    r = read_from_socket(sock, (unsigned char *) buffer, &bytes, sizeof (buffer), 35);
-    failif(bytes > 0, "Server said something or timed out too quickly after registration",
-            "Server correctly said nothing while idle for several seconds after registration");
-    if (bytes > 0) {
-        printf("FAIL: There are %d extra bytes: '%s'\n", bytes, buffer);
-        close(sock);
-        return -1;
-    }
-
-    w = write(sock, "QUIT\r\n", 6);
-    // expect nothing
-    r = read_from_socket(sock, (unsigned char *) buffer, &bytes, sizeof (buffer), 7);
-    test_next_response_is_error("Closing Link", buffer, &bytes,
-            "QUIT command closes connection");
-
-    return 0;
-
-}
-
-int new_connection(char *nick) {
-    /* Test that student programme accepts 1,000 successive connections.
-       Further test that it can do so within a minute. */
-    int sock = connect_to_port(student_port);
-    if (sock == -1) return -1;
-
-    char buffer[8192];
-    int bytes = 0;
-    int r;
-    char cmd[8192];
-
-    // Check for initial server response
-    r = read_from_socket(sock, (unsigned char *) buffer, &bytes, sizeof (buffer), 2);
-    if (r || (bytes < 1)) {
-        close(sock);
-        return -1;
-    }
-    if (bytes > 8191) bytes = 8191;
-    if (bytes >= 0 && bytes < 8192) buffer[bytes] = 0;
-    // Check for initial server greeting
-    if (test_next_response_is("020", "*", buffer, &bytes, "initial connection", NULL, 1))
-        return -1;
-    // check that there is nothing more in there    
-    if (bytes > 0) return -1;
-
-    // Now send NICK & USER commands to register.
-
-    sprintf(cmd, "NICK %s\n\r", nick);
-    int w = write(sock, cmd, strlen(cmd));
-    r = read_from_socket(sock, (unsigned char *) buffer, &bytes, sizeof (buffer), 1);
-    if (bytes > 0) return -1;
-
-    sprintf(cmd, "USER %s\n\r", channel_names[getpid()&3]);
-    w = write(sock, cmd, strlen(cmd));
-    // expect registration messages
-    r = read_from_socket(sock, (unsigned char *) buffer, &bytes, sizeof (buffer), 2);
-    // Expect 4 greeting lines (a little arbitrary, but that's okay for an assignment)
-    test_next_response_is("001", nick, buffer, &bytes, "USER", NULL, 1);
-    test_next_response_is("002", nick, buffer, &bytes, "USER", NULL, 1);
-    test_next_response_is("003", nick, buffer, &bytes, "USER", NULL, 1);
-    test_next_response_is("004", nick, buffer, &bytes, "USER", NULL, 1);
-    // Also expect 3 (again an arbitrary number) of statistics lines
-    test_next_response_is("253", nick, buffer, &bytes, "USER", NULL, 1);
-    test_next_response_is("254", nick, buffer, &bytes, "USER", NULL, 1);
-    test_next_response_is("255", nick, buffer, &bytes, "USER", NULL, 1);
-    if (bytes > 0) {
-        printf("FAIL: Server sent extra stuff after registration.\n");
-        printf("      The %d bytes are: '%s'\n", bytes, buffer);
-        close(sock);
-        return -1;
-    }
-
-    return sock;
-}
-
-int test_multipleclients() {
-    int i;
-    char nick[1024];
-    int socks[10];
-
-    char cmd[1024];
-
-    for (i = 0; i < 10; i++) {
-        snprintf(nick, 1024, "user%d", i);
-        socks[i] = new_connection(nick);
-        if (socks[i] < 0) {
-            printf("FAIL: Could not create 10 registered connections\n");
-            for (; i >= 0; i--) if (socks[i]>-1) {
-                    write(socks[i], "QUIT\r\n", 6);
-                    close(socks[i]);
-                }
-            return -1;
-        }
-    }
-    printf("SUCCESS: Created 10 registered client connections.\n");
-    success++;
-
-    char buffer[1024];
-    int bytes;
-    int r;
-
-    int j;
-
-    int delta = (random() % 9) + 1;
-
-    // Send messages between clients
-    for (i = 0; i < 10; i++) {
-        // send PONGs to all clients regularly to keep them alive
-        for (j = 0; j < 10; j++) write(socks[j], "PONG\r\n", 6);
-
-        int target = (i + delta) % 10;
-        char *greeting = greetings[random()&7];
-        snprintf(nick, 1024, "user%d", target);
-        sprintf(cmd, "PRIVMSG %s :%s\n\r", nick, greeting);
-        write(socks[i], cmd, strlen(cmd));
-        // Make sure that each client receives the message sent to it
-        bytes = 0;
-        r = read_from_socket(socks[target], (unsigned char *) buffer,
-                &bytes, sizeof (buffer), 2);
-        snprintf(nick, 1024, "user%d", target);
-        test_next_response_is("PRIVMSG", nick, buffer, &bytes, "PRIVMSG to another user",
-                greeting, 0);
-        r = read_from_socket(socks[i], (unsigned char *) buffer,
-                &bytes, sizeof (buffer), 1);
-        if (r > 0) {
-            snprintf(nick, 1024, "user%d", target);
-            printf("FAIL: PRIVMSG to %s didn't make it to the other client(s)\n", nick);
-            break;
-        }
-        r = read_from_socket(socks[(i + 1) % 10], (unsigned char *) buffer,
-                &bytes, sizeof (buffer), 1);
-        if (r > 0) {
-            snprintf(nick, 1024, "user%d", target);
-            printf("FAIL: PRIVMSG to %s was sent to other client(s)\n", nick);
-            break;
-        }
-    }
-
-    // clean up after ourselves
-    for (i = 0; i < 10; i++) {
-        write(socks[i], "QUIT\r\n", 6);
-        close(socks[i]);
-    }
-
-    // Now create a new connection, and make sure that the old messages don't get
-    // re-delivered.
-    i = random() % 10;
-    snprintf(nick, 1024, "user%d", i);
-    int sock = new_connection(nick);
-    if (sock > 0) {
-        printf("SUCCESS: A new session with a re-used nick does not receive old messages on connection.\n");
-        success++;
-    }
-    r = read_from_socket(sock, (unsigned char *) buffer,
-            &bytes, sizeof (buffer), 2);
-    if (r < 1) {
-        printf("SUCCESS: A new session with a re-used nick does not receive old messages soon after connection.\n");
-        success++;
-    } else {
-        printf("FAIL: A new session with a re-used nick received old messages soon after connection.\n");
-    }
-    write(sock, "QUIT\r\n", 6);
-    close(sock);
-
-    return 0;
-}
-
-int main(int argc, char **argv) {
-    if (argc != 2) {
-        fprintf(stderr, "usage: test <example program>\n");
-        exit(-1);
-    }
-
-    if (atoi(argv[1]) == 0)
-        launch_student_programme(argv[1]);
-    else {
-        student_port = atoi(argv[1]);
-        student_pid = 99999;
-    }
-
-    if (student_pid < 0) {
-        perror("Failed to launch student programme.");
-        return -1;
-    }
-
-    test_listensonport();
-    test_acceptmultipleconnections();
-    test_beforeregistration();
-    test_registration();
-    test_multipleclients();
-
-    int score = success * 84 / TOTAL_TESTS;
-    printf("Passed %d of %d tests.\n"
-            "Score for functional aspects of assignment 1 will be %02d%%.\n"
-            "Score for style (0%% -- 16%%) will be assessed manually.\n"
-            "Therefore your grade for this assignment will be in the range %02d%% -- %02d%% (%s -- %s)\n",
-            success, TOTAL_TESTS,
-            score, score, score + 16, gradeOf(score), gradeOf(score + 15));
-
-    if (student_pid > 100 && student_pid != 99999) {
-        fprintf(stderr, "About to kill student process %d\n", (int) student_pid);
-        int r = kill(student_pid, SIGKILL);
-        fprintf(stderr, "Seeing how that went.\n");
-        if (r) perror("failed to kill() student process.");
-    } else {
-        fprintf(stderr, "Successfully cleaned up student process.\n");
-    }
-
-    return 0;
-}
+/*
+  Test program for NOS 2014 assignment: implement a simple multi-threaded 
+  IRC-like chat service.
+
+  (C) Paul Gardner-Stephen 2014.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/filio.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <strings.h>
+#include <signal.h>
+#include <netdb.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/wait.h>
+
+#define TOTAL_TESTS 116
+
+// the password for OPER the server is started with, a server started by hand
+// for the tests has to be given it with -o
+#define OPERATOR_PASSWORD "kartoffel"
+
+pid_t student_pid = -1;
+int student_port;
+const char *student_executable; // so a test can start another copy
+int success = 0;
+int connections = 1000;
+
+char *gradeOf(int score) // works out grade
+{
+    if (score < 50) return "F";
+    if (score < 65) return "P";
+    if (score < 75) return "CR";
+    if (score < 85) return "DN";
+    return "HD";
+}
+
+int create_listen_socket(int port) // listen on port for incomming connection
+{
+    int sock = socket(AF_INET, SOCK_STREAM, 0); //create a ipv4 socket (INET), TCP (SOCK_STREAM), 0 default protocol
+    if (sock == -1) return -1; //fails
+
+    int on = 1;
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (char *) &on, sizeof (on)) == -1) {
+        close(sock);
+        return -1; // time out extra packets?
+    }
+    if (ioctl(sock, FIONBIO, (char *) &on) == -1) { //File I/O non blockin I/O
+        close(sock);
+        return -1; //nothing to get close
+    }
+
+    /* Bind it to the next port we want to try. */
+    struct sockaddr_in address;
+    bzero((char *) &address, sizeof (address)); //write zeros to address ... clear it
+    address.sin_family = AF_INET; // ipv4
+    address.sin_addr.s_addr = INADDR_ANY; // accept any connection on this port
+    address.sin_port = htons(port); // orders the bytes to go out on the network (high or low byte consistancy)
+    if (bind(sock, (struct sockaddr *) &address, sizeof (address)) == -1) { // bind the socket and address togeather
+        close(sock);
+        return -1; // send to address recived by this address
+    }
+
+    if (listen(sock, 20) != -1) return sock; // listen to 20 connections in the queue
+    //return the sock which is ready of connections
+    close(sock);
+    return -1;
+}
+
+int accept_incoming(int sock) //try to accept an incoming connection
+{
+    struct sockaddr addr; // hold the remote address
+    unsigned int addr_len = sizeof addr; // the size of the address
+    int asock; // hold socket number
+    if ((asock = accept(sock, &addr, &addr_len)) != -1) { // return an accepted connection
+        return asock;
+    }
+
+    return -1;
+}
+
+int connect_to_port(int port) //connect to port on the local machine
+{
+    struct hostent *hostent;
+    hostent = gethostbyname("127.0.0.1"); // the loopback 'local' address
+    if (!hostent) {
+        return -1;
+    }
+
+    struct sockaddr_in addr;
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr = *((struct in_addr *) hostent->h_addr);
+    bzero(&(addr.sin_zero), 8);
+
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock == -1) {
+        perror("Failed to create a socket.");
+        return -1;
+    }
+
+    if (connect(sock, (struct sockaddr *) &addr, sizeof (struct sockaddr)) == -1) {
+        perror("connect() to port failed");
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+int read_from_socket(int sock, unsigned char *buffer, int *count, int buffer_size,
+        int timeout) {
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, NULL) | O_NONBLOCK); // make sure sock wont block
+
+
+    int t = time(0) + timeout;
+    if (*count >= buffer_size) return 0; // got some data return zero
+    int r = read(sock, &buffer[*count], buffer_size - *count);
+    //address of the 0th elem in the array buffer
+    while (r != 0) {
+        if (r > 0) {
+            (*count) += r;
+            break;
+        }
+        r = read(sock, &buffer[*count], buffer_size - *count);
+        if (r == -1 && errno != EAGAIN) { // no double error
+            perror("read() returned error. Stopping reading from socket.");
+            return -1;
+        } else usleep(100000); // sleep 
+        // timeout after a few seconds of nothing, but keep what was just read
+        if (r <= 0 && time(0) >= t) break; //check the timeout
+    }
+    buffer[*count] = 0; //null the end of the string
+    return 0;
+}
+
+// read until the server has sent a line containing marker, as an answer of
+// several lines can take more than one read
+int read_until(int sock, char *buffer, int *bytes, int buffer_size, char *marker,
+        int timeout) {
+    int t = time(0) + timeout;
+    buffer[*bytes] = 0;
+    while (strstr(buffer, marker) == NULL && time(0) < t) {
+        if (read_from_socket(sock, (unsigned char *) buffer, bytes, buffer_size - 1, 1))
+            return -1;
+    }
+    return strstr(buffer, marker) == NULL ? -1 : 0;
+}
+
+int launch_student_programme(const char *executable, const char *const *options) {
+    // Find a free TCP port for the student programme to listen on
+    // that is not currently in use.
+    student_port = (getpid() | 0x8000)&0xffff; //process id or 80000 and make sure is <64k
+    int portclear = 0;
+    while (!portclear && (student_port < 65536)) { // all go get a clear port no
+        int sock = connect_to_port(student_port);
+        if (sock == -1) portclear = 1;
+        else {
+            close(sock);
+            student_port++;
+        }
+    }
+    fprintf(stderr, "Port %d is available for use by student programme.\n",
+            student_port);
+
+    pid_t child_pid = fork(); // now to programs
+
+    if (child_pid == -1) {
+        perror("fork");
+        return -1;
+    }
+    char port[128];
+    snprintf(port, 128, "%d", student_port); //
+    const char *args[16];
+    int n = 0;
+    args[n++] = executable;
+    while (*options != NULL && n < 14) args[n++] = *options++; // before the port
+    args[n++] = port;
+    args[n] = NULL;
+
+    if (!child_pid) {
+        // as the child: so exec() to the student's program
+        execv(executable, (char **) args);
+        /* execv doesn't return if it is successful */
+        perror("execv");
+        return -1;
+    }
+    /*
+      parent: just remember the PID so that we can kill it later
+     */
+    student_pid = child_pid;
+    return 0;
+}
+
+int test_listensonport() // see if program will listen on a port
+{
+    /* Test that student programme accepts a connection on the port */
+    int i;
+    for (i = 0; i < 10; i++) {
+        int sock = connect_to_port(student_port);
+        if (sock>-1) {
+            close(sock);
+            printf("SUCCESS: Accepts connections on specified TCP port\n");
+            success++;
+            return 0;
+        }
+        // allow some time for the student programme to get sorted.
+        // 100ms x 10 times should be enough
+        usleep(100000);
+    }
+    printf("FAIL: Accepting connection on a TCP port.\n");
+    return -1;
+}
+
+int test_acceptmultipleconnections() {
+    /* Test that student programme accepts 1,000 successive connections.
+       Further test that it can do so within a minute. */
+    int start_time = time(0);
+    int i;    
+    for (i = 0; i <= connections; i++) {
+        int sock = connect_to_port(student_port);
+        // Be merciful with student programs that are too slow to take 1,000 connections
+        // coming in really fast.
+        if (sock == -1) {
+            if (i < 10) usleep(100000);
+            else usleep(1000);
+            sock = connect_to_port(student_port);
+        }
+        if (sock == -1) {
+            printf("FAIL: Accepting multiple connections on a TCP port (failed on attempt %d).\n", i);
+            return -1;
+        }
+        write(sock, "QUIT\n\r", 6);
+        close(sock);
+        printf("\rMade %d/%d connections", i, connections);
+        fflush(stdout);
+        // allow upto 5 minutes to handle the 1,000 connections.
+        if (time(0) - start_time > 300) break;
+    }
+    printf("\n");
+
+    int end_time = time(0);
+
+    if (i == connections + 1) {
+        printf("SUCCESS: Accepting multiple connections on a TCP port\n");
+        success++;
+    } else
+        printf("FAIL: Accepting multiple connections on a TCP port. Did not complete 1,000 connections in less than 5 minutes.\n");
+
+    if (end_time - start_time > 60)
+        printf("FAIL: Accept 1,000 connections in less than a minute.\n");
+    else {
+        printf("SUCCESS: Accepted 1,000 connections in less than a minute.\n");
+        success++;
+    }
+    if (end_time - start_time > 30)
+        printf("FAIL: Accept 1,000 connections in less than 30 seconds.\n");
+    else {
+        printf("SUCCESS: Accepted 1,000 connections in less than 30 seconds.\n");
+        success++;
+    }
+    if (end_time - start_time > 10)
+        printf("FAIL: Accept 1,000 connections in less than 10 seconds.\n");
+    else {
+        printf("SUCCESS: Accepted 1,000 connections in less than 10 seconds.\n");
+        success++;
+    }
+    if (end_time - start_time > 3)
+        printf("FAIL: Accept 1,000 connections in less than 3 seconds.\n");
+    else {
+        printf("SUCCESS: Accepted 1,000 connections in less than 3 seconds.\n");
+        success++;
+    }
+
+    return 0;
+}
+
+int test_next_response_is(char *code, char *mynick, char *buffer, int *bytes,
+        char *inresponseto, char *expectedbody, int silentP) {
+    if ((*bytes) < 10) {
+        if (!silentP)
+            printf("FAIL: Too few bytes from server (%d) when looking for"
+                " server message '%s' in response to %s\n",
+                *bytes, code, inresponseto);
+        return -1;
+    } else {
+        if (!silentP)
+            printf("PROGRESS: There are at least 10 bytes when looking for server message '%s' in response to %s\n", code, inresponseto);
+    }
+    int n = 0;
+    char thecode[1024];
+    char serverid[*bytes];
+    char thenick[*bytes];
+    char themessage[*bytes];
+    int r = sscanf(buffer, ":%[^ ] %s %s %[^\n]%*[\n\r]%n",
+            serverid, thecode, thenick, themessage, &n);
+
+    if (r != 4) {
+        if (!silentP) {
+            printf("FAIL: Could not parse server message in response to %s (parsed %d out of %d fields)\n",
+                    inresponseto, r, 4);
+            printf("      This is what the server sent me: '%s'\n", buffer);
+        }
+        return -1;
+    } else {
+        if (!silentP)
+            printf("PROGRESS: Could parse server message in response to %s (saw message type '%s')\n", inresponseto, thecode);
+    }
+
+    if (n > 0 && (n <= (*bytes))) {
+        bcopy(&buffer[n], &buffer[0], (*bytes) - n);
+        (*bytes) = (*bytes) - n;
+        if (!silentP)
+            printf("PROGRESS: Server message in response to %s was a sensible length.\n",
+                inresponseto);
+    } else {
+        if (!silentP) {
+            printf("FAIL: Server message in response to %s was not a sensible length (length was %d).\n", inresponseto, n);
+            printf("      This is what the server sent me: '%s'\n", buffer);
+        }
+        *bytes = 0;
+        return -1;
+    }
+
+    if (strcasecmp(mynick, thenick)) {
+        if (!silentP)
+            printf("FAIL: Server message in response to %s contains wrong nick name (saw '%s' instead of '%s').\n", inresponseto, thenick, mynick);
+        return -1;
+    } else {
+        if (!silentP)
+            printf("PROGRESS: Server message in response to %s contains correct nick name ('%s').\n", inresponseto, mynick);
+    }
+    if (strcasecmp(code, thecode)) {
+        if (!silentP)
+            printf("FAIL: Server message in response to %s contains wrong code (saw '%s' instead of '%s').\n",
+                inresponseto, thecode, code);
+        return -1;
+    } else {
+        if (!silentP) {
+            printf("SUCCESS: Server message in response to %s contains correct response code ('%s').\n", inresponseto, code);
+            success++;
+        }
+    }
+
+    if (expectedbody != NULL) {
+        if (strcasecmp(code, thecode)) {
+            printf("FAIL: Server message in response to %s contains body (saw '%s' instead of '%s').\n",
+                    inresponseto, themessage, expectedbody);
+            return -1;
+        } else {
+            printf("SUCCESS: Server message in response to %s contains correct response body ('%s').\n", inresponseto, expectedbody);
+            success++;
+        }
+
+    }
+
+    return 0;
+}
+
+int test_next_response_is_error(char *message, char *buffer, int *bytes,
+        char *inresponseto) {
+    if ((*bytes) < 10) {
+        printf("FAIL: Too few bytes from server (%d) when looking for server error '%s' in response to %s\n",
+                *bytes, message, inresponseto);
+        return -1;
+    } else {
+        printf("PROGRESS: There are at least 10 bytes when looking for server error '%s' in response to %s\n", message, inresponseto);
+    }
+    int n = 0;
+    char themessage[*bytes];
+    int r = sscanf(buffer, "ERROR :%[^:]: %*[^\n]%*[\n\r]%n",
+            themessage, &n);
+    if (n > 0 && (n <= (*bytes))) {
+        bcopy(&buffer[n], &buffer[0], (*bytes) - n);
+        (*bytes) = (*bytes) - n;
+        printf("PROGRESS: Server ERROR message in response to %s was a sensible length.\n", inresponseto);
+    } else {
+        printf("FAIL: Server ERROR message in response to %s was not a sensible length (length was %d).\n", inresponseto, n);
+        printf("      This is what the server sent me: '%s'\n", buffer);
+        printf("      Don't forget errors like like 'ERROR :foo: bar (quux)'\n");
+        *bytes = 0;
+        return -1;
+    }
+
+    if (r != 1) {
+        printf("FAIL: Could not parse server error message in response to %s (parsed %d out of %d fields)\n", inresponseto, r, 1);
+        return -1;
+    } else {
+        printf("PROGRESS: Saw well-formed server error in response to %s (saw '%s')\n",
+                inresponseto, themessage);
+    }
+    if (strcasecmp(message, themessage)) {
+        printf("FAIL: Server error in response to %s contains wrong message (saw '%s' instead of '%s').\n", inresponseto, themessage, message);
+        return -1;
+    } else {
+        printf("SUCCESS: Server error in response to %s contains correct message.\n",
+                inresponseto);
+        success++;
+    }
+    return 0;
+}
+
+int failif(int failuretest, char *failmsg, char *successmsg) {
+    if (failuretest) {
+        printf("FAIL: %s\n", failmsg);
+        return -1;
+    } else {
+        printf("SUCCESS: %s\n", successmsg);
+        success++;
+        return 0;
+    }
+}
+
+char *channel_names[] = {"#deutsch", "#koeln", "#leipzig", "#bonn"};
+char *greetings[] = {"Hallo alle", "Guten abend", "Wie geht's alle?", "moin",
+    "Gibt es jemand hier?", "Ich bin eine Kartoffel",
+    "Pausenzeit", "Kann mir jemand helfen mit meinem Auftragt?"};
+char *nick_names[] = {"agentsmith", "neo", "trinity", "sportacus",
+    "yogibear", "silvester", "daffy", "wecoyote"};
+char *real_names[] = {"Sabina Müller", "Michael J. Fox", "A. Troll", "Tony Abbott",
+    "Queen Elizabeth, Lord of Mann", "Bob the Tomato",
+    "Napoleon Bonaparte", "Valgerður Gunnarsdóttir"};
+
+int test_beforeregistration() {
+    /* Test that student programme accepts 1,000 successive connections.
+       Further test that it can do so within a minute. */
+    int sock = connect_to_port(student_port);
+    if (sock == -1) {
+        printf("FAIL: Could not connect to server\n");
+        return -1;
+    } else {
+        printf("SUCCESS: Connected to server\n");
+        success++;
+    }
+
+    char buffer[8192];
+    int bytes = 0;
+    int r;
+    char cmd[8192];
+
+    // Check for server response
+    r = read_from_socket(sock, (unsigned char *) buffer, &bytes, sizeof (buffer), 2);
+    if (r || (bytes < 1)) {
+        close(sock);
+        printf("FAIL: No greeting received from server.\n");
+        return -1;
+    } else {
+        printf("SUCCESS: Server said something\n");
+        success++;
+    }
+    if (bytes > 8191) bytes = 8191;
+    if (bytes >= 0 && bytes < 8192) buffer[bytes] = 0;
+    // Check for initial server greeting
+    test_next_response_is("020", "*", buffer, &bytes, "newly created connection", NULL, 0);
+    // check that there is nothing more in there    
+    if (failif(bytes > 0,
+            "Extraneous server message(s)",
+            "Server said nothing else before registration")) {
+        printf("FAIL: There are %d extra bytes: '%s'\n", bytes, buffer);
+        return -1;
+    }
+    r = read_from_socket(sock, (unsigned char *) buffer, &bytes, sizeof (buffer), 6);
+    test_next_response_is_error("Closing Link", buffer, &bytes,
+            "waiting 5 seconds for the connection to timeout");
+    if (failif(bytes > 0,
+            "Extraneous server message(s) after timeout ERROR message",
+            "Server said nothing else before registration")) {
+        printf("FAIL: There are %d extra bytes: '%s'\n", bytes, buffer);
+        return -1;
+    }
+
+    // connections should have timed out, so get a fresh one
+    close(sock);
+    sock = connect_to_port(student_port);
+    if (sock == -1) {
+        printf("FAIL: Could not connect to server\n");
+        return -1;
+    } else {
+        printf("SUCCESS: Connected to server\n");
+        success++;
+    }
+    r = read_from_socket(sock, (unsigned char *) buffer, &bytes, sizeof (buffer), 2);
+    test_next_response_is("020", "*", buffer, &bytes, "initial connection", NULL, 0);
+
+    // Confirm that we can't send JOIN or MSG before registering
+    sprintf(cmd, "JOIN %s\n\r", channel_names[getpid()&3]);
+    int w = write(sock, cmd, strlen(cmd));
+    // expect a 241 complaint message
+    r = read_from_socket(sock, (unsigned char *) buffer, &bytes, sizeof (buffer), 2);
+    test_next_response_is("241", "*", buffer, &bytes,
+            "JOIN command sent before registration", NULL, 0);
+    sprintf(cmd, "PRIVMSG %s :%s\n\r",
+            channel_names[getpid()&3],
+            greetings[time(0)&7]);
+    w = write(sock, cmd, strlen(cmd));
+    // expect a 241 complaint message
+    r = read_from_socket(sock, (unsigned char *) buffer, &bytes, sizeof (buffer), 2);
+    test_next_response_is("241", "*", buffer, &bytes,
+            "PRIVMSG command send before registration", NULL, 0);
+
+    w = write(sock, "PONG\r\n", 6);
+    // expect nothing
+    r = read_from_socket(sock, (unsigned char *) buffer, &bytes, sizeof (buffer), 2);
+    failif(bytes > 0, "Server said something in response to PONG command",
+            "Server correctly said nothing in response to PONG");
+
+
+    w = write(sock, "QUIT\r\n", 6);
+    // expect nothing
+    r = read_from_socket(sock, (unsigned char *) buffer, &bytes, sizeof (buffer), 7);
+    test_next_response_is_error("Closing Link", buffer, &bytes,
+            "QUIT command closes connection");
+    close(sock);
+
+    return 0;
+}
+
+int test_registration() {
+    /* Test that student programme accepts 1,000 successive connections.
+       Further test that it can do so within a minute. */
+    int sock = connect_to_port(student_port);
+    if (sock == -1) {
+        printf("FAIL: Could not connect to server\n");
+        return -1;
+    } else {
+        printf("SUCCESS: Connected to server\n");
+        success++;
+    }
+
+    char buffer[8192];
+    int bytes = 0;
+    int r;
+    char cmd[8192];
+
+    // Check for initial server response
+    r = read_from_socket(sock, (unsigned char *) buffer, &bytes, sizeof (buffer), 2);
+    if (r || (bytes < 1)) {
+        close(sock);
+        printf("FAIL: No greeting received from server.\n");
+        return -1;
+    } else {
+        printf("SUCCESS: Server said something\n");
+        success++;
+    }
+    if (bytes > 8191) bytes = 8191;
+    if (bytes >= 0 && bytes < 8192) buffer[bytes] = 0;
+    // Check for initial server greeting
+    test_next_response_is("020", "*", buffer, &bytes, "initial connection", NULL, 0);
+    // check that there is nothing more in there    
+    if (failif(bytes > 0,
+            "Extraneous server message(s)",
+            "Server said nothing else before registration")) {
+        printf("FAIL: There are %d extra bytes: '%s'\n", bytes, buffer);
+        return -1;
+    }
+
+    // Now send NICK & USER commands to register.
+
+    char *mynickname = nick_names[random()&7];
+
+    sprintf(cmd, "NICK %s\n\r", mynickname);
+    int w = write(sock, cmd, strlen(cmd));
+    r = read_from_socket(sock, (unsigned char *) buffer, &bytes, sizeof (buffer), 2);
+    if (failif(bytes > 0,
+            "Extraneous server message(s) after NICK but before USER was sent",
+            "Server said nothing extra during registration")) {
+        printf("FAIL: There are %d extra bytes: '%s'\n", bytes, buffer);
+        return -1;
+    }
+
+    sprintf(cmd, "USER %s\n\r", channel_names[getpid()&3]);
+    w = write(sock, cmd, strlen(cmd));
+    // expect registration messages
+    r = read_from_socket(sock, (unsigned char *) buffer, &bytes, sizeof (buffer), 2);
+    // Expect 4 greeting lines (a little arbitrary, but that's okay for an assignment)
+    test_next_response_is("001", mynickname, buffer, &bytes, "USER", NULL, 0);
+    test_next_response_is("002", mynickname, buffer, &bytes, "USER", NULL, 0);
+    test_next_response_is("003", mynickname, buffer, &bytes, "USER", NULL, 0);
+    test_next_response_is("004", mynickname, buffer, &bytes, "USER", NULL, 0);
+    // Also expect 3 (again an arbitrary number) of statistics lines
+    test_next_response_is("253", mynickname, buffer, &bytes, "USER", NULL, 0);
+    test_next_response_is("254", mynickname, buffer, &bytes, "USER", NULL, 0);
+    test_next_response_is("255", mynickname, buffer, &bytes, "USER", NULL, 0);
+
+    // Make sure connection doesn't time out after 5 seconds once registered
+    // (is supposed to be 60 seconds, but we will jsut check 30 so that the tests
+    // don't take too long to run.
+    r = read_from_socket(sock, (unsigned char *) buffer, &bytes, sizeof (buffer), 35);
+    failif(bytes > 0, "Server said something or timed out too quickly after registration",
+            "Server correctly said nothing while idle for several seconds after registration");
+    if (bytes > 0) {
+        printf("FAIL: There are %d extra bytes: '%s'\n", bytes, buffer);
+        close(sock);
+        return -1;
+    }
+
+    // Now that we are registered, try sending ourselves a message
+    char *greeting = greetings[time(0)&7];
+    sprintf(cmd, "PRIVMSG %s :%s\n\r", mynickname, greeting);
+    w = write(sock, cmd, strlen(cmd));
+    // Check that we get a message sent back to us
+    r = read_from_socket(sock, (unsigned char *) buffer, &bytes, sizeof (buffer), 2);
+    test_next_response_is("PRIVMSG", mynickname, buffer, &bytes, "PRIVMSG to self",
+            greeting, 0);
+    if (failif(bytes > 0,
+            "Extraneous server message(s) after incoming PRIVMSG",
+            "Server said nothing after incoming PRIVMSG")) {
+        printf("FAIL: These are the %d extra bytes: '%s'\n", bytes, buffer);
+        return -1;
+    }
+    // Make sure connection doesn't time out after 5 seconds once registered
+    // (is supposed to be 60 seconds, but we will jsut check 30 so that the tests
+    // don't take too long to run.  We have to test again here, because the previous
+    // test is immediately after registration completes, where as here the timeout
+    // should be based on having received input from us. We use 35 seconds so that if
+    // the timeout was just set to t+60 seconds at registration, the 35 seconds here
+    // plus the 35 seconds waited earlier will trigger that.
+    r = read_from_socket(sock, (unsigned char *) buffer, &bytes, sizeof (buffer), 35);
+    failif(bytes > 0, "Server said something or timed out too quickly after registration",
+            "Server correctly said nothing while idle for several seconds after registration");
+    if (bytes > 0) {
+        printf("FAIL: There are %d extra bytes: '%s'\n", bytes, buffer);
+        close(sock);
+        return -1;
+    }
+
+    w = write(sock, "QUIT\r\n", 6);
+    // expect nothing
+    r = read_from_socket(sock, (unsigned char *) buffer, &bytes, sizeof (buffer), 7);
+    test_next_response_is_error("Closing Link", buffer, &bytes,
+            "QUIT command closes connection");
+
+    return 0;
+
+}
+
+int new_connection(char *nick) {
+    /* Test that student programme accepts 1,000 successive connections.
+       Further test that it can do so within a minute. */
+    int sock = connect_to_port(student_port);
+    if (sock == -1) return -1;
+
+    char buffer[8192];
+    int bytes = 0;
+    int r;
+    char cmd[8192];
+
+    // Check for initial server response
+    r = read_from_socket(sock, (unsigned char *) buffer, &bytes, sizeof (buffer), 2);
+    if (r || (bytes < 1)) {
+        close(sock);
+        return -1;
+    }
+    if (bytes > 8191) bytes = 8191;
+    if (bytes >= 0 && bytes < 8192) buffer[bytes] = 0;
+    // Check for initial server greeting
+    if (test_next_response_is("020", "*", buffer, &bytes, "initial connection", NULL, 1))
+        return -1;
+    // check that there is nothing more in there    
+    if (bytes > 0) return -1;
+
+    // Now send NICK & USER commands to register.
+
+    sprintf(cmd, "NICK %s\n\r", nick);
+    int w = write(sock, cmd, strlen(cmd));
+    r = read_from_socket(sock, (unsigned char *) buffer, &bytes, sizeof (buffer), 1);
+    if (bytes > 0) return -1;
+
+    sprintf(cmd, "USER %s\n\r", channel_names[getpid()&3]);
+    w = write(sock, cmd, strlen(cmd));
+    // expect registration messages
+    r = read_from_socket(sock, (unsigned char *) buffer, &bytes, sizeof (buffer), 2);
+    // Expect 4 greeting lines (a little arbitrary, but that's okay for an assignment)
+    test_next_response_is("001", nick, buffer, &bytes, "USER", NULL, 1);
+    test_next_response_is("002", nick, buffer, &bytes, "USER", NULL, 1);
+    test_next_response_is("003", nick, buffer, &bytes, "USER", NULL, 1);
+    test_next_response_is("004", nick, buffer, &bytes, "USER", NULL, 1);
+    // Also expect 3 (again an arbitrary number) of statistics lines
+    test_next_response_is("253", nick, buffer, &bytes, "USER", NULL, 1);
+    test_next_response_is("254", nick, buffer, &bytes, "USER", NULL, 1);
+    test_next_response_is("255", nick, buffer, &bytes, "USER", NULL, 1);
+    if (bytes > 0) {
+        printf("FAIL: Server sent extra stuff after registration.\n");
+        printf("      The %d bytes are: '%s'\n", bytes, buffer);
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+int test_multipleclients() {
+    int i;
+    char nick[1024];
+    int socks[10];
+
+    char cmd[1024];
+
+    for (i = 0; i < 10; i++) {
+        snprintf(nick, 1024, "user%d", i);
+        socks[i] = new_connection(nick);
+        if (socks[i] < 0) {
+            printf("FAIL: Could not create 10 registered connections\n");
+            for (; i >= 0; i--) if (socks[i]>-1) {
+                    write(socks[i], "QUIT\r\n", 6);
+                    close(socks[i]);
+                }
+            return -1;
+        }
+    }
+    printf("SUCCESS: Created 10 registered client connections.\n");
+    success++;
+
+    char buffer[1024];
+    int bytes;
+    int r;
+
+    int j;
+
+    int delta = (random() % 9) + 1;
+
+    // Send messages between clients
+    for (i = 0; i < 10; i++) {
+        // send PONGs to all clients regularly to keep them alive
+        for (j = 0; j < 10; j++) write(socks[j], "PONG\r\n", 6);
+
+        int target = (i + delta) % 10;
+        char *greeting = greetings[random()&7];
+        snprintf(nick, 1024, "user%d", target);
+        sprintf(cmd, "PRIVMSG %s :%s\n\r", nick, greeting);
+        write(socks[i], cmd, strlen(cmd));
+        // Make sure that each client receives the message sent to it
+        bytes = 0;
+        r = read_from_socket(socks[target], (unsigned char *) buffer,
+                &bytes, sizeof (buffer), 2);
+        snprintf(nick, 1024, "user%d", target);
+        test_next_response_is("PRIVMSG", nick, buffer, &bytes, "PRIVMSG to another user",
+                greeting, 0);
+        r = read_from_socket(socks[i], (unsigned char *) buffer,
+                &bytes, sizeof (buffer), 1);
+        if (r > 0) {
+            snprintf(nick, 1024, "user%d", target);
+            printf("FAIL: PRIVMSG to %s didn't make it to the other client(s)\n", nick);
+            break;
+        }
+        r = read_from_socket(socks[(i + 1) % 10], (unsigned char *) buffer,
+                &bytes, sizeof (buffer), 1);
+        if (r > 0) {
+            snprintf(nick, 1024, "user%d", target);
+            printf("FAIL: PRIVMSG to %s was sent to other client(s)\n", nick);
+            break;
+        }
+    }
+
+    // clean up after ourselves
+    for (i = 0; i < 10; i++) {
+        write(socks[i], "QUIT\r\n", 6);
+        close(socks[i]);
+    }
+
+    // Now create a new connection, and make sure that the old messages don't get
+    // re-delivered.
+    i = random() % 10;
+    snprintf(nick, 1024, "user%d", i);
+    int sock = new_connection(nick);
+    if (sock > 0) {
+        printf("SUCCESS: A new session with a re-used nick does not receive old messages on connection.\n");
+        success++;
+    }
+    r = read_from_socket(sock, (unsigned char *) buffer,
+            &bytes, sizeof (buffer), 2);
+    if (r < 1) {
+        printf("SUCCESS: A new session with a re-used nick does not receive old messages soon after connection.\n");
+        success++;
+    } else {
+        printf("FAIL: A new session with a re-used nick received old messages soon after connection.\n");
+    }
+    write(sock, "QUIT\r\n", 6);
+    close(sock);
+
+    return 0;
+}
+
+int test_nicknameinuse() {
+    char buffer[8192];
+    int bytes = 0;
+    char cmd[1024];
+
+    int holder = new_connection("nickholder");
+    int sender = new_connection("nicksender");
+    int impostor = connect_to_port(student_port);
+    if (holder < 0 || sender < 0 || impostor < 0) {
+        printf("FAIL: Could not create connections to try a nickname in use\n");
+        if (holder > -1) close(holder);
+        if (sender > -1) close(sender);
+        if (impostor > -1) close(impostor);
+        return -1;
+    }
+    // the greeting
+    read_from_socket(impostor, (unsigned char *) buffer, &bytes, sizeof (buffer), 2);
+    bytes = 0;
+
+    // a nickname another client has registered is refused
+    write(impostor, "NICK nickholder\n\r", 17);
+    read_from_socket(impostor, (unsigned char *) buffer, &bytes, sizeof (buffer), 2);
+    test_next_response_is("433", "*", buffer, &bytes, "NICK of a nickname in use", NULL, 0);
+    bytes = 0;
+    write(impostor, "USER impostor\n\r", 15);
+    read_from_socket(impostor, (unsigned char *) buffer, &bytes, sizeof (buffer), 1);
+    failif(strstr(buffer, " 001 ") != NULL, "A client registered a nickname already in use",
+            "A client could not register a nickname already in use");
+
+    // and the client holding it still gets its messages once the other goes
+    write(impostor, "QUIT\r\n", 6);
+    close(impostor);
+    usleep(200000);
+    sprintf(cmd, "PRIVMSG nickholder :%s\n\r", greetings[1]);
+    write(sender, cmd, strlen(cmd));
+    bytes = 0;
+    read_from_socket(holder, (unsigned char *) buffer, &bytes, sizeof (buffer), 2);
+    test_next_response_is("PRIVMSG", "nickholder", buffer, &bytes,
+            "PRIVMSG to a nickname another client tried to take", greetings[1], 0);
+    write(sender, "ISON nickholder\n\r", 17);
+    bytes = 0;
+    read_from_socket(sender, (unsigned char *) buffer, &bytes, sizeof (buffer), 2);
+    test_next_response_is("303", "nicksender", buffer, &bytes,
+            "ISON of a nickname another client tried to take", "nickholder", 0);
+
+    write(holder, "QUIT\r\n", 6);
+    close(holder);
+    write(sender, "QUIT\r\n", 6);
+    close(sender);
+    return 0;
+}
+
+int test_channels() {
+    char buffer[8192];
+    int bytes = 0;
+    char cmd[1024];
+    int i;
+
+    int a = new_connection("chana");
+    int b = new_connection("chanb");
+    int c = new_connection("chanc");
+    if (a < 0 || b < 0 || c < 0) {
+        printf("FAIL: Could not create connections to try channels\n");
+        if (a > -1) close(a);
+        if (b > -1) close(b);
+        if (c > -1) close(c);
+        return -1;
+    }
+
+    write(a, "JOIN #testroom\n\r", 16);
+    read_until(a, buffer, &bytes, sizeof (buffer), "\n", 2);
+    failif(strstr(buffer, "JOIN #testroom") == NULL, "JOIN was not confirmed",
+            "JOIN of a new channel was confirmed");
+    bytes = 0;
+    write(b, "JOIN #testroom\n\r", 16);
+    read_until(b, buffer, &bytes, sizeof (buffer), "\n", 2);
+    failif(strstr(buffer, "JOIN #testroom") == NULL, "JOIN was not confirmed",
+            "JOIN of an existing channel was confirmed");
+
+    // a message to the channel goes to its other members and nobody else
+    sprintf(cmd, "PRIVMSG #testroom :%s\n\r", greetings[2]);
+    write(a, cmd, strlen(cmd));
+    bytes = 0;
+    read_until(b, buffer, &bytes, sizeof (buffer), "\n", 2);
+    failif(strstr(buffer, greetings[2]) == NULL, "PRIVMSG to a channel did not reach a member",
+            "PRIVMSG to a channel reached a member");
+    test_next_response_is("PRIVMSG", "#testroom", buffer, &bytes, "PRIVMSG to a channel",
+            greetings[2], 0);
+    bytes = 0;
+    read_from_socket(c, (unsigned char *) buffer, &bytes, sizeof (buffer), 1);
+    failif(bytes > 0, "PRIVMSG to a channel was sent to a client not on it",
+            "PRIVMSG to a channel was not sent to a client not on it");
+
+    // a client named twice, and on a channel named too, gets each message once
+    sprintf(cmd, "PRIVMSG chanb,chanb,#testroom :%s\n\r", greetings[3]);
+    write(a, cmd, strlen(cmd));
+    bytes = 0;
+    read_until(b, buffer, &bytes, sizeof (buffer), "#testroom :", 2);
+    read_from_socket(b, (unsigned char *) buffer, &bytes, sizeof (buffer), 1);
+    int copies = 0;
+    char *p;
+    for (p = strstr(buffer, greetings[3]); p != NULL; p = strstr(p + 1, greetings[3])) copies++;
+    failif(copies != 2 || strstr(buffer, "PRIVMSG chanb :") == NULL,
+            "A target list naming a client twice was not sent once to it and once to its channel",
+            "A target list naming a client twice was sent once to it and once to its channel");
+
+    // a channel that does not exist
+    sprintf(cmd, "PRIVMSG #nosuchroom :%s\n\r", greetings[4]);
+    write(a, cmd, strlen(cmd));
+    bytes = 0;
+    read_until(a, buffer, &bytes, sizeof (buffer), "\n", 2);
+    test_next_response_is("403", "chana", buffer, &bytes, "PRIVMSG to a channel that does not exist",
+            NULL, 0);
+
+    // only the first MAX_TARGETS (32) of a target list are sent the message
+    sprintf(cmd, "PRIVMSG chanb");
+    for (i = 0; i < 32; i++) sprintf(cmd + strlen(cmd), ",nosuchnick%d", i);
+    sprintf(cmd + strlen(cmd), " :%s\n\r", greetings[4]);
+    write(a, cmd, strlen(cmd));
+    bytes = 0;
+    read_until(a, buffer, &bytes, sizeof (buffer), " 407 ", 3);
+    failif(strstr(buffer, " 407 chana ") == NULL, "Too many targets were not answered with 407",
+            "Too many targets were answered with 407");
+    bytes = 0;
+    read_until(b, buffer, &bytes, sizeof (buffer), "\n", 2);
+    failif(strstr(buffer, greetings[4]) == NULL, "The first of too many targets was not sent the message",
+            "The first of too many targets was sent the message");
+
+    // a client that has left a channel hears no more from it
+    write(b, "PART #testroom\n\r", 16);
+    bytes = 0;
+    read_until(b, buffer, &bytes, sizeof (buffer), "\n", 2);
+    failif(strstr(buffer, "PART #testroom") == NULL, "PART was not confirmed",
+            "PART was confirmed");
+    sprintf(cmd, "PRIVMSG #testroom :%s\n\r", greetings[5]);
+    write(a, cmd, strlen(cmd));
+    bytes = 0;
+    read_from_socket(b, (unsigned char *) buffer, &bytes, sizeof (buffer), 1);
+    failif(bytes > 0, "PRIVMSG to a channel was sent to a client that had left it",
+            "PRIVMSG to a channel was not sent to a client that had left it");
+    write(b, "PART #testroom\n\r", 16);
+    bytes = 0;
+    read_until(b, buffer, &bytes, sizeof (buffer), "\n", 2);
+    test_next_response_is("442", "chanb", buffer, &bytes, "PART of a channel not joined", NULL, 0);
+
+    write(a, "QUIT\r\n", 6);
+    close(a);
+    write(b, "QUIT\r\n", 6);
+    close(b);
+    write(c, "QUIT\r\n", 6);
+    close(c);
+    return 0;
+}
+
+int test_presence() {
+    char buffer[8192];
+    int bytes = 0;
+
+    int a = new_connection("presa");
+    int b = new_connection("presb");
+    if (a < 0 || b < 0) {
+        printf("FAIL: Could not create connections to try ISON, WHOIS and WHO\n");
+        if (a > -1) close(a);
+        if (b > -1) close(b);
+        return -1;
+    }
+    write(b, "JOIN #presroom\n\r", 16);
+    read_until(b, buffer, &bytes, sizeof (buffer), "\n", 2);
+
+    // ISON answers with those of the nicknames that are on
+    write(a, "ISON presb nosuchnick presa\n\r", 29);
+    bytes = 0;
+    read_until(a, buffer, &bytes, sizeof (buffer), "\n", 2);
+    failif(strstr(buffer, ":presb presa") == NULL, "ISON did not name just the nicknames that are on",
+            "ISON named just the nicknames that are on");
+    test_next_response_is("303", "presa", buffer, &bytes, "ISON", NULL, 0);
+
+    write(a, "WHOIS presb\n\r", 13);
+    bytes = 0;
+    read_until(a, buffer, &bytes, sizeof (buffer), " 318 ", 2);
+    failif(strstr(buffer, " 319 presa presb :#presroom") == NULL, "WHOIS did not give the channels",
+            "WHOIS gave the channels");
+    test_next_response_is("311", "presa", buffer, &bytes, "WHOIS", NULL, 0);
+    test_next_response_is("312", "presa", buffer, &bytes, "WHOIS", NULL, 0);
+    test_next_response_is("317", "presa", buffer, &bytes, "WHOIS", NULL, 0);
+    test_next_response_is("319", "presa", buffer, &bytes, "WHOIS", NULL, 0);
+    test_next_response_is("318", "presa", buffer, &bytes, "WHOIS", NULL, 0);
+
+    write(a, "WHO presb\n\r", 11);
+    bytes = 0;
+    read_until(a, buffer, &bytes, sizeof (buffer), " 315 ", 2);
+    test_next_response_is("352", "presa", buffer, &bytes, "WHO", NULL, 0);
+    test_next_response_is("315", "presa", buffer, &bytes, "WHO", NULL, 0);
+
+    // a mask is not looked up, so only ends the list
+    write(a, "WHO pres*\n\r", 11);
+    bytes = 0;
+    read_until(a, buffer, &bytes, sizeof (buffer), " 315 ", 2);
+    failif(strstr(buffer, " 352 ") != NULL, "WHO with a mask listed clients",
+            "WHO with a mask listed nobody");
+    test_next_response_is("315", "presa", buffer, &bytes, "WHO with a mask", NULL, 0);
+
+    write(a, "QUIT\r\n", 6);
+    close(a);
+    write(b, "QUIT\r\n", 6);
+    close(b);
+    return 0;
+}
+
+int test_list() {
+    char buffer[8192];
+    int bytes = 0;
+    char cmd[1024];
+    char nick[1024];
+    int socks[4];
+    int i, j;
+
+    int a = new_connection("lista");
+    int b = new_connection("listb");
+    if (a < 0 || b < 0) {
+        printf("FAIL: Could not create connections to try LIST\n");
+        if (a > -1) close(a);
+        if (b > -1) close(b);
+        return -1;
+    }
+    sprintf(cmd, "JOIN #listb,#Lista,#LISTC,#other\n\r");
+    write(a, cmd, strlen(cmd));
+    read_until(a, buffer, &bytes, sizeof (buffer), "JOIN #other", 2);
+    sprintf(cmd, "JOIN #listb\n\r");
+    write(b, cmd, strlen(cmd));
+    bytes = 0;
+    read_until(b, buffer, &bytes, sizeof (buffer), "\n", 2);
+
+    // channels are listed in order of name, whatever their case
+    sprintf(cmd, "LIST #list*\n\r");
+    write(a, cmd, strlen(cmd));
+    bytes = 0;
+    read_until(a, buffer, &bytes, sizeof (buffer), " 323 ", 2);
+    char *first = strstr(buffer, " #Lista ");
+    char *second = strstr(buffer, " #listb ");
+    char *third = strstr(buffer, " #LISTC ");
+    failif(first == NULL || second == NULL || third == NULL || strstr(buffer, " #other ") != NULL,
+            "LIST of a prefix did not list just the channels starting with it",
+            "LIST of a prefix listed just the channels starting with it");
+    failif(first == NULL || second == NULL || third == NULL || first > second || second > third,
+            "LIST did not list channels in order of name regardless of case",
+            "LIST listed channels in order of name regardless of case");
+
+    sprintf(cmd, "LIST >1\n\r");
+    write(a, cmd, strlen(cmd));
+    bytes = 0;
+    read_until(a, buffer, &bytes, sizeof (buffer), " 323 ", 2);
+    failif(strstr(buffer, " #listb 2 ") == NULL || strstr(buffer, " #Lista ") != NULL
+            || strstr(buffer, " #other ") != NULL,
+            "LIST >1 did not list just the channels with more than one user",
+            "LIST >1 listed just the channels with more than one user");
+
+    // a least number of users applies to the names and prefixes given with it
+    sprintf(cmd, "LIST #list*,>1\n\r");
+    write(a, cmd, strlen(cmd));
+    bytes = 0;
+    read_until(a, buffer, &bytes, sizeof (buffer), " 323 ", 2);
+    failif(strstr(buffer, " #listb 2 ") == NULL || strstr(buffer, " #Lista ") != NULL
+            || strstr(buffer, " #LISTC ") != NULL,
+            "LIST of a prefix and >1 did not list just the channels matching both",
+            "LIST of a prefix and >1 listed just the channels matching both");
+    sprintf(cmd, "LIST #other,#list*\n\r");
+    write(a, cmd, strlen(cmd));
+    bytes = 0;
+    read_until(a, buffer, &bytes, sizeof (buffer), " 323 ", 2);
+    failif(strstr(buffer, " #other ") == NULL || strstr(buffer, " #Lista ") == NULL
+            || strstr(buffer, " #listb ") == NULL || strstr(buffer, " #LISTC ") == NULL,
+            "LIST of a name and a prefix did not list the channels matching either",
+            "LIST of a name and a prefix listed the channels matching either");
+
+    // more channels than fit a page (LIST_PAGE_SIZE) are sent over several
+    for (i = 0; i < 4; i++) {
+        snprintf(nick, 1024, "pager%d", i);
+        socks[i] = new_connection(nick);
+        if (socks[i] < 0) continue;
+        sprintf(cmd, "JOIN ");
+        for (j = 0; j < 16; j++) {
+            sprintf(cmd + strlen(cmd), "%s#page%02d", j ? "," : "", i * 16 + j);
+        }
+        sprintf(cmd + strlen(cmd), "\n\r");
+        write(socks[i], cmd, strlen(cmd));
+        bytes = 0;
+        sprintf(nick, "#page%02d", i * 16 + 15);
+        read_until(socks[i], buffer, &bytes, sizeof (buffer), nick, 2);
+    }
+    sprintf(cmd, "LIST #page*\n\r");
+    write(a, cmd, strlen(cmd));
+    bytes = 0;
+    read_until(a, buffer, &bytes, sizeof (buffer), " 323 ", 5);
+    int listed = 0;
+    char *p;
+    for (p = strstr(buffer, " 322 "); p != NULL; p = strstr(p + 1, " 322 ")) listed++;
+    failif(listed != 64, "LIST over several pages did not list every channel",
+            "LIST over several pages listed every channel");
+    failif(strstr(buffer, " 323 ") == NULL, "LIST over several pages was not ended",
+            "LIST over several pages was ended");
+
+    for (i = 0; i < 4; i++) {
+        if (socks[i] < 0) continue;
+        write(socks[i], "QUIT\r\n", 6);
+        close(socks[i]);
+    }
+    write(a, "QUIT\r\n", 6);
+    close(a);
+    write(b, "QUIT\r\n", 6);
+    close(b);
+    return 0;
+}
+
+int test_operator() {
+    char buffer[8192];
+    int bytes = 0;
+    char cmd[1024];
+
+    int a = new_connection("opera");
+    int b = new_connection("operb");
+    if (a < 0 || b < 0) {
+        printf("FAIL: Could not create connections to try OPER and WALLOPS\n");
+        if (a > -1) close(a);
+        if (b > -1) close(b);
+        return -1;
+    }
+
+    sprintf(cmd, "WALLOPS :%s\n\r", greetings[6]);
+    write(a, cmd, strlen(cmd));
+    read_until(a, buffer, &bytes, sizeof (buffer), "\n", 2);
+    test_next_response_is("481", "opera", buffer, &bytes, "WALLOPS from a client not an operator",
+            NULL, 0);
+    sprintf(cmd, "OPER opera not%s\n\r", OPERATOR_PASSWORD);
+    write(a, cmd, strlen(cmd));
+    bytes = 0;
+    read_until(a, buffer, &bytes, sizeof (buffer), "\n", 2);
+    test_next_response_is("464", "opera", buffer, &bytes, "OPER with the wrong password", NULL, 0);
+    sprintf(cmd, "OPER opera %s\n\r", OPERATOR_PASSWORD);
+    write(a, cmd, strlen(cmd));
+    bytes = 0;
+    read_until(a, buffer, &bytes, sizeof (buffer), "\n", 2);
+    test_next_response_is("381", "opera", buffer, &bytes, "OPER with the right password", NULL, 0);
+
+    // an operator's notice goes to every client, and the operator is told
+    // how it went
+    sprintf(cmd, "WALLOPS :%s\n\r", greetings[6]);
+    write(a, cmd, strlen(cmd));
+    bytes = 0;
+    read_until(a, buffer, &bytes, sizeof (buffer), "skipped", 3);
+    failif(strstr(buffer, "NOTICE opera :Broadcast to ") == NULL,
+            "The operator was not told the WALLOPS was sent",
+            "The operator was told the WALLOPS was sent");
+    failif(strstr(buffer, " skipped as too far behind") == NULL,
+            "The operator was not told how many clients the WALLOPS skipped",
+            "The operator was told how many clients the WALLOPS skipped");
+    bytes = 0;
+    read_until(b, buffer, &bytes, sizeof (buffer), greetings[6], 3);
+    sprintf(cmd, "NOTICE * :%s", greetings[6]);
+    failif(strstr(buffer, cmd) == NULL, "WALLOPS did not reach another client",
+            "WALLOPS reached another client");
+
+    write(a, "QUIT\r\n", 6);
+    close(a);
+    write(b, "QUIT\r\n", 6);
+    close(b);
+    return 0;
+}
+
+// count the lines of a TOP report for a measure
+int count_top_lines(char *buffer, char *measure) {
+    char line[128];
+    snprintf(line, sizeof (line), ":top %s ", measure);
+    int count = 0;
+    char *at;
+    for (at = strstr(buffer, line); at != NULL; at = strstr(at + 1, line)) count++;
+    return count;
+}
+
+int test_top() {
+    char buffer[8192];
+    int bytes = 0;
+    char cmd[1024];
+
+    int a = new_connection("topa");
+    int b = new_connection("topb");
+    if (a < 0 || b < 0) {
+        printf("FAIL: Could not create connections to try TOP\n");
+        if (a > -1) close(a);
+        if (b > -1) close(b);
+        return -1;
+    }
+
+    write(b, "TOP\r\n", strlen("TOP\r\n"));
+    read_until(b, buffer, &bytes, sizeof (buffer), "\n", 2);
+    test_next_response_is("481", "topb", buffer, &bytes, "TOP from a client not an operator",
+            NULL, 0);
+    sprintf(cmd, "OPER topa %s\r\n", OPERATOR_PASSWORD);
+    write(a, cmd, strlen(cmd));
+    bytes = 0;
+    read_until(a, buffer, &bytes, sizeof (buffer), "\n", 2);
+
+    // the count after the measure limits the report
+    write(a, "TOP lines 1\r\n", strlen("TOP lines 1\r\n"));
+    bytes = 0;
+    read_until(a, buffer, &bytes, sizeof (buffer), " 219 ", 3);
+    failif(strstr(buffer, "TOP :End of TOP report") == NULL,
+            "TOP report did not end with 219", "TOP report ended with 219");
+    failif(count_top_lines(buffer, "lines") != 1,
+            "TOP lines 1 did not list exactly one client", "TOP lines 1 listed one client");
+    write(a, "TOP lines 2\r\n", strlen("TOP lines 2\r\n"));
+    bytes = 0;
+    read_until(a, buffer, &bytes, sizeof (buffer), " 219 ", 3);
+    failif(count_top_lines(buffer, "lines") != 2,
+            "TOP lines 2 did not list exactly two clients", "TOP lines 2 listed two clients");
+    // of form :top lines <rank> <nick> <value>
+    char *first = strstr(buffer, ":top lines 1 ");
+    char *second = strstr(buffer, ":top lines 2 ");
+    long first_value = -1, second_value = -1;
+    if (first) sscanf(first, ":top lines 1 %*s %ld", &first_value);
+    if (second) sscanf(second, ":top lines 2 %*s %ld", &second_value);
+    failif(first_value < second_value || second_value < 1,
+            "TOP did not rank the clients costing the most first",
+            "TOP ranked the clients costing the most first");
+
+    write(a, "TOP bogus\r\n", strlen("TOP bogus\r\n"));
+    bytes = 0;
+    read_until(a, buffer, &bytes, sizeof (buffer), "\n", 2);
+    test_next_response_is("461", "topa", buffer, &bytes, "TOP with an unknown measure", NULL, 0);
+
+    write(a, "QUIT\r\n", 6);
+    close(a);
+    write(b, "QUIT\r\n", 6);
+    close(b);
+    return 0;
+}
+
+int test_connectionlimit() {
+    char buffer[8192];
+    int bytes = 0;
+
+    // the limits only bite on a server started with them, so start another
+    // copy that applies them to loopback too
+    if (student_pid == 99999) {
+        printf("SKIPPED: Connection limits need a server this test starts itself\n");
+        return 0;
+    }
+    pid_t main_pid = student_pid;
+    int main_port = student_port;
+    const char *const options[] = {"-L", "-C", "2", "-R", "1", "-M", "2", NULL};
+    if (launch_student_programme(student_executable, options)) {
+        student_pid = main_pid;
+        student_port = main_port;
+        return -1;
+    }
+    pid_t limited_pid = student_pid;
+    int i;
+    for (i = 0; i < 50; i++) {
+        int sock = connect_to_port(student_port);
+        if (sock > -1) {
+            close(sock);
+            break;
+        }
+        usleep(100000);
+    }
+    sleep(2); // let the accept bucket refill after the probe
+
+    // the bucket holds two accepts, so a third straight after is refused
+    int a = connect_to_port(student_port);
+    int b = connect_to_port(student_port);
+    if (a > -1) close(a);
+    if (b > -1) close(b);
+    usleep(200000);
+    int c = connect_to_port(student_port);
+    bytes = 0;
+    read_until(c, buffer, &bytes, sizeof (buffer), "ERROR", 2);
+    failif(strstr(buffer, "reconnecting too fast") == NULL,
+            "A client reconnecting too fast was not refused",
+            "A client reconnecting too fast was refused");
+    test_next_response_is_error("Closing Link", buffer, &bytes, "reconnecting too fast");
+    close(c);
+
+    // with -C 2 the third connection from one address is refused
+    sleep(2);
+    a = new_connection("limita");
+    b = connect_to_port(student_port);
+    c = connect_to_port(student_port);
+    bytes = 0;
+    read_until(c, buffer, &bytes, sizeof (buffer), "ERROR", 2);
+    failif(strstr(buffer, "too many connections") == NULL,
+            "A third connection from one address was not refused",
+            "A third connection from one address was refused");
+    test_next_response_is_error("Closing Link", buffer, &bytes, "a third connection");
+    close(c);
+
+    // commands faster than -M are held back, and every refusal is counted
+    char flood[1024] = "";
+    for (i = 0; i < 10; i++) strcat(flood, "PONG :limita\r\n");
+    strcat(flood, "STATS\r\n");
+    write(a, flood, strlen(flood));
+    bytes = 0;
+    read_until(a, buffer, &bytes, sizeof (buffer), " 219 ", 10);
+    failif(strstr(buffer, "connections rejected, too many from one address 1\n") == NULL,
+            "STATS did not count the connection refused by the limit",
+            "STATS counted the connection refused by the limit");
+    failif(strstr(buffer, "connections rejected, address reconnecting too fast 1\n") == NULL,
+            "STATS did not count the connection refused for reconnecting too fast",
+            "STATS counted the connection refused for reconnecting too fast");
+    char *throttled = strstr(buffer, "clients throttled for sending commands too fast ");
+    failif(throttled == NULL || atoi(throttled + 48) < 1,
+            "STATS did not count the client sending commands too fast",
+            "STATS counted the client sending commands too fast");
+
+    if (a > -1) close(a);
+    if (b > -1) close(b);
+    kill(limited_pid, SIGKILL);
+    waitpid(limited_pid, NULL, 0);
+    student_pid = main_pid;
+    student_port = main_port;
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: test <example program>\n");
+        exit(-1);
+    }
+
+    const char *const options[] = {"-o", OPERATOR_PASSWORD, NULL};
+    student_executable = argv[1];
+    if (atoi(argv[1]) == 0)
+        launch_student_programme(argv[1], options);
+    else {
+        student_port = atoi(argv[1]);
+        student_pid = 99999;
+    }
+
+    if (student_pid < 0) {
+        perror("Failed to launch student programme.");
+        return -1;
+    }
+
+    test_listensonport();
+    test_acceptmultipleconnections();
+    test_beforeregistration();
+    test_registration();
+    test_multipleclients();
+    test_nicknameinuse();
+    test_channels();
+    test_presence();
+    test_list();
+    test_operator();
+    test_top();
+    test_connectionlimit();
+
+    int score = success * 84 / TOTAL_TESTS;
+    printf("Passed %d of %d tests.\n"
+            "Score for functional aspects of assignment 1 will be %02d%%.\n"
+            "Score for style (0%% -- 16%%) will be assessed manually.\n"
+            "Therefore your grade for this assignment will be in the range %02d%% -- %02d%% (%s -- %s)\n",
+            success, TOTAL_TESTS,
+            score, score, score + 16, gradeOf(score), gradeOf(score + 15));
+
+    if (student_pid > 100 && student_pid != 99999) {
+        fprintf(stderr, "About to kill student process %d\n", (int) student_pid);
+        int r = kill(student_pid, SIGKILL);
+        fprintf(stderr, "Seeing how that went.\n");
+        if (r) perror("failed to kill() student process.");
+    } else {
+        fprintf(stderr, "Successfully cleaned up student process.\n");
+    }
+
+    return 0;
+}